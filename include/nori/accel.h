@@ -0,0 +1,852 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/mesh.h>
+#include <nori/proplist.h>
+#include <nori/raypacket.h>
+#include <nori/transform.h>
+#include <unordered_map>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#if defined(_WIN32)
+#include <malloc.h>
+#endif
+
+/// Size of the memory pages that the treelet layout of wide BVHs is made for
+#define NORI_PAGE_SIZE 4096
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief STL allocator that places arrays at the start of a memory page
+ *
+ * The treelet layout (see \ref Accel::reorder()) packs nodes that are
+ * likely visited together into blocks of \ref NORI_PAGE_SIZE bytes,
+ * which only coincide with actual pages when the first node does.
+ */
+template <typename T> struct PageAlignedAllocator {
+    typedef T value_type;
+
+    PageAlignedAllocator() { }
+    template <typename U> PageAlignedAllocator(const PageAlignedAllocator<U> &) { }
+
+    T *allocate(size_t count) {
+        void *ptr = nullptr;
+#if defined(_WIN32)
+        ptr = _aligned_malloc(count * sizeof(T), NORI_PAGE_SIZE);
+#else
+        if (posix_memalign(&ptr, NORI_PAGE_SIZE, count * sizeof(T)) != 0)
+            ptr = nullptr;
+#endif
+        if (!ptr)
+            throw std::bad_alloc();
+        return (T *) ptr;
+    }
+
+    void deallocate(T *ptr, size_t) {
+#if defined(_WIN32)
+        _aligned_free(ptr);
+#else
+        free(ptr);
+#endif
+    }
+
+    template <typename U> bool operator==(const PageAlignedAllocator<U> &) const { return true; }
+    template <typename U> bool operator!=(const PageAlignedAllocator<U> &) const { return false; }
+};
+
+/**
+ * \brief Counters describing the traversal work of single-ray queries
+ *
+ * They are only incremented when Nori is compiled with the
+ * <tt>NORI_ACCEL_STATS</tt> option, otherwise the counting code is
+ * removed entirely. Every thread counts into its own instance, see
+ * \ref Accel::getThreadStatistics(). Packet and stream queries are not
+ * counted.
+ */
+struct TraversalStatistics {
+    uint64_t rays = 0;          ///< Closest-hit and shadow queries
+    uint64_t nodes = 0;         ///< Visited BVH nodes
+    uint64_t boxes = 0;         ///< Ray-box tests (all slots of a wide node)
+    uint64_t triangles = 0;     ///< Ray-triangle tests
+    uint64_t maxStackDepth = 0; ///< Deepest traversal stack of any query
+
+    /// Accumulate the counters of another thread
+    TraversalStatistics &operator+=(const TraversalStatistics &stats) {
+        rays += stats.rays;
+        nodes += stats.nodes;
+        boxes += stats.boxes;
+        triangles += stats.triangles;
+        maxStackDepth = std::max(maxStackDepth, stats.maxStackDepth);
+        return *this;
+    }
+
+    /// Return a human-readable summary with averages per ray
+    std::string toString() const;
+};
+
+/**
+ * \brief Acceleration data structure for ray intersection queries
+ *
+ * The triangles of all registered meshes are organized in a bounding
+ * volume hierarchy that is built using the surface area heuristic. After
+ * construction, the binary tree can optionally be collapsed into a wide
+ * (4- or 8-ary) hierarchy whose child bounding boxes are tested in a
+ * single SIMD pass during traversal.
+ *
+ * Meshes can also be registered as instances (see \ref addInstance()). In
+ * that case, every distinct mesh receives its own bottom-level BVH, and a
+ * top-level BVH is built over the world-space bounds of all instances.
+ * The meshes registered via \ref addMesh() live in the top-level object.
+ */
+class Accel {
+    friend class BVHBuildTask;
+    friend class SBVHBuilder;
+    friend class LBVHBuilder;
+public:
+    /**
+     * \brief Create a new and empty BVH
+     *
+     * The following properties are recognized (usually specified
+     * via an <tt>&lt;accel&gt;</tt> tag inside the scene):
+     *
+     * <tt>width</tt>: branching factor used for traversal (2, 4 or 8).
+     * The value 2 selects the original binary BVH.
+     *
+     * <tt>precompute</tt>: when \c true, the triangles are baked into
+     * leaf order as precomputed intersection records after the build
+     * (see \ref TriangleRecord). This trades 44 bytes per triangle for
+     * fewer indirections in the leaf test. Default: \c false.
+     *
+     * <tt>leafWidth</tt>: number of triangles tested at once by the leaf
+     * test (1, 4 or 8). With 4 or 8, the triangles are baked into blocks
+     * of that size (see \ref TriangleBlock) and intersected with SSE or
+     * AVX instructions. The SAH builder then prefers leaves whose size is
+     * a multiple of the leaf width, and the remaining leaves are padded.
+     * Default: 1.
+     *
+     * The <tt>type</tt> attribute of the <tt>&lt;accel&gt;</tt> tag selects
+     * the construction method: <tt>bvh</tt> (default) uses the parallel
+     * binned builder, which only performs object splits. <tt>sbvh</tt>
+     * additionally considers spatial splits that clip triangle references
+     * at the split plane (see \ref SBVHBuilder). This reduces node overlap
+     * around long or large triangles at the cost of duplicated references.
+     * <tt>lbvh</tt> and <tt>ploc</tt> select the much faster Morton code
+     * based builders (see \ref LBVHBuilder), which trade some tree quality
+     * for build speed and are meant for previews and animations.
+     *
+     * <tt>duplicationBudget</tt>: maximum number of additional triangle
+     * references created by <tt>sbvh</tt>, relative to the triangle count.
+     * Default: 0.3.
+     *
+     * <tt>plocRadius</tt>: search radius of the nearest neighbor search
+     * performed by <tt>ploc</tt>. Larger values produce better trees but
+     * take longer to build. Default: 8.
+     *
+     * <tt>cache</tt>: when \c true, the built hierarchies are stored in
+     * the file <tt>&lt;scene&gt;.bvhcache</tt> next to the scene file
+     * (given by the <tt>filename</tt> property). Later runs memory-map
+     * this file instead of building the BVH, as long as the mesh data and
+     * construction parameters are unchanged. Default: \c false.
+     *
+     * <tt>rebuildThreshold</tt>: \ref refit() rebuilds the tree from
+     * scratch when its SAH cost exceeds the cost after the last full
+     * build by more than this factor. Default: 1.5.
+     *
+     * <tt>quantization</tt>: when set to 8 or 16, the child bounding boxes
+     * of the wide BVH are stored with this many bits per coordinate,
+     * relative to the bounds of their parent (see \ref QuantizedBVHNode).
+     * Requires a width of 4 or 8. Default: 0 (full precision).
+     *
+     * <tt>layout</tt>: memory layout of the wide BVH. <tt>depthfirst</tt>
+     * (default) keeps the order in which the nodes were created,
+     * <tt>treelet</tt> groups nodes that are likely visited together
+     * into page-sized blocks (see \ref reorder()).
+     *
+     * <tt>lowMemory</tt>: when \c true, the <tt>bvh</tt> builder bounds
+     * its peak memory use. Nodes are allocated in blocks as the tree
+     * grows instead of reserving two nodes per triangle, and the triangle
+     * indices are partitioned in place. The split decisions are the same
+     * as usual. Default: \c false.
+     *
+     * <tt>quality</tt>: build-time vs. trace-time trade-off of the
+     * <tt>bvh</tt> builder. <tt>fast</tt> uses 8 bins and leaves of up
+     * to 16 triangles, <tt>balanced</tt> (default) 16 bins and leaves of
+     * up to 8 triangles. Both also bin the small subtrees near the leaves.
+     * <tt>high</tt> uses 32 bins, leaves of up to 4 triangles and an
+     * exact sort-based SAH sweep near the leaves. The individual settings
+     * can be overridden via <tt>binCount</tt> (2 to 64) and
+     * <tt>maxLeafSize</tt>.
+     */
+    Accel(const PropertyList &props = PropertyList());
+
+    /// Release all resources
+    virtual ~Accel() { clear(); };
+
+    /// Release all resources
+    void clear();
+
+    /**
+     * \brief Register a triangle mesh for inclusion in the BVH.
+     *
+     * Analytic shapes (see \ref Shape) are registered as an instance with
+     * the identity transformation instead, their bottom-level BVH is built
+     * over the primitives. This function can only be used before
+     * \ref build() is called
+     */
+    void addMesh(Mesh *mesh);
+
+    /**
+     * \brief Register an instance of a triangle mesh
+     *
+     * All instances of the same mesh share one bottom-level BVH, which
+     * takes ownership of the mesh. This function can only be used before
+     * \ref build() is called
+     */
+    void addInstance(Mesh *mesh, const Transform &toWorld);
+
+    /// Build the BVH
+    void build();
+
+    /**
+     * \brief Fill in the binary trees of this BVH and of all bottom-level
+     * BVHs from data in the format of the BVH cache file
+     *
+     * Meant to be called before \ref build(), which then skips the tree
+     * construction. The data must stay valid during the call only. When
+     * \c verify is \c false, the hash of the build input is not compared,
+     * which saves reading all vertices for data that is known to match the
+     * meshes (such as a scene snapshot).
+     *
+     * \return \c false if the data is incompatible, outdated or corrupted
+     */
+    bool readCache(const uint8_t *data, size_t size, bool verify);
+
+    /// Write the binary trees of this BVH and of all bottom-level BVHs in the cache format
+    void writeCache(std::ostream &os) const;
+
+    /**
+     * \brief Update the BVH after the vertices of its meshes have moved
+     *
+     * Meant for deforming meshes whose topology stays the same (see
+     * \ref Mesh::setVertexPositions()). The bounding boxes of all nodes
+     * are recomputed bottom-up while the tree structure is kept, which is
+     * much cheaper than \ref build(). Since the quality of a refitted tree
+     * degrades with the amount of deformation, it is rebuilt when its SAH
+     * cost grows too much (see the <tt>rebuildThreshold</tt> property).
+     */
+    void refit();
+
+    /**
+     * \brief Intersect a ray against all triangle meshes registered
+     * with the BVH
+     *
+     * Detailed information about the intersection, if any, will be
+     * stored in the provided \ref Intersection data record.
+     *
+     * The <tt>shadowRay</tt> parameter specifies whether this detailed
+     * information is really needed. When set to \c true, the
+     * function just checks whether or not there is occlusion, but without
+     * providing any more detail (i.e. \c its will not be filled with
+     * contents). This is usually much faster, see \ref rayOccluded().
+     *
+     * \return \c true If an intersection was found
+     */
+    bool rayIntersect(const Ray3f &ray, Intersection &its,
+        bool shadowRay = false) const;
+
+    /**
+     * \brief Check whether any triangle intersects the ray segment
+     * <tt>[ray.mint, ray.maxt]</tt>
+     *
+     * This any-hit query terminates at the first intersection found and
+     * does not reconstruct any surface information. Children are not
+     * visited in distance order; instead, the traversal favors the nodes
+     * that are most likely to contain an occluder.
+     */
+    bool rayOccluded(const Ray3f &ray) const;
+
+    /**
+     * \brief Intersect a packet of \c N rays against all triangle meshes
+     * registered with the BVH (instantiated for N = 4, 8 and 16)
+     *
+     * The packet traverses the same (binary, wide or quantized) BVH as
+     * single rays. Coherent packets (all directions share their signs)
+     * are first culled against each child box using interval arithmetic
+     * on their origins and directions.
+     * The resulting hit records can be turned into full \ref Intersection
+     * records using \ref getIntersection().
+     *
+     * When <tt>shadowRay</tt> is set, each ray terminates at its first
+     * hit and only the validity of the hit records is meaningful.
+     */
+    template <int N> void rayIntersectPacket(const RayPacket<N> &packet,
+        HitPacket<N> &hits, bool shadowRay = false) const;
+
+    /**
+     * \brief Intersect an arbitrary-length stream of rays against all
+     * triangle meshes registered with the BVH
+     *
+     * The stream is processed in consecutive packets of 16 rays, hence
+     * coherent rays should be stored next to each other.
+     */
+    void rayIntersectStream(const RayStream &rays, RayHits &hits,
+        bool shadowRay = false) const;
+
+    /// Reconstruct the full intersection record of a packet hit
+    template <int N> bool getIntersection(const HitPacket<N> &hits, int i,
+            Intersection &its) const {
+        if (!hits.isValid(i))
+            return false;
+        return getIntersection(hits.mesh[i], hits.prim[i], hits.t[i],
+            hits.u[i], hits.v[i], its);
+    }
+
+    /// Reconstruct the full intersection record of a stream hit
+    bool getIntersection(const RayHits &hits, size_t i, Intersection &its) const {
+        if (!hits.isValid(i))
+            return false;
+        return getIntersection(hits.mesh[i], hits.prim[i], hits.t[i],
+            hits.u[i], hits.v[i], its);
+    }
+
+    /**
+     * \brief Return the total number of meshes registered with the BVH
+     *
+     * Instanced meshes are not included. Packet and stream hits on the
+     * i-th instance report the mesh index <tt>getMeshCount() + i</tt>.
+     */
+    n_UINT getMeshCount() const { return (n_UINT) m_meshes.size(); }
+
+    /// Return the total number of registered instances
+    n_UINT getInstanceCount() const { return (n_UINT) m_instances.size(); }
+
+    /// Return the total number of internally represented triangles
+    n_UINT getTriangleCount() const { return m_meshOffset.back(); }
+
+    /// Return one of the registered meshes
+    Mesh *getMesh(n_UINT idx) { return m_meshes[idx]; }
+
+    /// Return one of the registered meshes (const version)
+    const Mesh *getMesh(n_UINT idx) const { return m_meshes[idx]; }
+
+    //// Return an axis-aligned bounding box containing the entire tree
+    const BoundingBox3f &getBoundingBox() const {
+        return m_bbox;
+    }
+
+    /// Return the branching factor used for traversal
+    int getWidth() const { return m_width; }
+
+    /**
+     * \brief Return the traversal counters of the calling thread
+     *
+     * Only updated when compiled with <tt>NORI_ACCEL_STATS</tt>. Meant
+     * for measuring the cost of individual queries (e.g. by comparing
+     * the counters before and after a call to \ref rayIntersect()).
+     */
+    static TraversalStatistics &getThreadStatistics();
+
+    /// Return the sum of the traversal counters of all threads
+    static TraversalStatistics getTraversalStatistics();
+
+    /// Reset the traversal counters of all threads (no queries may be running)
+    static void resetTraversalStatistics();
+
+protected:
+    /**
+     * \brief Ray together with the direction signs used by all box tests
+     * of one traversal
+     *
+     * The reciprocals of the direction are precomputed by \ref Ray3f::update().
+     * The signs select the near and far slab of every box without any
+     * further comparisons. The ray is referenced, hence the tests always
+     * use its current <tt>[mint, maxt]</tt> interval.
+     */
+    struct TraversalRay {
+        const Ray3f &ray;
+        /// Is the direction negative along the given axis? (0 or 1)
+        int dirIsNeg[3];
+
+        TraversalRay(const Ray3f &ray) : ray(ray) {
+            for (int k = 0; k < 3; ++k)
+                dirIsNeg[k] = std::signbit(ray.dRcp[k]) ? 1 : 0;
+        }
+
+        /**
+         * \brief Slab test against a bounding box, returns the entry
+         * distance in \c tnear
+         *
+         * A zero direction component yields NaN for a ray starting on the
+         * slab, which \c std::max and \c std::min ignore due to the order
+         * of their arguments.
+         */
+        bool intersect(const BoundingBox3f &bbox, float &tnear) const {
+            float t0 = ray.mint, t1 = ray.maxt;
+            for (int k = 0; k < 3; ++k) {
+                float slabNear = ((dirIsNeg[k] ? bbox.max[k] : bbox.min[k]) - ray.o[k]) * ray.dRcp[k],
+                      slabFar  = ((dirIsNeg[k] ? bbox.min[k] : bbox.max[k]) - ray.o[k]) * ray.dRcp[k];
+                t0 = std::max(t0, slabNear);
+                t1 = std::min(t1, slabFar);
+            }
+            tnear = t0;
+            return t0 <= t1;
+        }
+    };
+
+    /// Deferred node of a closest-hit traversal and its entry distance
+    struct TraversalEntry {
+        n_UINT node;
+        float tnear;
+    };
+
+    /* BVH node in 32 bytes */
+    struct BVHNode {
+        union {
+            struct {
+                unsigned flag : 1;
+                n_UINT size : 31;
+                n_UINT start;
+            } leaf;
+
+            struct {
+                unsigned flag : 1;
+                n_UINT axis : 2;
+                n_UINT rightChild;
+            } inner;
+
+            uint64_t data;
+        };
+        BoundingBox3f bbox;
+
+        bool isLeaf() const {
+            return leaf.flag == 1;
+        }
+
+        bool isInner() const {
+            return leaf.flag == 0;
+        }
+
+        bool isUnused() const {
+            return data == 0;
+        }
+
+        n_UINT start() const {
+            return leaf.start;
+        }
+
+        n_UINT end() const {
+            return leaf.start + leaf.size;
+        }
+    };
+
+    /**
+     * \brief Wide BVH node with \c N children
+     *
+     * The child bounding boxes are stored in structure-of-arrays form so
+     * that all of them can be tested against a ray at once. Inner children
+     * reference another wide node, leaf children reference a range of
+     * \ref m_indices. Unused slots have an empty (inverted) bounding box
+     * and never report an intersection.
+     */
+    template <int N> struct WideBVHNode {
+        float minX[N], minY[N], minZ[N];
+        float maxX[N], maxY[N], maxZ[N];
+        /// Index of the child node (inner) or first primitive (leaf)
+        n_UINT child[N];
+        /// Number of primitives for leaf children, zero for inner children
+        n_UINT count[N];
+
+        enum { Width = N };
+
+        bool isLeaf(int i) const { return count[i] != 0; }
+
+        bool isUnused(int i) const { return minX[i] > maxX[i]; }
+
+        /// Return the bounds of child \c i
+        void getChildBounds(int i, float *min, float *max) const {
+            min[0] = minX[i]; min[1] = minY[i]; min[2] = minZ[i];
+            max[0] = maxX[i]; max[1] = maxY[i]; max[2] = maxZ[i];
+        }
+
+        /// Return a bit mask of the children hit by the ray and their entry distances
+        int intersect(const TraversalRay &ray, float *tnear) const;
+    };
+
+    /**
+     * \brief Wide BVH node with quantized child bounding boxes
+     *
+     * Same as \ref WideBVHNode, except that the child bounds are stored as
+     * integers of type \c T (8 or 16 bit). The coordinate <tt>q</tt> maps
+     * to <tt>origin + q * scale</tt>, where the origin and scale span the
+     * bounds of the node. Lower bounds are rounded down and upper bounds
+     * up, so that the decoded boxes are conservative. Unused slots store
+     * inverted boxes.
+     */
+    template <int N, typename T> struct QuantizedBVHNode {
+        float origin[3], scale[3];
+        T minX[N], minY[N], minZ[N];
+        T maxX[N], maxY[N], maxZ[N];
+        /// Index of the child node (inner) or first primitive (leaf)
+        n_UINT child[N];
+        /// Number of primitives for leaf children, zero for inner children
+        n_UINT count[N];
+
+        enum { Width = N };
+
+        bool isLeaf(int i) const { return count[i] != 0; }
+
+        /// Decode the bounds of child \c i
+        void getChildBounds(int i, float *min, float *max) const {
+            min[0] = origin[0] + (float) minX[i] * scale[0];
+            min[1] = origin[1] + (float) minY[i] * scale[1];
+            min[2] = origin[2] + (float) minZ[i] * scale[2];
+            max[0] = origin[0] + (float) maxX[i] * scale[0];
+            max[1] = origin[1] + (float) maxY[i] * scale[1];
+            max[2] = origin[2] + (float) maxZ[i] * scale[2];
+        }
+
+        /// Decode the child bounds and test the ray against all children
+        int intersect(const TraversalRay &ray, float *tnear) const;
+    };
+
+    /// Array of wide BVH nodes that starts at a page boundary
+    template <typename Node> using NodeVector = std::vector<Node, PageAlignedAllocator<Node>>;
+
+    /// Instance of a mesh, referencing one of the bottom-level BVHs
+    struct InstanceRecord {
+        Transform toLocal;     ///< World-to-object transformation
+        BoundingBox3f bbox;    ///< World-space bounding box
+        n_UINT blas;           ///< Index into \ref m_blas
+        bool identity;         ///< Rays and hits need no transformation
+
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    };
+
+    /**
+     * \brief Precomputed triangle used by the leaf intersection test
+     *
+     * Stores the first vertex and the two edges used by the Moeller-Trumbore
+     * test along with the mesh and triangle index, so that a leaf can be
+     * processed by streaming through a contiguous array of records.
+     */
+    struct TriangleRecord {
+        Point3f p0;
+        Vector3f edge1, edge2;
+        n_UINT mesh;  ///< Index into \ref m_meshes
+        n_UINT prim;  ///< Index of the triangle within its mesh
+
+        /// Ray-triangle intersection test, equivalent to \ref Mesh::rayIntersect()
+        bool rayIntersect(const Ray3f &ray, float &u, float &v, float &t) const {
+            Vector3f pvec = ray.d.cross(edge2);
+
+            float det = edge1.dot(pvec);
+            if (det > -1e-8f && det < 1e-8f)
+                return false;
+            float inv_det = 1.0f / det;
+
+            Vector3f tvec = ray.o - p0;
+            u = tvec.dot(pvec) * inv_det;
+            if (u < 0.0 || u > 1.0)
+                return false;
+
+            Vector3f qvec = tvec.cross(edge1);
+            v = ray.d.dot(qvec) * inv_det;
+            if (v < 0.0 || u + v > 1.0)
+                return false;
+
+            t = edge2.dot(qvec) * inv_det;
+            return t >= ray.mint && t <= ray.maxt;
+        }
+    };
+
+    /**
+     * \brief \c W precomputed triangles in structure-of-arrays form
+     *
+     * Used when <tt>leafWidth</tt> is 4 or 8: every leaf is padded to a
+     * multiple of \c W triangles (by repeating its last triangle), so that
+     * the leaf <tt>[start, end)</tt> consists of the blocks
+     * <tt>start / W</tt> to <tt>end / W</tt>.
+     */
+    template <int W> struct TriangleBlock {
+        float p0[3][W], edge1[3][W], edge2[3][W];
+        n_UINT mesh[W];  ///< Index into \ref m_meshes
+        n_UINT prim[W];  ///< Index of the triangle within its mesh
+
+        /**
+         * \brief Intersect the ray against all \c W triangles at once
+         *
+         * Same test as \ref TriangleRecord::rayIntersect(). Returns a bit
+         * mask of the triangles that were hit, along with their distances
+         * and barycentric coordinates.
+         */
+        int rayIntersect(const Ray3f &ray, float *u, float *v, float *t) const;
+    };
+
+    /// Is the hit (u, v) on triangle \c f of \c mesh cut out by its opacity mask?
+    bool isMaskedOut(const Mesh *mesh, n_UINT f, float u, float v) const {
+        return m_alphaMasks && !mesh->isOpaque(f, u, v);
+    }
+
+    /**
+     * \brief Compute the mesh and triangle indices corresponding to
+     * a primitive index used by the underlying generic BVH implementation.
+     */
+    n_UINT findMesh(n_UINT &idx) const {
+        auto it = std::lower_bound(m_meshOffset.begin(), m_meshOffset.end(), idx+1) - 1;
+        idx -= *it;
+        return (n_UINT) (it - m_meshOffset.begin());
+    }
+
+    //// Return an axis-aligned bounding box containing the given triangle
+    BoundingBox3f getBoundingBox(n_UINT index) const {
+        n_UINT meshIdx = findMesh(index);
+        return m_meshes[meshIdx]->getBoundingBox(index);
+    }
+
+    //// Return the centroid of the given triangle
+    Point3f getCentroid(n_UINT index) const {
+        n_UINT meshIdx = findMesh(index);
+        return m_meshes[meshIdx]->getCentroid(index);
+    }
+
+    /// Compute internal tree statistics
+    std::pair<float, n_UINT> statistics(n_UINT index = 0) const;
+
+    /// Construction methods of the binary BVH
+    enum EBuildMethod {
+        EObjectSplits = 0,
+        ESpatialSplits,
+        ELinear,
+        EClustering
+    };
+
+    /// Build the binary BVH using the selected construction method
+    void buildTree();
+
+    /// Build the binary BVH with the parallel binned SAH builder
+    void buildObjectSplits();
+
+    /// Build the binary BVH with the spatial split builder (see \ref SBVHBuilder)
+    void buildSpatialSplits();
+
+    /// Build the binary BVH with one of the Morton code based builders (see \ref LBVHBuilder)
+    void buildLinear();
+
+    /// Remove the unused entries of a conservatively allocated node array
+    void compactNodes();
+
+    /// Account for memory allocated (or released, if negative) by the tree construction
+    void trackMemory(int64_t bytes);
+
+    /**
+     * \brief Hash all inputs of the tree construction
+     *
+     * Covers the construction parameters as well as the vertex positions
+     * and indices of all meshes (including those of the bottom-level BVHs).
+     */
+    uint64_t hashBuildInput() const;
+
+    /**
+     * \brief Load the binary trees of this BVH and of all bottom-level
+     * BVHs from the cache file
+     *
+     * \return \c false if the cache file does not exist or is outdated
+     */
+    bool loadCache();
+
+    /// Store the binary trees of this BVH and of all bottom-level BVHs
+    void saveCache() const;
+
+    /// Bake the triangles into leaf order (see \ref TriangleRecord)
+    void precomputeTriangles();
+
+    /// Pad all leaves to a multiple of \ref m_leafWidth triangles
+    void padLeaves();
+
+    /// Bake the (padded) leaves into blocks of \c W triangles (see \ref TriangleBlock)
+    template <int W> void packTriangles(std::vector<TriangleBlock<W>> &blocks);
+
+    /// Create the SIMD triangle blocks used by the leaf test (depending on the leaf width)
+    void packLeaves();
+
+    /// Create the wide BVH used for traversal (depending on the width and quantization)
+    void collapseNodes();
+
+    /// Collapse the binary tree into a wide BVH with \c N children per node
+    template <int N> void collapse(NodeVector<WideBVHNode<N>> &wideNodes);
+
+    /**
+     * \brief Reorder the nodes of a wide BVH for locality
+     *
+     * The tree is partitioned into treelets of up to one page (\ref NORI_PAGE_SIZE) of
+     * nodes. Each treelet is grown greedily from its root by adding the
+     * child with the largest surface area, i.e. the one that is most
+     * likely visited by a ray that reached the treelet. The nodes below
+     * a treelet become the roots of further treelets, which are laid out
+     * depth-first so that entire subtrees stay close together.
+     *
+     * \c nodeSize is the size of the nodes that traversal uses, which are
+     * the quantized nodes when quantization is enabled (it keeps the order).
+     */
+    template <int N> void reorder(NodeVector<WideBVHNode<N>> &wideNodes, size_t nodeSize);
+
+    /// Quantize the child bounds of a wide BVH and release the original nodes
+    template <int N, typename T> void quantize(NodeVector<WideBVHNode<N>> &wideNodes,
+        NodeVector<QuantizedBVHNode<N, T>> &quantizedNodes);
+
+    /// Build the bottom-level BVHs and the top-level BVH over all instances
+    void buildInstances();
+
+    /// Build the top-level BVH over the current bounds of all instances
+    void buildInstanceTree();
+
+    /// Recompute the bounds of the subtree at \c node_idx (parallel above \c depth 8)
+    void refitNode(n_UINT node_idx, int depth);
+
+    /// Recursively build the top-level BVH over the instances <tt>[start, end)</tt>
+    n_UINT buildInstanceNode(n_UINT start, n_UINT end);
+
+    /**
+     * \brief Closest-hit traversal of the meshes registered via \ref addMesh()
+     *
+     * On success, \c ray.maxt is shortened, the hit information of \c its
+     * is partially filled in and the triangle is returned via \c f.
+     */
+    bool rayIntersectLocal(Ray3f &ray, Intersection &its, n_UINT &f) const;
+
+    /// Any-hit traversal of the meshes registered via \ref addMesh()
+    bool rayOccludedLocal(const Ray3f &ray) const;
+
+    /// Closest-hit traversal of the top-level BVH (see \ref rayIntersectLocal())
+    bool rayIntersectInstances(Ray3f &ray, Intersection &its, n_UINT &f,
+        n_UINT &instance) const;
+
+    /// Any-hit traversal of the top-level BVH
+    bool rayOccludedInstances(const Ray3f &ray) const;
+
+    /// Traverse a wide BVH (full precision or quantized nodes) from the node \c root
+    template <typename Node> bool rayIntersectWide(const NodeVector<Node> &wideNodes,
+        Ray3f &ray, Intersection &its, n_UINT &f, n_UINT root = 0) const;
+
+    /// Any-hit traversal of a wide BVH (full precision or quantized nodes) from the node \c root
+    template <typename Node> bool rayOccludedWide(const NodeVector<Node> &wideNodes,
+        const Ray3f &ray, n_UINT root = 0) const;
+
+    /// Traversal state of a ray packet (see accel_packet.cpp)
+    template <int N> struct PacketState;
+
+    /// Packet traversal of the binary BVH
+    template <int N> void packetTraverse(PacketState<N> &state) const;
+
+    /// Packet traversal of a wide BVH (full precision or quantized nodes)
+    template <int N, typename Node> void packetTraverseWide(const NodeVector<Node> &wideNodes,
+        PacketState<N> &state) const;
+
+    /// Traverse the wide BVH subtree at \c root with each ray in \c mask individually
+    template <int N, typename Node> void packetSplit(const NodeVector<Node> &wideNodes,
+        PacketState<N> &state, n_UINT root, uint32_t mask) const;
+
+    /// Intersect the triangles <tt>[start, end)</tt> against the packet rays in \c mask
+    template <int N> void packetLeaf(PacketState<N> &state, n_UINT start, n_UINT end,
+        uint32_t mask) const;
+
+    /// Fetch the triangle at position \c j of the leaf ranges
+    void getLeafTriangle(n_UINT j, n_UINT &meshIdx, n_UINT &prim, Point3f &p0,
+        Vector3f &edge1, Vector3f &edge2) const;
+
+    /// Check whether any triangle in the index range <tt>[start, end)</tt> hits the ray
+    bool leafOccluded(n_UINT start, n_UINT end, const Ray3f &ray) const;
+
+    /// Closest-hit test of a padded leaf against its triangle blocks (see \ref leafIntersect())
+    template <int W> bool leafIntersectBlocks(const std::vector<TriangleBlock<W>> &blocks,
+        n_UINT start, n_UINT end, Ray3f &ray, Intersection &its, n_UINT &f) const;
+
+    /// Any-hit test of a padded leaf against its triangle blocks
+    template <int W> bool leafOccludedBlocks(const std::vector<TriangleBlock<W>> &blocks,
+        n_UINT start, n_UINT end, const Ray3f &ray) const;
+
+    /**
+     * \brief Intersect the ray against the triangles referenced by the
+     * index range <tt>[start, end)</tt>
+     *
+     * On success, \c ray.maxt is shortened, the hit information of \c its
+     * is partially filled in and the triangle is returned via \c f.
+     */
+    bool leafIntersect(n_UINT start, n_UINT end, Ray3f &ray,
+        Intersection &its, n_UINT &f) const;
+
+    /// Compute the remaining hit information after traversal has finished
+    void finalizeIntersection(n_UINT f, Intersection &its) const;
+
+    /// Compute the remaining hit information of an instance hit in world space
+    void finalizeInstanceIntersection(n_UINT instance, n_UINT f, Intersection &its) const;
+
+    /// Reconstruct an intersection record from a (mesh, triangle, t, u, v) tuple
+    bool getIntersection(n_UINT mesh, n_UINT f, float t, float u, float v,
+        Intersection &its) const;
+
+private:
+    std::vector<Mesh *> m_meshes;       ///< List of meshes registered with the BVH
+    std::vector<n_UINT> m_meshOffset;   ///< Index of the first triangle for each shape
+    std::vector<BVHNode> m_nodes;       ///< BVH nodes
+    std::vector<n_UINT> m_indices;      ///< Index references by BVH nodes
+    BoundingBox3f m_bbox;               ///< Bounding box of the entire BVH
+
+    int m_width;                                 ///< Branching factor used for traversal
+    bool m_precompute;                           ///< Bake triangles into leaf order?
+    EBuildMethod m_buildMethod;                  ///< Construction method of the binary BVH
+    float m_duplicationBudget;                   ///< Reference budget of the spatial split builder
+    int m_plocRadius;                            ///< Search radius of the PLOC builder
+    float m_rebuildThreshold;                    ///< Relative SAH cost increase that triggers a rebuild
+    float m_buildCost = 0;                       ///< SAH cost after the last full build
+    bool m_lowMemory;                            ///< Bound the peak memory use of the build?
+    int m_binCount;                              ///< Number of SAH bins of the object split builder
+    int m_maxLeafSize;                           ///< Larger leaves are always split
+    int m_requestedLeafSize;                     ///< m_maxLeafSize before rounding it to m_leafWidth
+    bool m_exactLeafSAH;                         ///< Sort-based (instead of binned) SAH near the leaves?
+    std::atomic<size_t> m_buildMemory{0};        ///< Memory currently held by the build
+    std::atomic<size_t> m_buildPeakMemory{0};    ///< Peak of m_buildMemory
+    std::string m_cacheFile;                     ///< BVH cache file (empty if disabled)
+    bool m_cached = false;                       ///< Trees filled in by \ref readCache()?
+    std::vector<TriangleRecord> m_triangles;     ///< Baked triangles (parallel to m_indices)
+    int m_leafWidth;                             ///< Number of triangles tested at once by the leaf test
+    bool m_alphaMasks = false;                   ///< Does any mesh have an opacity mask?
+    bool m_analytic = false;                     ///< Bottom-level BVH of a \ref Shape?
+    std::vector<TriangleBlock<4>> m_triangleBlocks4; ///< SIMD triangle blocks (if m_leafWidth == 4)
+    std::vector<TriangleBlock<8>> m_triangleBlocks8; ///< SIMD triangle blocks (if m_leafWidth == 8)
+
+    PropertyList m_props;                        ///< Configuration passed on to the bottom-level BVHs
+    std::vector<Accel *> m_blas;                 ///< Bottom-level BVHs of the instanced meshes
+    std::unordered_map<const Mesh *, n_UINT> m_blasIndex;   ///< Mesh -> bottom-level BVH
+    std::vector<InstanceRecord, Eigen::aligned_allocator<InstanceRecord>> m_instances;
+    std::vector<BVHNode> m_instanceNodes;        ///< Top-level BVH nodes over m_instances
+    NodeVector<WideBVHNode<4>> m_wideNodes4;     ///< Collapsed 4-wide nodes (if m_width == 4)
+    NodeVector<WideBVHNode<8>> m_wideNodes8;     ///< Collapsed 8-wide nodes (if m_width == 8)
+    int m_quantization;                          ///< Bits per quantized coordinate (0: disabled)
+    bool m_treeletLayout;                        ///< Reorder the wide nodes into treelets?
+    NodeVector<QuantizedBVHNode<4, uint8_t>> m_quantizedNodes4x8;    ///< 4-wide nodes, 8-bit bounds
+    NodeVector<QuantizedBVHNode<8, uint8_t>> m_quantizedNodes8x8;    ///< 8-wide nodes, 8-bit bounds
+    NodeVector<QuantizedBVHNode<4, uint16_t>> m_quantizedNodes4x16;  ///< 4-wide nodes, 16-bit bounds
+    NodeVector<QuantizedBVHNode<8, uint16_t>> m_quantizedNodes8x16;  ///< 8-wide nodes, 16-bit bounds
+};
+
+NORI_NAMESPACE_END
@@ -0,0 +1,99 @@
+/*
+    This file is an extension of Nori, a simple educational ray tracer
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/mesh.h>
+
+/// Magic number at the start of binary mesh files ("NMSH")
+#define NORI_BINARY_MESH_MAGIC 0x48534D4Eu
+
+/// Version of the binary mesh format, bump it when the layout changes
+#define NORI_BINARY_MESH_VERSION 2
+
+/// Alignment of the data blocks within binary mesh files
+#define NORI_BINARY_MESH_ALIGNMENT 64
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Header of the binary mesh format
+ *
+ * The header is followed by the data blocks, which start at multiples of
+ * \ref NORI_BINARY_MESH_ALIGNMENT bytes and store the columns of the
+ * corresponding \ref Mesh matrices one after another: 3 floats per vertex
+ * position and normal, 2 floats per texture coordinate and 3 indices per
+ * triangle. The optional last block holds the surface area of each
+ * triangle, from which the loader restores the area distribution without
+ * touching the vertices. All values use the byte order of the machine that
+ * wrote the file, which the loader checks using the magic number.
+ *
+ * Uncompressed blocks (the only encoding so far) are used in place
+ * from the memory-mapped file.
+ */
+struct BinaryMeshHeader {
+    enum EBlock {
+        EPositions = 0,
+        ENormals,
+        ETexCoords,
+        EIndices,
+        EAreas,
+        EBlockCount
+    };
+
+    enum EEncoding {
+        ERaw = 0 ///< Uncompressed data
+    };
+
+    uint32_t magic = NORI_BINARY_MESH_MAGIC;
+    uint32_t version = NORI_BINARY_MESH_VERSION;
+    uint32_t encoding = ERaw;
+    uint32_t reserved = 0;
+    uint64_t vertexCount = 0;
+    uint64_t triangleCount = 0;
+    float bboxMin[3] = { 0, 0, 0 };
+    float bboxMax[3] = { 0, 0, 0 };
+    uint64_t offset[EBlockCount] = { 0, 0, 0, 0, 0 }; ///< Start of each block (0 if missing)
+};
+
+/**
+ * \brief Write a mesh in the binary mesh format
+ *
+ * The resulting file can be loaded using the <tt>nmesh</tt> mesh type.
+ * Throws a \ref NoriException if the file cannot be written.
+ */
+extern void writeBinaryMesh(const Mesh *mesh, const std::string &filename);
+
+/**
+ * \brief Write a mesh in the binary mesh format at the current position of a stream
+ *
+ * The offsets of the blocks are relative to the current position, which
+ * must be a multiple of \ref NORI_BINARY_MESH_ALIGNMENT bytes for the
+ * blocks to be aligned within the file.
+ */
+extern void writeBinaryMesh(const Mesh *mesh, std::ostream &os);
+
+/**
+ * \brief Create a mesh from binary mesh data stored in a memory-mapped file
+ *
+ * Used for binary meshes that are embedded in other files, such as scene
+ * snapshots. The data starts \c offset bytes into the file, the mesh keeps
+ * the file mapped and uses the buffers in place.
+ */
+extern Mesh *createBinaryMesh(std::shared_ptr<MemoryMappedFile> file, uint64_t offset,
+                              const std::string &name);
+
+NORI_NAMESPACE_END
@@ -0,0 +1,69 @@
+/*
+    This file is an extension of Nori, a simple educational ray tracer
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/mesh.h>
+#include <nori/transform.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Placement of a shared mesh in the scene
+ *
+ * An instance references a \ref Mesh (given as its only child) and places
+ * it in the scene using the <tt>toWorld</tt> transformation. All instances
+ * of the same mesh share a single bottom-level BVH inside \ref Accel.
+ *
+ * Identical <tt>&lt;mesh&gt;</tt> declarations found in several instances
+ * are only loaded once by the scene parser, e.g.
+ * \code
+ * <instance>
+ *     <mesh type="obj">
+ *         <string name="filename" value="tree.obj"/>
+ *     </mesh>
+ *     <transform name="toWorld">
+ *         <translate value="1, 0, 0"/>
+ *     </transform>
+ * </instance>
+ * \endcode
+ */
+class Instance : public NoriObject {
+public:
+    Instance(const PropertyList &props);
+
+    /// Register the instanced mesh
+    virtual void addChild(NoriObject *obj, const std::string& name = "none");
+
+    /// Check that a mesh was provided
+    virtual void activate();
+
+    /// Return the instanced mesh
+    Mesh *getMesh() const { return m_mesh; }
+
+    /// Return the object-to-world transformation
+    const Transform &getToWorld() const { return m_toWorld; }
+
+    virtual std::string toString() const;
+
+    virtual EClassType getClassType() const { return EInstance; }
+
+protected:
+    Mesh *m_mesh = nullptr;
+    Transform m_toWorld;
+};
+
+NORI_NAMESPACE_END
@@ -0,0 +1,374 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/object.h>
+#include <nori/frame.h>
+#include <nori/bbox.h>
+#include <nori/dpdf.h>
+#include <nori/mmap.h>
+
+NORI_NAMESPACE_BEGIN
+
+/// Read-only view of vertex attributes (see \ref Mesh::getVertexPositions())
+typedef Eigen::Map<const MatrixXf> MatrixXfView;
+
+/// Read-only view of the triangle indices (see \ref Mesh::getIndices())
+typedef Eigen::Map<const MatrixXu> MatrixXuView;
+
+/**
+ * \brief Intersection data structure
+ *
+ * This data structure records local information about a ray-triangle intersection.
+ * This includes the position, traveled ray distance, uv coordinates, as well
+ * as well as two local coordinate frames (one that corresponds to the true
+ * geometry, and one that is used for shading computations).
+ */
+struct Intersection {
+    /// Position of the surface intersection
+    Point3f p;
+    /// Unoccluded distance along the ray
+    float t;
+    /// UV coordinates, if any
+    Point2f uv;
+    /// Shading frame (based on the shading normal)
+    Frame shFrame;
+    /// Geometric frame (based on the true geometry)
+    Frame geoFrame;
+    /// Pointer to the associated mesh
+    const Mesh *mesh;
+
+    /// Create an uninitialized intersection record
+    Intersection() : mesh(nullptr) { }
+
+    /// Transform a direction vector into the local shading frame
+    Vector3f toLocal(const Vector3f &d) const {
+        return shFrame.toLocal(d);
+    }
+
+    /// Transform a direction vector from local to world coordinates
+    Vector3f toWorld(const Vector3f &d) const {
+        return shFrame.toWorld(d);
+    }
+
+    /// Return a human-readable summary of the intersection record
+    std::string toString() const;
+};
+
+/**
+ * \brief Triangle mesh
+ *
+ * This class stores a triangle mesh object and provides numerous functions
+ * for querying the individual triangles. Subclasses of \c Mesh implement
+ * the specifics of how to create its contents (e.g. by loading from an
+ * external file)
+ */
+class Mesh : public NoriObject {
+public:
+    /// Release all memory
+    virtual ~Mesh();
+
+    /// Initialize internal data structures (called once by the XML parser)
+    virtual void activate();
+
+    /// Return the total number of triangles in this shape
+    n_UINT getTriangleCount() const { return m_file ? m_mapped.triangleCount : (n_UINT) m_F.cols(); }
+
+    /// Return the total number of vertices in this shape
+    n_UINT getVertexCount() const {
+        return m_file ? m_mapped.vertexCount
+             : (m_compact.V.empty() ? (n_UINT) m_V.cols() : (n_UINT) m_compact.V.size());
+    }
+
+    /// Return the number of primitives (the triangles, unless this is a \ref Shape)
+    virtual n_UINT getPrimitiveCount() const { return getTriangleCount(); }
+
+    /// Is this a set of analytic primitives (see \ref Shape) rather than a triangle mesh?
+    virtual bool isAnalytic() const { return false; }
+
+    /// Return the surface area of the given triangle
+    virtual float surfaceArea(n_UINT index) const;
+
+    //// Return an axis-aligned bounding box of the entire mesh
+    const BoundingBox3f &getBoundingBox() const { return m_bbox; }
+
+    //// Return an axis-aligned bounding box containing the given triangle
+    virtual BoundingBox3f getBoundingBox(n_UINT index) const;
+
+    //// Return the centroid of the given triangle
+    virtual Point3f getCentroid(n_UINT index) const;
+
+    /** \brief Ray-triangle intersection test
+     *
+     * Uses the algorithm by Moeller and Trumbore discussed at
+     * <tt>http://www.acm.org/jgt/papers/MollerTrumbore97/code.html</tt>.
+     *
+     * Note that the test only applies to a single triangle in the mesh.
+     * An acceleration data structure like \ref BVH is needed to search
+     * for intersections against many triangles.
+     *
+     * \param index
+     *    Index of the triangle that should be intersected
+     * \param ray
+     *    The ray segment to be used for the intersection query
+     * \param t
+     *    Upon success, \a t contains the distance from the ray origin to the
+     *    intersection point,
+     * \param u
+     *   Upon success, \c u will contain the 'U' component of the intersection
+     *   in barycentric coordinates
+     * \param v
+     *   Upon success, \c v will contain the 'V' component of the intersection
+     *   in barycentric coordinates
+     * \return
+     *   \c true if an intersection has been detected
+     */
+    virtual bool rayIntersect(n_UINT index, const Ray3f &ray, float &u, float &v, float &t) const;
+
+    /**
+     * \brief Return the vertex positions
+     *
+     * The attribute and index accessors return views, since the data may
+     * be used in place from a memory-mapped file (see \ref setMappedBuffers()).
+     * Bind the result to a view rather than to a <tt>const MatrixXf &</tt>,
+     * which would silently copy it. Attributes stored in compact form (see
+     * \ref compactVertexAttributes()) are not available as matrices and
+     * result in empty views, use the per-vertex accessors such as
+     * \ref getVertexPosition() for code that must handle any mesh.
+     */
+    MatrixXfView getVertexPositions() const {
+        return m_file ? MatrixXfView(m_mapped.V, 3, m_mapped.vertexCount)
+                      : MatrixXfView(m_V.data(), m_V.rows(), m_V.cols());
+    }
+
+    /// Return the vertex normals (empty if there are none)
+    MatrixXfView getVertexNormals() const {
+        return m_file ? MatrixXfView(m_mapped.N, m_mapped.N ? 3 : 0, m_mapped.N ? m_mapped.vertexCount : 0)
+                      : MatrixXfView(m_N.data(), m_N.rows(), m_N.cols());
+    }
+
+    /// Return the texture coordinates (empty if there are none)
+    MatrixXfView getVertexTexCoords() const {
+        return m_file ? MatrixXfView(m_mapped.UV, m_mapped.UV ? 2 : 0, m_mapped.UV ? m_mapped.vertexCount : 0)
+                      : MatrixXfView(m_UV.data(), m_UV.rows(), m_UV.cols());
+    }
+
+    /// Return the triangle vertex index list
+    MatrixXuView getIndices() const {
+        return m_file ? MatrixXuView(m_mapped.F, 3, m_mapped.triangleCount)
+                      : MatrixXuView(m_F.data(), m_F.rows(), m_F.cols());
+    }
+
+    /// Return the position of a vertex (decoding it if it is stored in compact form)
+    Point3f getVertexPosition(n_UINT index) const {
+        if (m_compact.V.empty())
+            return getVertexPositions().col(index);
+        uint64_t q = m_compact.V[index];
+        return m_compact.positionOffset + m_compact.positionScale.cwiseProduct(Vector3f(
+            (float) (q & 0x1FFFFF), (float) ((q >> 21) & 0x1FFFFF), (float) (q >> 42)));
+    }
+
+    /// Return the normal of a vertex (decoding it if it is stored in compact form)
+    Normal3f getVertexNormal(n_UINT index) const {
+        if (m_compact.N.empty())
+            return getVertexNormals().col(index);
+        return decodeOctahedral(m_compact.N[index]);
+    }
+
+    /// Return the texture coordinates of a vertex (decoding them if they are stored in compact form)
+    Point2f getVertexTexCoord(n_UINT index) const {
+        if (m_compact.UV.empty())
+            return getVertexTexCoords().col(index);
+        uint32_t q = m_compact.UV[index];
+        return m_compact.uvOffset + m_compact.uvScale.cwiseProduct(
+            Vector2f((float) (q & 0xFFFF), (float) (q >> 16)));
+    }
+
+    /// Does the mesh have vertex normals?
+    bool hasVertexNormals() const { return !m_compact.N.empty() || getVertexNormals().size() > 0; }
+
+    /// Does the mesh have texture coordinates?
+    bool hasVertexTexCoords() const { return !m_compact.UV.empty() || getVertexTexCoords().size() > 0; }
+
+    /**
+     * \brief Store the vertex attributes in compact form
+     *
+     * Normals are encoded into 32 bits using an octahedral mapping and
+     * texture coordinates are quantized to 16 bits per coordinate over
+     * their range in the mesh. When \c positions is \c true, the positions
+     * are also quantized to 21 bits per coordinate relative to the bounding
+     * box of the mesh, which roughly halves the size of the vertex data. The
+     * decoded positions are then used everywhere, including the BVH, so the
+     * mesh stays watertight. The largest decoding errors are logged.
+     *
+     * Memory-mapped buffers are copied first. Replacing the positions or
+     * normals of a deforming mesh stores them as floats again.
+     */
+    void compactVertexAttributes(bool positions);
+
+    /**
+     * \brief Reorder the triangles and vertices for memory locality
+     *
+     * Sorts the triangles along a Morton curve through their centroids and
+     * then renumbers the vertices in the order of their first use. Triangles
+     * that are close in space, and hence tend to be intersected and shaded
+     * one after another, then refer to nearby vertex data. Must be called
+     * before the acceleration structure is built and before
+     * \ref compactVertexAttributes().
+     */
+    void optimizeLayout();
+
+    /**
+     * \brief Replace the vertex positions of a deforming mesh
+     *
+     * The topology must stay the same, i.e. \c V needs to have as many
+     * columns as there are vertices. Updates the bounding box and the
+     * area distribution used for sampling. Any \ref Accel containing
+     * the mesh must be refitted afterwards (see \ref Accel::refit()).
+     * Memory-mapped buffers are copied first.
+     */
+    void setVertexPositions(const MatrixXf &V);
+
+    /// Replace the vertex normals of a deforming mesh (same size as before)
+    void setVertexNormals(const MatrixXf &N);
+
+    /// Is this mesh an area emitter?
+    bool isEmitter() const { return m_emitter != nullptr; }
+
+    /// Return a pointer to an attached area emitter instance
+    Emitter *getEmitter() { return m_emitter; }
+
+    /// Return a pointer to an attached area emitter instance (const version)
+    const Emitter *getEmitter() const { return m_emitter; }
+
+    /// Return a pointer to the BSDF associated with this mesh
+    const BSDF *getBSDF() const { return m_bsdf; }
+
+    /// Does the mesh have an opacity mask (see \ref isOpaque())?
+    bool hasAlphaMask() const { return m_alpha != nullptr; }
+
+    /**
+     * \brief Evaluate the opacity mask at a point of the given triangle
+     *
+     * The point is specified by the barycentric coordinates \c u and \c v
+     * computed by \ref rayIntersect(). The mask texture (registered as the
+     * <tt>alpha</tt> child of the mesh) is looked up at the interpolated
+     * texture coordinates, and the surface is cut out wherever its
+     * luminance is below 0.5. Meshes without mask are opaque everywhere.
+     */
+    bool isOpaque(n_UINT index, float u, float v) const;
+
+    /**
+     * \brief Uniformly sample a position on the mesh with
+     * respect to surface area. Returns both position and normal
+     */
+    virtual void samplePosition(const Point2f &sample, Point3f &p, Normal3f &n, Point2f &uv) const;
+
+    /// Return the probability density of a position sampled by \ref samplePosition()
+    float pdf(const Point3f &p) const;
+
+    /// Register a child object (e.g. a BSDF) with the mesh
+    virtual void addChild(NoriObject *child, const std::string& name = "none");
+
+    /// Return the name of this mesh
+    const std::string &getName() const { return m_name; }
+
+    /// Return a human-readable summary of this instance
+    std::string toString() const;
+
+    /**
+     * \brief Return the type of object (i.e. Mesh/BSDF/etc.)
+     * provided by this instance
+     * */
+    EClassType getClassType() const { return EMesh; }
+
+protected:
+    /// Create an empty mesh
+    Mesh();
+
+    /// Compute the area distribution of the triangles used for sampling
+    virtual void computeAreaDistribution();
+
+    /**
+     * \brief Use buffers of a memory-mapped file instead of \c m_V, \c m_N, \c m_UV and \c m_F
+     *
+     * The mesh shares ownership of the file and keeps it mapped. The
+     * buffers are stored column by column like the matrices they replace,
+     * \c N and \c UV may be \c nullptr.
+     */
+    void setMappedBuffers(std::shared_ptr<MemoryMappedFile> file, n_UINT vertexCount, n_UINT triangleCount,
+                          const float *V, const float *N, const float *UV, const uint32_t *F);
+
+    /// Copy memory-mapped buffers into \c m_V, \c m_N, \c m_UV and \c m_F (to modify them)
+    void copyMappedBuffers();
+
+    /// Encode a direction for \ref decodeOctahedral() with the smallest possible error
+    static uint32_t encodeOctahedral(const Vector3f &n);
+
+    /// Decode a normal stored by \ref compactVertexAttributes()
+    static Normal3f decodeOctahedral(uint32_t code) {
+        float x = (float) (code & 0xFFFF) * (2.0f / 65535.0f) - 1.0f,
+              y = (float) (code >> 16) * (2.0f / 65535.0f) - 1.0f,
+              z = 1.0f - std::abs(x) - std::abs(y);
+        if (z < 0) {
+            /* Unfold the lower hemisphere */
+            float x0 = x;
+            x = std::copysign(1.0f - std::abs(y), x0);
+            y = std::copysign(1.0f - std::abs(x0), y);
+        }
+        return Normal3f(Vector3f(x, y, z).normalized());
+    }
+
+protected:
+    std::string m_name;                  ///< Identifying name
+    MatrixXf      m_V;                   ///< Vertex positions
+    MatrixXf      m_N;                   ///< Vertex normals
+    MatrixXf      m_UV;                  ///< Vertex texture coordinates
+    MatrixXu      m_F;                   ///< Faces
+    BSDF         *m_bsdf = nullptr;      ///< BSDF of the surface
+    Emitter    *m_emitter = nullptr;     ///< Associated emitter, if any
+    Texture      *m_alpha = nullptr;     ///< Opacity mask (cutout), if any
+    BoundingBox3f m_bbox;                ///< Bounding box of the mesh
+    DiscretePDF   m_pdf;                 ///< Area distribution of the triangles
+
+    /// Vertex and index buffers in a memory-mapped file
+    struct MappedBuffers {
+        const float *V = nullptr, *N = nullptr, *UV = nullptr;
+        const uint32_t *F = nullptr;
+        n_UINT vertexCount = 0, triangleCount = 0;
+    };
+
+    std::shared_ptr<MemoryMappedFile> m_file; ///< File holding \ref m_mapped, if any
+    MappedBuffers m_mapped;              ///< Buffers used in place of the matrices
+
+    /// Vertex attributes in compact form (see \ref compactVertexAttributes())
+    struct CompactBuffers {
+        std::vector<uint64_t> V;         ///< Quantized positions (21 bits per coordinate)
+        std::vector<uint32_t> N;         ///< Octahedral normals (16 bits per coordinate)
+        std::vector<uint32_t> UV;        ///< Quantized texture coordinates (16 bits per coordinate)
+        Point3f positionOffset;          ///< Decoded position = offset + scale * quantized position
+        Vector3f positionScale;
+        Point2f uvOffset;                ///< Decoded texture coordinates = offset + scale * quantized value
+        Vector2f uvScale;
+    };
+
+    CompactBuffers m_compact;            ///< Used in place of \ref m_V, \ref m_N and \ref m_UV if not empty
+};
+
+NORI_NAMESPACE_END
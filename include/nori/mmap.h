@@ -0,0 +1,56 @@
+/*
+    This file is an extension of Nori, a simple educational ray tracer
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/common.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Read-only memory mapping of an entire file
+ *
+ * The pages of the file are loaded lazily by the operating system when
+ * they are first accessed. Throws a \ref NoriException when the file
+ * cannot be opened or mapped.
+ */
+class MemoryMappedFile {
+public:
+    /// Map the given file into memory
+    MemoryMappedFile(const std::string &filename);
+
+    /// Unmap the file
+    ~MemoryMappedFile();
+
+    /// Return a pointer to the file contents
+    const uint8_t *data() const { return (const uint8_t *) m_data; }
+
+    /// Return the size of the file in bytes
+    size_t size() const { return m_size; }
+
+private:
+    MemoryMappedFile(const MemoryMappedFile &) = delete;
+    MemoryMappedFile &operator=(const MemoryMappedFile &) = delete;
+
+    void *m_data = nullptr;
+    size_t m_size = 0;
+#if defined(_WIN32)
+    void *m_file = nullptr;
+    void *m_mapping = nullptr;
+#endif
+};
+
+NORI_NAMESPACE_END
@@ -0,0 +1,139 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/ray.h>
+
+NORI_NAMESPACE_BEGIN
+
+/// Marks a ray in a \ref HitPacket or \ref RayHits record that did not hit anything
+#define NORI_INVALID_HIT ((n_UINT) -1)
+
+/**
+ * \brief Fixed-size packet of \c N rays in structure-of-arrays layout
+ *
+ * Packets are traversed through the BVH as a whole, which amortizes
+ * node fetches over all rays and allows the entire packet to be culled
+ * at once when it is coherent (e.g. primary rays of one image block).
+ */
+template <int N> struct RayPacket {
+    float o[3][N];     ///< Ray origins
+    float d[3][N];     ///< Ray directions
+    float dRcp[3][N];  ///< Componentwise reciprocals of the ray directions
+    float mint[N];     ///< Minimum position on the ray segments
+    float maxt[N];     ///< Maximum position on the ray segments
+    int size;          ///< Number of valid rays (unused lanes are ignored)
+
+    enum { Width = N };
+
+    RayPacket() : size(0) { }
+
+    /// Store a ray in the given lane
+    void set(int i, const Ray3f &ray) {
+        for (int k = 0; k < 3; ++k) {
+            o[k][i] = ray.o[k];
+            d[k][i] = ray.d[k];
+            dRcp[k][i] = ray.dRcp[k];
+        }
+        mint[i] = ray.mint;
+        maxt[i] = ray.maxt;
+    }
+
+    /// Append a ray to the packet
+    void append(const Ray3f &ray) { set(size++, ray); }
+
+    /// Return the ray stored in the given lane
+    Ray3f get(int i) const {
+        return Ray3f(Point3f(o[0][i], o[1][i], o[2][i]),
+                     Vector3f(d[0][i], d[1][i], d[2][i]), mint[i], maxt[i]);
+    }
+};
+
+/**
+ * \brief Hit records of a \ref RayPacket in structure-of-arrays layout
+ *
+ * \c mesh is set to \ref NORI_INVALID_HIT for rays that did not hit
+ * anything. The full \ref Intersection record of a hit can be obtained
+ * using \ref Accel::getIntersection().
+ */
+template <int N> struct HitPacket {
+    float t[N];        ///< Distance to the intersection
+    float u[N], v[N];  ///< Barycentric coordinates of the intersection
+    n_UINT mesh[N];    ///< Index of the intersected mesh
+    n_UINT prim[N];    ///< Index of the intersected triangle within its mesh
+
+    bool isValid(int i) const { return mesh[i] != NORI_INVALID_HIT; }
+};
+
+/// Arbitrary-length stream of rays in structure-of-arrays layout
+struct RayStream {
+    std::vector<float> o[3], d[3], mint, maxt;
+
+    size_t size() const { return mint.size(); }
+
+    void clear() {
+        for (int k = 0; k < 3; ++k) {
+            o[k].clear();
+            d[k].clear();
+        }
+        mint.clear();
+        maxt.clear();
+    }
+
+    void reserve(size_t n) {
+        for (int k = 0; k < 3; ++k) {
+            o[k].reserve(n);
+            d[k].reserve(n);
+        }
+        mint.reserve(n);
+        maxt.reserve(n);
+    }
+
+    void append(const Ray3f &ray) {
+        for (int k = 0; k < 3; ++k) {
+            o[k].push_back(ray.o[k]);
+            d[k].push_back(ray.d[k]);
+        }
+        mint.push_back(ray.mint);
+        maxt.push_back(ray.maxt);
+    }
+
+    Ray3f get(size_t i) const {
+        return Ray3f(Point3f(o[0][i], o[1][i], o[2][i]),
+                     Vector3f(d[0][i], d[1][i], d[2][i]), mint[i], maxt[i]);
+    }
+};
+
+/// Hit records of a \ref RayStream in structure-of-arrays layout
+struct RayHits {
+    std::vector<float> t, u, v;
+    std::vector<n_UINT> mesh, prim;
+
+    size_t size() const { return t.size(); }
+
+    void resize(size_t n) {
+        t.resize(n);
+        u.resize(n);
+        v.resize(n);
+        mesh.resize(n);
+        prim.resize(n);
+    }
+
+    bool isValid(size_t i) const { return mesh[i] != NORI_INVALID_HIT; }
+};
+
+NORI_NAMESPACE_END
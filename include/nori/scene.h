@@ -0,0 +1,208 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/accel.h>
+#include <nori/instance.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Main scene data structure
+ *
+ * This class holds information on scene objects and is responsible for
+ * coordinating rendering jobs. It also provides useful query routines that
+ * are mostly used by the \ref Integrator implementations.
+ */
+class Scene : public NoriObject {
+public:
+    /// Construct a new scene object
+    Scene(const PropertyList &);
+
+    /// Release all memory
+    virtual ~Scene();
+
+    /// Return a pointer to the scene's kd-tree
+    const Accel *getAccel() const { return m_accel; }
+
+    /// Return a pointer to the scene's integrator
+    const Integrator *getIntegrator() const { return m_integrator; }
+
+    /// Return a pointer to the scene's integrator
+    Integrator *getIntegrator() { return m_integrator; }
+
+    /// Return a pointer to the scene's camera
+    const Camera *getCamera() const { return m_camera; }
+
+    /// Return a pointer to the scene's sample generator (const version)
+    const Sampler *getSampler() const { return m_sampler; }
+
+    /// Return a pointer to the scene's sample generator
+    Sampler *getSampler() { return m_sampler; }
+
+    /// Return a reference to an array containing all meshes (excluding instanced ones)
+    const std::vector<Mesh *> &getMeshes() const { return m_meshes; }
+
+    /// Return a reference to an array containing all mesh instances
+    const std::vector<Instance *> &getInstances() const { return m_instances; }
+
+    /// Return a reference to an array containing all lights
+    const std::vector<Emitter *> &getLights() const { return m_emitters; }
+
+    /// Sample emitter
+    const Emitter *sampleEmitter(float rnd, float &pdf) const;
+
+    /// Return the probability of sampling the given emitter
+    float pdfEmitter(const Emitter *em) const;
+
+    /// Return the radiance of the environment seen along the given ray (if any)
+    Color3f getBackground(const Ray3f &ray) const;
+
+    /**
+     * \brief Intersect a ray against all triangles stored in the scene
+     * and return detailed intersection information
+     *
+     * \param ray
+     *    A 3-dimensional ray data structure with minimum/maximum
+     *    extent information
+     *
+     * \param its
+     *    A detailed intersection record, which will be filled by the
+     *    intersection query
+     *
+     * \return \c true if an intersection was found
+     */
+    bool rayIntersect(const Ray3f &ray, Intersection &its) const {
+        if (m_primaryHit.pending)
+            return consumePrimaryHit(ray, its);
+        return m_accel->rayIntersect(ray, its, false);
+    }
+
+    /**
+     * \brief Provide the result of the next closest-hit query of the
+     * calling thread
+     *
+     * The render loop traces the primary rays of a tile as packets and
+     * passes each hit on to the integrator this way: if the next call to
+     * \ref rayIntersect(const Ray3f &, Intersection &) const asks for
+     * exactly the same ray segment, it returns the stored record instead
+     * of tracing the ray again.
+     */
+    void setPrimaryHit(const Ray3f &ray, const Intersection &its, bool hit) const;
+
+    /**
+     * \brief Intersect a ray against all triangles stored in the scene
+     * and \a only determine whether or not there is an intersection.
+     *
+     * This method much faster than the other ray tracing function,
+     * but the performance comes at the cost of not providing any
+     * additional information about the detected intersection
+     * (not even its position).
+     *
+     * \param ray
+     *    A 3-dimensional ray data structure with minimum/maximum
+     *    extent information
+     *
+     * \return \c true if an intersection was found
+     */
+    bool rayIntersect(const Ray3f &ray) const {
+        return m_accel->rayOccluded(ray);
+    }
+
+    /**
+     * \brief Check whether the segment <tt>[ray.mint, ray.maxt]</tt> of
+     * the given ray is blocked by any triangle in the scene
+     *
+     * This is the query that should be used for shadow rays: it stops at
+     * the first intersection that is found and skips the computation of
+     * the surface interaction.
+     */
+    bool occluded(const Ray3f &ray) const {
+        return m_accel->rayOccluded(ray);
+    }
+
+    /**
+     * \brief Intersect a packet of rays against all triangles stored in
+     * the scene (see \ref Accel::rayIntersectPacket())
+     */
+    template <int N> void rayIntersect(const RayPacket<N> &packet, HitPacket<N> &hits,
+            bool shadowRay = false) const {
+        m_accel->rayIntersectPacket(packet, hits, shadowRay);
+    }
+
+    /**
+     * \brief Intersect a stream of rays against all triangles stored in
+     * the scene (see \ref Accel::rayIntersectStream())
+     */
+    void rayIntersect(const RayStream &rays, RayHits &hits, bool shadowRay = false) const {
+        m_accel->rayIntersectStream(rays, hits, shadowRay);
+    }
+
+    /**
+     * \brief Update the acceleration data structure after the vertices
+     * of some meshes have moved (see \ref Accel::refit())
+     */
+    void refit() { m_accel->refit(); }
+
+    /// \brief Return an axis-aligned box that bounds the scene
+    const BoundingBox3f &getBoundingBox() const {
+        return m_accel->getBoundingBox();
+    }
+
+    /**
+     * \brief Inherited from \ref NoriObject::activate()
+     *
+     * Initializes the internal data structures (kd-tree,
+     * emitter sampling data structures, etc.)
+     */
+    virtual void activate();
+
+    /// Add a child object to the scene (meshes, integrators etc.)
+    virtual void addChild(NoriObject *obj, const std::string& name = "none");
+
+    /// Return a string summary of the scene (for debugging purposes)
+    virtual std::string toString() const;
+
+    virtual EClassType getClassType() const { return EScene; }
+private:
+    /// Hit record of a primary ray that was traced in advance
+    struct PrimaryHit {
+        Ray3f ray;
+        Intersection its;
+        bool hit = false;
+        bool pending = false;
+    };
+
+    /// Return the stored primary hit if it matches the ray (see \ref setPrimaryHit())
+    bool consumePrimaryHit(const Ray3f &ray, Intersection &its) const;
+
+    static thread_local PrimaryHit m_primaryHit;
+
+    std::vector<Mesh *> m_meshes;
+    std::vector<Instance *> m_instances;
+    Integrator *m_integrator = nullptr;
+    Sampler *m_sampler = nullptr;
+    Camera *m_camera = nullptr;
+    Accel *m_accel = nullptr;
+
+    std::vector<Emitter *> m_emitters;
+    Emitter *m_enviromentalEmitter = nullptr;
+};
+
+NORI_NAMESPACE_END
@@ -0,0 +1,65 @@
+/*
+    This file is an extension of Nori, a simple educational ray tracer
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/mesh.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Set of analytic primitives (spheres, disks or quads)
+ *
+ * Shapes are meshes without triangles: the \ref Accel builds its BVH over
+ * the primitives and intersects them exactly, and area emitters attached
+ * to a shape sample its surface uniformly. The hit coordinates reported
+ * by \ref rayIntersect() are the surface parameterization of the
+ * primitive (instead of barycentric coordinates) and are also used as
+ * texture coordinates.
+ *
+ * Subclasses store their primitives and implement the per-primitive
+ * queries declared below.
+ */
+class Shape : public Mesh {
+public:
+    /// Compute the bounding box and the area distribution of the primitives
+    virtual void activate();
+
+    bool isAnalytic() const { return true; }
+
+    /// Return the center of the bounding box of the given primitive
+    Point3f getCentroid(n_UINT index) const { return getBoundingBox(index).getCenter(); }
+
+    /**
+     * \brief Compute the position, frames and texture coordinates of a hit
+     *
+     * \c its.uv contains the coordinates found by \ref rayIntersect(),
+     * which the hit information is computed from.
+     */
+    virtual void computeIntersection(n_UINT index, Intersection &its) const = 0;
+
+    /// Uniformly sample a position on the given primitive
+    virtual void samplePrimitive(n_UINT index, const Point2f &sample, Point3f &p,
+        Normal3f &n, Point2f &uv) const = 0;
+
+    /// Uniformly sample a position on the shape with respect to surface area
+    void samplePosition(const Point2f &sample, Point3f &p, Normal3f &n, Point2f &uv) const;
+
+    /// Return a human-readable summary of this instance
+    std::string toString() const;
+};
+
+NORI_NAMESPACE_END
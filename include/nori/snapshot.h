@@ -0,0 +1,179 @@
+/*
+    This file is an extension of Nori, a simple educational ray tracer
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <nori/mesh.h>
+#include <map>
+#include <mutex>
+
+/// Magic number at the start of scene snapshots ("NSNP")
+#define NORI_SNAPSHOT_MAGIC 0x504E534Eu
+
+/// Version of the snapshot format, bump it when the layout changes
+#define NORI_SNAPSHOT_VERSION 1
+
+/// Alignment of the data blocks within scene snapshots
+#define NORI_SNAPSHOT_ALIGNMENT 64
+
+NORI_NAMESPACE_BEGIN
+
+class Scene;
+class Accel;
+class Bitmap;
+class LDRBitmap;
+
+/**
+ * \brief Header of a scene snapshot
+ *
+ * All offsets are relative to the start of the file and all blocks start
+ * at multiples of \ref NORI_SNAPSHOT_ALIGNMENT bytes. The values use the
+ * byte order of the machine that wrote the file.
+ */
+struct SnapshotHeader {
+    uint32_t magic = NORI_SNAPSHOT_MAGIC;
+    uint32_t version = NORI_SNAPSHOT_VERSION;
+    uint64_t document = 0, documentSize = 0; ///< XML scene description
+    uint64_t meshes = 0, meshCount = 0;      ///< Table of \ref SnapshotEntry records
+    uint64_t images = 0, imageCount = 0;     ///< Table of \ref SnapshotEntry records
+    uint64_t accel = 0, accelSize = 0;       ///< Hierarchies in the format of the BVH cache
+};
+
+/// Mesh or image stored in a scene snapshot
+struct SnapshotEntry {
+    uint64_t key = 0, keySize = 0;   ///< XML declaration of the mesh or filename of the image
+    uint64_t name = 0, nameSize = 0; ///< Name of the mesh
+    uint64_t data = 0;               ///< Binary mesh data (see \ref BinaryMeshHeader) or pixels
+    uint32_t rows = 0, cols = 0;     ///< Resolution of the image
+    uint32_t pixelSize = 0;          ///< Bytes per pixel of the image
+    uint32_t reserved = 0;
+};
+
+/**
+ * \brief Memory-mappable snapshot of a fully loaded scene
+ *
+ * A snapshot holds the XML scene description together with everything that
+ * is expensive to recompute when the scene is loaded: the geometry of all
+ * meshes (including the area distributions used for sampling them), the
+ * decoded images of textures and environment maps, and the hierarchies of
+ * the acceleration structure. Created by <tt>nori --snapshot scene.xml</tt>
+ * and rendered by passing the resulting <tt>.snapshot</tt> file to nori.
+ *
+ * While a snapshot object exists, it is the active snapshot (see
+ * \ref getActive()) and the loading code consults it: the XML parser
+ * registers meshes with it or creates them from it, \ref Bitmap and
+ * \ref LDRBitmap do the same for decoded images and the scene for its
+ * acceleration structure. Meshes keep the snapshot file mapped after the
+ * snapshot object is destroyed.
+ *
+ * Meshes are identified by their XML declaration and images by their
+ * filename relative to the directory of the scene, hence snapshots can be
+ * loaded on machines where the referenced files do not exist. Analytic
+ * shapes (see \ref Shape) are not stored and loaded as usual.
+ */
+class SceneSnapshot {
+public:
+    enum EMode {
+        ECreate = 0, ///< Collect the data of the scene that is loaded next (see \ref write())
+        ELoad        ///< Load the scene from an existing snapshot file
+    };
+
+    /**
+     * \brief Activate a snapshot
+     *
+     * \param filename The XML scene description (\ref ECreate) or the
+     * snapshot file, which is mapped into memory (\ref ELoad)
+     */
+    SceneSnapshot(const std::string &filename, EMode mode);
+
+    /// Deactivate the snapshot
+    ~SceneSnapshot();
+
+    /// Return the snapshot that is currently used, if any
+    static SceneSnapshot *getActive() { return m_active; }
+
+    /// Is the scene loaded from this snapshot (as opposed to stored into it)?
+    bool isLoading() const { return (bool) m_file; }
+
+    /// Write the snapshot of a loaded scene to a file
+    void write(const std::string &filename, const Scene *scene) const;
+
+    /// Return the XML scene description stored in the snapshot
+    std::string getDocument() const;
+
+    /// Register a loaded mesh, identified by its XML declaration
+    void addMesh(const std::string &key, const Mesh *mesh);
+
+    /// Create a mesh that was stored in the snapshot (\c nullptr if it is not available)
+    Mesh *createMesh(const std::string &key) const;
+
+    /// Register a decoded image
+    void addImage(const std::string &filename, const Bitmap &bitmap);
+
+    /// Register a decoded image
+    void addImage(const std::string &filename, const LDRBitmap &bitmap);
+
+    /// Is the decoded image stored in the snapshot?
+    bool hasImage(const std::string &filename) const;
+
+    /// Fill in an image that was stored in the snapshot (returns \c false if it is not available)
+    bool readImage(const std::string &filename, Bitmap &bitmap) const;
+
+    /// Fill in an image that was stored in the snapshot (returns \c false if it is not available)
+    bool readImage(const std::string &filename, LDRBitmap &bitmap) const;
+
+    /// Fill in the hierarchies of the acceleration structure (returns \c false if not stored)
+    bool readAccel(Accel *accel) const;
+
+protected:
+    /// Image data collected while loading a scene
+    struct Image {
+        uint32_t rows, cols, pixelSize;
+        std::vector<uint8_t> pixels;
+    };
+
+    /// Identify an image by its filename relative to the scene directory
+    std::string imageKey(const std::string &filename) const;
+
+    void addImage(const std::string &filename, uint32_t rows, uint32_t cols,
+                  uint32_t pixelSize, const void *pixels);
+
+    const uint8_t *findImage(const std::string &filename, uint32_t pixelSize,
+                             uint32_t &rows, uint32_t &cols) const;
+
+private:
+    SceneSnapshot(const SceneSnapshot &) = delete;
+    SceneSnapshot &operator=(const SceneSnapshot &) = delete;
+
+    std::string m_filename;                      ///< Scene description or snapshot file
+    std::string m_directory;                     ///< Directory of \ref m_filename
+    SceneSnapshot *m_previous;                   ///< Snapshot that was active before this one
+
+    /* Writing */
+    std::map<std::string, const Mesh *> m_meshes;
+    std::map<std::string, Image> m_images;
+    std::mutex m_mutex;
+
+    /* Loading */
+    std::shared_ptr<MemoryMappedFile> m_file;
+    SnapshotHeader m_header;
+    std::map<std::string, const SnapshotEntry *> m_meshEntries;
+    std::map<std::string, const SnapshotEntry *> m_imageEntries;
+
+    static SceneSnapshot *m_active;
+};
+
+NORI_NAMESPACE_END
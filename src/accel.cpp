@@ -17,21 +17,180 @@
 */
 
 #include <nori/accel.h>
+#include <nori/shape.h>
 #include <nori/timer.h>
 #include <tbb/tbb.h>
 #include <Eigen/Geometry>
 #include <atomic>
+#include <functional>
+#include <mutex>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#define NORI_ACCEL_SSE 1
+#endif
+
+/* Traversal counters, removed entirely unless NORI_ACCEL_STATS is defined */
+#if defined(NORI_ACCEL_STATS)
+#define NORI_ACCEL_STAT(expr) expr
+#else
+#define NORI_ACCEL_STAT(expr)
+#endif
 
 NORI_NAMESPACE_BEGIN
 
 /* Bin data structure for counting triangles and computing their bounding box */
 struct Bins {
-	static const int BIN_COUNT = 16;
-	Bins() { memset(counts, 0, sizeof(n_UINT) * BIN_COUNT); }
-	n_UINT counts[BIN_COUNT];
-	BoundingBox3f bbox[BIN_COUNT];
+	/// Upper limit of the configurable bin count (see \ref Accel::m_binCount)
+	static const int MAX_BIN_COUNT = 64;
+	Bins() { memset(counts, 0, sizeof(n_UINT) * MAX_BIN_COUNT); }
+	n_UINT counts[MAX_BIN_COUNT];
+	BoundingBox3f bbox[MAX_BIN_COUNT];
+
+	/// Return the bin of a centroid coordinate
+	static int index(float centroid, float min, float inv_bin_size, int bin_count) {
+		return std::min(std::max((int) ((centroid - min) * inv_bin_size), 0), bin_count - 1);
+	}
+};
+
+/**
+ * \brief Thread-safe pool that hands out pairs of BVH nodes
+ *
+ * Used by the memory-bounded build: nodes are allocated in blocks as the
+ * tree grows, so the memory use stays within one block of the actual node
+ * count. Pairs never straddle a block, and nodes are never moved.
+ */
+template <typename Node> class NodePool {
+public:
+	/// Maximum number of nodes per block (log2)
+	static const int MAX_BLOCK_SHIFT = 12;
+
+	/**
+	 * \brief Create a pool for at most \c maxNodes nodes
+	 *
+	 * Small trees get a single block of just the right size. \c track is
+	 * informed about every allocated and released block.
+	 */
+	NodePool(size_t maxNodes, const std::function<void(int64_t)> &track)
+		: m_blockShift(1), m_size(0), m_track(track) {
+		while (m_blockShift < MAX_BLOCK_SHIFT && ((size_t) 1 << m_blockShift) < maxNodes)
+			m_blockShift++;
+		m_blockCount = (maxNodes >> m_blockShift) + 1;
+		m_blocks.reset(new std::atomic<Node *>[m_blockCount]);
+		for (size_t i = 0; i < m_blockCount; ++i)
+			m_blocks[i] = nullptr;
+	}
+
+	~NodePool() {
+		for (size_t i = 0; i < m_blockCount; ++i) {
+			if (m_blocks[i]) {
+				delete[] m_blocks[i].load();
+				m_track(-(int64_t) (sizeof(Node) << m_blockShift));
+			}
+		}
+	}
+
+	/// Allocate two consecutive (zero-initialized) nodes and return the index of the first one
+	n_UINT allocatePair() {
+		n_UINT idx = m_size.fetch_add(2);
+		assert((idx >> m_blockShift) < m_blockCount);
+		std::atomic<Node *> &block = m_blocks[idx >> m_blockShift];
+		if (!block.load(std::memory_order_acquire)) {
+			std::lock_guard<std::mutex> guard(m_mutex);
+			if (!block.load(std::memory_order_relaxed)) {
+				m_track(sizeof(Node) << m_blockShift);
+				block.store(new Node[(size_t) 1 << m_blockShift](), std::memory_order_release);
+			}
+		}
+		return idx;
+	}
+
+	Node &operator[](n_UINT idx) {
+		return m_blocks[idx >> m_blockShift].load(std::memory_order_relaxed)
+			[idx & (((n_UINT) 1 << m_blockShift) - 1)];
+	}
+
+	/// Return the number of allocated nodes
+	n_UINT size() const { return m_size; }
+
+private:
+	int m_blockShift;
+	size_t m_blockCount;
+	std::unique_ptr<std::atomic<Node *>[]> m_blocks;
+	std::atomic<n_UINT> m_size;
+	std::mutex m_mutex;
+	std::function<void(int64_t)> m_track;
 };
 
+/**
+ * \brief Parallel in-place partition
+ *
+ * Every chunk of \c grainSize elements is partitioned on its own first.
+ * Afterwards, the elements that ended up on the wrong side of the overall
+ * split position are swapped pairwise. Only needs memory proportional to
+ * the number of chunks. Returns the number of elements satisfying \c pred,
+ * which come first afterwards (in no particular order).
+ */
+template <typename T, typename Predicate> static size_t parallelPartition(T *data, size_t size,
+		size_t grainSize, const Predicate &pred) {
+	size_t chunkCount = (size + grainSize - 1) / grainSize;
+	std::vector<size_t> leftCounts(chunkCount);
+
+	tbb::parallel_for(size_t(0), chunkCount, [&](size_t c) {
+		T *begin = data + c * grainSize, *end = data + std::min(size, (c + 1) * grainSize);
+		leftCounts[c] = (size_t) (std::partition(begin, end, pred) - begin);
+	});
+
+	size_t leftCount = 0;
+	for (size_t count : leftCounts)
+		leftCount += count;
+
+	/* Ranges of misplaced elements: those failing the predicate before
+	   'leftCount', and those satisfying it after 'leftCount' */
+	std::vector<size_t> wrongLeft, wrongRight;   /* Pairs of [begin, end) */
+	for (size_t c = 0; c < chunkCount; ++c) {
+		size_t begin = c * grainSize, mid = begin + leftCounts[c],
+		       end = std::min(size, (c + 1) * grainSize);
+		if (mid < leftCount && mid < end) {
+			wrongLeft.push_back(mid);
+			wrongLeft.push_back(std::min(end, leftCount));
+		}
+		if (mid > leftCount && mid > begin) {
+			wrongRight.push_back(std::max(begin, leftCount));
+			wrongRight.push_back(mid);
+		}
+	}
+
+	/* Prefix sums over the range sizes, which enumerate the misplaced elements */
+	auto prefixSums = [](const std::vector<size_t> &ranges) {
+		std::vector<size_t> sums(1, 0);
+		for (size_t i = 0; i < ranges.size(); i += 2)
+			sums.push_back(sums.back() + ranges[i + 1] - ranges[i]);
+		return sums;
+	};
+	std::vector<size_t> sumsLeft = prefixSums(wrongLeft), sumsRight = prefixSums(wrongRight);
+	assert(sumsLeft.back() == sumsRight.back());
+
+	/* Swap the k-th misplaced element on the left with the k-th one on the right */
+	tbb::parallel_for(tbb::blocked_range<size_t>(0, sumsLeft.back(), grainSize),
+		[&](const tbb::blocked_range<size_t> &range) {
+		size_t rl = std::upper_bound(sumsLeft.begin(), sumsLeft.end(), range.begin()) - sumsLeft.begin() - 1,
+		       rr = std::upper_bound(sumsRight.begin(), sumsRight.end(), range.begin()) - sumsRight.begin() - 1;
+		size_t il = wrongLeft[2 * rl] + range.begin() - sumsLeft[rl],
+		       ir = wrongRight[2 * rr] + range.begin() - sumsRight[rr];
+
+		for (size_t k = range.begin(); k != range.end(); ++k) {
+			while (il == wrongLeft[2 * rl + 1])
+				il = wrongLeft[2 * ++rl];
+			while (ir == wrongRight[2 * rr + 1])
+				ir = wrongRight[2 * ++rr];
+			std::swap(data[il++], data[ir++]);
+		}
+	});
+
+	return leftCount;
+}
+
 /**
  * \brief Build task for parallel BVH construction
  *
@@ -45,6 +204,7 @@ struct Bins {
 class BVHBuildTask : public tbb::task {
 private:
 	Accel &bvh;
+	NodePool<Accel::BVHNode> *pool;
 	n_UINT node_idx;
 	n_UINT *start, *end, *temp;
 
@@ -71,6 +231,10 @@ public:
 	 * \param bvh
 	 *    Reference to the underlying BVH
 	 *
+	 * \param pool
+	 *    Node pool of the memory-bounded build, or \c nullptr to use the
+	 *    conservatively allocated node array of \c bvh
+	 *
 	 * \param node_idx
 	 *    Index of the BVH node that should be built
 	 *
@@ -83,25 +247,47 @@ public:
 	 *  \param temp
 	 *    Pointer into a temporary memory region that can be used for
 	 *    construction purposes. The usable length is <tt>end-start</tt>
-	 *    unsigned integers.
+	 *    unsigned integers. The memory-bounded build passes \c nullptr
+	 *    and partitions the indices in place.
 	 */
-	BVHBuildTask(Accel &bvh, n_UINT node_idx, n_UINT *start, n_UINT *end, n_UINT *temp)
-		: bvh(bvh), node_idx(node_idx), start(start), end(end), temp(temp) { }
+	BVHBuildTask(Accel &bvh, NodePool<Accel::BVHNode> *pool, n_UINT node_idx,
+			n_UINT *start, n_UINT *end, n_UINT *temp)
+		: bvh(bvh), pool(pool), node_idx(node_idx), start(start), end(end), temp(temp) { }
+
+	static Accel::BVHNode &getNode(Accel &bvh, NodePool<Accel::BVHNode> *pool, n_UINT idx) {
+		return pool ? (*pool)[idx] : bvh.m_nodes[idx];
+	}
+
+	/// Allocate the children of a node whose left subtree contains \c left_count triangles
+	static void allocateChildren(NodePool<Accel::BVHNode> *pool, n_UINT node_idx,
+			n_UINT left_count, n_UINT &left, n_UINT &right) {
+		if (pool) {
+			/* Siblings are stored next to each other, the node array is
+			   put into depth-first order once the build has finished */
+			left = pool->allocatePair();
+			right = left + 1;
+		} else {
+			/* The left subtree needs at most 2 * left_count - 1 nodes */
+			left = node_idx + 1;
+			right = node_idx + 2 * left_count;
+		}
+	}
 
 	task *execute() {
 		n_UINT size = (n_UINT)(end - start);
-		Accel::BVHNode &node = bvh.m_nodes[node_idx];
+		Accel::BVHNode &node = getNode(bvh, pool, node_idx);
 
 		/* Switch to a serial build when less than SERIAL_THRESHOLD triangles are left */
 		if (size < SERIAL_THRESHOLD) {
-			execute_serially(bvh, node_idx, start, end, temp);
+			execute_serially(bvh, pool, node_idx, start, end, temp);
 			return nullptr;
 		}
 
 		/* Always split along the largest axis */
+		const int bin_count = bvh.m_binCount;
 		int axis = node.bbox.getLargestAxis();
 		float min = node.bbox.min[axis], max = node.bbox.max[axis],
-			inv_bin_size = Bins::BIN_COUNT / (max - min);
+			inv_bin_size = bin_count / (max - min);
 
 		/* Accumulate all triangles into bins */
 		Bins bins = tbb::parallel_reduce(
@@ -113,9 +299,7 @@ public:
 				n_UINT f = start[i];
 				float centroid = bvh.getCentroid(f)[axis];
 
-				int index = std::min(std::max(
-					(int)((centroid - min) * inv_bin_size), 0),
-					(Bins::BIN_COUNT - 1));
+				int index = Bins::index(centroid, min, inv_bin_size, bin_count);
 
 				result.counts[index]++;
 				result.bbox[index].expandBy(bvh.getBoundingBox(f));
@@ -123,9 +307,9 @@ public:
 			return result;
 		},
 			/* REDUCE: Combine two 'Bins' data structures */
-			[](const Bins &b1, const Bins &b2) {
+			[&](const Bins &b1, const Bins &b2) {
 			Bins result;
-			for (int i = 0; i < Bins::BIN_COUNT; ++i) {
+			for (int i = 0; i < bin_count; ++i) {
 				result.counts[i] = b1.counts[i] + b2.counts[i];
 				result.bbox[i] = BoundingBox3f::merge(b1.bbox[i], b2.bbox[i]);
 			}
@@ -134,23 +318,23 @@ public:
 		);
 
 		/* Choose the best split plane based on the binned data */
-		BoundingBox3f bbox_left[Bins::BIN_COUNT];
+		BoundingBox3f bbox_left[Bins::MAX_BIN_COUNT];
 		bbox_left[0] = bins.bbox[0];
-		for (int i = 1; i < Bins::BIN_COUNT; ++i) {
+		for (int i = 1; i < bin_count; ++i) {
 			bins.counts[i] += bins.counts[i - 1];
 			bbox_left[i] = BoundingBox3f::merge(bbox_left[i - 1], bins.bbox[i]);
 		}
 
-		BoundingBox3f bbox_right = bins.bbox[Bins::BIN_COUNT - 1], best_bbox_right;
+		BoundingBox3f bbox_right = bins.bbox[bin_count - 1], best_bbox_right;
 		int64_t best_index = -1;
-		float best_cost = (float)INTERSECTION_COST * size;
+		float best_cost = leafCost(bvh, size);
 		float tri_factor = (float)INTERSECTION_COST / node.bbox.getSurfaceArea();
 
-		for (int i = Bins::BIN_COUNT - 2; i >= 0; --i) {
+		for (int i = bin_count - 2; i >= 0; --i) {
 			n_UINT prims_left = bins.counts[i], prims_right = (n_UINT)(end - start) - bins.counts[i];
 			float sah_cost = 2.0f * TRAVERSAL_COST +
-				tri_factor * (prims_left * bbox_left[i].getSurfaceArea() +
-					prims_right * bbox_right.getSurfaceArea());
+				tri_factor * (leafTests(bvh, prims_left) * bbox_left[i].getSurfaceArea() +
+					leafTests(bvh, prims_right) * bbox_right.getSurfaceArea());
 			if (sah_cost < best_cost) {
 				best_cost = sah_cost;
 				best_index = i;
@@ -162,20 +346,31 @@ public:
 		if (best_index == -1) {
 			/* Could not find a good split plane -- retry with
 			   more careful serial code just to be sure.. */
-			execute_serially(bvh, node_idx, start, end, temp);
+			execute_serially(bvh, pool, node_idx, start, end, temp);
 			return nullptr;
 		}
 
 		n_UINT left_count = bins.counts[best_index];
-		int node_idx_left = node_idx + 1;
-		int node_idx_right = node_idx + 2 * left_count;
+		n_UINT node_idx_left, node_idx_right;
+		allocateChildren(pool, node_idx, left_count, node_idx_left, node_idx_right);
 
-		bvh.m_nodes[node_idx_left].bbox = bbox_left[best_index];
-		bvh.m_nodes[node_idx_right].bbox = best_bbox_right;
+		getNode(bvh, pool, node_idx_left).bbox = bbox_left[best_index];
+		getNode(bvh, pool, node_idx_right).bbox = best_bbox_right;
 		node.inner.rightChild = node_idx_right;
 		node.inner.axis = axis;
 		node.inner.flag = 0;
 
+		if (!temp) {
+			size_t count = parallelPartition(start, size, GRAIN_SIZE, [&](n_UINT f) {
+				float centroid = bvh.getCentroid(f)[axis];
+				return Bins::index(centroid, min, inv_bin_size, bin_count) <= best_index;
+			});
+			assert(count == left_count);
+			(void) count;
+			spawnChildren(node_idx_left, node_idx_right, left_count);
+			return this;
+		}
+
 		std::atomic<n_UINT> offset_left(0),
 			offset_right(bins.counts[best_index]);
 
@@ -186,7 +381,7 @@ public:
 			for (n_UINT i = range.begin(); i != range.end(); ++i) {
 				n_UINT f = start[i];
 				float centroid = bvh.getCentroid(f)[axis];
-				int index = (int)((centroid - min) * inv_bin_size);
+				int index = Bins::index(centroid, min, inv_bin_size, bin_count);
 				(index <= best_index ? count_left : count_right)++;
 			}
 			n_UINT idx_l = offset_left.fetch_add(count_left);
@@ -194,7 +389,7 @@ public:
 			for (n_UINT i = range.begin(); i != range.end(); ++i) {
 				n_UINT f = start[i];
 				float centroid = bvh.getCentroid(f)[axis];
-				int index = (int)((centroid - min) * inv_bin_size);
+				int index = Bins::index(centroid, min, inv_bin_size, bin_count);
 				if (index <= best_index)
 					temp[idx_l++] = f;
 				else
@@ -205,31 +400,103 @@ public:
 		memcpy(start, temp, size * sizeof(n_UINT));
 		assert(offset_left == left_count && offset_right == size);
 
+		spawnChildren(node_idx_left, node_idx_right, left_count);
+		return this;
+	}
+
+	/// Post the right subtree to the scheduler and continue with the left one
+	void spawnChildren(n_UINT node_idx_left, n_UINT node_idx_right, n_UINT left_count) {
 		/* Create an empty parent task */
 		tbb::task& c = *new (allocate_continuation()) tbb::empty_task;
 		c.set_ref_count(2);
 
 		/* Post right subtree to scheduler */
 		BVHBuildTask &b = *new (c.allocate_child())
-			BVHBuildTask(bvh, node_idx_right, start + left_count,
-				end, temp + left_count);
+			BVHBuildTask(bvh, pool, node_idx_right, start + left_count,
+				end, temp ? temp + left_count : nullptr);
 		spawn(b);
 
 		/* Directly start working on left subtree */
 		recycle_as_child_of(c);
 		node_idx = node_idx_left;
 		end = start + left_count;
+	}
 
-		return this;
+	/// Number of triangle tests needed by a leaf of \c size triangles (padded to the leaf width)
+	static n_UINT leafTests(const Accel &bvh, n_UINT size) {
+		return (size + bvh.m_leafWidth - 1) / bvh.m_leafWidth * bvh.m_leafWidth;
+	}
+
+	/// SAH cost of turning \c size triangles into a leaf (infinite when the leaf would be too large)
+	static float leafCost(const Accel &bvh, n_UINT size) {
+		if (size > (n_UINT) bvh.m_maxLeafSize)
+			return std::numeric_limits<float>::infinity();
+		return (float)INTERSECTION_COST * leafTests(bvh, size);
 	}
 
 	/// Single-threaded build function
-	static void execute_serially(Accel &bvh, n_UINT node_idx, n_UINT *start, n_UINT *end, n_UINT *temp) {
-		Accel::BVHNode &node = bvh.m_nodes[node_idx];
+	static void execute_serially(Accel &bvh, NodePool<Accel::BVHNode> *pool, n_UINT node_idx,
+			n_UINT *start, n_UINT *end, n_UINT *temp) {
+		Accel::BVHNode &node = getNode(bvh, pool, node_idx);
+		n_UINT size = (n_UINT)(end - start);
+
+		int axis = -1;
+		n_UINT left_count = 0;
+		if (size > 1) {
+			if (bvh.m_exactLeafSAH)
+				sweepSplit(bvh, node, start, end, temp, axis, left_count);
+			else
+				binnedSplit(bvh, node, start, end, axis, left_count);
+		} else {
+			node.bbox = bvh.getBoundingBox(*start);
+		}
+
+		if (axis == -1) {
+			/* Splitting does not reduce the cost, make a leaf */
+			node.leaf.flag = 1;
+			node.leaf.start = (n_UINT)(start - bvh.m_indices.data());
+			node.leaf.size = size;
+			return;
+		}
+
+		n_UINT node_idx_left, node_idx_right;
+		allocateChildren(pool, node_idx, left_count, node_idx_left, node_idx_right);
+		node.inner.rightChild = node_idx_right;
+		node.inner.axis = axis;
+		node.inner.flag = 0;
+
+		execute_serially(bvh, pool, node_idx_left, start, start + left_count, temp);
+		execute_serially(bvh, pool, node_idx_right, start + left_count, end,
+			temp ? temp + left_count : nullptr);
+	}
+
+	/**
+	 * \brief Exact SAH split search that sorts the triangles along every axis
+	 *
+	 * Computes the bounding box of \c node and, if splitting is cheaper than
+	 * a leaf, sets \c best_axis and \c left_count and leaves the triangles
+	 * sorted along that axis. \c best_axis stays -1 otherwise.
+	 */
+	static void sweepSplit(Accel &bvh, Accel::BVHNode &node, n_UINT *start, n_UINT *end,
+			n_UINT *temp, int &best_axis, n_UINT &left_count) {
 		n_UINT size = (n_UINT)(end - start);
-		float best_cost = (float)INTERSECTION_COST * size;
-		int64_t best_index = -1, best_axis = -1;
-		float *left_areas = (float *)temp;
+		float best_cost = leafCost(bvh, size);
+		int64_t best_index = -1;
+		float *left_areas = (float *)temp, local_areas[SERIAL_THRESHOLD];
+
+		/* Without a temporary array, small subtrees use the stack. Larger
+		   ones (when the binned build found no split) get their own buffer,
+		   which is released before recursing */
+		std::unique_ptr<float[]> scratch;
+		if (!temp) {
+			if (size <= SERIAL_THRESHOLD) {
+				left_areas = local_areas;
+			} else {
+				scratch.reset(new float[size]);
+				left_areas = scratch.get();
+				bvh.trackMemory(sizeof(float) * size);
+			}
+		}
 
 		/* Try splitting along every axis */
 		for (int axis = 0; axis < 3; ++axis) {
@@ -261,8 +528,8 @@ public:
 				n_UINT prims_right = size - i;
 
 				float sah_cost = 2.0f * TRAVERSAL_COST +
-					tri_factor * (prims_left * left_area +
-						prims_right * right_area);
+					tri_factor * (leafTests(bvh, prims_left) * left_area +
+						leafTests(bvh, prims_right) * right_area);
 
 				if (sah_cost < best_cost) {
 					best_cost = sah_cost;
@@ -272,34 +539,233 @@ public:
 			}
 		}
 
-		if (best_index == -1) {
-			/* Splitting does not reduce the cost, make a leaf */
-			node.leaf.flag = 1;
-			node.leaf.start = (n_UINT)(start - bvh.m_indices.data());
-			node.leaf.size = size;
-			return;
+		if (scratch) {
+			scratch.reset();
+			bvh.trackMemory(-(int64_t) (sizeof(float) * size));
 		}
 
+		if (best_index == -1)
+			return;
+
 		std::sort(start, end, [&](n_UINT f1, n_UINT f2) {
 			return bvh.getCentroid(f1)[best_axis] < bvh.getCentroid(f2)[best_axis];
 		});
+		left_count = (n_UINT)best_index;
+	}
 
-		n_UINT left_count = (n_UINT)best_index;
-		n_UINT node_idx_left = node_idx + 1;
-		n_UINT node_idx_right = node_idx + 2 * left_count;
-		node.inner.rightChild = node_idx_right;
-		node.inner.axis = best_axis;
-		node.inner.flag = 0;
+	/**
+	 * \brief Binned SAH split search over all three axes
+	 *
+	 * Same contract as \ref sweepSplit(), but only evaluates the bin
+	 * boundaries and partitions the triangles in place, which avoids the
+	 * three sorts per level. When the centroids cannot be separated and the
+	 * node exceeds the maximum leaf size, the triangles are split in half.
+	 */
+	static void binnedSplit(Accel &bvh, Accel::BVHNode &node, n_UINT *start, n_UINT *end,
+			int &best_axis, n_UINT &left_count) {
+		const int bin_count = bvh.m_binCount;
+		n_UINT size = (n_UINT)(end - start);
+
+		BoundingBox3f centroid_bbox;
+		node.bbox.reset();
+		for (n_UINT *f = start; f != end; ++f) {
+			node.bbox.expandBy(bvh.getBoundingBox(*f));
+			centroid_bbox.expandBy(bvh.getCentroid(*f));
+		}
 
-		execute_serially(bvh, node_idx_left, start, start + left_count, temp);
-		execute_serially(bvh, node_idx_right, start + left_count, end, temp + left_count);
+		float best_cost = leafCost(bvh, size);
+		float tri_factor = (float)INTERSECTION_COST / node.bbox.getSurfaceArea();
+		int best_index = -1;
+
+		for (int axis = 0; axis < 3; ++axis) {
+			float min = centroid_bbox.min[axis], extent = centroid_bbox.max[axis] - min;
+			if (!(extent > 0))
+				continue;
+			float inv_bin_size = bin_count / extent;
+
+			Bins bins;
+			for (n_UINT *f = start; f != end; ++f) {
+				int index = Bins::index(bvh.getCentroid(*f)[axis], min, inv_bin_size, bin_count);
+				bins.counts[index]++;
+				bins.bbox[index].expandBy(bvh.getBoundingBox(*f));
+			}
+
+			float left_areas[Bins::MAX_BIN_COUNT];
+			BoundingBox3f bbox;
+			for (int i = 0; i < bin_count; ++i) {
+				bbox.expandBy(bins.bbox[i]);
+				left_areas[i] = bbox.getSurfaceArea();
+				if (i > 0)
+					bins.counts[i] += bins.counts[i - 1];
+			}
+
+			bbox.reset();
+			for (int i = bin_count - 2; i >= 0; --i) {
+				bbox.expandBy(bins.bbox[i + 1]);
+				n_UINT prims_left = bins.counts[i], prims_right = size - prims_left;
+				if (prims_left == 0 || prims_right == 0)
+					continue;
+
+				float sah_cost = 2.0f * TRAVERSAL_COST +
+					tri_factor * (leafTests(bvh, prims_left) * left_areas[i] +
+						leafTests(bvh, prims_right) * bbox.getSurfaceArea());
+
+				if (sah_cost < best_cost) {
+					best_cost = sah_cost;
+					best_index = i;
+					best_axis = axis;
+					left_count = prims_left;
+				}
+			}
+		}
+
+		if (best_axis != -1) {
+			float min = centroid_bbox.min[best_axis],
+				inv_bin_size = bin_count / (centroid_bbox.max[best_axis] - min);
+			std::partition(start, end, [&](n_UINT f) {
+				return Bins::index(bvh.getCentroid(f)[best_axis], min,
+					inv_bin_size, bin_count) <= best_index;
+			});
+		} else if (size > (n_UINT) bvh.m_maxLeafSize) {
+			/* All centroids coincide, but the leaf would be too large */
+			best_axis = node.bbox.getLargestAxis();
+			left_count = size / 2;
+		}
 	}
 };
 
+Accel::Accel(const PropertyList &props) {
+	m_meshOffset.push_back(0u);
+
+	/* Branching factor of the hierarchy that is used for traversal */
+	m_width = props.getInteger("width", 2);
+	if (m_width != 2 && m_width != 4 && m_width != 8)
+		throw NoriException("Accel: unsupported BVH width %i (must be 2, 4 or 8)!", m_width);
+
+	m_precompute = props.getBoolean("precompute", false);
+
+	m_leafWidth = props.getInteger("leafWidth", 1);
+	if (m_leafWidth != 1 && m_leafWidth != 4 && m_leafWidth != 8)
+		throw NoriException("Accel: unsupported leaf width %i (must be 1, 4 or 8)!", m_leafWidth);
+
+	m_quantization = props.getInteger("quantization", 0);
+	if (m_quantization != 0 && m_quantization != 8 && m_quantization != 16)
+		throw NoriException("Accel: unsupported quantization %i (must be 0, 8 or 16 bits)!", m_quantization);
+	if (m_quantization != 0 && m_width == 2)
+		throw NoriException("Accel: quantized bounds require a wide BVH (width 4 or 8)!");
+
+	std::string layout = props.getString("layout", "depthfirst");
+	if (layout != "treelet" && layout != "depthfirst")
+		throw NoriException("Accel: unknown node layout \"%s\"!", layout);
+	m_treeletLayout = layout == "treelet";
+	m_props = props;
+
+	/* Construction method, selected via <accel type=".."> */
+	std::string type = props.getString("accel", "bvh");
+	if (type == "bvh")
+		m_buildMethod = EObjectSplits;
+	else if (type == "sbvh")
+		m_buildMethod = ESpatialSplits;
+	else if (type == "lbvh")
+		m_buildMethod = ELinear;
+	else if (type == "ploc")
+		m_buildMethod = EClustering;
+	else
+		throw NoriException("Accel: unknown acceleration structure type \"%s\"!", type);
+
+	m_duplicationBudget = props.getFloat("duplicationBudget", 0.3f);
+	if (m_duplicationBudget < 0)
+		throw NoriException("Accel: the duplication budget must be nonnegative!");
+
+	m_plocRadius = props.getInteger("plocRadius", 8);
+	if (m_plocRadius < 1)
+		throw NoriException("Accel: the PLOC search radius must be positive!");
+
+	m_rebuildThreshold = props.getFloat("rebuildThreshold", 1.5f);
+	if (m_rebuildThreshold < 1)
+		throw NoriException("Accel: the rebuild threshold must be at least 1!");
+
+	m_lowMemory = props.getBoolean("lowMemory", false);
+
+	/* Build quality presets of the object split builder */
+	std::string quality = props.getString("quality", "balanced");
+	if (quality == "fast") {
+		m_binCount = 8; m_maxLeafSize = 16; m_exactLeafSAH = false;
+	} else if (quality == "balanced") {
+		m_binCount = 16; m_maxLeafSize = 8; m_exactLeafSAH = false;
+	} else if (quality == "high") {
+		m_binCount = 32; m_maxLeafSize = 4; m_exactLeafSAH = true;
+	} else {
+		throw NoriException("Accel: unknown build quality \"%s\"!", quality);
+	}
+
+	m_binCount = props.getInteger("binCount", m_binCount);
+	if (m_binCount < 2 || m_binCount > Bins::MAX_BIN_COUNT)
+		throw NoriException("Accel: the bin count must be between 2 and %i!", (int) Bins::MAX_BIN_COUNT);
+
+	m_requestedLeafSize = props.getInteger("maxLeafSize", m_maxLeafSize);
+	if (m_requestedLeafSize < 1)
+		throw NoriException("Accel: the maximum leaf size must be positive!");
+
+	/* Full SIMD leaves should not be split up */
+	m_maxLeafSize = (m_requestedLeafSize + m_leafWidth - 1) / m_leafWidth * m_leafWidth;
+
+	/* The cache file is stored next to the scene description */
+	if (props.getBoolean("cache", false)) {
+		std::string filename = props.getString("filename", "");
+		if (filename.empty())
+			cerr << "Accel: the scene filename is unknown, disabling the BVH cache." << endl;
+		else
+			m_cacheFile = filename + ".bvhcache";
+	}
+}
+
 void Accel::addMesh(Mesh *mesh) {
+	/* Analytic shapes get a bottom-level BVH of their own (see addInstance()) */
+	if (mesh->isAnalytic() && !m_analytic) {
+		addInstance(mesh, Transform());
+		return;
+	}
+
 	m_meshes.push_back(mesh);
-	m_meshOffset.push_back(m_meshOffset.back() + mesh->getTriangleCount());
+	m_meshOffset.push_back(m_meshOffset.back() + mesh->getPrimitiveCount());
 	m_bbox.expandBy(mesh->getBoundingBox());
+	m_alphaMasks |= mesh->hasAlphaMask();
+}
+
+void Accel::addInstance(Mesh *mesh, const Transform &toWorld) {
+	/* Instances of the same mesh share one bottom-level BVH */
+	auto it = m_blasIndex.find(mesh);
+	if (it == m_blasIndex.end()) {
+		/* The bottom-level BVHs are stored in the cache file of this BVH */
+		Accel *blas = new Accel(m_props);
+		blas->m_cacheFile.clear();
+		if (mesh->isAnalytic()) {
+			/* Triangle records, triangle blocks and spatial splits need
+			   vertex data, analytic primitives are only tested via the mesh */
+			blas->m_analytic = true;
+			blas->m_precompute = false;
+			blas->m_leafWidth = 1;
+			blas->m_maxLeafSize = m_requestedLeafSize;
+			if (blas->m_buildMethod == ESpatialSplits)
+				blas->m_buildMethod = EObjectSplits;
+		}
+		blas->addMesh(mesh);
+		it = m_blasIndex.insert(std::make_pair(mesh, (n_UINT) m_blas.size())).first;
+		m_blas.push_back(blas);
+	}
+
+	InstanceRecord instance;
+	instance.toLocal = toWorld.inverse();
+	instance.blas = it->second;
+	instance.identity = toWorld.getMatrix().isIdentity();
+
+	const BoundingBox3f &bbox = mesh->getBoundingBox();
+	for (int i = 0; i < 8; ++i)
+		instance.bbox.expandBy(toWorld * bbox.getCorner(i));
+
+	m_instances.push_back(instance);
+	m_bbox.expandBy(instance.bbox);
 }
 
 void Accel::clear() {
@@ -308,44 +774,256 @@ void Accel::clear() {
 	m_meshes.clear();
 	m_meshOffset.clear();
 	m_meshOffset.push_back(0u);
+	m_alphaMasks = false;
 	m_nodes.clear();
 	m_indices.clear();
+	m_wideNodes4.clear();
+	m_wideNodes8.clear();
 	m_bbox.reset();
 	m_nodes.shrink_to_fit();
 	m_meshes.shrink_to_fit();
 	m_meshOffset.shrink_to_fit();
 	m_indices.shrink_to_fit();
+	m_wideNodes4.shrink_to_fit();
+	m_wideNodes8.shrink_to_fit();
+	m_quantizedNodes4x8.clear();
+	m_quantizedNodes8x8.clear();
+	m_quantizedNodes4x16.clear();
+	m_quantizedNodes8x16.clear();
+	m_quantizedNodes4x8.shrink_to_fit();
+	m_quantizedNodes8x8.shrink_to_fit();
+	m_quantizedNodes4x16.shrink_to_fit();
+	m_quantizedNodes8x16.shrink_to_fit();
+	m_triangles.clear();
+	m_triangles.shrink_to_fit();
+	m_triangleBlocks4.clear();
+	m_triangleBlocks8.clear();
+	m_triangleBlocks4.shrink_to_fit();
+	m_triangleBlocks8.shrink_to_fit();
+	for (auto blas : m_blas)
+		delete blas;
+	m_blas.clear();
+	m_blasIndex.clear();
+	m_instances.clear();
+	m_instanceNodes.clear();
+	m_blas.shrink_to_fit();
+	m_instances.shrink_to_fit();
+	m_instanceNodes.shrink_to_fit();
 }
 
 void Accel::build() {
+	/* Reuse the hierarchies stored by an earlier run if possible. This
+	   fills in the nodes of this BVH and of all bottom-level BVHs */
+	bool cached = m_cached || (!m_cacheFile.empty() && loadCache());
+
+	if (!m_instances.empty())
+		buildInstances();
+
 	n_UINT size = getTriangleCount();
+	if (size > 0 && m_nodes.empty())
+		buildTree();
+
+	if (!m_cacheFile.empty() && !cached)
+		saveCache();
+
 	if (size == 0)
 		return;
-	cout << "Constructing a SAH BVH (" << m_meshes.size()
+
+	if (m_precompute)
+		precomputeTriangles();
+	packLeaves();
+
+	collapseNodes();
+}
+
+void Accel::refit() {
+	/* Bottom-level BVHs of deforming instanced meshes */
+	for (auto blas : m_blas)
+		blas->refit();
+
+	m_bbox.reset();
+	for (auto mesh : m_meshes)
+		m_bbox.expandBy(mesh->getBoundingBox());
+
+	if (!m_instances.empty()) {
+		for (InstanceRecord &instance : m_instances) {
+			Transform toWorld = instance.toLocal.inverse();
+			const BoundingBox3f &bbox = m_blas[instance.blas]->getBoundingBox();
+			instance.bbox.reset();
+			for (int i = 0; i < 8; ++i)
+				instance.bbox.expandBy(toWorld * bbox.getCorner(i));
+			m_bbox.expandBy(instance.bbox);
+		}
+
+		/* The top-level tree is small, simply rebuild it */
+		buildInstanceTree();
+	}
+
+	if (m_nodes.empty())
+		return;
+
+	cout << "Refitting the BVH (" << m_meshes.size()
 		<< (m_meshes.size() == 1 ? " mesh, " : " meshes, ")
-		<< size << " triangles) .. ";
+		<< getTriangleCount() << " triangles) .. ";
 	cout.flush();
 	Timer timer;
 
-	/* Conservative estimate for the total number of nodes */
-	m_nodes.resize(2 * size);
-	memset(m_nodes.data(), 0, sizeof(BVHNode) * m_nodes.size());
-	m_nodes[0].bbox = m_bbox;
-	m_indices.resize(size);
+	refitNode(0, 0);
+
+	float cost = statistics().first;
+	cout << "done (took " << timer.elapsedString() << ", SAH cost = " << cost
+		<< " vs. " << m_buildCost << " after the last build)." << endl;
+
+	if (cost > m_buildCost * m_rebuildThreshold) {
+		cout << "The SAH cost increased by more than a factor of "
+			<< m_rebuildThreshold << ", rebuilding." << endl;
+		m_nodes.clear();
+		m_indices.clear();
+		buildTree();
+	}
+
+	if (m_precompute)
+		precomputeTriangles();
+	packLeaves();
+
+	collapseNodes();
+}
+
+void Accel::refitNode(n_UINT node_idx, int depth) {
+	/* Process the subtrees of the first levels in parallel */
+	const int PARALLEL_DEPTH = 8;
+
+	BVHNode &node = m_nodes[node_idx];
+	if (node.isLeaf()) {
+		node.bbox.reset();
+		for (n_UINT i = node.start(), end = node.end(); i < end; ++i)
+			node.bbox.expandBy(getBoundingBox(m_indices[i]));
+		return;
+	}
+
+	n_UINT left = node_idx + 1, right = node.inner.rightChild;
+	if (depth < PARALLEL_DEPTH) {
+		tbb::parallel_invoke(
+			[&] { refitNode(left, depth + 1); },
+			[&] { refitNode(right, depth + 1); }
+		);
+	} else {
+		refitNode(left, depth + 1);
+		refitNode(right, depth + 1);
+	}
+
+	node.bbox = BoundingBox3f::merge(m_nodes[left].bbox, m_nodes[right].bbox);
+}
+
+void Accel::buildTree() {
+	n_UINT size = getTriangleCount();
+	const char *name = "SAH BVH";
+	if (m_buildMethod == ESpatialSplits)
+		name = "spatial split SAH BVH";
+	else if (m_buildMethod == ELinear)
+		name = "linear BVH";
+	else if (m_buildMethod == EClustering)
+		name = "PLOC BVH";
+
+	cout << "Constructing a " << name << " (" << m_meshes.size()
+		<< (m_meshes.size() == 1 ? " mesh, " : " meshes, ")
+		<< size << " triangles) .. ";
+	cout.flush();
+	Timer timer;
 
 	cout << "Size of each node is " << sizeof(BVHNode);
 
 	if ((sizeof(n_UINT) == 4) && (sizeof(BVHNode) != 32))
 		throw NoriException("BVH Node is not packed! Investigate compiler settings.");
 
+	m_buildMemory = m_buildPeakMemory = 0;
+	if (m_buildMethod == ESpatialSplits)
+		buildSpatialSplits();
+	else if (m_buildMethod == ELinear || m_buildMethod == EClustering)
+		buildLinear();
+	else
+		buildObjectSplits();
+
+	if (m_leafWidth > 1)
+		padLeaves();
+
+	m_buildCost = statistics().first;
+	cout << "done (took " << timer.elapsedString() << " and "
+		<< memString(sizeof(BVHNode) * m_nodes.size() + sizeof(n_UINT)*m_indices.size());
+	if (m_buildPeakMemory > 0)
+		cout << ", peak " << memString(m_buildPeakMemory);
+	cout << ", SAH cost = " << m_buildCost;
+	if (m_indices.size() != size)
+		cout << ", " << m_indices.size() << " references";
+	cout << ")." << endl;
+}
+
+void Accel::buildObjectSplits() {
+	n_UINT size = getTriangleCount();
+
+	m_indices.resize(size);
+	trackMemory(sizeof(n_UINT) * size);
 	for (n_UINT i = 0; i < size; ++i)
 		m_indices[i] = i;
+	n_UINT *indices = m_indices.data();
+
+	if (m_lowMemory) {
+		/* The root occupies the first pair of nodes on its own */
+		NodePool<BVHNode> pool(2 * (size_t) size + 2, [this](int64_t bytes) { trackMemory(bytes); });
+		pool.allocatePair();
+		pool[0].bbox = m_bbox;
+
+		BVHBuildTask& task = *new(tbb::task::allocate_root())
+			BVHBuildTask(*this, &pool, 0u, indices, indices + size, nullptr);
+		tbb::task::spawn_root_and_wait(task);
+
+		/* Copy the nodes into depth-first order, where the left child
+		   directly follows its parent. The stack holds the pool indices
+		   of the nodes to be visited, together with the parent that
+		   references them as its right child (if any) */
+		m_nodes.resize(pool.size() - 1);
+		trackMemory(sizeof(BVHNode) * m_nodes.size());
+
+		const n_UINT noParent = (n_UINT) -1;
+		std::vector<std::pair<n_UINT, n_UINT>> stack(1, std::make_pair(0u, noParent));
+		for (n_UINT idx = 0; !stack.empty(); ++idx) {
+			std::pair<n_UINT, n_UINT> entry = stack.back();
+			stack.pop_back();
+			if (entry.second != noParent)
+				m_nodes[entry.second].inner.rightChild = idx;
+
+			BVHNode &node = m_nodes[idx];
+			node = pool[entry.first];
+			if (node.isInner()) {
+				stack.push_back(std::make_pair(node.inner.rightChild, idx));
+				stack.push_back(std::make_pair(node.inner.rightChild - 1, noParent));
+			}
+		}
+		return;
+	}
+
+	/* Conservative estimate for the total number of nodes */
+	m_nodes.resize(2 * size);
+	memset(m_nodes.data(), 0, sizeof(BVHNode) * m_nodes.size());
+	m_nodes[0].bbox = m_bbox;
 
-	n_UINT *indices = m_indices.data(), *temp = new n_UINT[size];
+	n_UINT *temp = new n_UINT[size];
+	trackMemory(sizeof(BVHNode) * m_nodes.size() + sizeof(n_UINT) * size);
 	BVHBuildTask& task = *new(tbb::task::allocate_root())
-		BVHBuildTask(*this, 0u, indices, indices + size, temp);
+		BVHBuildTask(*this, nullptr, 0u, indices, indices + size, temp);
 	tbb::task::spawn_root_and_wait(task);
 	delete[] temp;
+	trackMemory(-(int64_t) (sizeof(n_UINT) * size));
+
+	/* The compaction temporarily holds both node arrays and a skip count per node */
+	compactNodes();
+	int64_t compaction = sizeof(BVHNode) * m_nodes.size() + sizeof(n_UINT) * 2 * (size_t) size;
+	trackMemory(compaction);
+	trackMemory(-compaction - (int64_t) (sizeof(BVHNode) * 2 * (size_t) size) +
+		(int64_t) (sizeof(BVHNode) * m_nodes.size()));
+}
+
+void Accel::compactNodes() {
 	std::pair<float, n_UINT> stats = statistics();
 
 	/* The node array was allocated conservatively and now contains
@@ -366,138 +1044,1351 @@ void Accel::build() {
 				(skipped - skipped_accum[new_node.inner.rightChild]));
 		}
 	}
-	cout << "done (took " << timer.elapsedString() << " and "
-		<< memString(sizeof(BVHNode) * m_nodes.size() + sizeof(n_UINT)*m_indices.size())
-		<< ", SAH cost = " << stats.first
-		<< ")." << endl;
 
 	m_nodes = std::move(compactified);
 }
 
-std::pair<float, n_UINT> Accel::statistics(n_UINT node_idx) const {
-	const BVHNode &node = m_nodes[node_idx];
-	if (node.isLeaf()) {
-		return std::make_pair((float)BVHBuildTask::INTERSECTION_COST * node.leaf.size, 1u);
-	}
-	else {
-		std::pair<float, n_UINT> stats_left = statistics(node_idx + 1u);
-		std::pair<float, n_UINT> stats_right = statistics(node.inner.rightChild);
-		float saLeft = m_nodes[node_idx + 1u].bbox.getSurfaceArea();
-		float saRight = m_nodes[node.inner.rightChild].bbox.getSurfaceArea();
-		float saCur = node.bbox.getSurfaceArea();
-		float sahCost =
-			2 * BVHBuildTask::TRAVERSAL_COST +
-			(saLeft * stats_left.first + saRight * stats_right.first) / saCur;
-		return std::make_pair(
-			sahCost,
-			stats_left.second + stats_right.second + 1u
-		);
-	}
+void Accel::trackMemory(int64_t bytes) {
+	size_t current = m_buildMemory.fetch_add((size_t) bytes) + (size_t) bytes,
+	       peak = m_buildPeakMemory;
+	while (current > peak && !m_buildPeakMemory.compare_exchange_weak(peak, current))
+		;
 }
 
-bool Accel::rayIntersect(const Ray3f &_ray, Intersection &its, bool shadowRay) const {
-	n_UINT node_idx = 0, stack_idx = 0, stack[64];
+void Accel::buildInstances() {
+	/* Bottom level: one BVH per distinct mesh */
+	for (auto blas : m_blas)
+		blas->build();
 
-	its.t = std::numeric_limits<float>::infinity();
+	buildInstanceTree();
+}
 
-	/* Use an adaptive ray epsilon */
-	Ray3f ray(_ray);
-	if (ray.mint == Epsilon)
-		ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
+void Accel::buildInstanceTree() {
+	cout << "Constructing the top-level BVH (" << m_instances.size()
+		<< (m_instances.size() == 1 ? " instance of " : " instances of ")
+		<< m_blas.size() << (m_blas.size() == 1 ? " mesh) .. " : " meshes) .. ");
+	cout.flush();
+	Timer timer;
 
-	if (m_nodes.empty() || ray.maxt < ray.mint)
-		return false;
+	m_instanceNodes.clear();
+	m_instanceNodes.reserve(2 * m_instances.size());
+	buildInstanceNode(0, (n_UINT) m_instances.size());
+	m_instanceNodes.shrink_to_fit();
 
-	bool foundIntersection = false;
-	n_UINT f = 0;
+	cout << "done (took " << timer.elapsedString() << " and "
+		<< memString(sizeof(BVHNode) * m_instanceNodes.size() +
+			sizeof(InstanceRecord) * m_instances.size())
+		<< ")." << endl;
+}
 
-	while (true) {
-		const BVHNode &node = m_nodes[node_idx];
+n_UINT Accel::buildInstanceNode(n_UINT start, n_UINT end) {
+	/* Maximum number of instances per top-level leaf */
+	const n_UINT INSTANCE_LEAF_SIZE = 2;
 
-		if (!node.bbox.rayIntersect(ray)) {
-			if (stack_idx == 0)
-				break;
-			node_idx = stack[--stack_idx];
-			continue;
-		}
+	n_UINT node_idx = (n_UINT) m_instanceNodes.size();
+	m_instanceNodes.emplace_back();
 
-		if (node.isInner()) {
-			stack[stack_idx++] = node.inner.rightChild;
-			node_idx++;
-			assert(stack_idx < 64);
+	BVHNode node;
+	memset(&node, 0, sizeof(BVHNode));
+	node.bbox.reset();
+	BoundingBox3f centroids;
+	for (n_UINT i = start; i < end; ++i) {
+		node.bbox.expandBy(m_instances[i].bbox);
+		centroids.expandBy(m_instances[i].bbox.getCenter());
+	}
+
+	if (end - start <= INSTANCE_LEAF_SIZE) {
+		node.leaf.flag = 1;
+		node.leaf.start = start;
+		node.leaf.size = end - start;
+		m_instanceNodes[node_idx] = node;
+		return node_idx;
+	}
+
+	/* Object median split along the largest centroid extent. The instances
+	   are reordered in place, so leaves reference contiguous ranges */
+	int axis = centroids.getMajorAxis();
+	n_UINT mid = start + (end - start) / 2;
+	std::nth_element(m_instances.begin() + start, m_instances.begin() + mid,
+		m_instances.begin() + end, [axis](const InstanceRecord &a, const InstanceRecord &b) {
+			return a.bbox.getCenter()[axis] < b.bbox.getCenter()[axis];
 		}
-		else {
-			for (n_UINT i = node.start(), end = node.end(); i < end; ++i) {
-				n_UINT idx = m_indices[i];
-				const Mesh *mesh = m_meshes[findMesh(idx)];
+	);
 
-				float u, v, t;
-				if (mesh->rayIntersect(idx, ray, u, v, t)) {
-					if (shadowRay)
-						return true;
-					foundIntersection = true;
-					ray.maxt = its.t = t;
-					its.uv = Point2f(u, v);
-					its.mesh = mesh;
-					f = idx;
+	buildInstanceNode(start, mid);
+	node.inner.flag = 0;
+	node.inner.axis = axis;
+	node.inner.rightChild = buildInstanceNode(mid, end);
+	m_instanceNodes[node_idx] = node;
+
+	return node_idx;
+}
+
+void Accel::precomputeTriangles() {
+	cout << "Precomputing triangle records .. ";
+	cout.flush();
+	Timer timer;
+
+	m_triangles.resize(m_indices.size());
+
+	tbb::parallel_for(tbb::blocked_range<size_t>(0, m_indices.size()),
+		[&](const tbb::blocked_range<size_t> &range) {
+			for (size_t i = range.begin(); i != range.end(); ++i) {
+				n_UINT idx = m_indices[i];
+				n_UINT meshIdx = findMesh(idx);
+				const Mesh *mesh = m_meshes[meshIdx];
+				MatrixXuView F = mesh->getIndices();
+
+				TriangleRecord &tri = m_triangles[i];
+				tri.p0 = mesh->getVertexPosition(F(0, idx));
+				tri.edge1 = mesh->getVertexPosition(F(1, idx)) - tri.p0;
+				tri.edge2 = mesh->getVertexPosition(F(2, idx)) - tri.p0;
+				tri.mesh = meshIdx;
+				tri.prim = idx;
+			}
+		}
+	);
+
+	cout << "done (took " << timer.elapsedString() << " and "
+		<< memString(sizeof(TriangleRecord) * m_triangles.size()) << ")." << endl;
+}
+
+void Accel::padLeaves() {
+	const n_UINT width = (n_UINT) m_leafWidth;
+	std::vector<n_UINT> indices;
+	indices.reserve(m_indices.size() + m_indices.size() / 2);
+
+	/* Repeating the last triangle of a leaf does not change its hits */
+	for (BVHNode &node : m_nodes) {
+		if (!node.isLeaf() || node.leaf.size == 0)
+			continue;
+		n_UINT start = (n_UINT) indices.size();
+		indices.insert(indices.end(), m_indices.begin() + node.start(), m_indices.begin() + node.end());
+		while ((indices.size() - start) % width != 0)
+			indices.push_back(indices.back());
+		node.leaf.start = start;
+		node.leaf.size = (n_UINT) indices.size() - start;
+	}
+
+	m_indices.swap(indices);
+}
+
+template <int W> void Accel::packTriangles(std::vector<TriangleBlock<W>> &blocks) {
+	cout << "Packing triangles into blocks of " << W << " .. ";
+	cout.flush();
+	Timer timer;
+
+	assert(m_indices.size() % W == 0);
+	blocks.resize(m_indices.size() / W);
+
+	tbb::parallel_for(tbb::blocked_range<size_t>(0, blocks.size()),
+		[&](const tbb::blocked_range<size_t> &range) {
+			for (size_t i = range.begin(); i != range.end(); ++i) {
+				TriangleBlock<W> &block = blocks[i];
+				for (int j = 0; j < W; ++j) {
+					n_UINT idx = m_indices[i * W + j];
+					n_UINT meshIdx = findMesh(idx);
+					const Mesh *mesh = m_meshes[meshIdx];
+					MatrixXuView F = mesh->getIndices();
+
+					Point3f p0 = mesh->getVertexPosition(F(0, idx));
+					Vector3f edge1 = mesh->getVertexPosition(F(1, idx)) - p0,
+					         edge2 = mesh->getVertexPosition(F(2, idx)) - p0;
+					for (int k = 0; k < 3; ++k) {
+						block.p0[k][j] = p0[k];
+						block.edge1[k][j] = edge1[k];
+						block.edge2[k][j] = edge2[k];
+					}
+					block.mesh[j] = meshIdx;
+					block.prim[j] = idx;
+				}
+			}
+		}
+	);
+
+	cout << "done (took " << timer.elapsedString() << " and "
+		<< memString(sizeof(TriangleBlock<W>) * blocks.size()) << ")." << endl;
+}
+
+void Accel::packLeaves() {
+	if (m_leafWidth == 4)
+		packTriangles(m_triangleBlocks4);
+	else if (m_leafWidth == 8)
+		packTriangles(m_triangleBlocks8);
+}
+
+void Accel::collapseNodes() {
+	/* Quantization keeps the node order, hence treelets are sized for the
+	   nodes that traversal ends up using */
+	if (m_width == 4) {
+		collapse(m_wideNodes4);
+		if (m_treeletLayout)
+			reorder(m_wideNodes4, m_quantization == 8 ? sizeof(QuantizedBVHNode<4, uint8_t>)
+				: m_quantization == 16 ? sizeof(QuantizedBVHNode<4, uint16_t>)
+				: sizeof(WideBVHNode<4>));
+	} else if (m_width == 8) {
+		collapse(m_wideNodes8);
+		if (m_treeletLayout)
+			reorder(m_wideNodes8, m_quantization == 8 ? sizeof(QuantizedBVHNode<8, uint8_t>)
+				: m_quantization == 16 ? sizeof(QuantizedBVHNode<8, uint16_t>)
+				: sizeof(WideBVHNode<8>));
+	}
+
+	if (m_quantization == 8) {
+		if (m_width == 4)
+			quantize(m_wideNodes4, m_quantizedNodes4x8);
+		else
+			quantize(m_wideNodes8, m_quantizedNodes8x8);
+	} else if (m_quantization == 16) {
+		if (m_width == 4)
+			quantize(m_wideNodes4, m_quantizedNodes4x16);
+		else
+			quantize(m_wideNodes8, m_quantizedNodes8x16);
+	}
+}
+
+template <int N> void Accel::collapse(NodeVector<WideBVHNode<N>> &wideNodes) {
+	cout << "Collapsing into a " << N << "-wide BVH .. ";
+	cout.flush();
+	Timer timer;
+
+	wideNodes.clear();
+	wideNodes.reserve(m_nodes.size() / (N - 1) + 1);
+
+	/* Recursively create a wide node for the binary subtree at 'node_idx'.
+	   The children of the binary node are repeatedly replaced by their own
+	   children (largest surface area first) until N slots are filled. */
+	std::function<n_UINT(n_UINT)> collapseNode = [&](n_UINT node_idx) -> n_UINT {
+		n_UINT children[N], childCount = 0;
+		const BVHNode &node = m_nodes[node_idx];
+
+		if (node.isLeaf()) {
+			children[childCount++] = node_idx;
+		} else {
+			children[childCount++] = node_idx + 1;
+			children[childCount++] = node.inner.rightChild;
+		}
+
+		while (childCount < N) {
+			int best = -1;
+			float bestArea = -1.f;
+			for (n_UINT i = 0; i < childCount; ++i) {
+				const BVHNode &child = m_nodes[children[i]];
+				if (child.isInner() && child.bbox.getSurfaceArea() > bestArea) {
+					bestArea = child.bbox.getSurfaceArea();
+					best = (int) i;
+				}
+			}
+			if (best == -1)
+				break;
+
+			n_UINT expand = children[best];
+			children[best] = expand + 1;
+			children[childCount++] = m_nodes[expand].inner.rightChild;
+		}
+
+		n_UINT wide_idx = (n_UINT) wideNodes.size();
+		wideNodes.emplace_back();
+
+		for (int i = 0; i < N; ++i) {
+			WideBVHNode<N> &wide = wideNodes[wide_idx];
+			if ((n_UINT) i >= childCount) {
+				/* Unused slot: inverted box that can never be hit */
+				wide.minX[i] = wide.minY[i] = wide.minZ[i] = std::numeric_limits<float>::infinity();
+				wide.maxX[i] = wide.maxY[i] = wide.maxZ[i] = -std::numeric_limits<float>::infinity();
+				wide.child[i] = 0;
+				wide.count[i] = 0;
+				continue;
+			}
+
+			const BVHNode &child = m_nodes[children[i]];
+			wide.minX[i] = child.bbox.min.x(); wide.maxX[i] = child.bbox.max.x();
+			wide.minY[i] = child.bbox.min.y(); wide.maxY[i] = child.bbox.max.y();
+			wide.minZ[i] = child.bbox.min.z(); wide.maxZ[i] = child.bbox.max.z();
+
+			if (child.isLeaf()) {
+				wide.child[i] = child.start();
+				wide.count[i] = child.leaf.size;
+			} else {
+				/* Note: 'wideNodes' may be reallocated by the recursive call */
+				n_UINT child_idx = collapseNode(children[i]);
+				wideNodes[wide_idx].child[i] = child_idx;
+				wideNodes[wide_idx].count[i] = 0;
+			}
+		}
+
+		return wide_idx;
+	};
+
+	collapseNode(0u);
+	wideNodes.shrink_to_fit();
+
+	cout << "done (took " << timer.elapsedString() << ", " << wideNodes.size()
+		<< " nodes, " << memString(sizeof(WideBVHNode<N>) * wideNodes.size())
+		<< ")." << endl;
+}
+
+/**
+ * \brief Expected number of page changes per ray during traversal
+ *
+ * Sums the probabilities of all parent-child transitions that cross a
+ * page boundary, where the probability of visiting a node is its surface
+ * area relative to the root (the usual SAH ray distribution). Nodes of
+ * \c nodeSize bytes are stored back to back, and a node belongs to the
+ * page in which it starts.
+ */
+template <typename Node, typename Allocator> static float pageTransitions(
+		const std::vector<Node, Allocator> &wideNodes,
+		const std::vector<float> &area, size_t nodeSize) {
+	double result = 0;
+	for (size_t n = 0; n < wideNodes.size(); ++n) {
+		for (int i = 0; i < Node::Width; ++i) {
+			n_UINT child = wideNodes[n].child[i];
+			if (wideNodes[n].isLeaf(i) || wideNodes[n].isUnused(i) ||
+				child * nodeSize / NORI_PAGE_SIZE == n * nodeSize / NORI_PAGE_SIZE)
+				continue;
+			result += area[child] / area[0];
+		}
+	}
+	return (float) result;
+}
+
+template <int N> void Accel::reorder(NodeVector<WideBVHNode<N>> &wideNodes, size_t nodeSize) {
+	cout << "Reordering the wide BVH into treelets .. ";
+	cout.flush();
+	Timer timer;
+
+	n_UINT count = (n_UINT) wideNodes.size();
+
+	/* Surface area of every node, given by its bounds within the parent.
+	   Children are always created after their parents */
+	std::vector<float> area(count);
+	area[0] = m_nodes[0].bbox.getSurfaceArea();
+	for (n_UINT n = 0; n < count; ++n) {
+		const WideBVHNode<N> &node = wideNodes[n];
+		for (int i = 0; i < N; ++i) {
+			if (node.isLeaf(i) || node.isUnused(i))
+				continue;
+			Vector3f extents(node.maxX[i] - node.minX[i], node.maxY[i] - node.minY[i],
+			                 node.maxZ[i] - node.minZ[i]);
+			area[node.child[i]] = 2.f * (extents.x() * extents.y() +
+				extents.y() * extents.z() + extents.z() * extents.x());
+		}
+	}
+	float before = pageTransitions(wideNodes, area, nodeSize);
+
+	/* Old node indices in their new order */
+	std::vector<n_UINT> order, roots(1, 0u), candidates;
+	order.reserve(count);
+	auto smaller = [&](n_UINT a, n_UINT b) { return area[a] < area[b]; };
+
+	while (!roots.empty()) {
+		candidates.clear();
+
+		/* The treelet consists of the nodes that start within the current
+		   page, their number varies when the node size does not divide it */
+		size_t page = order.size() * nodeSize / NORI_PAGE_SIZE;
+		n_UINT treeletSize = (n_UINT) std::max((size_t) 1,
+			((page + 1) * NORI_PAGE_SIZE + nodeSize - 1) / nodeSize - order.size());
+
+		/* Grow the treelet by the node that is most likely visited. When a
+		   subtree fits completely, the page is filled from the next root so
+		   that all following treelets remain aligned to page boundaries */
+		for (n_UINT k = 0; k < treeletSize; ++k) {
+			if (candidates.empty()) {
+				if (roots.empty())
+					break;
+				candidates.push_back(roots.back());
+				roots.pop_back();
+			}
+
+			std::pop_heap(candidates.begin(), candidates.end(), smaller);
+			const WideBVHNode<N> &node = wideNodes[candidates.back()];
+			order.push_back(candidates.back());
+			candidates.pop_back();
+
+			for (int i = 0; i < N; ++i) {
+				if (node.isLeaf(i) || node.isUnused(i))
+					continue;
+				candidates.push_back(node.child[i]);
+				std::push_heap(candidates.begin(), candidates.end(), smaller);
+			}
+		}
+
+		/* Continue with the remaining candidates, largest one first */
+		std::sort(candidates.begin(), candidates.end(), smaller);
+		roots.insert(roots.end(), candidates.begin(), candidates.end());
+	}
+	assert(order.size() == count);
+
+	std::vector<n_UINT> newIndex(count);
+	for (n_UINT n = 0; n < count; ++n)
+		newIndex[order[n]] = n;
+
+	NodeVector<WideBVHNode<N>> reordered(count);
+	std::vector<float> reorderedArea(count);
+	for (n_UINT n = 0; n < count; ++n) {
+		WideBVHNode<N> &node = reordered[n];
+		node = wideNodes[order[n]];
+		reorderedArea[n] = area[order[n]];
+		for (int i = 0; i < N; ++i) {
+			if (!node.isLeaf(i) && !node.isUnused(i))
+				node.child[i] = newIndex[node.child[i]];
+		}
+	}
+	wideNodes = std::move(reordered);
+
+	cout << "done (took " << timer.elapsedString() << ", expected page transitions per ray: "
+		<< before << " -> " << pageTransitions(wideNodes, reorderedArea, nodeSize) << ")." << endl;
+}
+
+/**
+ * \brief Quantize the interval <tt>[min, max]</tt> relative to \c origin and
+ * \c scale such that the decoded interval contains the original one
+ */
+template <typename T> static inline void quantizeInterval(float min, float max,
+		float origin, float scale, T &qmin, T &qmax) {
+	const int levels = (int) std::numeric_limits<T>::max();
+	int lo = (int) std::floor((min - origin) / scale),
+	    hi = (int) std::ceil((max - origin) / scale);
+	lo = std::min(std::max(lo, 0), levels);
+	hi = std::min(std::max(hi, 0), levels);
+
+	/* Correct for rounding errors in the division above */
+	while (lo > 0 && origin + lo * scale > min)
+		--lo;
+	while (hi < levels && origin + hi * scale < max)
+		++hi;
+
+	qmin = (T) lo;
+	qmax = (T) hi;
+}
+
+template <int N, typename T> void Accel::quantize(NodeVector<WideBVHNode<N>> &wideNodes,
+		NodeVector<QuantizedBVHNode<N, T>> &quantizedNodes) {
+	cout << "Quantizing the child bounds to " << (8 * sizeof(T)) << " bits .. ";
+	cout.flush();
+	Timer timer;
+
+	const int levels = (int) std::numeric_limits<T>::max();
+	quantizedNodes.resize(wideNodes.size());
+
+	tbb::parallel_for(tbb::blocked_range<size_t>(0, wideNodes.size()),
+		[&](const tbb::blocked_range<size_t> &range) {
+			for (size_t n = range.begin(); n != range.end(); ++n) {
+				const WideBVHNode<N> &node = wideNodes[n];
+				QuantizedBVHNode<N, T> &qnode = quantizedNodes[n];
+				const float *mins[3] = { node.minX, node.minY, node.minZ },
+				            *maxs[3] = { node.maxX, node.maxY, node.maxZ };
+				T *qmins[3] = { qnode.minX, qnode.minY, qnode.minZ },
+				  *qmaxs[3] = { qnode.maxX, qnode.maxY, qnode.maxZ };
+
+				for (int k = 0; k < 3; ++k) {
+					/* Bounds of the node (unused slots are inverted and do not contribute) */
+					float lo = std::numeric_limits<float>::infinity(), hi = -lo;
+					for (int i = 0; i < N; ++i) {
+						lo = std::min(lo, mins[k][i]);
+						hi = std::max(hi, maxs[k][i]);
+					}
+
+					/* The scale must be positive so that unused slots stay inverted,
+					   and the largest level has to reach the upper bound */
+					float scale = (hi - lo) / levels;
+					if (!(scale > 0))
+						scale = 1.f;
+					while (lo + levels * scale < hi)
+						scale = std::nextafter(scale, std::numeric_limits<float>::infinity());
+					qnode.origin[k] = lo;
+					qnode.scale[k] = scale;
+
+					for (int i = 0; i < N; ++i) {
+						if (mins[k][i] > maxs[k][i]) {
+							qmins[k][i] = (T) levels;
+							qmaxs[k][i] = 0;
+						} else {
+							quantizeInterval(mins[k][i], maxs[k][i], lo, scale,
+								qmins[k][i], qmaxs[k][i]);
+						}
+					}
+				}
+
+				for (int i = 0; i < N; ++i) {
+					qnode.child[i] = node.child[i];
+					qnode.count[i] = node.count[i];
 				}
 			}
+		}
+	);
+
+	size_t before = sizeof(WideBVHNode<N>) * wideNodes.size();
+	wideNodes.clear();
+	wideNodes.shrink_to_fit();
+
+	cout << "done (took " << timer.elapsedString() << ", "
+		<< memString(sizeof(QuantizedBVHNode<N, T>) * quantizedNodes.size())
+		<< " instead of " << memString(before) << ")." << endl;
+}
+
+std::pair<float, n_UINT> Accel::statistics(n_UINT node_idx) const {
+	const BVHNode &node = m_nodes[node_idx];
+	if (node.isLeaf()) {
+		return std::make_pair((float)BVHBuildTask::INTERSECTION_COST * node.leaf.size, 1u);
+	}
+	else {
+		std::pair<float, n_UINT> stats_left = statistics(node_idx + 1u);
+		std::pair<float, n_UINT> stats_right = statistics(node.inner.rightChild);
+		float saLeft = m_nodes[node_idx + 1u].bbox.getSurfaceArea();
+		float saRight = m_nodes[node.inner.rightChild].bbox.getSurfaceArea();
+		float saCur = node.bbox.getSurfaceArea();
+		float sahCost =
+			2 * BVHBuildTask::TRAVERSAL_COST +
+			(saLeft * stats_left.first + saRight * stats_right.first) / saCur;
+		return std::make_pair(
+			sahCost,
+			stats_left.second + stats_right.second + 1u
+		);
+	}
+}
+
+/**
+ * \brief Test a ray against all child bounding boxes of a wide BVH node
+ *
+ * Uses the ordered slab test: the near and far planes along each axis are
+ * selected by the direction signs precomputed in the \ref TraversalRay,
+ * which also makes the inverted boxes of unused slots fail the test.
+ * Returns a bit mask of the children that were hit and their entry
+ * distances in \c tnear.
+ */
+template <int N, typename Node, typename TraversalRay> static inline int
+	intersectChildren(const Node &node, const TraversalRay &tray, float *tnear) {
+	const Ray3f &ray = tray.ray;
+	const float *nearX = tray.dirIsNeg[0] ? node.maxX : node.minX,
+	            *farX  = tray.dirIsNeg[0] ? node.minX : node.maxX,
+	            *nearY = tray.dirIsNeg[1] ? node.maxY : node.minY,
+	            *farY  = tray.dirIsNeg[1] ? node.minY : node.maxY,
+	            *nearZ = tray.dirIsNeg[2] ? node.maxZ : node.minZ,
+	            *farZ  = tray.dirIsNeg[2] ? node.minZ : node.maxZ;
+	int mask = 0;
+
+#if defined(NORI_ACCEL_SSE)
+	const __m128 ox = _mm_set1_ps(ray.o.x()), rx = _mm_set1_ps(ray.dRcp.x()),
+	             oy = _mm_set1_ps(ray.o.y()), ry = _mm_set1_ps(ray.dRcp.y()),
+	             oz = _mm_set1_ps(ray.o.z()), rz = _mm_set1_ps(ray.dRcp.z()),
+	             mint = _mm_set1_ps(ray.mint), maxt = _mm_set1_ps(ray.maxt);
+
+	/* Process the children in groups of four. An 8-wide node is handled
+	   by one AVX pass below when available, otherwise by two SSE passes */
+	int i = 0;
+#if defined(__AVX__)
+	if (N == 8) {
+		const __m256 ox8 = _mm256_set1_ps(ray.o.x()), rx8 = _mm256_set1_ps(ray.dRcp.x()),
+		             oy8 = _mm256_set1_ps(ray.o.y()), ry8 = _mm256_set1_ps(ray.dRcp.y()),
+		             oz8 = _mm256_set1_ps(ray.o.z()), rz8 = _mm256_set1_ps(ray.dRcp.z());
+		__m256 t0 = _mm256_max_ps(
+			_mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(nearX), ox8), rx8),
+			              _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(nearY), oy8), ry8)),
+			_mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(nearZ), oz8), rz8),
+			              _mm256_set1_ps(ray.mint)));
+		__m256 t1 = _mm256_min_ps(
+			_mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(farX), ox8), rx8),
+			              _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(farY), oy8), ry8)),
+			_mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(farZ), oz8), rz8),
+			              _mm256_set1_ps(ray.maxt)));
+		_mm256_storeu_ps(tnear, t0);
+		return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+	}
+#endif
+	for (; i < N; i += 4) {
+		__m128 t0 = _mm_max_ps(
+			_mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(nearX + i), ox), rx),
+			           _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(nearY + i), oy), ry)),
+			_mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(nearZ + i), oz), rz), mint));
+		__m128 t1 = _mm_min_ps(
+			_mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(farX + i), ox), rx),
+			           _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(farY + i), oy), ry)),
+			_mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(farZ + i), oz), rz), maxt));
+		_mm_storeu_ps(tnear + i, t0);
+		mask |= _mm_movemask_ps(_mm_cmple_ps(t0, t1)) << i;
+	}
+#else
+	for (int i = 0; i < N; ++i) {
+		float t0 = std::max(
+			std::max((nearX[i] - ray.o.x()) * ray.dRcp.x(), (nearY[i] - ray.o.y()) * ray.dRcp.y()),
+			std::max((nearZ[i] - ray.o.z()) * ray.dRcp.z(), ray.mint));
+		float t1 = std::min(
+			std::min((farX[i] - ray.o.x()) * ray.dRcp.x(), (farY[i] - ray.o.y()) * ray.dRcp.y()),
+			std::min((farZ[i] - ray.o.z()) * ray.dRcp.z(), ray.maxt));
+		tnear[i] = t0;
+		if (t0 <= t1)
+			mask |= 1 << i;
+	}
+#endif
+	return mask;
+}
+
+/// Convert quantized coordinates to <tt>origin + q * scale</tt> (N must be a multiple of 4)
+template <int N, typename T> static inline void dequantize(const T *q, float origin,
+		float scale, float *result) {
+#if defined(NORI_ACCEL_SSE)
+	const __m128 o = _mm_set1_ps(origin), s = _mm_set1_ps(scale);
+	const __m128i zero = _mm_setzero_si128();
+	for (int i = 0; i < N; i += 4) {
+		__m128i v;
+		if (sizeof(T) == 1) {
+			int32_t bits;
+			memcpy(&bits, q + i, sizeof(int32_t));
+			v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bits), zero), zero);
+		} else {
+			v = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *) (q + i)), zero);
+		}
+		_mm_storeu_ps(result + i, _mm_add_ps(o, _mm_mul_ps(_mm_cvtepi32_ps(v), s)));
+	}
+#else
+	for (int i = 0; i < N; ++i)
+		result[i] = origin + (float) q[i] * scale;
+#endif
+}
+
+template <int N> int Accel::WideBVHNode<N>::intersect(const TraversalRay &ray, float *tnear) const {
+	return intersectChildren<N>(*this, ray, tnear);
+}
+
+template <int N, typename T> int Accel::QuantizedBVHNode<N, T>::intersect(const TraversalRay &ray,
+		float *tnear) const {
+	struct { float minX[N], minY[N], minZ[N], maxX[N], maxY[N], maxZ[N]; } bounds;
+	dequantize<N>(minX, origin[0], scale[0], bounds.minX);
+	dequantize<N>(minY, origin[1], scale[1], bounds.minY);
+	dequantize<N>(minZ, origin[2], scale[2], bounds.minZ);
+	dequantize<N>(maxX, origin[0], scale[0], bounds.maxX);
+	dequantize<N>(maxY, origin[1], scale[1], bounds.maxY);
+	dequantize<N>(maxZ, origin[2], scale[2], bounds.maxZ);
+	return intersectChildren<N>(bounds, ray, tnear);
+}
+
+#if defined(NORI_ACCEL_SSE)
+/// Four floats in an SSE register with the arithmetic needed by the triangle test
+struct Float4 {
+	enum { Size = 4 };
+	__m128 value;
+
+	Float4(__m128 value) : value(value) { }
+	explicit Float4(float f) : value(_mm_set1_ps(f)) { }
+	static Float4 load(const float *ptr) { return _mm_loadu_ps(ptr); }
+	void store(float *ptr) const { _mm_storeu_ps(ptr, value); }
+	int mask() const { return _mm_movemask_ps(value); }
+
+	friend Float4 operator+(Float4 a, Float4 b) { return _mm_add_ps(a.value, b.value); }
+	friend Float4 operator-(Float4 a, Float4 b) { return _mm_sub_ps(a.value, b.value); }
+	friend Float4 operator*(Float4 a, Float4 b) { return _mm_mul_ps(a.value, b.value); }
+	friend Float4 operator/(Float4 a, Float4 b) { return _mm_div_ps(a.value, b.value); }
+	friend Float4 operator&(Float4 a, Float4 b) { return _mm_and_ps(a.value, b.value); }
+	friend Float4 operator|(Float4 a, Float4 b) { return _mm_or_ps(a.value, b.value); }
+	friend Float4 operator<=(Float4 a, Float4 b) { return _mm_cmple_ps(a.value, b.value); }
+	friend Float4 operator>=(Float4 a, Float4 b) { return _mm_cmpge_ps(a.value, b.value); }
+};
+
+#if defined(__AVX__)
+/// Eight floats in an AVX register (see \ref Float4)
+struct Float8 {
+	enum { Size = 8 };
+	__m256 value;
+
+	Float8(__m256 value) : value(value) { }
+	explicit Float8(float f) : value(_mm256_set1_ps(f)) { }
+	static Float8 load(const float *ptr) { return _mm256_loadu_ps(ptr); }
+	void store(float *ptr) const { _mm256_storeu_ps(ptr, value); }
+	int mask() const { return _mm256_movemask_ps(value); }
+
+	friend Float8 operator+(Float8 a, Float8 b) { return _mm256_add_ps(a.value, b.value); }
+	friend Float8 operator-(Float8 a, Float8 b) { return _mm256_sub_ps(a.value, b.value); }
+	friend Float8 operator*(Float8 a, Float8 b) { return _mm256_mul_ps(a.value, b.value); }
+	friend Float8 operator/(Float8 a, Float8 b) { return _mm256_div_ps(a.value, b.value); }
+	friend Float8 operator&(Float8 a, Float8 b) { return _mm256_and_ps(a.value, b.value); }
+	friend Float8 operator|(Float8 a, Float8 b) { return _mm256_or_ps(a.value, b.value); }
+	friend Float8 operator<=(Float8 a, Float8 b) { return _mm256_cmp_ps(a.value, b.value, _CMP_LE_OQ); }
+	friend Float8 operator>=(Float8 a, Float8 b) { return _mm256_cmp_ps(a.value, b.value, _CMP_GE_OQ); }
+};
+#endif
+
+/**
+ * \brief Moeller-Trumbore test of the triangles <tt>[i, i + Vec::Size)</tt>
+ * of a \ref Accel::TriangleBlock
+ *
+ * Evaluates the same expressions as \ref Accel::TriangleRecord::rayIntersect()
+ * in every SIMD lane and returns the bit mask of the triangles that were hit.
+ */
+template <typename Vec, typename Block> static inline int intersectTriangles(const Block &block,
+		int i, const Ray3f &ray, float *u, float *v, float *t) {
+	const Vec dx(ray.d.x()), dy(ray.d.y()), dz(ray.d.z());
+	const Vec e1x = Vec::load(block.edge1[0] + i), e1y = Vec::load(block.edge1[1] + i),
+	          e1z = Vec::load(block.edge1[2] + i), e2x = Vec::load(block.edge2[0] + i),
+	          e2y = Vec::load(block.edge2[1] + i), e2z = Vec::load(block.edge2[2] + i);
+
+	Vec px = dy * e2z - dz * e2y, py = dz * e2x - dx * e2z, pz = dx * e2y - dy * e2x;
+	Vec det = e1x * px + e1y * py + e1z * pz;
+	Vec invDet = Vec(1.0f) / det;
+
+	Vec tx = Vec(ray.o.x()) - Vec::load(block.p0[0] + i),
+	    ty = Vec(ray.o.y()) - Vec::load(block.p0[1] + i),
+	    tz = Vec(ray.o.z()) - Vec::load(block.p0[2] + i);
+	Vec qx = ty * e1z - tz * e1y, qy = tz * e1x - tx * e1z, qz = tx * e1y - ty * e1x;
+
+	Vec bu = (tx * px + ty * py + tz * pz) * invDet,
+	    bv = (dx * qx + dy * qy + dz * qz) * invDet,
+	    bt = (e2x * qx + e2y * qy + e2z * qz) * invDet;
+
+	Vec hit = ((det <= Vec(-1e-8f)) | (det >= Vec(1e-8f))) &
+		(bu >= Vec(0.0f)) & (bu <= Vec(1.0f)) & (bv >= Vec(0.0f)) & (bu + bv <= Vec(1.0f)) &
+		(bt >= Vec(ray.mint)) & (bt <= Vec(ray.maxt));
+
+	bu.store(u + i);
+	bv.store(v + i);
+	bt.store(t + i);
+	return hit.mask() << i;
+}
+#endif
+
+template <int W> int Accel::TriangleBlock<W>::rayIntersect(const Ray3f &ray, float *u,
+		float *v, float *t) const {
+	int mask = 0;
+#if defined(NORI_ACCEL_SSE)
+	/* Blocks of 8 are tested in one AVX pass when available, otherwise by two SSE passes */
+#if defined(__AVX__)
+	if (W == 8)
+		return intersectTriangles<Float8>(*this, 0, ray, u, v, t);
+#endif
+	for (int i = 0; i < W; i += 4)
+		mask |= intersectTriangles<Float4>(*this, i, ray, u, v, t);
+#else
+	for (int i = 0; i < W; ++i) {
+		TriangleRecord tri;
+		tri.p0 = Point3f(p0[0][i], p0[1][i], p0[2][i]);
+		tri.edge1 = Vector3f(edge1[0][i], edge1[1][i], edge1[2][i]);
+		tri.edge2 = Vector3f(edge2[0][i], edge2[1][i], edge2[2][i]);
+		if (tri.rayIntersect(ray, u[i], v[i], t[i]))
+			mask |= 1 << i;
+	}
+#endif
+	return mask;
+}
+
+static tbb::enumerable_thread_specific<TraversalStatistics> traversalStatistics;
+
+TraversalStatistics &Accel::getThreadStatistics() {
+	/* Cache the lookup of the thread's counters, which involves a hash table */
+	static thread_local TraversalStatistics *stats = &traversalStatistics.local();
+	return *stats;
+}
+
+TraversalStatistics Accel::getTraversalStatistics() {
+	TraversalStatistics result;
+	for (const TraversalStatistics &stats : traversalStatistics)
+		result += stats;
+	return result;
+}
+
+void Accel::resetTraversalStatistics() {
+	for (TraversalStatistics &stats : traversalStatistics)
+		stats = TraversalStatistics();
+}
+
+std::string TraversalStatistics::toString() const {
+	double count = (double) std::max(rays, (uint64_t) 1);
+	return tfm::format("%i rays, %.1f nodes, %.1f boxes and %.1f triangles per ray, "
+		"max. stack depth %i", rays, nodes / count, boxes / count, triangles / count,
+		maxStackDepth);
+}
+
+template <int W> bool Accel::leafIntersectBlocks(const std::vector<TriangleBlock<W>> &blocks,
+		n_UINT start, n_UINT end, Ray3f &ray, Intersection &its, n_UINT &f) const {
+	bool foundIntersection = false;
+
+	for (n_UINT i = start / W; i < end / W; ++i) {
+		const TriangleBlock<W> &block = blocks[i];
+
+		float u[W], v[W], t[W];
+		int mask = block.rayIntersect(ray, u, v, t);
+		if (mask == 0)
+			continue;
+
+		/* Keep the closest of the triangles that were hit. The opacity mask
+		   is only evaluated for hits that are closer than the current one */
+		int best = -1;
+		for (int j = 0; j < W; ++j) {
+			if ((mask & (1 << j)) && (best == -1 || t[j] < t[best]) &&
+				!isMaskedOut(m_meshes[block.mesh[j]], block.prim[j], u[j], v[j]))
+				best = j;
+		}
+		if (best == -1)
+			continue;
+
+		foundIntersection = true;
+		ray.maxt = its.t = t[best];
+		its.uv = Point2f(u[best], v[best]);
+		its.mesh = m_meshes[block.mesh[best]];
+		f = block.prim[best];
+	}
+
+	return foundIntersection;
+}
+
+template <int W> bool Accel::leafOccludedBlocks(const std::vector<TriangleBlock<W>> &blocks,
+		n_UINT start, n_UINT end, const Ray3f &ray) const {
+	float u[W], v[W], t[W];
+	NORI_ACCEL_STAT(TraversalStatistics &stats = getThreadStatistics());
+
+	for (n_UINT i = start / W; i < end / W; ++i) {
+		const TriangleBlock<W> &block = blocks[i];
+		NORI_ACCEL_STAT(stats.triangles += W);
+		int mask = block.rayIntersect(ray, u, v, t);
+		if (mask == 0)
+			continue;
+		if (!m_alphaMasks)
+			return true;
+
+		for (int j = 0; j < W; ++j) {
+			if ((mask & (1 << j)) && !isMaskedOut(m_meshes[block.mesh[j]], block.prim[j], u[j], v[j]))
+				return true;
+		}
+	}
+	return false;
+}
+
+bool Accel::leafIntersect(n_UINT start, n_UINT end, Ray3f &ray,
+		Intersection &its, n_UINT &f) const {
+	bool foundIntersection = false;
+	NORI_ACCEL_STAT(getThreadStatistics().triangles += end - start);
+
+	if (m_leafWidth == 4)
+		return leafIntersectBlocks(m_triangleBlocks4, start, end, ray, its, f);
+	else if (m_leafWidth == 8)
+		return leafIntersectBlocks(m_triangleBlocks8, start, end, ray, its, f);
+
+	if (!m_triangles.empty()) {
+		for (n_UINT i = start; i < end; ++i) {
+			const TriangleRecord &tri = m_triangles[i];
+
+			float u, v, t;
+			if (tri.rayIntersect(ray, u, v, t) && !isMaskedOut(m_meshes[tri.mesh], tri.prim, u, v)) {
+				foundIntersection = true;
+				ray.maxt = its.t = t;
+				its.uv = Point2f(u, v);
+				its.mesh = m_meshes[tri.mesh];
+				f = tri.prim;
+			}
+		}
+		return foundIntersection;
+	}
+
+	for (n_UINT i = start; i < end; ++i) {
+		n_UINT idx = m_indices[i];
+		const Mesh *mesh = m_meshes[findMesh(idx)];
+
+		float u, v, t;
+		if (mesh->rayIntersect(idx, ray, u, v, t) && !isMaskedOut(mesh, idx, u, v)) {
+			foundIntersection = true;
+			ray.maxt = its.t = t;
+			its.uv = Point2f(u, v);
+			its.mesh = mesh;
+			f = idx;
+		}
+	}
+
+	return foundIntersection;
+}
+
+template <typename Node> bool Accel::rayIntersectWide(const NodeVector<Node> &wideNodes,
+		Ray3f &ray, Intersection &its, n_UINT &f, n_UINT root) const {
+	const int N = Node::Width;
+	TraversalRay tray(ray);
+	n_UINT node_idx = root, stack_idx = 0, stack[64 * N];
+	float stackNear[64 * N];
+	bool foundIntersection = false;
+	NORI_ACCEL_STAT(TraversalStatistics &stats = getThreadStatistics());
+
+	while (true) {
+		const Node &node = wideNodes[node_idx];
+		NORI_ACCEL_STAT(stats.nodes++; stats.boxes += N);
+
+		float tnear[N];
+		int mask = node.intersect(tray, tnear);
+
+		/* Collect the children that were hit, sorted by decreasing distance,
+		   so that the closest one ends up on top of the stack */
+		int order[N], hitCount = 0;
+		for (int i = 0; i < N; ++i) {
+			if (!(mask & (1 << i)))
+				continue;
+			int j = hitCount++;
+			while (j > 0 && tnear[order[j - 1]] < tnear[i]) {
+				order[j] = order[j - 1];
+				--j;
+			}
+			order[j] = i;
+		}
+
+		/* Leaves are intersected right away (front to back) */
+		for (int k = hitCount - 1; k >= 0; --k) {
+			int i = order[k];
+			if (!node.isLeaf(i) || tnear[i] > ray.maxt)
+				continue;
+			if (leafIntersect(node.child[i], node.child[i] + node.count[i], ray, its, f))
+				foundIntersection = true;
+		}
+
+		/* .. while inner nodes are deferred (back to front) */
+		for (int k = 0; k < hitCount; ++k) {
+			int i = order[k];
+			if (node.isLeaf(i))
+				continue;
+			stack[stack_idx] = node.child[i];
+			stackNear[stack_idx++] = tnear[i];
+			assert(stack_idx < 64 * N);
+		}
+		NORI_ACCEL_STAT(stats.maxStackDepth = std::max(stats.maxStackDepth, (uint64_t) stack_idx));
+
+		/* Skip subtrees that start behind the closest intersection so far */
+		do {
+			if (stack_idx == 0)
+				return foundIntersection;
+			--stack_idx;
+		} while (stackNear[stack_idx] > ray.maxt);
+		node_idx = stack[stack_idx];
+	}
+}
+
+template <typename Node> bool Accel::rayOccludedWide(const NodeVector<Node> &wideNodes,
+		const Ray3f &ray, n_UINT root) const {
+	const int N = Node::Width;
+	TraversalRay tray(ray);
+	n_UINT node_idx = root, stack_idx = 0, stack[64 * N];
+	NORI_ACCEL_STAT(TraversalStatistics &stats = getThreadStatistics());
+
+	while (true) {
+		const Node &node = wideNodes[node_idx];
+		NORI_ACCEL_STAT(stats.nodes++; stats.boxes += N);
+
+		float tnear[N];
+		int mask = node.intersect(tray, tnear);
+
+		/* The hit children are not sorted: any occluder ends the query. Leaf
+		   children are tested first since they can terminate it right away */
+		for (int i = 0; i < N; ++i) {
+			if ((mask & (1 << i)) && node.isLeaf(i) &&
+				leafOccluded(node.child[i], node.child[i] + node.count[i], ray))
+				return true;
+		}
+
+		for (int i = 0; i < N; ++i) {
+			if (!(mask & (1 << i)) || node.isLeaf(i))
+				continue;
+			stack[stack_idx++] = node.child[i];
+			assert(stack_idx < 64 * N);
+		}
+		NORI_ACCEL_STAT(stats.maxStackDepth = std::max(stats.maxStackDepth, (uint64_t) stack_idx));
+
+		if (stack_idx == 0)
+			break;
+		node_idx = stack[--stack_idx];
+	}
+
+	return false;
+}
+
+bool Accel::leafOccluded(n_UINT start, n_UINT end, const Ray3f &ray) const {
+	if (m_leafWidth == 4)
+		return leafOccludedBlocks(m_triangleBlocks4, start, end, ray);
+	else if (m_leafWidth == 8)
+		return leafOccludedBlocks(m_triangleBlocks8, start, end, ray);
+
+	float u, v, t;
+	NORI_ACCEL_STAT(TraversalStatistics &stats = getThreadStatistics());
+
+	if (!m_triangles.empty()) {
+		for (n_UINT i = start; i < end; ++i) {
+			const TriangleRecord &tri = m_triangles[i];
+			NORI_ACCEL_STAT(stats.triangles++);
+			if (tri.rayIntersect(ray, u, v, t) && !isMaskedOut(m_meshes[tri.mesh], tri.prim, u, v))
+				return true;
+		}
+		return false;
+	}
+
+	for (n_UINT i = start; i < end; ++i) {
+		n_UINT idx = m_indices[i];
+		const Mesh *mesh = m_meshes[findMesh(idx)];
+
+		NORI_ACCEL_STAT(stats.triangles++);
+		if (mesh->rayIntersect(idx, ray, u, v, t) && !isMaskedOut(mesh, idx, u, v))
+			return true;
+	}
+	return false;
+}
+
+bool Accel::rayOccludedLocal(const Ray3f &ray) const {
+	if (m_nodes.empty())
+		return false;
+
+	if (m_quantization == 8)
+		return m_width == 4 ? rayOccludedWide(m_quantizedNodes4x8, ray)
+		                    : rayOccludedWide(m_quantizedNodes8x8, ray);
+	else if (m_quantization == 16)
+		return m_width == 4 ? rayOccludedWide(m_quantizedNodes4x16, ray)
+		                    : rayOccludedWide(m_quantizedNodes8x16, ray);
+	else if (m_width == 4)
+		return rayOccludedWide(m_wideNodes4, ray);
+	else if (m_width == 8)
+		return rayOccludedWide(m_wideNodes8, ray);
+
+	TraversalRay tray(ray);
+	n_UINT node_idx = 0, stack_idx = 0, stack[64];
+	NORI_ACCEL_STAT(TraversalStatistics &stats = getThreadStatistics());
+
+	while (true) {
+		const BVHNode &node = m_nodes[node_idx];
+		NORI_ACCEL_STAT(stats.nodes++; stats.boxes++);
+
+		float tnear;
+		if (!tray.intersect(node.bbox, tnear)) {
 			if (stack_idx == 0)
 				break;
 			node_idx = stack[--stack_idx];
 			continue;
 		}
+
+		if (node.isInner()) {
+			/* Descend into the child with the larger surface area first: it
+			   is the one most likely to contain an occluder */
+			n_UINT first = node_idx + 1, second = node.inner.rightChild;
+			if (m_nodes[second].bbox.getSurfaceArea() > m_nodes[first].bbox.getSurfaceArea())
+				std::swap(first, second);
+			stack[stack_idx++] = second;
+			node_idx = first;
+			assert(stack_idx < 64);
+			NORI_ACCEL_STAT(stats.maxStackDepth = std::max(stats.maxStackDepth, (uint64_t) stack_idx));
+		}
+		else {
+			if (leafOccluded(node.start(), node.end(), ray))
+				return true;
+			if (stack_idx == 0)
+				break;
+			node_idx = stack[--stack_idx];
+		}
 	}
 
-	if (foundIntersection) {
-		/* Find the barycentric coordinates */
-		Vector3f bary;
-		bary << 1 - its.uv.sum(), its.uv;
-
-		/* References to all relevant mesh buffers */
-		const Mesh *mesh = its.mesh;
-		const MatrixXf &V = mesh->getVertexPositions();
-		const MatrixXf &N = mesh->getVertexNormals();
-		const MatrixXf &UV = mesh->getVertexTexCoords();
-		const MatrixXu &F = mesh->getIndices();
-
-		/* Vertex indices of the triangle */
-		n_UINT idx0 = F(0, f), idx1 = F(1, f), idx2 = F(2, f);
-
-		Point3f p0 = V.col(idx0), p1 = V.col(idx1), p2 = V.col(idx2);
-
-		/* Compute the intersection positon accurately
-		   using barycentric coordinates */
-		its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
-
-		/* Compute proper texture coordinates if provided by the mesh */
-		if (UV.size() > 0)
-			its.uv = bary.x() * UV.col(idx0) +
-			bary.y() * UV.col(idx1) +
-			bary.z() * UV.col(idx2);
-
-		/* Compute the geometry frame */
-		its.geoFrame = Frame((p1 - p0).cross(p2 - p0).normalized());
-
-		if (N.size() > 0) {
-			/* Compute the shading frame. Note that for simplicity,
-			   the current implementation doesn't attempt to provide
-			   tangents that are continuous across the surface. That
-			   means that this code will need to be modified to be able
-			   use anisotropic BRDFs, which need tangent continuity */
-
-			its.shFrame = Frame(
-				(bary.x() * N.col(idx0) +
-					bary.y() * N.col(idx1) +
-					bary.z() * N.col(idx2)).normalized());
+	return false;
+}
+
+bool Accel::rayOccludedInstances(const Ray3f &ray) const {
+	TraversalRay tray(ray);
+	n_UINT node_idx = 0, stack_idx = 0, stack[64];
+	NORI_ACCEL_STAT(TraversalStatistics &stats = getThreadStatistics());
+
+	while (true) {
+		const BVHNode &node = m_instanceNodes[node_idx];
+		NORI_ACCEL_STAT(stats.nodes++; stats.boxes++);
+
+		float tnear;
+		if (!tray.intersect(node.bbox, tnear)) {
+			if (stack_idx == 0)
+				break;
+			node_idx = stack[--stack_idx];
+			continue;
+		}
+
+		if (node.isInner()) {
+			stack[stack_idx++] = node.inner.rightChild;
+			node_idx++;
+			assert(stack_idx < 64);
+			NORI_ACCEL_STAT(stats.maxStackDepth = std::max(stats.maxStackDepth, (uint64_t) stack_idx));
 		}
 		else {
-			its.shFrame = its.geoFrame;
+			for (n_UINT i = node.start(), end = node.end(); i < end; ++i) {
+				const InstanceRecord &instance = m_instances[i];
+				const Accel *blas = m_blas[instance.blas];
+				if (instance.identity ? blas->rayOccludedLocal(ray)
+						: blas->rayOccludedLocal(instance.toLocal * ray))
+					return true;
+			}
+			if (stack_idx == 0)
+				break;
+			node_idx = stack[--stack_idx];
 		}
 	}
 
+	return false;
+}
+
+bool Accel::rayOccluded(const Ray3f &_ray) const {
+	NORI_ACCEL_STAT(getThreadStatistics().rays++);
+
+	/* Use an adaptive ray epsilon */
+	Ray3f ray(_ray);
+	if (ray.mint == Epsilon)
+		ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
+
+	if (ray.maxt < ray.mint)
+		return false;
+
+	return rayOccludedLocal(ray) ||
+		(!m_instances.empty() && rayOccludedInstances(ray));
+}
+
+bool Accel::rayIntersectLocal(Ray3f &ray, Intersection &its, n_UINT &f) const {
+	if (m_nodes.empty())
+		return false;
+
+	if (m_quantization == 8)
+		return m_width == 4 ? rayIntersectWide(m_quantizedNodes4x8, ray, its, f)
+		                    : rayIntersectWide(m_quantizedNodes8x8, ray, its, f);
+	else if (m_quantization == 16)
+		return m_width == 4 ? rayIntersectWide(m_quantizedNodes4x16, ray, its, f)
+		                    : rayIntersectWide(m_quantizedNodes8x16, ray, its, f);
+	else if (m_width == 4)
+		return rayIntersectWide(m_wideNodes4, ray, its, f);
+	else if (m_width == 8)
+		return rayIntersectWide(m_wideNodes8, ray, its, f);
+
+	TraversalRay tray(ray);
+	NORI_ACCEL_STAT(TraversalStatistics &stats = getThreadStatistics(); stats.boxes++);
+	float tnear;
+	if (!tray.intersect(m_nodes[0].bbox, tnear))
+		return false;
+
+	TraversalEntry stack[64];
+	n_UINT node_idx = 0, stack_idx = 0;
+	bool foundIntersection = false;
+
+	while (true) {
+		const BVHNode &node = m_nodes[node_idx];
+		NORI_ACCEL_STAT(stats.nodes++);
+
+		if (node.isInner()) {
+			/* The left child lies on the lower side of the split axis,
+			   so the sign of the direction tells which one is in front */
+			n_UINT first = node_idx + 1, second = node.inner.rightChild;
+			if (tray.dirIsNeg[node.inner.axis])
+				std::swap(first, second);
+
+			float tfirst, tsecond;
+			bool hitFirst = tray.intersect(m_nodes[first].bbox, tfirst),
+			     hitSecond = tray.intersect(m_nodes[second].bbox, tsecond);
+			NORI_ACCEL_STAT(stats.boxes += 2);
+
+			if (hitFirst || hitSecond) {
+				if (hitFirst && hitSecond) {
+					stack[stack_idx++] = TraversalEntry { second, tsecond };
+					assert(stack_idx < 64);
+					NORI_ACCEL_STAT(stats.maxStackDepth = std::max(stats.maxStackDepth, (uint64_t) stack_idx));
+				}
+				node_idx = hitFirst ? first : second;
+				continue;
+			}
+		}
+		else if (leafIntersect(node.start(), node.end(), ray, its, f)) {
+			foundIntersection = true;
+		}
+
+		/* Skip subtrees that start behind the closest intersection so far */
+		do {
+			if (stack_idx == 0)
+				return foundIntersection;
+			--stack_idx;
+		} while (stack[stack_idx].tnear > ray.maxt);
+		node_idx = stack[stack_idx].node;
+	}
+}
+
+bool Accel::rayIntersectInstances(Ray3f &ray, Intersection &its, n_UINT &f,
+		n_UINT &instanceIdx) const {
+	TraversalRay tray(ray);
+	NORI_ACCEL_STAT(TraversalStatistics &stats = getThreadStatistics(); stats.boxes++);
+	float tnear;
+	if (!tray.intersect(m_instanceNodes[0].bbox, tnear))
+		return false;
+
+	TraversalEntry stack[64];
+	n_UINT node_idx = 0, stack_idx = 0;
+	bool foundIntersection = false;
+
+	while (true) {
+		const BVHNode &node = m_instanceNodes[node_idx];
+		NORI_ACCEL_STAT(stats.nodes++);
+
+		if (node.isInner()) {
+			n_UINT first = node_idx + 1, second = node.inner.rightChild;
+			if (tray.dirIsNeg[node.inner.axis])
+				std::swap(first, second);
+
+			float tfirst, tsecond;
+			bool hitFirst = tray.intersect(m_instanceNodes[first].bbox, tfirst),
+			     hitSecond = tray.intersect(m_instanceNodes[second].bbox, tsecond);
+			NORI_ACCEL_STAT(stats.boxes += 2);
+
+			if (hitFirst || hitSecond) {
+				if (hitFirst && hitSecond) {
+					stack[stack_idx++] = TraversalEntry { second, tsecond };
+					assert(stack_idx < 64);
+					NORI_ACCEL_STAT(stats.maxStackDepth = std::max(stats.maxStackDepth, (uint64_t) stack_idx));
+				}
+				node_idx = hitFirst ? first : second;
+				continue;
+			}
+		}
+		else {
+			for (n_UINT i = node.start(), end = node.end(); i < end; ++i) {
+				const InstanceRecord &instance = m_instances[i];
+
+				/* The direction is not renormalized, hence distances along
+				   the local ray match those along the world-space ray */
+				Ray3f localRay = instance.identity ? ray : instance.toLocal * ray;
+				if (m_blas[instance.blas]->rayIntersectLocal(localRay, its, f)) {
+					ray.maxt = localRay.maxt;
+					instanceIdx = i;
+					foundIntersection = true;
+				}
+			}
+		}
+
+		do {
+			if (stack_idx == 0)
+				return foundIntersection;
+			--stack_idx;
+		} while (stack[stack_idx].tnear > ray.maxt);
+		node_idx = stack[stack_idx].node;
+	}
+}
+
+bool Accel::rayIntersect(const Ray3f &_ray, Intersection &its, bool shadowRay) const {
+	if (shadowRay)
+		return rayOccluded(_ray);
+
+	NORI_ACCEL_STAT(getThreadStatistics().rays++);
+	its.t = std::numeric_limits<float>::infinity();
+
+	/* Use an adaptive ray epsilon */
+	Ray3f ray(_ray);
+	if (ray.mint == Epsilon)
+		ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
+
+	if (ray.maxt < ray.mint)
+		return false;
+
+	n_UINT f = 0, instance = NORI_INVALID_HIT;
+	bool foundIntersection = rayIntersectLocal(ray, its, f);
+
+	if (!m_instances.empty() && rayIntersectInstances(ray, its, f, instance))
+		foundIntersection = true;
+
+	if (foundIntersection) {
+		if (instance != NORI_INVALID_HIT)
+			finalizeInstanceIntersection(instance, f, its);
+		else
+			finalizeIntersection(f, its);
+	}
+
 	return foundIntersection;
 }
 
+bool Accel::getIntersection(n_UINT mesh, n_UINT f, float t, float u, float v,
+		Intersection &its) const {
+	its.t = t;
+	its.uv = Point2f(u, v);
+
+	if (mesh >= m_meshes.size()) {
+		n_UINT instance = mesh - (n_UINT) m_meshes.size();
+		its.mesh = m_blas[m_instances[instance].blas]->m_meshes[0];
+		finalizeInstanceIntersection(instance, f, its);
+	} else {
+		its.mesh = m_meshes[mesh];
+		finalizeIntersection(f, its);
+	}
+	return true;
+}
+
+void Accel::finalizeInstanceIntersection(n_UINT instance, n_UINT f, Intersection &its) const {
+	const InstanceRecord &record = m_instances[instance];
+	m_blas[record.blas]->finalizeIntersection(f, its);
+	if (record.identity)
+		return;
+
+	/* Move the hit information from object space to world space */
+	Transform toWorld = record.toLocal.inverse();
+	its.p = toWorld * its.p;
+	its.geoFrame = Frame((toWorld * its.geoFrame.n).normalized());
+	its.shFrame = Frame((toWorld * its.shFrame.n).normalized());
+}
+
+void Accel::finalizeIntersection(n_UINT f, Intersection &its) const {
+	if (m_analytic) {
+		static_cast<const Shape *>(its.mesh)->computeIntersection(f, its);
+		return;
+	}
+
+	/* Find the barycentric coordinates */
+	Vector3f bary;
+	bary << 1 - its.uv.sum(), its.uv;
+
+	/* The accessors decode attributes stored in compact form */
+	const Mesh *mesh = its.mesh;
+	MatrixXuView F = mesh->getIndices();
+
+	/* Vertex indices of the triangle */
+	n_UINT idx0 = F(0, f), idx1 = F(1, f), idx2 = F(2, f);
+
+	Point3f p0 = mesh->getVertexPosition(idx0),
+	        p1 = mesh->getVertexPosition(idx1),
+	        p2 = mesh->getVertexPosition(idx2);
+
+	/* Compute the intersection positon accurately
+	   using barycentric coordinates */
+	its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
+
+	/* Compute proper texture coordinates if provided by the mesh */
+	if (mesh->hasVertexTexCoords())
+		its.uv = bary.x() * mesh->getVertexTexCoord(idx0) +
+		bary.y() * mesh->getVertexTexCoord(idx1) +
+		bary.z() * mesh->getVertexTexCoord(idx2);
+
+	/* Compute the geometry frame */
+	its.geoFrame = Frame((p1 - p0).cross(p2 - p0).normalized());
+
+	if (mesh->hasVertexNormals()) {
+		/* Compute the shading frame. Note that for simplicity,
+		   the current implementation doesn't attempt to provide
+		   tangents that are continuous across the surface. That
+		   means that this code will need to be modified to be able
+		   use anisotropic BRDFs, which need tangent continuity */
+
+		its.shFrame = Frame(
+			(bary.x() * mesh->getVertexNormal(idx0) +
+				bary.y() * mesh->getVertexNormal(idx1) +
+				bary.z() * mesh->getVertexNormal(idx2)).normalized());
+	}
+	else {
+		its.shFrame = its.geoFrame;
+	}
+}
+
+/* The packet traversal (accel_packet.cpp) shares the node tests and the single-ray kernels */
+template struct Accel::WideBVHNode<4>;
+template struct Accel::WideBVHNode<8>;
+template struct Accel::QuantizedBVHNode<4, uint8_t>;
+template struct Accel::QuantizedBVHNode<8, uint8_t>;
+template struct Accel::QuantizedBVHNode<4, uint16_t>;
+template struct Accel::QuantizedBVHNode<8, uint16_t>;
+template bool Accel::rayIntersectWide(const NodeVector<WideBVHNode<4>> &, Ray3f &, Intersection &, n_UINT &, n_UINT) const;
+template bool Accel::rayIntersectWide(const NodeVector<WideBVHNode<8>> &, Ray3f &, Intersection &, n_UINT &, n_UINT) const;
+template bool Accel::rayIntersectWide(const NodeVector<QuantizedBVHNode<4, uint8_t>> &, Ray3f &, Intersection &, n_UINT &, n_UINT) const;
+template bool Accel::rayIntersectWide(const NodeVector<QuantizedBVHNode<8, uint8_t>> &, Ray3f &, Intersection &, n_UINT &, n_UINT) const;
+template bool Accel::rayIntersectWide(const NodeVector<QuantizedBVHNode<4, uint16_t>> &, Ray3f &, Intersection &, n_UINT &, n_UINT) const;
+template bool Accel::rayIntersectWide(const NodeVector<QuantizedBVHNode<8, uint16_t>> &, Ray3f &, Intersection &, n_UINT &, n_UINT) const;
+template bool Accel::rayOccludedWide(const NodeVector<WideBVHNode<4>> &, const Ray3f &, n_UINT) const;
+template bool Accel::rayOccludedWide(const NodeVector<WideBVHNode<8>> &, const Ray3f &, n_UINT) const;
+template bool Accel::rayOccludedWide(const NodeVector<QuantizedBVHNode<4, uint8_t>> &, const Ray3f &, n_UINT) const;
+template bool Accel::rayOccludedWide(const NodeVector<QuantizedBVHNode<8, uint8_t>> &, const Ray3f &, n_UINT) const;
+template bool Accel::rayOccludedWide(const NodeVector<QuantizedBVHNode<4, uint16_t>> &, const Ray3f &, n_UINT) const;
+template bool Accel::rayOccludedWide(const NodeVector<QuantizedBVHNode<8, uint16_t>> &, const Ray3f &, n_UINT) const;
+
 NORI_NAMESPACE_END
 
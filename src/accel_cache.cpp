@@ -0,0 +1,267 @@
+/*
+    This file is an extension of Nori, a simple educational ray tracer
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/accel.h>
+#include <nori/mmap.h>
+#include <nori/timer.h>
+#include <fstream>
+#include <memory>
+
+NORI_NAMESPACE_BEGIN
+
+/* Identifies cache files, bump the version when the file layout changes */
+#define NORI_BVH_CACHE_MAGIC "NORIBVH"
+#define NORI_BVH_CACHE_VERSION 1
+
+/**
+ * \brief Header of a BVH cache file
+ *
+ * It is followed by one block per tree (the BVH itself, then all
+ * bottom-level BVHs), each consisting of a \ref CacheBlockHeader, the
+ * nodes and the primitive indices.
+ */
+struct CacheHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t nodeSize;
+	uint64_t hash;
+	uint32_t blockCount;
+	uint32_t reserved;
+};
+
+struct CacheBlockHeader {
+	uint64_t nodeCount;
+	uint64_t indexCount;
+};
+
+/// Incrementally hash a block of memory (64 bits at a time)
+static uint64_t hashBytes(uint64_t hash, const void *data, size_t size) {
+	const uint8_t *ptr = (const uint8_t *) data;
+
+	auto mix = [](uint64_t h, uint64_t value) {
+		h ^= value;
+		h *= 0x9E3779B97F4A7C15ull;
+		return h ^ (h >> 29);
+	};
+
+	for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t), ptr += sizeof(uint64_t)) {
+		uint64_t value;
+		memcpy(&value, ptr, sizeof(uint64_t));
+		hash = mix(hash, value);
+	}
+
+	uint64_t tail = 0;
+	memcpy(&tail, ptr, size);
+	return mix(hash, tail ^ ((uint64_t) size << 56));
+}
+
+template <typename T> static uint64_t hashValue(uint64_t hash, const T &value) {
+	return hashBytes(hash, &value, sizeof(T));
+}
+
+uint64_t Accel::hashBuildInput() const {
+	uint64_t hash = hashValue(0xCBF29CE484222325ull, (uint32_t) NORI_BVH_CACHE_VERSION);
+
+	/* Construction parameters */
+	hash = hashValue(hash, (uint32_t) m_buildMethod);
+	hash = hashValue(hash, m_duplicationBudget);
+	hash = hashValue(hash, m_plocRadius);
+	hash = hashValue(hash, m_binCount);
+	hash = hashValue(hash, m_maxLeafSize);
+	hash = hashValue(hash, (uint32_t) m_exactLeafSAH);
+	hash = hashValue(hash, m_leafWidth);
+
+	/* Geometry */
+	hash = hashValue(hash, (uint64_t) m_meshes.size());
+	for (const Mesh *mesh : m_meshes) {
+		if (mesh->isAnalytic()) {
+			/* The builder only sees the bounding boxes of the primitives */
+			hash = hashValue(hash, (uint64_t) mesh->getPrimitiveCount());
+			for (n_UINT i = 0; i < mesh->getPrimitiveCount(); ++i) {
+				BoundingBox3f bbox = mesh->getBoundingBox(i);
+				hash = hashBytes(hash, bbox.min.data(), sizeof(float) * 3);
+				hash = hashBytes(hash, bbox.max.data(), sizeof(float) * 3);
+			}
+			continue;
+		}
+
+		MatrixXfView V = mesh->getVertexPositions();
+		MatrixXuView F = mesh->getIndices();
+		hash = hashValue(hash, (uint64_t) mesh->getVertexCount());
+		hash = hashValue(hash, (uint64_t) F.cols());
+		if (V.size() > 0) {
+			hash = hashBytes(hash, V.data(), sizeof(float) * V.size());
+		} else {
+			/* Quantized positions, hash what the hierarchy was built from */
+			for (n_UINT i = 0; i < mesh->getVertexCount(); ++i) {
+				Point3f p = mesh->getVertexPosition(i);
+				hash = hashBytes(hash, p.data(), sizeof(float) * 3);
+			}
+		}
+		hash = hashBytes(hash, F.data(), sizeof(uint32_t) * F.size());
+	}
+
+	hash = hashValue(hash, (uint64_t) m_blas.size());
+	for (const Accel *blas : m_blas)
+		hash = hashValue(hash, blas->hashBuildInput());
+
+	return hash;
+}
+
+bool Accel::loadCache() {
+	std::unique_ptr<MemoryMappedFile> file;
+	try {
+		file.reset(new MemoryMappedFile(m_cacheFile));
+	} catch (const NoriException &) {
+		return false; /* No cache yet */
+	}
+
+	cout << "Loading the BVH cache \"" << m_cacheFile << "\" .. ";
+	cout.flush();
+	return readCache(file->data(), file->size(), true);
+}
+
+bool Accel::readCache(const uint8_t *data, size_t size, bool verify) {
+	Timer timer;
+
+	std::vector<Accel *> trees(1, this);
+	trees.insert(trees.end(), m_blas.begin(), m_blas.end());
+
+	const uint8_t *ptr = data, *end = ptr + size;
+
+	CacheHeader header;
+	if (size < sizeof(CacheHeader)) {
+		cout << "invalid, rebuilding." << endl;
+		return false;
+	}
+	memcpy(&header, ptr, sizeof(CacheHeader));
+	ptr += sizeof(CacheHeader);
+
+	if (memcmp(header.magic, NORI_BVH_CACHE_MAGIC, sizeof(NORI_BVH_CACHE_MAGIC)) != 0 ||
+		header.version != NORI_BVH_CACHE_VERSION ||
+		header.nodeSize != sizeof(BVHNode) ||
+		header.blockCount != trees.size()) {
+		cout << "incompatible, rebuilding." << endl;
+		return false;
+	}
+
+	if (verify && header.hash != hashBuildInput()) {
+		cout << "outdated, rebuilding." << endl;
+		return false;
+	}
+
+	for (Accel *tree : trees) {
+		CacheBlockHeader block;
+		if ((size_t) (end - ptr) < sizeof(CacheBlockHeader))
+			break;
+		memcpy(&block, ptr, sizeof(CacheBlockHeader));
+		ptr += sizeof(CacheBlockHeader);
+
+		size_t available = (size_t) (end - ptr);
+		if (block.nodeCount > available / sizeof(BVHNode) ||
+		    block.indexCount > available / sizeof(n_UINT))
+			break;
+		size_t nodeBytes = block.nodeCount * sizeof(BVHNode),
+		       indexBytes = block.indexCount * sizeof(n_UINT);
+		if (available < nodeBytes + indexBytes)
+			break;
+
+		tree->m_nodes.resize(block.nodeCount);
+		tree->m_indices.resize(block.indexCount);
+		memcpy(tree->m_nodes.data(), ptr, nodeBytes);
+		memcpy(tree->m_indices.data(), ptr + nodeBytes, indexBytes);
+		ptr += nodeBytes + indexBytes;
+
+		/* Make sure that the tree cannot reference anything out of bounds */
+		bool valid = tree->m_nodes.empty() == (tree->getTriangleCount() == 0);
+		n_UINT triangleCount = tree->getTriangleCount();
+		for (n_UINT index : tree->m_indices)
+			valid &= index < triangleCount;
+		/* Children must follow their parent, which also rules out cycles */
+		for (uint64_t i = 0; i < block.nodeCount; ++i) {
+			const BVHNode &node = tree->m_nodes[i];
+			if (node.isLeaf())
+				valid &= (uint64_t) node.start() + node.leaf.size <= block.indexCount;
+			else
+				valid &= i + 1 < node.inner.rightChild && node.inner.rightChild < block.nodeCount;
+		}
+
+		if (!valid) {
+			ptr = nullptr;
+			break;
+		}
+
+		if (!tree->m_nodes.empty())
+			tree->m_buildCost = tree->statistics().first;
+	}
+
+	if (ptr != end) {
+		for (Accel *tree : trees) {
+			tree->m_nodes.clear();
+			tree->m_indices.clear();
+		}
+		cout << "corrupted, rebuilding." << endl;
+		return false;
+	}
+
+	for (Accel *tree : trees)
+		tree->m_cached = true;
+
+	cout << "done (took " << timer.elapsedString() << " and " << memString(size);
+	if (!m_nodes.empty())
+		cout << ", SAH cost = " << m_buildCost;
+	cout << ")." << endl;
+
+	return true;
+}
+
+void Accel::saveCache() const {
+	std::ofstream os(m_cacheFile, std::ios::binary | std::ios::trunc);
+	if (os.fail()) {
+		cerr << "Accel: unable to write the BVH cache \"" << m_cacheFile << "\"!" << endl;
+		return;
+	}
+
+	writeCache(os);
+
+	if (os.fail())
+		cerr << "Accel: unable to write the BVH cache \"" << m_cacheFile << "\"!" << endl;
+}
+
+void Accel::writeCache(std::ostream &os) const {
+	std::vector<const Accel *> trees(1, this);
+	trees.insert(trees.end(), m_blas.begin(), m_blas.end());
+
+	CacheHeader header;
+	memset(&header, 0, sizeof(CacheHeader));
+	memcpy(header.magic, NORI_BVH_CACHE_MAGIC, sizeof(NORI_BVH_CACHE_MAGIC));
+	header.version = NORI_BVH_CACHE_VERSION;
+	header.nodeSize = sizeof(BVHNode);
+	header.hash = hashBuildInput();
+	header.blockCount = (uint32_t) trees.size();
+	os.write((const char *) &header, sizeof(CacheHeader));
+
+	for (const Accel *tree : trees) {
+		CacheBlockHeader block;
+		block.nodeCount = tree->m_nodes.size();
+		block.indexCount = tree->m_indices.size();
+		os.write((const char *) &block, sizeof(CacheBlockHeader));
+		os.write((const char *) tree->m_nodes.data(), sizeof(BVHNode) * block.nodeCount);
+		os.write((const char *) tree->m_indices.data(), sizeof(n_UINT) * block.indexCount);
+	}
+}
+
+NORI_NAMESPACE_END
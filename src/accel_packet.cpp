@@ -0,0 +1,567 @@
+/*
+    This file is an extension of Nori, a simple educational ray tracer
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/accel.h>
+#include <Eigen/Geometry>
+
+NORI_NAMESPACE_BEGIN
+
+/// Number of rays per packet when intersecting a \ref RayStream
+#define NORI_STREAM_PACKET_SIZE 16
+
+/// Wide BVHs: subtrees visited by at most this many rays are traversed one ray at a time
+#define NORI_PACKET_SPLIT_SIZE 2
+
+/**
+ * \brief Conservative packet/box test based on interval arithmetic
+ *
+ * Bounds the entry and exit distances of all rays of a packet whose
+ * direction signs agree on every axis. Returns \c false only when no
+ * ray of the packet can possibly intersect the box.
+ */
+static inline bool intervalIntersect(const float *bmin, const float *bmax, const bool *positive,
+		const float *oMin, const float *oMax, const float *rMin, const float *rMax,
+		float mint, float maxt) {
+	float nearT = mint, farT = maxt;
+
+	for (int k = 0; k < 3; ++k) {
+		float nearP = positive[k] ? bmin[k] : bmax[k],
+		      farP  = positive[k] ? bmax[k] : bmin[k];
+
+		/* Interval of (plane - origin) multiplied by the interval of reciprocals */
+		float a0 = nearP - oMax[k], a1 = nearP - oMin[k];
+		float b0 = farP - oMax[k], b1 = farP - oMin[k];
+
+		nearT = std::max(nearT, std::min(std::min(a0 * rMin[k], a0 * rMax[k]),
+		                                 std::min(a1 * rMin[k], a1 * rMax[k])));
+		farT = std::min(farT, std::max(std::max(b0 * rMin[k], b0 * rMax[k]),
+		                               std::max(b1 * rMin[k], b1 * rMax[k])));
+	}
+
+	return nearT <= farT;
+}
+
+/**
+ * \brief Traversal state of a ray packet
+ *
+ * Unused lanes hold zeros and an empty segment, so that the per-lane
+ * loops can process all lanes without branches.
+ */
+template <int N> struct Accel::PacketState {
+	typedef uint32_t Mask;
+
+	float o[3][N], d[3][N], dRcp[3][N], mint[N], maxt[N];
+	Ray3f rays[N];     ///< Active rays for the single-ray node tests (same maxt)
+	Mask active = 0;   ///< Rays with a non-empty segment
+	Mask done = 0;     ///< Shadow rays that found an occluder
+	HitPacket<N> *hits;
+	bool shadowRay;
+
+	/* Packet bounds used for interval culling. This is only possible
+	   when all directions agree in their signs on every axis */
+	bool coherent, positive[3];
+	float oMin[3], oMax[3], rMin[3], rMax[3], packetMint, packetMaxt;
+
+	/**
+	 * \brief Determine which rays of \c mask hit the box
+	 *
+	 * The box is first tested against the entire packet, and then against
+	 * the individual rays. Returns the mask of the rays that were hit and
+	 * the smallest of their entry distances via \c tnear.
+	 */
+	Mask intersect(const float *bmin, const float *bmax, Mask mask, float &tnear) const {
+		if (coherent && !intervalIntersect(bmin, bmax, positive, oMin, oMax,
+				rMin, rMax, packetMint, packetMaxt))
+			return 0;
+
+		int boxHit[N];
+		float nearest = std::numeric_limits<float>::infinity();
+		for (int i = 0; i < N; ++i) {
+			float nearT = mint[i], farT = maxt[i];
+			for (int k = 0; k < 3; ++k) {
+				/* Select the planes by the direction sign (not by the order of
+				   t0 and t1), so that the inverted boxes of unused slots miss */
+				float t0 = (bmin[k] - o[k][i]) * dRcp[k][i],
+				      t1 = (bmax[k] - o[k][i]) * dRcp[k][i];
+				bool negative = dRcp[k][i] < 0.f;
+				nearT = std::max(nearT, negative ? t1 : t0);
+				farT = std::min(farT, negative ? t0 : t1);
+			}
+			boxHit[i] = nearT <= farT;
+			nearest = std::min(nearest, boxHit[i] ? nearT : std::numeric_limits<float>::infinity());
+		}
+
+		Mask hitMask = 0;
+		for (int i = 0; i < N; ++i)
+			hitMask |= (Mask) boxHit[i] << i;
+		tnear = nearest;
+		return hitMask & mask;
+	}
+};
+
+template <int N> void Accel::rayIntersectPacket(const RayPacket<N> &packet,
+		HitPacket<N> &hits, bool shadowRay) const {
+	static_assert(N <= 32, "Packets are limited to 32 rays");
+	typedef uint32_t Mask;
+
+	PacketState<N> state;
+	state.hits = &hits;
+	state.shadowRay = shadowRay;
+	float (&o)[3][N] = state.o, (&d)[3][N] = state.d, (&dRcp)[3][N] = state.dRcp;
+	float (&mint)[N] = state.mint, (&maxt)[N] = state.maxt;
+	Mask &active = state.active;
+
+	for (int i = 0; i < N; ++i) {
+		hits.t[i] = std::numeric_limits<float>::infinity();
+		hits.mesh[i] = NORI_INVALID_HIT;
+
+		bool used = i < packet.size;
+		for (int k = 0; k < 3; ++k) {
+			o[k][i] = used ? packet.o[k][i] : 0.f;
+			d[k][i] = used ? packet.d[k][i] : 0.f;
+			dRcp[k][i] = used ? packet.dRcp[k][i] : 0.f;
+		}
+		mint[i] = std::numeric_limits<float>::infinity();
+		maxt[i] = -std::numeric_limits<float>::infinity();
+		if (!used)
+			continue;
+
+		/* Use an adaptive ray epsilon */
+		mint[i] = packet.mint[i];
+		maxt[i] = packet.maxt[i];
+		if (mint[i] == Epsilon)
+			mint[i] = std::max(mint[i], mint[i] * std::max(std::max(
+				std::abs(packet.o[0][i]), std::abs(packet.o[1][i])), std::abs(packet.o[2][i])));
+		if (mint[i] <= maxt[i])
+			active |= (Mask) 1 << i;
+		state.rays[i] = packet.get(i);
+		state.rays[i].mint = mint[i];
+		state.rays[i].maxt = maxt[i];
+	}
+
+	if (!active)
+		return;
+
+	/* Instances are handled one ray at a time. Their hits shorten the rays
+	   before the packet traverses the remaining geometry */
+	if (!m_instances.empty()) {
+		for (int i = 0; i < N; ++i) {
+			if (!(active & ((Mask) 1 << i)))
+				continue;
+			Ray3f ray = packet.get(i);
+			ray.mint = mint[i];
+			ray.maxt = maxt[i];
+
+			if (shadowRay) {
+				if (rayOccludedInstances(ray)) {
+					hits.mesh[i] = getMeshCount();
+					state.done |= (Mask) 1 << i;
+				}
+				continue;
+			}
+
+			Intersection its;
+			n_UINT f, instance;
+			if (rayIntersectInstances(ray, its, f, instance)) {
+				maxt[i] = state.rays[i].maxt = hits.t[i] = its.t;
+				hits.u[i] = its.uv.x();
+				hits.v[i] = its.uv.y();
+				hits.mesh[i] = getMeshCount() + instance;
+				hits.prim[i] = f;
+			}
+		}
+	}
+
+	if (m_nodes.empty() || state.done == active)
+		return;
+
+	state.coherent = true;
+	state.packetMint = std::numeric_limits<float>::infinity();
+	state.packetMaxt = 0.f;
+	for (int k = 0; k < 3; ++k) {
+		state.oMin[k] = state.rMin[k] = std::numeric_limits<float>::infinity();
+		state.oMax[k] = state.rMax[k] = -std::numeric_limits<float>::infinity();
+		state.positive[k] = false;
+	}
+
+	for (int i = 0, first = 1; i < N; ++i) {
+		if (!(active & ((Mask) 1 << i)))
+			continue;
+		for (int k = 0; k < 3; ++k) {
+			float dk = packet.d[k][i];
+			if (dk == 0.f || (!first && (dk > 0.f) != state.positive[k]))
+				state.coherent = false;
+			state.positive[k] = dk > 0.f;
+			state.oMin[k] = std::min(state.oMin[k], packet.o[k][i]);
+			state.oMax[k] = std::max(state.oMax[k], packet.o[k][i]);
+			state.rMin[k] = std::min(state.rMin[k], packet.dRcp[k][i]);
+			state.rMax[k] = std::max(state.rMax[k], packet.dRcp[k][i]);
+		}
+		state.packetMint = std::min(state.packetMint, mint[i]);
+		state.packetMaxt = std::max(state.packetMaxt, maxt[i]);
+		first = 0;
+	}
+
+	/* Traverse the same node layout as single rays */
+	if (m_quantization == 8) {
+		if (m_width == 4)
+			packetTraverseWide(m_quantizedNodes4x8, state);
+		else
+			packetTraverseWide(m_quantizedNodes8x8, state);
+	} else if (m_quantization == 16) {
+		if (m_width == 4)
+			packetTraverseWide(m_quantizedNodes4x16, state);
+		else
+			packetTraverseWide(m_quantizedNodes8x16, state);
+	} else if (m_width == 4) {
+		packetTraverseWide(m_wideNodes4, state);
+	} else if (m_width == 8) {
+		packetTraverseWide(m_wideNodes8, state);
+	} else {
+		packetTraverse(state);
+	}
+}
+
+template <int N> void Accel::packetTraverse(PacketState<N> &state) const {
+	typedef uint32_t Mask;
+
+	/* Each stack entry records the rays that are still interested in the node */
+	struct Entry { n_UINT node; Mask mask; } stack[64];
+	n_UINT node_idx = 0, stack_idx = 0;
+	Mask mask = state.active;
+
+	while (true) {
+		const BVHNode &node = m_nodes[node_idx];
+		mask &= ~state.done;
+
+		float tnear;
+		Mask hitMask = mask ? state.intersect(node.bbox.min.data(),
+			node.bbox.max.data(), mask, tnear) : 0;
+
+		if (!hitMask) {
+			if (stack_idx == 0)
+				break;
+			--stack_idx;
+			node_idx = stack[stack_idx].node;
+			mask = stack[stack_idx].mask;
+			continue;
+		}
+
+		if (node.isInner()) {
+			/* Visit the child on the near side of the split first, based
+			   on the direction of the first interested ray */
+			int lane = 0;
+			while (!(hitMask & ((Mask) 1 << lane)))
+				++lane;
+			n_UINT first = node_idx + 1, second = node.inner.rightChild;
+			if (state.d[node.inner.axis][lane] < 0)
+				std::swap(first, second);
+
+			stack[stack_idx].node = second;
+			stack[stack_idx++].mask = hitMask;
+			assert(stack_idx < 64);
+			node_idx = first;
+			mask = hitMask;
+			continue;
+		}
+
+		packetLeaf(state, node.start(), node.end(), hitMask);
+
+		if (state.shadowRay && state.done == state.active)
+			return;
+
+		if (stack_idx == 0)
+			break;
+		--stack_idx;
+		node_idx = stack[stack_idx].node;
+		mask = stack[stack_idx].mask;
+	}
+}
+
+template <int N, typename Node> void Accel::packetTraverseWide(const NodeVector<Node> &wideNodes,
+		PacketState<N> &state) const {
+	typedef uint32_t Mask;
+	const int W = Node::Width;
+
+	/* Each stack entry records the rays that are still interested in the
+	   node, and the closest distance at which any of them enters it */
+	struct Entry { n_UINT node; Mask mask; float tnear; } stack[64 * W];
+	n_UINT node_idx = 0, stack_idx = 0;
+	Mask mask = state.active & ~state.done;
+	int rayCount = 0;
+	for (Mask m = mask; m; m &= m - 1)
+		++rayCount;
+
+	while (true) {
+		const Node &node = wideNodes[node_idx];
+		Mask childMask[W];
+		float childNear[W];
+
+		if (rayCount > W) {
+			/* Many rays: test one child at a time against the packet, which
+			   culls most misses with a single interval test */
+			for (int c = 0; c < W; ++c) {
+				float bmin[3], bmax[3];
+				node.getChildBounds(c, bmin, bmax);
+				childMask[c] = state.intersect(bmin, bmax, mask, childNear[c]);
+			}
+		} else {
+			/* Few rays: test all children against one ray at a time with
+			   the SIMD node test of single rays */
+			for (int c = 0; c < W; ++c) {
+				childMask[c] = 0;
+				childNear[c] = std::numeric_limits<float>::infinity();
+			}
+			for (int i = 0; i < N; ++i) {
+				if (!(mask & ((Mask) 1 << i)))
+					continue;
+				float tnear[W];
+				int hitMask = node.intersect(TraversalRay(state.rays[i]), tnear);
+				for (int c = 0; hitMask; ++c, hitMask >>= 1) {
+					if (hitMask & 1) {
+						childMask[c] |= (Mask) 1 << i;
+						childNear[c] = std::min(childNear[c], tnear[c]);
+					}
+				}
+			}
+		}
+
+		/* Sort the children that were hit by decreasing distance */
+		int order[W], childCount = 0;
+		for (int c = 0; c < W; ++c) {
+			if (!childMask[c])
+				continue;
+			int j = childCount++;
+			while (j > 0 && childNear[order[j - 1]] < childNear[c]) {
+				order[j] = order[j - 1];
+				--j;
+			}
+			order[j] = c;
+		}
+
+		/* Leaves are intersected right away (front to back) .. */
+		for (int j = childCount - 1; j >= 0; --j) {
+			int c = order[j];
+			if (!node.isLeaf(c))
+				continue;
+			packetLeaf(state, node.child[c], node.child[c] + node.count[c], childMask[c]);
+			if (state.shadowRay && state.done == state.active)
+				return;
+		}
+
+		/* .. while inner nodes are deferred (back to front) */
+		for (int j = 0; j < childCount; ++j) {
+			int c = order[j];
+			if (node.isLeaf(c))
+				continue;
+			stack[stack_idx++] = Entry { node.child[c], childMask[c], childNear[c] };
+			assert(stack_idx < 64 * W);
+		}
+
+		/* Skip entries whose rays have terminated or hit something closer */
+		while (true) {
+			if (stack_idx == 0)
+				return;
+			--stack_idx;
+			mask = stack[stack_idx].mask & ~state.done;
+			float farthest = -std::numeric_limits<float>::infinity();
+			rayCount = 0;
+			for (int i = 0; i < N; ++i)
+				farthest = std::max(farthest, (mask & ((Mask) 1 << i)) ? state.maxt[i]
+					: -std::numeric_limits<float>::infinity());
+			for (Mask m = mask; m; m &= m - 1)
+				++rayCount;
+			if (!mask || stack[stack_idx].tnear > farthest)
+				continue;
+
+			/* Once the packet has diverged, the bookkeeping of the shared
+			   stack no longer pays off */
+			if (rayCount > NORI_PACKET_SPLIT_SIZE)
+				break;
+			packetSplit(wideNodes, state, stack[stack_idx].node, mask);
+			if (state.shadowRay && state.done == state.active)
+				return;
+		}
+		node_idx = stack[stack_idx].node;
+	}
+}
+
+template <int N, typename Node> void Accel::packetSplit(const NodeVector<Node> &wideNodes,
+		PacketState<N> &state, n_UINT root, uint32_t mask) const {
+	HitPacket<N> &hits = *state.hits;
+
+	for (int i = 0; i < N; ++i) {
+		if (!(mask & ((uint32_t) 1 << i)))
+			continue;
+		Ray3f &ray = state.rays[i];
+
+		if (state.shadowRay) {
+			if (rayOccludedWide(wideNodes, ray, root)) {
+				/* Only the validity of the record matters, but keep it decodable */
+				hits.mesh[i] = hits.prim[i] = 0;
+				state.done |= (uint32_t) 1 << i;
+			}
+			continue;
+		}
+
+		Intersection its;
+		n_UINT f;
+		if (rayIntersectWide(wideNodes, ray, its, f, root)) {
+			state.maxt[i] = hits.t[i] = its.t;
+			hits.u[i] = its.uv.x();
+			hits.v[i] = its.uv.y();
+			hits.mesh[i] = (n_UINT) (std::find(m_meshes.begin(), m_meshes.end(), its.mesh) - m_meshes.begin());
+			hits.prim[i] = f;
+		}
+	}
+}
+
+/// Copy triangle \c i of a SIMD block
+template <typename Block> static inline void getBlockTriangle(const Block &block, int i,
+		n_UINT &meshIdx, n_UINT &prim, Point3f &p0, Vector3f &edge1, Vector3f &edge2) {
+	meshIdx = block.mesh[i];
+	prim = block.prim[i];
+	p0 = Point3f(block.p0[0][i], block.p0[1][i], block.p0[2][i]);
+	edge1 = Vector3f(block.edge1[0][i], block.edge1[1][i], block.edge1[2][i]);
+	edge2 = Vector3f(block.edge2[0][i], block.edge2[1][i], block.edge2[2][i]);
+}
+
+void Accel::getLeafTriangle(n_UINT j, n_UINT &meshIdx, n_UINT &prim, Point3f &p0,
+		Vector3f &edge1, Vector3f &edge2) const {
+	/* Padded leaves read their triangles from the SIMD blocks */
+	if (m_leafWidth == 4) {
+		getBlockTriangle(m_triangleBlocks4[j / 4], (int) (j % 4), meshIdx, prim, p0, edge1, edge2);
+		return;
+	} else if (m_leafWidth == 8) {
+		getBlockTriangle(m_triangleBlocks8[j / 8], (int) (j % 8), meshIdx, prim, p0, edge1, edge2);
+		return;
+	}
+
+	if (!m_triangles.empty()) {
+		const TriangleRecord &tri = m_triangles[j];
+		prim = tri.prim;
+		meshIdx = tri.mesh;
+		p0 = tri.p0;
+		edge1 = tri.edge1;
+		edge2 = tri.edge2;
+		return;
+	}
+
+	prim = m_indices[j];
+	meshIdx = findMesh(prim);
+	const Mesh *mesh = m_meshes[meshIdx];
+	MatrixXuView F = mesh->getIndices();
+	p0 = mesh->getVertexPosition(F(0, prim));
+	edge1 = mesh->getVertexPosition(F(1, prim)) - p0;
+	edge2 = mesh->getVertexPosition(F(2, prim)) - p0;
+}
+
+template <int N> void Accel::packetLeaf(PacketState<N> &state, n_UINT start, n_UINT end,
+		uint32_t mask) const {
+	typedef uint32_t Mask;
+	const float (&o)[3][N] = state.o, (&d)[3][N] = state.d;
+	float (&mint)[N] = state.mint, (&maxt)[N] = state.maxt;
+	HitPacket<N> &hits = *state.hits;
+
+	/* Intersect each triangle of the leaf against all interested rays,
+	   so that the vertex data is fetched only once per packet */
+	for (n_UINT j = start; j < end; ++j) {
+		n_UINT idx, meshIdx;
+		Point3f p0;
+		Vector3f edge1, edge2;
+		getLeafTriangle(j, meshIdx, idx, p0, edge1, edge2);
+
+		/* Moeller-Trumbore test of all lanes without branches */
+		float uHit[N], vHit[N], tHit[N];
+		int triangleHit[N];
+		for (int i = 0; i < N; ++i) {
+			float dx = d[0][i], dy = d[1][i], dz = d[2][i];
+			float px = dy * edge2.z() - dz * edge2.y(),
+			      py = dz * edge2.x() - dx * edge2.z(),
+			      pz = dx * edge2.y() - dy * edge2.x();
+			float det = edge1.x() * px + edge1.y() * py + edge1.z() * pz;
+			float inv_det = 1.0f / det;
+
+			float tx = o[0][i] - p0.x(), ty = o[1][i] - p0.y(), tz = o[2][i] - p0.z();
+			float u = (tx * px + ty * py + tz * pz) * inv_det;
+
+			float qx = ty * edge1.z() - tz * edge1.y(),
+			      qy = tz * edge1.x() - tx * edge1.z(),
+			      qz = tx * edge1.y() - ty * edge1.x();
+			float v = (dx * qx + dy * qy + dz * qz) * inv_det;
+			float t = (edge2.x() * qx + edge2.y() * qy + edge2.z() * qz) * inv_det;
+
+			bool hit = ((det <= -1e-8f) | (det >= 1e-8f)) & (u >= 0.f) & (u <= 1.f) &
+			           (v >= 0.f) & (u + v <= 1.f) & (t >= mint[i]) & (t <= maxt[i]);
+			uHit[i] = u;
+			vHit[i] = v;
+			tHit[i] = t;
+			triangleHit[i] = hit;
+		}
+
+		Mask triangleMask = 0;
+		for (int i = 0; i < N; ++i)
+			triangleMask |= (Mask) triangleHit[i] << i;
+		triangleMask &= mask & ~state.done;
+
+		for (int i = 0; i < N; ++i) {
+			if (!(triangleMask & ((Mask) 1 << i)))
+				continue;
+
+			float u = uHit[i], v = vHit[i], t = tHit[i];
+			if (isMaskedOut(m_meshes[meshIdx], idx, u, v))
+				continue;
+
+			maxt[i] = state.rays[i].maxt = hits.t[i] = t;
+			hits.u[i] = u;
+			hits.v[i] = v;
+			hits.mesh[i] = meshIdx;
+			hits.prim[i] = idx;
+			if (state.shadowRay)
+				state.done |= (Mask) 1 << i;
+		}
+	}
+}
+
+void Accel::rayIntersectStream(const RayStream &rays, RayHits &hits, bool shadowRay) const {
+	size_t size = rays.size();
+	hits.resize(size);
+
+	RayPacket<NORI_STREAM_PACKET_SIZE> packet;
+	HitPacket<NORI_STREAM_PACKET_SIZE> packetHits;
+
+	for (size_t start = 0; start < size; start += NORI_STREAM_PACKET_SIZE) {
+		packet.size = (int) std::min((size_t) NORI_STREAM_PACKET_SIZE, size - start);
+		for (int i = 0; i < packet.size; ++i)
+			packet.set(i, rays.get(start + i));
+
+		rayIntersectPacket(packet, packetHits, shadowRay);
+
+		for (int i = 0; i < packet.size; ++i) {
+			hits.t[start + i] = packetHits.t[i];
+			hits.u[start + i] = packetHits.u[i];
+			hits.v[start + i] = packetHits.v[i];
+			hits.mesh[start + i] = packetHits.mesh[i];
+			hits.prim[start + i] = packetHits.prim[i];
+		}
+	}
+}
+
+template void Accel::rayIntersectPacket<4>(const RayPacket<4> &, HitPacket<4> &, bool) const;
+template void Accel::rayIntersectPacket<8>(const RayPacket<8> &, HitPacket<8> &, bool) const;
+template void Accel::rayIntersectPacket<16>(const RayPacket<16> &, HitPacket<16> &, bool) const;
+
+NORI_NAMESPACE_END
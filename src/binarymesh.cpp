@@ -0,0 +1,261 @@
+/*
+    This file is an extension of Nori, a simple educational ray tracer
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/binarymesh.h>
+#include <nori/timer.h>
+#include <filesystem/resolver.h>
+#include <tbb/tbb.h>
+#include <fstream>
+
+NORI_NAMESPACE_BEGIN
+
+/// Size of a block of the binary mesh format in bytes
+static uint64_t blockSize(const BinaryMeshHeader &header, int block) {
+    switch (block) {
+        case BinaryMeshHeader::EPositions:
+        case BinaryMeshHeader::ENormals: return header.vertexCount * 3 * sizeof(float);
+        case BinaryMeshHeader::ETexCoords: return header.vertexCount * 2 * sizeof(float);
+        case BinaryMeshHeader::EAreas: return header.triangleCount * sizeof(float);
+        default: return header.triangleCount * 3 * sizeof(uint32_t);
+    }
+}
+
+/**
+ * \brief Loader for meshes in the binary mesh format (see \ref BinaryMeshHeader)
+ *
+ * The file is memory-mapped and its blocks are used in place as the
+ * vertex and index buffers of the mesh, hence loading mostly amounts to
+ * checking the indices. Only a <tt>toWorld</tt> transformation forces
+ * a copy of the positions and normals. Such files are created from other
+ * mesh formats by the <tt>meshconvert</tt> tool.
+ *
+ * Setting <tt>compact</tt> (and <tt>quantizePositions</tt>) converts the
+ * vertex attributes into compact form (see \ref Mesh::compactVertexAttributes()),
+ * which also copies them out of the file.
+ */
+class BinaryMesh : public Mesh {
+public:
+    BinaryMesh(const PropertyList &propList) {
+        filesystem::path filename =
+            getFileResolver()->resolve(propList.getString("filename"));
+        Transform trafo = propList.getTransform("toWorld", Transform());
+
+        cout << "Loading \"" << filename << "\" .. ";
+        cout.flush();
+        Timer timer;
+
+        std::shared_ptr<MemoryMappedFile> file(new MemoryMappedFile(filename.str()));
+        size_t fileSize = file->size();
+        load(std::move(file), 0, filename.str());
+
+        bool mapped = trafo.getMatrix().isIdentity();
+        if (!mapped) {
+            copyMappedBuffers();
+            m_bbox.reset();
+            for (n_UINT i = 0; i < (n_UINT) m_V.cols(); ++i) {
+                m_V.col(i) = trafo * Point3f(m_V.col(i));
+                m_bbox.expandBy(Point3f(m_V.col(i)));
+            }
+            for (n_UINT i = 0; i < (n_UINT) m_N.cols(); ++i)
+                m_N.col(i) = (trafo * Normal3f(m_N.col(i))).normalized();
+        }
+
+        m_name = filename.str();
+        cout << "done. (V=" << getVertexCount() << ", F=" << getTriangleCount() << ", took "
+             << timer.elapsedString() << ", "
+             << (mapped ? "mapped " : "copied ") << memString(fileSize)
+             << ")" << endl;
+
+        if (propList.getBoolean("compact", false))
+            compactVertexAttributes(propList.getBoolean("quantizePositions", false));
+    }
+
+    BinaryMesh(std::shared_ptr<MemoryMappedFile> file, uint64_t offset, const std::string &name) {
+        load(std::move(file), offset, name);
+        m_name = name;
+    }
+
+protected:
+    /// Use the binary mesh data starting \c base bytes into \c file
+    void load(std::shared_ptr<MemoryMappedFile> file, uint64_t base, const std::string &filename) {
+        if (base % NORI_BINARY_MESH_ALIGNMENT != 0 || base > file->size() ||
+            file->size() - base < sizeof(BinaryMeshHeader))
+            throw NoriException("\"%s\" is not a binary mesh file!", filename);
+        size_t size = file->size() - base;
+        const uint8_t *data = file->data() + base;
+
+        BinaryMeshHeader header;
+        memcpy(&header, data, sizeof(BinaryMeshHeader));
+        if (header.magic != NORI_BINARY_MESH_MAGIC)
+            throw NoriException("\"%s\" is not a binary mesh file (or was written on a "
+                                "machine with a different byte order)!", filename);
+        if (header.version != NORI_BINARY_MESH_VERSION)
+            throw NoriException("\"%s\" has version %i of the binary mesh format, expected %i!",
+                                filename, header.version, NORI_BINARY_MESH_VERSION);
+        if (header.encoding != BinaryMeshHeader::ERaw)
+            throw NoriException("\"%s\" uses an unsupported encoding!", filename);
+        if (header.vertexCount > (uint64_t) std::numeric_limits<n_UINT>::max() ||
+            header.triangleCount > (uint64_t) std::numeric_limits<n_UINT>::max())
+            throw NoriException("\"%s\" is too large!", filename);
+
+        const uint8_t *blocks[BinaryMeshHeader::EBlockCount];
+        for (int i = 0; i < BinaryMeshHeader::EBlockCount; ++i) {
+            uint64_t offset = header.offset[i];
+            blocks[i] = offset ? data + offset : nullptr;
+            if (offset == 0 && (i == BinaryMeshHeader::EPositions ||
+                                i == BinaryMeshHeader::EIndices))
+                throw NoriException("\"%s\" is missing a required block!", filename);
+            if (offset % NORI_BINARY_MESH_ALIGNMENT != 0 || offset > size ||
+                (offset && blockSize(header, i) > size - offset))
+                throw NoriException("\"%s\" is truncated or corrupt!", filename);
+        }
+
+        n_UINT vertexCount = (n_UINT) header.vertexCount,
+               triangleCount = (n_UINT) header.triangleCount;
+        const uint32_t *indices = (const uint32_t *) blocks[BinaryMeshHeader::EIndices];
+
+        /* The indices are the only data that could cause invalid memory accesses */
+        bool valid = tbb::parallel_reduce(
+            tbb::blocked_range<size_t>(0, 3 * (size_t) triangleCount, GRAIN_SIZE), true,
+            [&](const tbb::blocked_range<size_t> &range, bool valid) {
+                for (size_t i = range.begin(); i != range.end(); ++i)
+                    valid &= indices[i] < vertexCount;
+                return valid;
+            },
+            [](bool a, bool b) { return a && b; }
+        );
+        if (!valid)
+            throw NoriException("\"%s\" contains invalid vertex indices!", filename);
+
+        setMappedBuffers(std::move(file), vertexCount, triangleCount,
+            (const float *) blocks[BinaryMeshHeader::EPositions],
+            (const float *) blocks[BinaryMeshHeader::ENormals],
+            (const float *) blocks[BinaryMeshHeader::ETexCoords], indices);
+        m_areas = (const float *) blocks[BinaryMeshHeader::EAreas];
+        m_bbox = BoundingBox3f(Point3f(header.bboxMin[0], header.bboxMin[1], header.bboxMin[2]),
+                               Point3f(header.bboxMax[0], header.bboxMax[1], header.bboxMax[2]));
+    }
+
+    void computeAreaDistribution() {
+        /* The stored areas are only valid as long as the vertices are mapped */
+        if (!m_file || !m_areas) {
+            Mesh::computeAreaDistribution();
+            return;
+        }
+
+        n_UINT triangleCount = getTriangleCount();
+        m_pdf.clear();
+        m_pdf.reserve(triangleCount);
+        for (n_UINT i = 0; i < triangleCount; ++i)
+            m_pdf.append(m_areas[i]);
+        m_pdf.normalize();
+    }
+
+    /// Indices checked per task
+    static const size_t GRAIN_SIZE = 65536;
+
+    const float *m_areas = nullptr; ///< Mapped surface areas of the triangles, if stored
+};
+
+Mesh *createBinaryMesh(std::shared_ptr<MemoryMappedFile> file, uint64_t offset,
+                       const std::string &name) {
+    return new BinaryMesh(std::move(file), offset, name);
+}
+
+void writeBinaryMesh(const Mesh *mesh, const std::string &filename) {
+    std::ofstream os(filename, std::ios::binary);
+    if (os.fail())
+        throw NoriException("Unable to open \"%s\" for writing!", filename);
+
+    writeBinaryMesh(mesh, os);
+
+    if (os.fail())
+        throw NoriException("Error while writing \"%s\"!", filename);
+}
+
+void writeBinaryMesh(const Mesh *mesh, std::ostream &os) {
+    MatrixXfView V = mesh->getVertexPositions(), N = mesh->getVertexNormals(),
+                 UV = mesh->getVertexTexCoords();
+    MatrixXuView F = mesh->getIndices();
+    n_UINT vertexCount = mesh->getVertexCount();
+    const float *dataV = V.data(), *dataN = N.data(), *dataUV = UV.data();
+
+    /* The format stores floats, decode attributes that are stored in compact form */
+    MatrixXf decodedV, decodedN, decodedUV;
+    if (V.size() == 0) {
+        decodedV.resize(3, vertexCount);
+        for (n_UINT i = 0; i < vertexCount; ++i)
+            decodedV.col(i) = mesh->getVertexPosition(i);
+        dataV = decodedV.data();
+    }
+    if (N.size() == 0 && mesh->hasVertexNormals()) {
+        decodedN.resize(3, vertexCount);
+        for (n_UINT i = 0; i < vertexCount; ++i)
+            decodedN.col(i) = mesh->getVertexNormal(i);
+        dataN = decodedN.data();
+    }
+    if (UV.size() == 0 && mesh->hasVertexTexCoords()) {
+        decodedUV.resize(2, vertexCount);
+        for (n_UINT i = 0; i < vertexCount; ++i)
+            decodedUV.col(i) = mesh->getVertexTexCoord(i);
+        dataUV = decodedUV.data();
+    }
+
+    BinaryMeshHeader header;
+    header.vertexCount = vertexCount;
+    header.triangleCount = mesh->getTriangleCount();
+    const BoundingBox3f &bbox = mesh->getBoundingBox();
+    for (int i = 0; i < 3; ++i) {
+        header.bboxMin[i] = bbox.min[i];
+        header.bboxMax[i] = bbox.max[i];
+    }
+
+    /* Surface areas of the triangles, from which the area distribution is restored */
+    std::vector<float> areas(header.triangleCount);
+    tbb::parallel_for(tbb::blocked_range<n_UINT>(0, (n_UINT) areas.size()),
+        [&](const tbb::blocked_range<n_UINT> &range) {
+            for (n_UINT i = range.begin(); i != range.end(); ++i)
+                areas[i] = mesh->surfaceArea(i);
+        }
+    );
+
+    const void *data[BinaryMeshHeader::EBlockCount] = { dataV, dataN, dataUV, F.data(), areas.data() };
+    bool present[BinaryMeshHeader::EBlockCount] = { true, mesh->hasVertexNormals(),
+                                                    mesh->hasVertexTexCoords(), true, true };
+
+    uint64_t offset = sizeof(BinaryMeshHeader);
+    for (int i = 0; i < BinaryMeshHeader::EBlockCount; ++i) {
+        if (!present[i])
+            continue;
+        offset = (offset + NORI_BINARY_MESH_ALIGNMENT - 1) / NORI_BINARY_MESH_ALIGNMENT
+            * NORI_BINARY_MESH_ALIGNMENT;
+        header.offset[i] = offset;
+        offset += blockSize(header, i);
+    }
+
+    uint64_t start = (uint64_t) os.tellp();
+    os.write((const char *) &header, sizeof(BinaryMeshHeader));
+    for (int i = 0; i < BinaryMeshHeader::EBlockCount; ++i) {
+        if (!present[i])
+            continue;
+        char padding[NORI_BINARY_MESH_ALIGNMENT] = { 0 };
+        os.write(padding, (std::streamsize) (start + header.offset[i] - (uint64_t) os.tellp()));
+        os.write((const char *) data[i], (std::streamsize) blockSize(header, i));
+    }
+}
+
+NORI_REGISTER_CLASS(BinaryMesh, "nmesh");
+NORI_NAMESPACE_END
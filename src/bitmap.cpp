@@ -20,6 +20,7 @@
 */
 
 #include <nori/bitmap.h>
+#include <nori/snapshot.h>
 #include <ImfInputFile.h>
 #include <ImfOutputFile.h>
 #include <ImfChannelList.h>
@@ -35,6 +36,11 @@
 NORI_NAMESPACE_BEGIN
 
 Bitmap::Bitmap(const std::string &filename) {
+    /* Scene snapshots store the decoded image */
+    SceneSnapshot *snapshot = SceneSnapshot::getActive();
+    if (snapshot && snapshot->readImage(filename, *this))
+        return;
+
     Imf::InputFile file(filename.c_str());
     const Imf::Header &header = file.header();
     const Imf::ChannelList &channels = header.channels();
@@ -81,6 +87,9 @@ Bitmap::Bitmap(const std::string &filename) {
     frameBuffer.insert(ch_b, Imf::Slice(Imf::FLOAT, ptr, pixelStride, rowStride));
     file.setFrameBuffer(frameBuffer);
     file.readPixels(dw.min.y, dw.max.y);
+
+    if (snapshot)
+        snapshot->addImage(filename, *this);
 }
 
 void Bitmap::saveEXR(const std::string &filename) {
@@ -164,6 +173,11 @@ Color3f Bitmap::eval(const Point2f& uv) const
 
 LDRBitmap::LDRBitmap(const std::string& filename)
 {
+    /* Scene snapshots store the decoded image */
+    SceneSnapshot *snapshot = SceneSnapshot::getActive();
+    if (snapshot && snapshot->readImage(filename, *this))
+        return;
+
     int x,y,n;
     unsigned char *im = stbi_load(filename.c_str(), &x, &y, &n, 3);
     
@@ -178,6 +192,9 @@ LDRBitmap::LDRBitmap(const std::string& filename)
     memcpy((void*)this->data(), (void*)im, y * x * 3 * sizeof(uint8_t));
     
     stbi_image_free(im);
+
+    if (snapshot)
+        snapshot->addImage(filename, *this);
 }
 
 Color3f LDRBitmap::eval(const Point2f& uv) const
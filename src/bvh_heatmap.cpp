@@ -0,0 +1,98 @@
+/*
+    This file is an extension of Nori, a simple educational ray tracer
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/integrator.h>
+#include <nori/scene.h>
+#include <nori/accel.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Visualizes the cost of tracing the camera rays through the BVH
+ *
+ * Every pixel stores the number of traversal steps of its camera rays
+ * (averaged over the pixel samples), which makes the geometry that slows
+ * down rendering easy to spot in the EXR output. The <tt>metric</tt>
+ * property selects what is counted: <tt>nodes</tt> (default), <tt>boxes</tt>,
+ * <tt>triangles</tt> or <tt>total</tt> (boxes and triangles). The counts
+ * are multiplied by <tt>scale</tt> (default: 1).
+ *
+ * Requires Nori to be compiled with the <tt>NORI_ACCEL_STATS</tt> option.
+ */
+class BVHHeatmapIntegrator : public Integrator {
+public:
+    enum EMetric {
+        ENodes = 0,
+        EBoxes,
+        ETriangles,
+        ETotal
+    };
+
+    BVHHeatmapIntegrator(const PropertyList &props) {
+#if !defined(NORI_ACCEL_STATS)
+        throw NoriException("BVHHeatmapIntegrator: traversal statistics are not available, "
+            "recompile with the NORI_ACCEL_STATS option!");
+#endif
+        std::string metric = props.getString("metric", "nodes");
+        if (metric == "nodes")
+            m_metric = ENodes;
+        else if (metric == "boxes")
+            m_metric = EBoxes;
+        else if (metric == "triangles")
+            m_metric = ETriangles;
+        else if (metric == "total")
+            m_metric = ETotal;
+        else
+            throw NoriException("BVHHeatmapIntegrator: unknown metric \"%s\"!", metric);
+        m_scale = props.getFloat("scale", 1.f);
+    }
+
+    Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
+        const TraversalStatistics &stats = Accel::getThreadStatistics();
+        TraversalStatistics before = stats;
+
+        Intersection its;
+        scene->rayIntersect(ray, its);
+
+        uint64_t cost = 0;
+        switch (m_metric) {
+            case ENodes: cost = stats.nodes - before.nodes; break;
+            case EBoxes: cost = stats.boxes - before.boxes; break;
+            case ETriangles: cost = stats.triangles - before.triangles; break;
+            case ETotal: cost = stats.boxes - before.boxes +
+                                stats.triangles - before.triangles; break;
+        }
+
+        return Color3f(m_scale * (float) cost);
+    }
+
+    std::string toString() const {
+        const char *metrics[] = { "nodes", "boxes", "triangles", "total" };
+        return tfm::format(
+            "BVHHeatmapIntegrator[\n"
+            "  metric = %s,\n"
+            "  scale = %f\n"
+            "]", metrics[m_metric], m_scale);
+    }
+
+private:
+    EMetric m_metric;
+    float m_scale;
+};
+
+NORI_REGISTER_CLASS(BVHHeatmapIntegrator, "bvh_heatmap");
+
+NORI_NAMESPACE_END
@@ -0,0 +1,432 @@
+/*
+    This file is an extension of Nori, a simple educational ray tracer
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/accel.h>
+#include <nori/timer.h>
+#include <nori/warp.h>
+#include <filesystem/resolver.h>
+#include <pcg32.h>
+#include <Eigen/Geometry>
+#include <iomanip>
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace nori;
+
+/**
+ * \brief Hardware event counter of the calling thread
+ *
+ * Only available on Linux, and only when the kernel permits access to
+ * the performance monitoring unit (see perf_event_paranoid).
+ */
+class PerfCounter {
+public:
+    PerfCounter(uint32_t type, uint64_t config) {
+#if defined(__linux__)
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(perf_event_attr));
+        attr.size = sizeof(perf_event_attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        m_fd = (int) syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+    }
+
+    ~PerfCounter() {
+#if defined(__linux__)
+        if (m_fd >= 0)
+            close(m_fd);
+#endif
+    }
+
+    bool isValid() const { return m_fd >= 0; }
+
+    void start() {
+#if defined(__linux__)
+        if (m_fd >= 0) {
+            ioctl(m_fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(m_fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+#endif
+    }
+
+    uint64_t stop() {
+        uint64_t value = 0;
+#if defined(__linux__)
+        if (m_fd >= 0) {
+            ioctl(m_fd, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(m_fd, &value, sizeof(uint64_t)) != sizeof(uint64_t))
+                value = 0;
+        }
+#endif
+        return value;
+    }
+
+private:
+    int m_fd = -1;
+};
+
+#if defined(__linux__)
+#define NORI_CACHE_EVENT(cache) \
+    (PERF_COUNT_HW_CACHE_##cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | \
+     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+#endif
+
+/// Generate incoherent rays from a sphere around the mesh towards random points inside of it
+static std::vector<Ray3f> generateRays(const BoundingBox3f &bbox, size_t count) {
+    pcg32 random;
+    std::vector<Ray3f> rays;
+    rays.reserve(count);
+
+    Point3f center = bbox.getCenter();
+    float radius = (bbox.max - bbox.min).norm();
+    for (size_t i = 0; i < count; ++i) {
+        Point3f origin = center + radius * Warp::squareToUniformSphere(
+            Point2f(random.nextFloat(), random.nextFloat()));
+        Point3f target = bbox.min + (bbox.max - bbox.min).cwiseProduct(
+            Vector3f(random.nextFloat(), random.nextFloat(), random.nextFloat()));
+        rays.push_back(Ray3f(origin, (target - origin).normalized()));
+    }
+
+    return rays;
+}
+
+/**
+ * \brief Generate coherent primary rays of a pinhole camera looking at the mesh
+ *
+ * The rays are ordered in tiles of 4x4 pixels, so that every packet of 16
+ * consecutive rays covers a compact region of the image.
+ */
+static std::vector<Ray3f> generatePrimaryRays(const BoundingBox3f &bbox, size_t count) {
+    int resolution = std::max(4, (int) std::sqrt((double) count) / 4 * 4);
+    Point3f center = bbox.getCenter();
+    float radius = 0.5f * (bbox.max - bbox.min).norm();
+
+    /* Frame the bounding sphere with a 40 degree field of view */
+    Vector3f forward = -Vector3f(0.36f, 0.48f, 0.8f);
+    Point3f origin = center - forward * (radius / std::sin(degToRad(20.f)));
+    Vector3f right = forward.cross(Vector3f(0.f, 1.f, 0.f)).normalized(),
+             up = right.cross(forward);
+    float scale = std::tan(degToRad(20.f));
+
+    std::vector<Ray3f> rays;
+    rays.reserve((size_t) resolution * resolution);
+    for (int tileY = 0; tileY < resolution; tileY += 4) {
+        for (int tileX = 0; tileX < resolution; tileX += 4) {
+            for (int y = tileY; y < tileY + 4; ++y) {
+                for (int x = tileX; x < tileX + 4; ++x) {
+                    float sx = (2.f * (x + 0.5f) / resolution - 1.f) * scale,
+                          sy = (1.f - 2.f * (y + 0.5f) / resolution) * scale;
+                    rays.push_back(Ray3f(origin, (forward + sx * right + sy * up).normalized()));
+                }
+            }
+        }
+    }
+
+    return rays;
+}
+
+/**
+ * \brief Compare single rays with packets of 16 rays and ray streams on
+ * coherent primary rays
+ *
+ * Closest-hit queries compute full intersection records in all modes,
+ * occlusion queries only report whether something was hit. All modes
+ * traverse the same (binary or wide) BVH.
+ */
+static void benchmarkPackets(const char *filename, int width, size_t rayCount) {
+    PropertyList meshProps;
+    meshProps.setString("filename", filename);
+    Mesh *mesh = static_cast<Mesh *>(NoriObjectFactory::createInstance("obj", meshProps));
+
+    PropertyList props;
+    props.setInteger("width", width);
+    Accel accel(props);
+    accel.addMesh(mesh);
+    accel.build();
+
+    std::vector<Ray3f> rays = generatePrimaryRays(accel.getBoundingBox(), rayCount);
+    RayStream stream;
+    stream.reserve(rays.size());
+    for (const Ray3f &ray : rays)
+        stream.append(ray);
+
+    /* Rays per second and hits of each mode, for closest-hit and occlusion queries */
+    double raysPerSecond[3][2];
+    uint64_t hits[3][2] = { { 0, 0 }, { 0, 0 }, { 0, 0 } };
+
+    for (int shadowRay = 0; shadowRay < 2; ++shadowRay) {
+        Intersection its;
+        Timer timer;
+        for (const Ray3f &ray : rays) {
+            if (shadowRay ? accel.rayOccluded(ray) : accel.rayIntersect(ray, its, false))
+                hits[0][shadowRay]++;
+        }
+        raysPerSecond[0][shadowRay] = rays.size() / (timer.elapsed() * 1e-3);
+
+        timer.reset();
+        RayPacket<16> packet;
+        HitPacket<16> packetHits;
+        for (size_t start = 0; start < rays.size(); start += 16) {
+            packet.size = 0;
+            for (size_t i = start; i < std::min(rays.size(), start + 16); ++i)
+                packet.append(rays[i]);
+            accel.rayIntersectPacket(packet, packetHits, shadowRay != 0);
+            for (int i = 0; i < packet.size; ++i) {
+                if (shadowRay ? packetHits.isValid(i) : accel.getIntersection(packetHits, i, its))
+                    hits[1][shadowRay]++;
+            }
+        }
+        raysPerSecond[1][shadowRay] = rays.size() / (timer.elapsed() * 1e-3);
+
+        timer.reset();
+        RayHits streamHits;
+        accel.rayIntersectStream(stream, streamHits, shadowRay != 0);
+        for (size_t i = 0; i < streamHits.size(); ++i) {
+            if (shadowRay ? streamHits.isValid(i) : accel.getIntersection(streamHits, i, its))
+                hits[2][shadowRay]++;
+        }
+        raysPerSecond[2][shadowRay] = rays.size() / (timer.elapsed() * 1e-3);
+    }
+
+    const char *modes[3] = { "single", "packet16", "stream" };
+    cout << endl << rays.size() << " coherent primary rays (4x4 tiles), width " << width << ":" << endl
+         << std::setw(12) << std::left << "Mode" << std::right
+         << std::setw(16) << "Closest Mrays/s" << std::setw(10) << "Speedup"
+         << std::setw(18) << "Occluded Mrays/s" << std::setw(10) << "Speedup" << endl;
+    for (int i = 0; i < 3; ++i) {
+        cout << std::setw(12) << std::left << modes[i] << std::right << std::fixed
+             << std::setprecision(3) << std::setw(16) << raysPerSecond[i][0] * 1e-6
+             << std::setprecision(2) << std::setw(9) << raysPerSecond[i][0] / raysPerSecond[0][0] << "x"
+             << std::setprecision(3) << std::setw(18) << raysPerSecond[i][1] * 1e-6
+             << std::setprecision(2) << std::setw(9) << raysPerSecond[i][1] / raysPerSecond[0][1] << "x"
+             << endl;
+    }
+
+    for (int i = 1; i < 3; ++i) {
+        if (hits[i][0] != hits[0][0] || hits[i][1] != hits[0][1])
+            cerr << "Warning: packets, streams and single rays report a different number of hits!" << endl;
+    }
+}
+
+/// Closest-hit throughput of a BVH on the given rays (single-threaded)
+static double measureThroughput(const Accel &accel, const std::vector<Ray3f> &rays, uint64_t &hits) {
+    Intersection its;
+    hits = 0;
+    Timer timer;
+    for (const Ray3f &ray : rays) {
+        if (accel.rayIntersect(ray, its, false))
+            hits++;
+    }
+    return rays.size() / (timer.elapsed() * 1e-3);
+}
+
+/**
+ * \brief Compare refitting with rebuilding the BVH of a deforming mesh
+ *
+ * The mesh is twisted around its vertical axis by a growing angle over
+ * a few frames. Every frame, the BVH of the animated mesh is refitted
+ * (see \ref Accel::refit()) while a second copy of the mesh gets a new
+ * BVH, so that the update times and the ray throughput of both trees
+ * can be compared. Refitting falls back to a rebuild once the SAH cost
+ * has grown past the rebuild threshold.
+ */
+static void benchmarkRefit(const char *filename, int width, size_t rayCount, int frameCount) {
+    PropertyList meshProps;
+    meshProps.setString("filename", filename);
+    Mesh *mesh = static_cast<Mesh *>(NoriObjectFactory::createInstance("obj", meshProps));
+
+    PropertyList props;
+    props.setInteger("width", width);
+    Accel accel(props);
+    accel.addMesh(mesh);
+    accel.build();
+
+    const MatrixXf V = mesh->getVertexPositions();
+    const BoundingBox3f bbox = accel.getBoundingBox();
+    const Point3f center = bbox.getCenter();
+    std::vector<Ray3f> rays = generateRays(bbox, rayCount);
+
+    struct Frame {
+        float angle;
+        double refitTime, rebuildTime, refitRaysPerSecond, rebuildRaysPerSecond;
+        bool hitsMatch;
+    };
+    std::vector<Frame> frames;
+
+    for (int i = 1; i <= frameCount; ++i) {
+        Frame frame;
+        frame.angle = 0.5f * i;
+
+        /* Rotate every vertex by an angle that grows linearly with its height */
+        MatrixXf deformed(V.rows(), V.cols());
+        for (n_UINT j = 0; j < (n_UINT) V.cols(); ++j) {
+            Vector3f p = V.col(j) - center.matrix();
+            float height = (p.y() - (bbox.min.y() - center.y())) / bbox.getExtents().y();
+            float phi = frame.angle * height, c = std::cos(phi), s = std::sin(phi);
+            deformed.col(j) = center.matrix() + Vector3f(c * p.x() + s * p.z(), p.y(), -s * p.x() + c * p.z());
+        }
+
+        mesh->setVertexPositions(deformed);
+        Timer timer;
+        accel.refit();
+        frame.refitTime = timer.elapsed();
+
+        Mesh *copy = static_cast<Mesh *>(NoriObjectFactory::createInstance("obj", meshProps));
+        copy->setVertexPositions(deformed);
+        Accel rebuilt(props);
+        rebuilt.addMesh(copy);
+        timer.reset();
+        rebuilt.build();
+        frame.rebuildTime = timer.elapsed();
+
+        uint64_t refitHits, rebuildHits;
+        frame.refitRaysPerSecond = measureThroughput(accel, rays, refitHits);
+        frame.rebuildRaysPerSecond = measureThroughput(rebuilt, rays, rebuildHits);
+        frame.hitsMatch = refitHits == rebuildHits;
+        frames.push_back(frame);
+    }
+
+    cout << endl << "Twisted mesh, " << rays.size() << " rays, width " << width << ":" << endl
+         << std::setw(10) << std::left << "Twist" << std::right
+         << std::setw(12) << "Refit ms" << std::setw(14) << "Rebuild ms"
+         << std::setw(16) << "Refit Mrays/s" << std::setw(18) << "Rebuild Mrays/s" << endl;
+    for (const Frame &frame : frames) {
+        cout << std::setw(10) << std::left << tfm::format("%.1f rad", frame.angle) << std::right
+             << std::fixed << std::setprecision(1)
+             << std::setw(12) << frame.refitTime << std::setw(14) << frame.rebuildTime
+             << std::setprecision(3) << std::setw(16) << frame.refitRaysPerSecond * 1e-6
+             << std::setw(18) << frame.rebuildRaysPerSecond * 1e-6 << endl;
+        if (!frame.hitsMatch)
+            cerr << "Warning: the refitted and the rebuilt BVH report a different number of hits!" << endl;
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        cerr << "Syntax: " << argv[0] << " <mesh.obj> [width (2, 4 or 8)] [ray count]" << endl
+             << endl
+             << "Builds the BVH of the given mesh with the depth-first and the treelet" << endl
+             << "node layout and compares their single-threaded closest-hit throughput" << endl
+             << "and cache behavior (hardware counters are only available on Linux)." << endl
+             << "The layout only affects wide BVHs (width 4 or 8). Afterwards, single" << endl
+             << "rays are compared with ray packets and streams on coherent primary rays," << endl
+             << "and refitting the BVH of a deforming copy of the mesh with rebuilding it." << endl;
+        return -1;
+    }
+
+    int width = argc > 2 ? atoi(argv[2]) : 8;
+    size_t rayCount = argc > 3 ? (size_t) atoll(argv[3]) : 1000000;
+    filesystem::path path(argv[1]);
+    getFileResolver()->prepend(path.parent_path());
+
+    struct Result {
+        std::string layout;
+        double raysPerSecond;
+        uint64_t hits, l1Misses, llcMisses, tlbMisses;
+        bool counters;
+    };
+    std::vector<Result> results;
+    std::vector<Ray3f> rays;
+
+    try {
+        for (const char *layout : { "depthfirst", "treelet" }) {
+            /* The BVH takes ownership of the mesh, so it is loaded again for every layout */
+            PropertyList meshProps;
+            meshProps.setString("filename", argv[1]);
+            Mesh *mesh = static_cast<Mesh *>(NoriObjectFactory::createInstance("obj", meshProps));
+
+            PropertyList props;
+            props.setInteger("width", width);
+            props.setString("layout", layout);
+            Accel accel(props);
+            accel.addMesh(mesh);
+            accel.build();
+
+            if (rays.empty())
+                rays = generateRays(accel.getBoundingBox(), rayCount);
+
+#if defined(__linux__)
+            PerfCounter l1(PERF_TYPE_HW_CACHE, NORI_CACHE_EVENT(L1D)),
+                        llc(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES),
+                        tlb(PERF_TYPE_HW_CACHE, NORI_CACHE_EVENT(DTLB));
+#else
+            PerfCounter l1(0, 0), llc(0, 0), tlb(0, 0);
+#endif
+
+            Result result;
+            result.layout = layout;
+            result.hits = 0;
+            result.counters = l1.isValid() && llc.isValid() && tlb.isValid();
+
+            Timer timer;
+            l1.start(); llc.start(); tlb.start();
+            for (const Ray3f &ray : rays) {
+                Intersection its;
+                if (accel.rayIntersect(ray, its, false))
+                    result.hits++;
+            }
+            result.tlbMisses = tlb.stop();
+            result.llcMisses = llc.stop();
+            result.l1Misses = l1.stop();
+            result.raysPerSecond = rays.size() / (timer.elapsed() * 1e-3);
+            results.push_back(result);
+        }
+    } catch (const std::exception &e) {
+        cerr << "Fatal error: " << e.what() << endl;
+        return -1;
+    }
+
+    cout << endl << rays.size() << " rays, width " << width << ":" << endl
+         << std::setw(12) << std::left << "Layout" << std::right
+         << std::setw(12) << "Mrays/s" << std::setw(16) << "L1D miss/ray"
+         << std::setw(16) << "LLC miss/ray" << std::setw(16) << "dTLB miss/ray" << endl;
+
+    for (const Result &result : results) {
+        cout << std::setw(12) << std::left << result.layout << std::right << std::fixed
+             << std::setprecision(3) << std::setw(12) << result.raysPerSecond * 1e-6;
+        if (result.counters) {
+            cout << std::setprecision(2)
+                 << std::setw(16) << (double) result.l1Misses / rays.size()
+                 << std::setw(16) << (double) result.llcMisses / rays.size()
+                 << std::setw(16) << (double) result.tlbMisses / rays.size();
+        } else {
+            cout << std::setw(16) << "n/a" << std::setw(16) << "n/a" << std::setw(16) << "n/a";
+        }
+        cout << endl;
+    }
+
+    if (results.size() == 2 && results[0].hits != results[1].hits)
+        cerr << "Warning: the layouts report a different number of hits!" << endl;
+
+    try {
+        benchmarkPackets(argv[1], width, rayCount);
+        benchmarkRefit(argv[1], width, rayCount, 4);
+    } catch (const std::exception &e) {
+        cerr << "Fatal error: " << e.what() << endl;
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,223 @@
+/*
+    This file is an extension of Nori, a simple educational ray tracer
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/mesh.h>
+#include <nori/warp.h>
+#include <pcg32.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Vertex cloud that covers the corner cases of the compact encodings
+ *
+ * Positions are spread over a box that is far from the origin and much
+ * thinner along one axis, normals cover the sphere including the axes and
+ * the fold of the octahedral map, and the texture coordinates leave the
+ * unit square. There are no triangles, only the vertex data is tested.
+ */
+class CompactTestMesh : public Mesh {
+public:
+    CompactTestMesh(int vertexCount) {
+        static const float directions[][3] = {
+            { 1, 0, 0 }, { -1, 0, 0 }, { 0, 1, 0 }, { 0, -1, 0 }, { 0, 0, 1 }, { 0, 0, -1 },
+            { 1, 1, 1 }, { -1, 1, 1 }, { 1, -1, 1 }, { -1, -1, 1 },
+            { 1, 1, -1 }, { -1, 1, -1 }, { 1, -1, -1 }, { -1, -1, -1 },
+            { 0.6f, 0.8f, 1e-4f }, { 0.6f, 0.8f, -1e-4f }, { -0.8f, 0.6f, -1e-4f }, { 1e-4f, -1, -1e-4f }
+        };
+        const int directionCount = (int) (sizeof(directions) / sizeof(directions[0]));
+
+        m_name = "synthetic vertex cloud";
+        m_V.resize(3, vertexCount);
+        m_N.resize(3, vertexCount);
+        m_UV.resize(2, vertexCount);
+
+        pcg32 random;
+        for (int i = 0; i < vertexCount; ++i) {
+            Point3f p(-100.0f + 400.0f * random.nextFloat(),
+                      0.5f + random.nextFloat(),
+                      -1000.0f + 100.0f * random.nextFloat());
+            Vector3f n = i < directionCount
+                ? Vector3f(directions[i][0], directions[i][1], directions[i][2]).normalized()
+                : Warp::squareToUniformSphere(Point2f(random.nextFloat(), random.nextFloat()));
+            Point2f uv(-2.0f + 5.0f * random.nextFloat(), random.nextFloat());
+
+            m_V.col(i) = p;
+            m_N.col(i) = n;
+            m_UV.col(i) = uv;
+            m_bbox.expandBy(p);
+        }
+    }
+};
+
+/**
+ * \brief Round-trip test of the compact vertex attribute encodings
+ *
+ * Stores the vertex data of each mesh in compact form (see
+ * \ref Mesh::compactVertexAttributes()) and compares the decoded attributes
+ * against the original floats. Besides the meshes given as children, a
+ * synthetic vertex cloud covering the corner cases of the encodings is
+ * tested. The meshes must not be compacted by their loader, e.g.
+ *
+ * <pre>
+ * &lt;test type="compacttest"&gt;
+ *     &lt;mesh type="obj"&gt;
+ *         &lt;string name="filename" value="bunny.obj"/&gt;
+ *     &lt;/mesh&gt;
+ * &lt;/test&gt;
+ * </pre>
+ */
+class CompactAttributeTest : public NoriObject {
+public:
+    CompactAttributeTest(const PropertyList &propList) {
+        /* Largest position error, relative to the largest extent of the
+           mesh. Quantizing to 21 bits alone is off by at most 2.4e-7. */
+        m_positionTolerance = propList.getFloat("positionTolerance", 1e-6f);
+
+        /* Largest angle between an original and a decoded normal in degrees */
+        m_normalTolerance = propList.getFloat("normalTolerance", 0.01f);
+
+        /* Largest texture coordinate error, relative to the range of the
+           texture coordinates. Quantizing to 16 bits alone is off by at
+           most 7.6e-6. */
+        m_uvTolerance = propList.getFloat("uvTolerance", 1e-5f);
+
+        /* Number of vertices of the synthetic vertex cloud (0: disabled) */
+        m_vertexCount = propList.getInteger("vertexCount", 100000);
+    }
+
+    virtual ~CompactAttributeTest() {
+        for (auto mesh : m_meshes)
+            delete mesh;
+    }
+
+    void addChild(NoriObject *obj, const std::string& name = "none") {
+        switch (obj->getClassType()) {
+            case EMesh:
+                m_meshes.push_back(static_cast<Mesh *>(obj));
+                break;
+
+            default:
+                throw NoriException("CompactAttributeTest::addChild(<%s>) is not supported!",
+                    classTypeName(obj->getClassType()));
+        }
+    }
+
+    /// Compact the vertex data of every mesh and check the decoding errors
+    void activate() {
+        if (m_vertexCount > 0)
+            m_meshes.push_back(new CompactTestMesh(m_vertexCount));
+
+        int total = 0, passed = 0;
+        for (auto mesh : m_meshes) {
+            cout << "------------------------------------------------------" << endl;
+            cout << "Testing mesh \"" << mesh->getName() << "\" ("
+                 << mesh->getVertexCount() << " vertices)" << endl;
+
+            /* Keep copies of the original attributes */
+            MatrixXf V = mesh->getVertexPositions(),
+                     N = mesh->getVertexNormals(),
+                     UV = mesh->getVertexTexCoords();
+            if (V.size() == 0)
+                throw NoriException("CompactAttributeTest: the vertex positions of \"%s\" "
+                    "are already compact!", mesh->getName());
+            n_UINT count = (n_UINT) V.cols();
+
+            mesh->compactVertexAttributes(true);
+
+            if (mesh->getVertexCount() != count || mesh->hasVertexNormals() != (N.size() > 0) ||
+                mesh->hasVertexTexCoords() != (UV.size() > 0)) {
+                cout << "Vertex count or attribute set changed: FAILED" << endl;
+                ++total;
+                continue;
+            }
+
+            float extent = (V.rowwise().maxCoeff() - V.rowwise().minCoeff()).maxCoeff();
+            float positionError = 0;
+            for (n_UINT i = 0; i < count; ++i)
+                positionError = std::max(positionError,
+                    (mesh->getVertexPosition(i) - Point3f(V.col(i))).cwiseAbs().maxCoeff());
+            if (extent > 0)
+                positionError /= extent;
+            passed += check("Positions", positionError, m_positionTolerance);
+            ++total;
+
+            if (N.size() > 0) {
+                float normalError = 0;
+                for (n_UINT i = 0; i < count; ++i) {
+                    Vector3f n = N.col(i);
+                    if (n.squaredNorm() == 0)
+                        continue;
+                    /* More accurate than acos() for small angles */
+                    float chord = (Vector3f(mesh->getVertexNormal(i)) - n.normalized()).norm();
+                    normalError = std::max(normalError,
+                        radToDeg(2.0f * std::asin(std::min(0.5f * chord, 1.0f))));
+                }
+                passed += check("Normals", normalError, m_normalTolerance);
+                ++total;
+            }
+
+            if (UV.size() > 0) {
+                float range = (UV.rowwise().maxCoeff() - UV.rowwise().minCoeff()).maxCoeff();
+                float uvError = 0;
+                for (n_UINT i = 0; i < count; ++i)
+                    uvError = std::max(uvError,
+                        (mesh->getVertexTexCoord(i) - Point2f(UV.col(i))).cwiseAbs().maxCoeff());
+                if (range > 0)
+                    uvError /= range;
+                passed += check("Texture coordinates", uvError, m_uvTolerance);
+                ++total;
+            }
+        }
+
+        cout << "Passed " << passed << "/" << total << " tests." << endl;
+        if (passed < total)
+            throw std::runtime_error("Some tests failed :(");
+    }
+
+    std::string toString() const {
+        return tfm::format(
+            "CompactAttributeTest[\n"
+            "  positionTolerance = %g,\n"
+            "  normalTolerance = %g,\n"
+            "  uvTolerance = %g,\n"
+            "  vertexCount = %i\n"
+            "]",
+            m_positionTolerance,
+            m_normalTolerance,
+            m_uvTolerance,
+            m_vertexCount
+        );
+    }
+
+    EClassType getClassType() const { return ETest; }
+private:
+    /// Print the outcome of a single comparison
+    static bool check(const char *name, float error, float tolerance) {
+        bool success = error <= tolerance;
+        cout << tfm::format("%s: max. error %g (tolerance %g): %s", name, error,
+            tolerance, success ? "passed" : "FAILED") << endl;
+        return success;
+    }
+
+    std::vector<Mesh *> m_meshes;
+    float m_positionTolerance;
+    float m_normalTolerance;
+    float m_uvTolerance;
+    int m_vertexCount;
+};
+
+NORI_REGISTER_CLASS(CompactAttributeTest, "compacttest");
+NORI_NAMESPACE_END
@@ -19,7 +19,6 @@ public:
 
 		//Find the surface that is visible in the request direction
 		Intersection its;
-		Intersection its_sh;
 
 		// If ray does not intersect with scene, assume the bacground
 		if (!scene->rayIntersect(ray, its))
@@ -51,12 +50,10 @@ public:
 		//We create a shadow ray (shadowRay) that starts at the intersection point its.p and goes in the direction of wi
 		Ray3f shadowRay(its.p, wi);
 
-		//shadowRay.maxt is set to the distance between the intersection point its.p and the position of the light source emitterRecord.p, normalized by .norm().
-		shadowRay.maxt = (emitterRecord.p - its.p).norm();
+		//shadowRay.maxt is set to the distance between the intersection point its.p and the position of the light source emitterRecord.p, minus Epsilon so that the emitter itself is not reported as an occluder.
+		shadowRay.maxt = (emitterRecord.p - its.p).norm() - Epsilon;
 
-		bool inter_shadow = scene->rayIntersect(shadowRay, its_sh); //Check if the ray intersect with the scene
-
-		if (inter_shadow && (its_sh.t < emitterRecord.dist)) { // If it intersects, is a shadow
+		if (scene->occluded(shadowRay)) { // If it intersects, is a shadow
 		}
 		else { 
 
@@ -35,7 +35,6 @@ public:
  
         float ems_pdf(1.);
         float ems_wmat_pdf(1.);
-        Intersection its_sh_ems;
         
         float pdflight_ems; //Probablity of choosing a lightsource
 
@@ -56,11 +55,9 @@ public:
         Ray3f shadowRay_ems(its.p, wi_ems, Epsilon, emitterRecord_ems.dist - Epsilon);
 
         //shadowRay.maxt is set to the distance between the intersection point its.p and the position of the light source emitterRecord.p, normalized by .norm().
-        shadowRay_ems.maxt = (emitterRecord_ems.p - its.p).norm();
+        shadowRay_ems.maxt = (emitterRecord_ems.p - its.p).norm() - Epsilon;
 
-        bool inter_shadow_ems = scene->rayIntersect(shadowRay_ems, its_sh_ems); //Comprobamos si el rayo intersecta con scene
-
-        if (inter_shadow_ems && (its_sh_ems.t < (emitterRecord_ems.dist - Epsilon))) { // Si intersecta, es sombra, valor 0
+        if (scene->occluded(shadowRay_ems)) { // Si intersecta, es sombra, valor 0
             Lo_ems(0.);
         }
         else { //En caso contrario, se calcula Lo
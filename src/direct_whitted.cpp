@@ -40,9 +40,13 @@ public:
             // For that, we create a ray object (shadow ray),
             // and compute the intersection
 
-            Ray3f shadow_ray(its.p, emitterRecord.p - its.p);
-            Intersection shadow_its;
-            if (!scene->rayIntersect(shadow_ray,shadow_its))
+            // The segment ends Epsilon before the sampled point, so the
+            // emitter itself is not reported as an occluder.
+            Vector3f toLight = emitterRecord.p - its.p;
+            float dist = toLight.norm();
+            Ray3f shadow_ray(its.p, toLight / dist);
+            shadow_ray.maxt = dist - Epsilon;
+            if (!scene->occluded(shadow_ray))
              {
 
                 BSDFQueryRecord bsdfRecord(
@@ -14,6 +14,7 @@
 
 #include <nori/emitter.h>
 #include <nori/bitmap.h>
+#include <nori/snapshot.h>
 #include <nori/warp.h>
 #include <filesystem/resolver.h>
 #include <fstream>
@@ -32,8 +33,10 @@ public:
 		filesystem::path filename =
 			getFileResolver()->resolve(m_environment_name);
 
+		/* Scene snapshots store the decoded image, the file may not exist */
+		SceneSnapshot *snapshot = SceneSnapshot::getActive();
 		std::ifstream is(filename.str());
-		if (!is.fail())
+		if (!is.fail() || (snapshot && snapshot->hasImage(filename.str())))
 		{
 			cout << "Loading Environment Map: " << filename.str() << endl;
 
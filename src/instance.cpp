@@ -0,0 +1,60 @@
+/*
+    This file is an extension of Nori, a simple educational ray tracer
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/instance.h>
+
+NORI_NAMESPACE_BEGIN
+
+Instance::Instance(const PropertyList &props) {
+    m_toWorld = props.getTransform("toWorld", Transform());
+}
+
+void Instance::addChild(NoriObject *obj, const std::string& name) {
+    switch (obj->getClassType()) {
+        case EMesh:
+            if (m_mesh)
+                throw NoriException("Instance: only a single mesh can be instanced!");
+            m_mesh = static_cast<Mesh *>(obj);
+            break;
+
+        default:
+            throw NoriException("Instance::addChild(<%s>) is not supported!",
+                classTypeName(obj->getClassType()));
+    }
+}
+
+void Instance::activate() {
+    if (!m_mesh)
+        throw NoriException("Instance: no mesh was specified!");
+
+    /* Emitters sample positions on the untransformed mesh */
+    if (m_mesh->isEmitter())
+        throw NoriException("Instance: emissive meshes cannot be instanced!");
+}
+
+std::string Instance::toString() const {
+    return tfm::format(
+        "Instance[\n"
+        "  mesh = \"%s\",\n"
+        "  toWorld = %s\n"
+        "]",
+        m_mesh ? m_mesh->getName() : "null",
+        indent(m_toWorld.toString(), 12)
+    );
+}
+
+NORI_REGISTER_CLASS(Instance, "instance");
+NORI_NAMESPACE_END
@@ -0,0 +1,457 @@
+/*
+    This file is an extension of Nori, a simple educational ray tracer
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/accel.h>
+#include <tbb/tbb.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Builder for BVHs based on Morton codes
+ *
+ * The triangle centroids are quantized to a 1024^3 grid and sorted along
+ * the resulting Z-order curve using a parallel radix sort. The hierarchy
+ * is then created in one of two ways:
+ *
+ * - Linear BVH (<tt>lbvh</tt>): every node splits its range of sorted
+ *   triangles at the highest bit in which their Morton codes differ, as
+ *   described in "Fast BVH Construction on GPUs" by Christian Lauterbach
+ *   et al. (Computer Graphics Forum, 2009).
+ *
+ * - PLOC (<tt>ploc</tt>): clusters are merged bottom-up with their nearest
+ *   neighbor among the adjacent clusters in Morton order, as described in
+ *   "Parallel Locally-Ordered Clustering for Bounding Volume Hierarchy
+ *   Construction" by Daniel Meister and Jiri Bittner (IEEE TVCG, 2018).
+ *
+ * Both produce a binary tree with one triangle per leaf. Its subtrees are
+ * collapsed into leaves wherever that lowers the SAH cost, and the result
+ * is written in the same depth-first layout as the one produced by
+ * \ref BVHBuildTask.
+ */
+class LBVHBuilder {
+public:
+	/// Build-related parameters
+	enum {
+		/// Quantization levels of the centroids along each axis (10 bits)
+		MORTON_GRID_SIZE = 1024,
+
+		/// Maximum number of triangles in a collapsed leaf
+		MAX_LEAF_SIZE = 8,
+
+		/// Create a leaf when the tree gets deeper than this (traversal stacks hold 64 entries)
+		MAX_DEPTH = 48,
+
+		/// Process subtrees with more triangles than this in parallel
+		PARALLEL_THRESHOLD = 4096,
+
+		/// Process triangles in batches of 1K for the purpose of parallelization
+		GRAIN_SIZE = 1000,
+
+		/// Number of keys processed by each task of the radix sort
+		SORT_BLOCK_SIZE = 65536,
+
+		/// Heuristic cost value for traversal operations (same as \ref BVHBuildTask)
+		TRAVERSAL_COST = 1,
+
+		/// Heuristic cost value for intersection operations (same as \ref BVHBuildTask)
+		INTERSECTION_COST = 1
+	};
+
+	/// Node of the intermediate binary tree
+	struct Cluster {
+		BoundingBox3f bbox;
+		/// Child clusters, or the triangle index and \c INVALID for single triangles
+		n_UINT left, right;
+		/// Number of triangles below this cluster
+		n_UINT count;
+		/// SAH cost of the subtree
+		float cost;
+		/// Should the subtree be turned into a single leaf?
+		bool collapse;
+
+		bool isTriangle() const { return right == INVALID; }
+	};
+
+	static const n_UINT INVALID = (n_UINT) -1;
+
+	LBVHBuilder(Accel &bvh, bool clustering, int radius)
+		: bvh(bvh), m_clustering(clustering), m_radius(radius) { }
+
+	/// Build the tree into the \c m_nodes and \c m_indices arrays of the BVH
+	void build() {
+		n_UINT size = bvh.getTriangleCount();
+
+		computeMortonCodes();
+		radixSort();
+
+		/* The first 'size' clusters hold the triangles in Morton order */
+		m_clusters.resize(2 * size - 1);
+		tbb::parallel_for(
+			tbb::blocked_range<n_UINT>(0u, size, GRAIN_SIZE),
+			[&](const tbb::blocked_range<n_UINT> &range) {
+			for (n_UINT i = range.begin(); i != range.end(); ++i) {
+				Cluster &cluster = m_clusters[i];
+				cluster.left = (n_UINT) (m_keys[i] & 0xFFFFFFFFu);
+				cluster.right = INVALID;
+				cluster.bbox = bvh.getBoundingBox(cluster.left);
+				cluster.count = 1;
+				cluster.cost = (float) (TRAVERSAL_COST + INTERSECTION_COST) *
+					cluster.bbox.getSurfaceArea();
+				cluster.collapse = true;
+			}
+		}
+		);
+
+		n_UINT root = m_clustering ? cluster() : split(0, size);
+		m_keys.clear();
+		m_keys.shrink_to_fit();
+
+		/* Conservative estimate for the total number of nodes */
+		bvh.m_nodes.resize(2 * size);
+		memset(bvh.m_nodes.data(), 0, sizeof(Accel::BVHNode) * bvh.m_nodes.size());
+		bvh.m_indices.resize(size);
+
+		emit(root, 0, 0, 0);
+		bvh.compactNodes();
+	}
+
+protected:
+	/// Insert two 0 bits after each of the 10 low bits of \c v
+	static uint32_t expandBits(uint32_t v) {
+		v = (v * 0x00010001u) & 0xFF0000FFu;
+		v = (v * 0x00000101u) & 0x0F00F00Fu;
+		v = (v * 0x00000011u) & 0xC30C30C3u;
+		v = (v * 0x00000005u) & 0x49249249u;
+		return v;
+	}
+
+	/// Return the Morton code stored in the upper half of a sort key
+	uint32_t code(n_UINT i) const {
+		return (uint32_t) (m_keys[i] >> 32);
+	}
+
+	/// Compute a sort key (Morton code, triangle index) for every triangle
+	void computeMortonCodes() {
+		n_UINT size = bvh.getTriangleCount();
+
+		BoundingBox3f centroidBounds = tbb::parallel_reduce(
+			tbb::blocked_range<n_UINT>(0u, size, GRAIN_SIZE),
+			BoundingBox3f(),
+			[&](const tbb::blocked_range<n_UINT> &range, BoundingBox3f result) {
+			for (n_UINT i = range.begin(); i != range.end(); ++i)
+				result.expandBy(bvh.getCentroid(i));
+			return result;
+		},
+			[](const BoundingBox3f &b1, const BoundingBox3f &b2) {
+			return BoundingBox3f::merge(b1, b2);
+		}
+		);
+
+		Vector3f scale;
+		for (int k = 0; k < 3; ++k) {
+			float extent = centroidBounds.max[k] - centroidBounds.min[k];
+			scale[k] = extent > 0 ? MORTON_GRID_SIZE / extent : 0.f;
+		}
+
+		m_keys.resize(size);
+		tbb::parallel_for(
+			tbb::blocked_range<n_UINT>(0u, size, GRAIN_SIZE),
+			[&](const tbb::blocked_range<n_UINT> &range) {
+			for (n_UINT i = range.begin(); i != range.end(); ++i) {
+				Point3f p = bvh.getCentroid(i);
+				uint32_t q[3];
+				for (int k = 0; k < 3; ++k)
+					q[k] = (uint32_t) std::min(std::max(
+						(p[k] - centroidBounds.min[k]) * scale[k], 0.f),
+						(float) (MORTON_GRID_SIZE - 1));
+				uint32_t code = (expandBits(q[0]) << 2) | (expandBits(q[1]) << 1) | expandBits(q[2]);
+				m_keys[i] = ((uint64_t) code << 32) | i;
+			}
+		}
+		);
+	}
+
+	/**
+	 * \brief Sort the keys by their Morton codes
+	 *
+	 * Least significant digit radix sort with 8-bit digits. Every pass
+	 * counts the digits of each block of keys in parallel, computes the
+	 * output offsets of all blocks and then scatters them in parallel.
+	 * The sort is stable, hence equal codes remain ordered by triangle index.
+	 */
+	void radixSort() {
+		size_t size = m_keys.size(),
+		       blockCount = (size + SORT_BLOCK_SIZE - 1) / SORT_BLOCK_SIZE;
+		std::vector<uint64_t> temp(size);
+		std::vector<size_t> offsets(blockCount * 256);
+
+		/* Only the upper 32 bits hold the Morton code */
+		for (int shift = 32; shift < 64; shift += 8) {
+			tbb::parallel_for(size_t(0), blockCount, [&](size_t block) {
+				size_t *count = &offsets[block * 256];
+				memset(count, 0, sizeof(size_t) * 256);
+				for (size_t i = block * SORT_BLOCK_SIZE,
+				            end = std::min(size, i + SORT_BLOCK_SIZE); i < end; ++i)
+					count[(m_keys[i] >> shift) & 0xFF]++;
+			});
+
+			/* Turn the counts into output positions (digit-major order) */
+			size_t sum = 0;
+			for (size_t digit = 0; digit < 256; ++digit) {
+				for (size_t block = 0; block < blockCount; ++block) {
+					size_t count = offsets[block * 256 + digit];
+					offsets[block * 256 + digit] = sum;
+					sum += count;
+				}
+			}
+
+			tbb::parallel_for(size_t(0), blockCount, [&](size_t block) {
+				size_t *offset = &offsets[block * 256];
+				for (size_t i = block * SORT_BLOCK_SIZE,
+				            end = std::min(size, i + SORT_BLOCK_SIZE); i < end; ++i)
+					temp[offset[(m_keys[i] >> shift) & 0xFF]++] = m_keys[i];
+			});
+
+			m_keys.swap(temp);
+		}
+	}
+
+	/// Initialize the cluster \c index as the parent of \c left and \c right
+	void merge(n_UINT index, n_UINT left, n_UINT right) {
+		const Cluster &l = m_clusters[left], &r = m_clusters[right];
+		Cluster &cluster = m_clusters[index];
+		cluster.bbox = BoundingBox3f::merge(l.bbox, r.bbox);
+		cluster.left = left;
+		cluster.right = right;
+		cluster.count = l.count + r.count;
+
+		float area = cluster.bbox.getSurfaceArea();
+		float leafCost = (float) (TRAVERSAL_COST + INTERSECTION_COST * cluster.count) * area;
+		float innerCost = (float) TRAVERSAL_COST * area + l.cost + r.cost;
+		cluster.collapse = cluster.count <= MAX_LEAF_SIZE && leafCost <= innerCost;
+		cluster.cost = cluster.collapse ? leafCost : innerCost;
+	}
+
+	/**
+	 * \brief Recursively build the linear BVH over the sorted triangles
+	 * <tt>[start, end)</tt> and return the index of its root cluster
+	 *
+	 * The inner cluster is stored at the index <tt>size + split - 1</tt>,
+	 * which is unique since every split position is used only once.
+	 */
+	n_UINT split(n_UINT start, n_UINT end) {
+		if (end - start == 1)
+			return start;
+
+		uint32_t first = code(start), last = code(end - 1);
+		n_UINT mid;
+		if (first == last) {
+			/* All codes are the same, split in the middle */
+			mid = start + (end - start) / 2;
+		} else {
+			/* Find the first key that has the highest differing bit set */
+			uint32_t bit = first ^ last;
+			bit |= bit >> 1; bit |= bit >> 2; bit |= bit >> 4;
+			bit |= bit >> 8; bit |= bit >> 16;
+			bit ^= bit >> 1;
+
+			n_UINT lo = start, hi = end - 1;
+			while (lo < hi) {
+				n_UINT m = lo + (hi - lo) / 2;
+				if (code(m) & bit)
+					hi = m;
+				else
+					lo = m + 1;
+			}
+			mid = lo;
+		}
+
+		n_UINT left, right;
+		if (end - start > PARALLEL_THRESHOLD) {
+			tbb::parallel_invoke(
+				[&] { left = split(start, mid); },
+				[&] { right = split(mid, end); }
+			);
+		} else {
+			left = split(start, mid);
+			right = split(mid, end);
+		}
+
+		n_UINT index = (n_UINT) m_keys.size() + mid - 1;
+		merge(index, left, right);
+		return index;
+	}
+
+	/**
+	 * \brief Build the tree by repeatedly merging mutual nearest neighbors
+	 * and return the index of its root cluster
+	 *
+	 * The neighbor search considers the \c m_radius clusters on either
+	 * side in Morton order. The global closest pair is always mutual, so
+	 * every iteration merges at least one pair. The merges are performed
+	 * in order to keep the result deterministic.
+	 */
+	n_UINT cluster() {
+		n_UINT size = (n_UINT) m_keys.size(), next = size, radius = (n_UINT) m_radius;
+		std::vector<n_UINT> current(size), merged, neighbor(size);
+		std::vector<BoundingBox3f> bboxes(size);
+		/* Merged areas of each cluster with the 'radius' following ones */
+		std::vector<float> areas((size_t) size * radius);
+		for (n_UINT i = 0; i < size; ++i)
+			current[i] = i;
+		merged.reserve(size);
+
+		while (current.size() > 1) {
+			n_UINT count = (n_UINT) current.size();
+
+			/* Evaluate every pair of clusters only once */
+			tbb::parallel_for(
+				tbb::blocked_range<n_UINT>(0u, count, GRAIN_SIZE),
+				[&](const tbb::blocked_range<n_UINT> &range) {
+				for (n_UINT i = range.begin(); i != range.end(); ++i)
+					bboxes[i] = m_clusters[current[i]].bbox;
+			}
+			);
+
+			tbb::parallel_for(
+				tbb::blocked_range<n_UINT>(0u, count, GRAIN_SIZE),
+				[&](const tbb::blocked_range<n_UINT> &range) {
+				for (n_UINT i = range.begin(); i != range.end(); ++i) {
+					float *area = &areas[(size_t) i * radius];
+					for (n_UINT k = 1; k <= radius && i + k < count; ++k)
+						area[k - 1] = BoundingBox3f::merge(bboxes[i], bboxes[i + k]).getSurfaceArea();
+				}
+			}
+			);
+
+			tbb::parallel_for(
+				tbb::blocked_range<n_UINT>(0u, count, GRAIN_SIZE),
+				[&](const tbb::blocked_range<n_UINT> &range) {
+				for (n_UINT i = range.begin(); i != range.end(); ++i) {
+					n_UINT best = INVALID;
+					float bestArea = std::numeric_limits<float>::infinity();
+
+					/* Visit the candidates in index order to break ties consistently */
+					for (n_UINT k = std::min(i, radius); k >= 1; --k) {
+						float area = areas[(size_t) (i - k) * radius + k - 1];
+						if (area < bestArea) {
+							bestArea = area;
+							best = i - k;
+						}
+					}
+					for (n_UINT k = 1; k <= radius && i + k < count; ++k) {
+						float area = areas[(size_t) i * radius + k - 1];
+						if (area < bestArea) {
+							bestArea = area;
+							best = i + k;
+						}
+					}
+					neighbor[i] = best;
+				}
+			}
+			);
+
+			merged.clear();
+			for (n_UINT i = 0; i < count; ++i) {
+				n_UINT j = neighbor[i];
+				if (neighbor[j] != i) {
+					merged.push_back(current[i]);
+				} else if (i < j) {
+					merge(next, current[i], current[j]);
+					merged.push_back(next++);
+				}
+			}
+			current.swap(merged);
+		}
+
+		return current[0];
+	}
+
+	/// Write the triangles below the given cluster to \c indices
+	void gather(n_UINT index, n_UINT *indices) const {
+		std::vector<n_UINT> stack(1, index);
+		while (!stack.empty()) {
+			const Cluster &cluster = m_clusters[stack.back()];
+			stack.pop_back();
+			if (cluster.isTriangle()) {
+				*indices++ = cluster.left;
+			} else {
+				stack.push_back(cluster.right);
+				stack.push_back(cluster.left);
+			}
+		}
+	}
+
+	/**
+	 * \brief Create the BVH node \c node_idx for the given cluster, whose
+	 * triangles start at position \c offset of \c m_indices
+	 */
+	void emit(n_UINT index, n_UINT node_idx, n_UINT offset, int depth) {
+		const Cluster &cluster = m_clusters[index];
+		Accel::BVHNode &node = bvh.m_nodes[node_idx];
+		node.bbox = cluster.bbox;
+
+		if (cluster.collapse || depth >= MAX_DEPTH) {
+			node.leaf.flag = 1;
+			node.leaf.start = offset;
+			node.leaf.size = cluster.count;
+			gather(index, bvh.m_indices.data() + offset);
+			return;
+		}
+
+		/* Order the children along the axis that separates them best, so
+		   that traversal can visit the near child first */
+		n_UINT left = cluster.left, right = cluster.right;
+		Point3f cl = m_clusters[left].bbox.getCenter(),
+		        cr = m_clusters[right].bbox.getCenter();
+		int axis = 0;
+		for (int k = 1; k < 3; ++k)
+			if (std::abs(cr[k] - cl[k]) > std::abs(cr[axis] - cl[axis]))
+				axis = k;
+		if (cr[axis] < cl[axis])
+			std::swap(left, right);
+
+		n_UINT left_count = m_clusters[left].count;
+		n_UINT node_idx_left = node_idx + 1;
+		n_UINT node_idx_right = node_idx + 2 * left_count;
+		node.inner.rightChild = node_idx_right;
+		node.inner.axis = axis;
+		node.inner.flag = 0;
+
+		if (cluster.count > PARALLEL_THRESHOLD) {
+			tbb::parallel_invoke(
+				[&] { emit(left, node_idx_left, offset, depth + 1); },
+				[&] { emit(right, node_idx_right, offset + left_count, depth + 1); }
+			);
+		} else {
+			emit(left, node_idx_left, offset, depth + 1);
+			emit(right, node_idx_right, offset + left_count, depth + 1);
+		}
+	}
+
+private:
+	Accel &bvh;
+	bool m_clustering;
+	int m_radius;
+	std::vector<uint64_t> m_keys;
+	std::vector<Cluster> m_clusters;
+};
+
+void Accel::buildLinear() {
+	LBVHBuilder(*this, m_buildMethod == EClustering, m_plocRadius).build();
+}
+
+NORI_NAMESPACE_END
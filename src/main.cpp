@@ -25,6 +25,8 @@
 #include <nori/sampler.h>
 #include <nori/integrator.h>
 #include <nori/gui.h>
+#include <nori/accel.h>
+#include <nori/snapshot.h>
 #include <tbb/parallel_for.h>
 #include <tbb/blocked_range.h>
 #include <tbb/task_scheduler_init.h>
@@ -35,6 +37,9 @@ using namespace nori;
 
 static int threadCount = -1;
 
+/// Side length of the pixel tiles whose primary rays are traced together
+#define NORI_PACKET_TILE_SIZE 4
+
 static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block) {
     const Camera *camera = scene->getCamera();
     const Integrator *integrator = scene->getIntegrator();
@@ -45,6 +50,54 @@ static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block)
     /* Clear the block contents */
     block.clear();
 
+#if !defined(NORI_ACCEL_STATS)
+    /* Generate the primary rays of small tiles of pixels and trace each
+       tile as a stream of ray packets. The integrator then receives the
+       hits via Scene::setPrimaryHit() instead of tracing the rays again.
+       (Builds with traversal statistics keep tracing single rays.) */
+    std::vector<Point2f> pixelSamples;
+    std::vector<Color3f> weights;
+    RayStream rays;
+    RayHits hits;
+
+    for (int ty=0; ty<size.y(); ty += NORI_PACKET_TILE_SIZE) {
+        for (int tx=0; tx<size.x(); tx += NORI_PACKET_TILE_SIZE) {
+            pixelSamples.clear();
+            weights.clear();
+            rays.clear();
+
+            for (int y=ty; y<std::min(ty + NORI_PACKET_TILE_SIZE, size.y()); ++y) {
+                for (int x=tx; x<std::min(tx + NORI_PACKET_TILE_SIZE, size.x()); ++x) {
+                    for (uint32_t i=0; i<sampler->getSampleCount(); ++i) {
+                        Point2f pixelSample = Point2f((float) (x + offset.x()), (float) (y + offset.y())) + sampler->next2D();
+                        Point2f apertureSample = sampler->next2D();
+
+                        /* Sample a ray from the camera */
+                        Ray3f ray;
+                        weights.push_back(camera->sampleRay(ray, pixelSample, apertureSample));
+                        pixelSamples.push_back(pixelSample);
+                        rays.append(ray);
+                    }
+                }
+            }
+
+            scene->rayIntersect(rays, hits);
+
+            for (size_t j=0; j<rays.size(); ++j) {
+                Ray3f ray = rays.get(j);
+                Intersection its;
+                bool hit = scene->getAccel()->getIntersection(hits, j, its);
+                scene->setPrimaryHit(ray, its, hit);
+
+                /* Compute the incident radiance */
+                Color3f value = weights[j] * integrator->Li(scene, sampler, ray);
+
+                /* Store in the image block */
+                block.put(pixelSamples[j], value);
+            }
+        }
+    }
+#else
     /* For each pixel and pixel sample sample */
     for (int y=0; y<size.y(); ++y) {
         for (int x=0; x<size.x(); ++x) {
@@ -64,6 +117,7 @@ static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block)
             }
         }
     }
+#endif
 }
 
 static void render(Scene* scene, const std::string& filename, bool nogui) {
@@ -92,6 +146,7 @@ static void render(Scene* scene, const std::string& filename, bool nogui) {
 
         cout << "Rendering .. ";
         cout.flush();
+        Accel::resetTraversalStatistics();
         Timer timer;
 
         tbb::blocked_range<int> range(0, blockGenerator.getBlockCount());
@@ -128,6 +183,12 @@ static void render(Scene* scene, const std::string& filename, bool nogui) {
         // map(range);
 
         cout << "done. (took " << timer.elapsedString() << ")" << endl;
+
+#if defined(NORI_ACCEL_STATS)
+        TraversalStatistics stats = Accel::getTraversalStatistics();
+        cout << "Traversal statistics: " << stats.toString() << " ("
+             << stats.rays / (timer.elapsed() * 1e3) << " Mrays/s)" << endl;
+#endif
     });
 
     if (!nogui)
@@ -165,11 +226,12 @@ static void render(Scene* scene, const std::string& filename, bool nogui) {
 
 int main(int argc, char **argv) {
     if (argc < 2) {
-        cerr << "Syntax: " << argv[0] << " <scene.xml>" << endl;
+        cerr << "Syntax: " << argv[0] << " [--snapshot] <scene.xml | scene.snapshot>" << endl;
         return -1;
     }
 
     bool nogui = false;
+    bool snapshot = false;
     std::string sceneName = "";
 
     for (int i = 1; i < argc; ++i) {
@@ -190,12 +252,15 @@ int main(int argc, char **argv) {
         }
         else if(token == "--nogui" || token == "-b")
             nogui = true;
+        else if (token == "--snapshot")
+            /* Write a snapshot of the loaded scene instead of rendering it */
+            snapshot = true;
         else
         {
             filesystem::path path(argv[i]);
 
             try {
-                if (path.extension() == "xml") {
+                if (path.extension() == "xml" || path.extension() == "snapshot") {
                     sceneName = argv[i];
 
                     /* Add the parent directory of the scene file to the
@@ -216,7 +281,7 @@ int main(int argc, char **argv) {
                 }
                 else {
                     cerr << "Fatal error: unknown file \"" << argv[1]
-                        << "\", expected an extension of type .xml or .exr" << endl;
+                        << "\", expected an extension of type .xml, .snapshot or .exr" << endl;
                 }
             }
             catch (const std::exception& e) {
@@ -232,11 +297,33 @@ int main(int argc, char **argv) {
 
     if (sceneName != "") {
         try {
-            std::unique_ptr<NoriObject> root(loadFromXML(argv[1]));
+            /* Scene snapshots are consulted by the loading code while they exist */
+            bool fromSnapshot = filesystem::path(sceneName).extension() == "snapshot";
+            if (snapshot && fromSnapshot)
+                throw NoriException("\"%s\" already is a scene snapshot!", sceneName);
+            std::unique_ptr<SceneSnapshot> sceneSnapshot;
+            if (snapshot || fromSnapshot)
+                sceneSnapshot.reset(new SceneSnapshot(sceneName,
+                    fromSnapshot ? SceneSnapshot::ELoad : SceneSnapshot::ECreate));
+
+            std::unique_ptr<NoriObject> root(loadFromXML(sceneName));
+
+            if (snapshot) {
+                if (root->getClassType() != NoriObject::EScene)
+                    throw NoriException("Only scenes can be stored in snapshots!");
+
+                std::string outputName = sceneName;
+                size_t lastdot = outputName.find_last_of(".");
+                if (lastdot != std::string::npos)
+                    outputName.erase(lastdot, std::string::npos);
+                sceneSnapshot->write(outputName + ".snapshot", static_cast<Scene*>(root.get()));
+                return 0;
+            }
+            sceneSnapshot.reset();
 
             /* When the XML root object is a scene, start rendering it .. */
             if (root->getClassType() == NoriObject::EScene)
-                render(static_cast<Scene*>(root.get()), argv[1], nogui);
+                render(static_cast<Scene*>(root.get()), sceneName, nogui);
         }
         catch (const std::exception& e) {
             cerr << "[FATAL ERROR]: " << e.what() << endl;
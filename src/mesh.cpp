@@ -24,8 +24,11 @@
 #include <nori/bbox.h>
 #include <nori/bsdf.h>
 #include <nori/emitter.h>
+#include <nori/texture.h>
 #include <nori/warp.h>
+#include <nori/timer.h>
 #include <Eigen/Geometry>
+#include <tbb/tbb.h>
 
 NORI_NAMESPACE_BEGIN
 
@@ -35,6 +38,7 @@ Mesh::~Mesh() {
     m_pdf.clear();
     delete m_bsdf;
     delete m_emitter;
+    delete m_alpha;
 }
 
 void Mesh::activate() {
@@ -44,9 +48,14 @@ void Mesh::activate() {
             NoriObjectFactory::createInstance("diffuse", PropertyList()));
     }
 
-    m_pdf.reserve(m_F.cols());
+    computeAreaDistribution();
+}
+
+void Mesh::computeAreaDistribution() {
+    m_pdf.clear();
+    m_pdf.reserve(getPrimitiveCount());
 
-    for (n_UINT i = 0; i < m_F.cols(); i++) //Depending on the number of triangles
+    for (n_UINT i = 0; i < getPrimitiveCount(); i++) //Depending on the number of triangles
     {
         float area = surfaceArea(i); //We get the area of the triangle
         m_pdf.append(area); // Append it to the list m_pdf    
@@ -55,16 +64,18 @@ void Mesh::activate() {
 }
 
 float Mesh::surfaceArea(n_UINT index) const {
-    n_UINT i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
+    MatrixXuView F = getIndices();
+    n_UINT i0 = F(0, index), i1 = F(1, index), i2 = F(2, index);
 
-    const Point3f p0 = m_V.col(i0), p1 = m_V.col(i1), p2 = m_V.col(i2);
+    const Point3f p0 = getVertexPosition(i0), p1 = getVertexPosition(i1), p2 = getVertexPosition(i2);
 
     return 0.5f * Vector3f((p1 - p0).cross(p2 - p0)).norm();
 }
 
 bool Mesh::rayIntersect(n_UINT index, const Ray3f &ray, float &u, float &v, float &t) const {
-    n_UINT i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
-    const Point3f p0 = m_V.col(i0), p1 = m_V.col(i1), p2 = m_V.col(i2);
+    MatrixXuView F = getIndices();
+    n_UINT i0 = F(0, index), i1 = F(1, index), i2 = F(2, index);
+    const Point3f p0 = getVertexPosition(i0), p1 = getVertexPosition(i1), p2 = getVertexPosition(i2);
 
     /* Find vectors for two edges sharing v[0] */
     Vector3f edge1 = p1 - p0, edge2 = p2 - p0;
@@ -102,17 +113,19 @@ bool Mesh::rayIntersect(n_UINT index, const Ray3f &ray, float &u, float &v, floa
 }
 
 BoundingBox3f Mesh::getBoundingBox(n_UINT index) const {
-    BoundingBox3f result(m_V.col(m_F(0, index)));
-    result.expandBy(m_V.col(m_F(1, index)));
-    result.expandBy(m_V.col(m_F(2, index)));
+    MatrixXuView F = getIndices();
+    BoundingBox3f result(getVertexPosition(F(0, index)));
+    result.expandBy(getVertexPosition(F(1, index)));
+    result.expandBy(getVertexPosition(F(2, index)));
     return result;
 }
 
 Point3f Mesh::getCentroid(n_UINT index) const {
+    MatrixXuView F = getIndices();
     return (1.0f / 3.0f) *
-        (m_V.col(m_F(0, index)) +
-         m_V.col(m_F(1, index)) +
-         m_V.col(m_F(2, index)));
+        (getVertexPosition(F(0, index)) +
+         getVertexPosition(F(1, index)) +
+         getVertexPosition(F(2, index)));
 }
 
 /**
@@ -123,13 +136,14 @@ void Mesh::samplePosition(const Point2f &sample, Point3f &p, Normal3f &n, Point2
 {
     auto randomSmpl = sample;
     size_t triangle_index = m_pdf.sampleReuse(randomSmpl[0]);   
+    MatrixXuView F = getIndices();
 	// Index of the vertices of the triangle
-    n_UINT i0 = m_F(0, triangle_index), i1 = m_F(1, triangle_index), i2 = m_F(2, triangle_index);
+    n_UINT i0 = F(0, triangle_index), i1 = F(1, triangle_index), i2 = F(2, triangle_index);
 
     // Positions of the vertices of the triangle
-    const Point3f v0 = m_V.col(i0);
-    const Point3f v1 = m_V.col(i1);
-    const Point3f v2 = m_V.col(i2);
+    const Point3f v0 = getVertexPosition(i0);
+    const Point3f v1 = getVertexPosition(i1);
+    const Point3f v2 = getVertexPosition(i2);
 
     // Baricentric coordinates of the sample
     Point2f baricentric = Warp::squareToUniformTriangle(randomSmpl);
@@ -140,11 +154,11 @@ void Mesh::samplePosition(const Point2f &sample, Point3f &p, Normal3f &n, Point2
     // Interpolate the position to the triangle 
     p = b0 * v0 + b1 * v1 + b2 * v2;
 
-    if (m_N.size() > 0) {
+    if (hasVertexNormals()) {
 		// Interpolate the normal (using normals in the vertices)
-        const Normal3f n0 = m_N.col(0);
-        const Normal3f n1 = m_N.col(1);
-        const Normal3f n2 = m_N.col(2);
+        const Normal3f n0 = getVertexNormal(i0);
+        const Normal3f n1 = getVertexNormal(i1);
+        const Normal3f n2 = getVertexNormal(i2);
         n = b0 * n0 + b1 * n1 + b2 * n2;
 	}
 	else {
@@ -154,10 +168,10 @@ void Mesh::samplePosition(const Point2f &sample, Point3f &p, Normal3f &n, Point2
     n.normalize();
 
     // Interpolate coordinates UV, checking if the mesh has UV coordinates
-    if (m_UV.size() > 0) {
-        Point2f uv0 = m_UV.col(0);
-        Point2f uv1 = m_UV.col(1);
-        Point2f uv2 = m_UV.col(2);
+    if (hasVertexTexCoords()) {
+        Point2f uv0 = getVertexTexCoord(i0);
+        Point2f uv1 = getVertexTexCoord(i1);
+        Point2f uv2 = getVertexTexCoord(i2);
         uv = b0 * uv0 + b1 * uv1 + b2 * uv2;
     }
     else {
@@ -165,6 +179,280 @@ void Mesh::samplePosition(const Point2f &sample, Point3f &p, Normal3f &n, Point2
     }
 }
 
+void Mesh::setVertexPositions(const MatrixXf &V) {
+    if (V.rows() != 3 || V.cols() != getVertexCount())
+        throw NoriException("Mesh::setVertexPositions(): expected %i vertices, got %i!",
+                            getVertexCount(), V.cols());
+
+    copyMappedBuffers();
+    m_V = V;
+    m_compact.V.clear();
+    m_compact.V.shrink_to_fit();
+    m_bbox.reset();
+    for (n_UINT i = 0; i < m_V.cols(); ++i)
+        m_bbox.expandBy(m_V.col(i));
+
+    /* Deformations change the triangle areas */
+    computeAreaDistribution();
+}
+
+void Mesh::setVertexNormals(const MatrixXf &N) {
+    n_UINT count = hasVertexNormals() ? getVertexCount() : 0;
+    if (N.rows() != 3 || N.cols() != count)
+        throw NoriException("Mesh::setVertexNormals(): expected %i normals, got %i!",
+                            count, N.cols());
+
+    copyMappedBuffers();
+    m_N = N;
+    m_compact.N.clear();
+    m_compact.N.shrink_to_fit();
+}
+
+void Mesh::setMappedBuffers(std::shared_ptr<MemoryMappedFile> file, n_UINT vertexCount, n_UINT triangleCount,
+                            const float *V, const float *N, const float *UV, const uint32_t *F) {
+    m_file = std::move(file);
+    m_mapped.V = V;
+    m_mapped.N = N;
+    m_mapped.UV = UV;
+    m_mapped.F = F;
+    m_mapped.vertexCount = vertexCount;
+    m_mapped.triangleCount = triangleCount;
+
+    m_V.resize(0, 0);
+    m_N.resize(0, 0);
+    m_UV.resize(0, 0);
+    m_F.resize(0, 0);
+    m_compact = CompactBuffers();
+}
+
+void Mesh::copyMappedBuffers() {
+    if (!m_file)
+        return;
+
+    m_V = getVertexPositions();
+    m_N = getVertexNormals();
+    m_UV = getVertexTexCoords();
+    m_F = getIndices();
+    m_file.reset();
+    m_mapped = MappedBuffers();
+}
+
+/// Insert two 0 bits after each of the 10 low bits of \c v
+static uint32_t expandBits(uint32_t v) {
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+void Mesh::optimizeLayout() {
+    if (!m_compact.V.empty() || !m_compact.N.empty() || !m_compact.UV.empty())
+        throw NoriException("Mesh::optimizeLayout(): the vertex attributes of \"%s\" "
+                            "are already compact!", m_name);
+
+    cout << "Optimizing the layout of \"" << m_name << "\" .. ";
+    cout.flush();
+    Timer timer;
+
+    copyMappedBuffers();
+    n_UINT triangleCount = getTriangleCount(), vertexCount = getVertexCount();
+    const n_UINT INVALID = (n_UINT) -1;
+
+    /* Sort keys (Morton code of the centroid, triangle index) */
+    Vector3f scale;
+    for (int k = 0; k < 3; ++k) {
+        float extent = m_bbox.max[k] - m_bbox.min[k];
+        scale[k] = extent > 0 ? 1024.0f / extent : 0.0f;
+    }
+
+    std::vector<uint64_t> keys(triangleCount);
+    tbb::parallel_for(
+        tbb::blocked_range<n_UINT>(0u, triangleCount, 16384),
+        [&](const tbb::blocked_range<n_UINT> &range) {
+            for (n_UINT i = range.begin(); i != range.end(); ++i) {
+                Point3f p = getCentroid(i);
+                uint32_t q[3];
+                for (int k = 0; k < 3; ++k)
+                    q[k] = (uint32_t) clamp((p[k] - m_bbox.min[k]) * scale[k], 0.0f, 1023.0f);
+                uint32_t code = (expandBits(q[0]) << 2) | (expandBits(q[1]) << 1) | expandBits(q[2]);
+                keys[i] = ((uint64_t) code << 32) | i;
+            }
+        }
+    );
+    tbb::parallel_sort(keys.begin(), keys.end());
+
+    /* Renumber the vertices in the order of their first use (sequential by nature) */
+    MatrixXu F(3, triangleCount);
+    std::vector<n_UINT> newIndex(vertexCount, INVALID), oldIndex;
+    oldIndex.reserve(vertexCount);
+    for (n_UINT i = 0; i < triangleCount; ++i) {
+        n_UINT triangle = (n_UINT) (keys[i] & 0xFFFFFFFFu);
+        for (int j = 0; j < 3; ++j) {
+            n_UINT &vertex = newIndex[m_F(j, triangle)];
+            if (vertex == INVALID) {
+                vertex = (n_UINT) oldIndex.size();
+                oldIndex.push_back(m_F(j, triangle));
+            }
+            F(j, i) = vertex;
+        }
+    }
+
+    /* Unreferenced vertices are dropped */
+    n_UINT usedCount = (n_UINT) oldIndex.size();
+    MatrixXf V(3, usedCount), N(m_N.rows(), m_N.size() > 0 ? usedCount : 0),
+             UV(m_UV.rows(), m_UV.size() > 0 ? usedCount : 0);
+    tbb::parallel_for(
+        tbb::blocked_range<n_UINT>(0u, usedCount, 16384),
+        [&](const tbb::blocked_range<n_UINT> &range) {
+            for (n_UINT i = range.begin(); i != range.end(); ++i) {
+                V.col(i) = m_V.col(oldIndex[i]);
+                if (N.size() > 0)
+                    N.col(i) = m_N.col(oldIndex[i]);
+                if (UV.size() > 0)
+                    UV.col(i) = m_UV.col(oldIndex[i]);
+            }
+        }
+    );
+
+    m_F.swap(F);
+    m_V.swap(V);
+    m_N.swap(N);
+    m_UV.swap(UV);
+
+    cout << "done. (took " << timer.elapsedString();
+    if (usedCount != vertexCount)
+        cout << ", removed " << (vertexCount - usedCount) << " unused vertices";
+    cout << ")" << endl;
+}
+
+uint32_t Mesh::encodeOctahedral(const Vector3f &n) {
+    float norm = std::abs(n.x()) + std::abs(n.y()) + std::abs(n.z());
+    if (norm == 0)
+        return encodeOctahedral(Vector3f(0.0f, 0.0f, 1.0f));
+
+    /* Project onto the octahedron and fold the lower hemisphere over the upper one */
+    float x = n.x() / norm, y = n.y() / norm;
+    if (n.z() < 0) {
+        float x0 = x;
+        x = std::copysign(1.0f - std::abs(y), x0);
+        y = std::copysign(1.0f - std::abs(x0), y);
+    }
+
+    /* Plain rounding can be off by up to twice the optimal error, hence
+       try the four neighboring grid points and keep the best one (comparing
+       distances, as cosines are too close to one to be told apart) */
+    float qx = (x * 0.5f + 0.5f) * 65535.0f, qy = (y * 0.5f + 0.5f) * 65535.0f;
+    Vector3f direction = n.normalized();
+    uint32_t bestCode = 0;
+    float bestDistance = std::numeric_limits<float>::infinity();
+    for (int i = 0; i < 4; ++i) {
+        uint32_t cx = (uint32_t) clamp((i & 1) ? std::ceil(qx) : std::floor(qx), 0.0f, 65535.0f),
+                 cy = (uint32_t) clamp((i & 2) ? std::ceil(qy) : std::floor(qy), 0.0f, 65535.0f),
+                 code = cx | (cy << 16);
+        float distance = (decodeOctahedral(code) - direction).squaredNorm();
+        if (distance < bestDistance) {
+            bestDistance = distance;
+            bestCode = code;
+        }
+    }
+    return bestCode;
+}
+
+void Mesh::compactVertexAttributes(bool positions) {
+    cout << "Compacting the vertex attributes of \"" << m_name << "\" .. ";
+    cout.flush();
+    Timer timer;
+
+    copyMappedBuffers();
+    auto memoryUsage = [&]() {
+        return sizeof(float) * (m_V.size() + m_N.size() + m_UV.size()) +
+               sizeof(uint64_t) * m_compact.V.size() +
+               sizeof(uint32_t) * (m_compact.N.size() + m_compact.UV.size());
+    };
+    size_t memoryBefore = memoryUsage();
+
+    /* Attributes that are already compact are left alone */
+    n_UINT count = getVertexCount();
+    bool compactV = positions && m_V.size() > 0, compactN = m_N.size() > 0, compactUV = m_UV.size() > 0;
+
+    if (compactV) {
+        m_compact.positionOffset = m_bbox.min;
+        m_compact.positionScale = m_bbox.getExtents() / (float) 0x1FFFFF;
+        m_compact.V.resize(count);
+    }
+    if (compactN)
+        m_compact.N.resize(count);
+    if (compactUV) {
+        Vector2f uvMin = m_UV.rowwise().minCoeff(), uvMax = m_UV.rowwise().maxCoeff();
+        m_compact.uvOffset = uvMin;
+        m_compact.uvScale = (uvMax - uvMin) / 65535.0f;
+        m_compact.UV.resize(count);
+    }
+
+    auto quantize = [](float value, float offset, float scale, float maxValue) {
+        return scale > 0 ? (uint64_t) clamp(std::round((value - offset) / scale), 0.0f, maxValue) : 0;
+    };
+
+    /* Encode and measure the largest errors (normal angle, texture coordinate, position) */
+    Vector3f error = tbb::parallel_reduce(
+        tbb::blocked_range<n_UINT>(0u, count, 16384),
+        Vector3f(Vector3f::Zero()),
+        [&](const tbb::blocked_range<n_UINT> &range, Vector3f result) {
+            for (n_UINT i = range.begin(); i != range.end(); ++i) {
+                if (compactV) {
+                    Vector3f p = m_V.col(i);
+                    m_compact.V[i] = quantize(p.x(), m_compact.positionOffset.x(), m_compact.positionScale.x(), (float) 0x1FFFFF) |
+                                     quantize(p.y(), m_compact.positionOffset.y(), m_compact.positionScale.y(), (float) 0x1FFFFF) << 21 |
+                                     quantize(p.z(), m_compact.positionOffset.z(), m_compact.positionScale.z(), (float) 0x1FFFFF) << 42;
+                    result.z() = std::max(result.z(), (getVertexPosition(i) - p).cwiseAbs().maxCoeff());
+                }
+                if (compactN) {
+                    Vector3f n = m_N.col(i);
+                    m_compact.N[i] = encodeOctahedral(n);
+                    if (n.squaredNorm() > 0)
+                        result.x() = std::max(result.x(), radToDeg(2.0f * std::asin(
+                            std::min(0.5f * (getVertexNormal(i) - n.normalized()).norm(), 1.0f))));
+                }
+                if (compactUV) {
+                    Vector2f uv = m_UV.col(i);
+                    m_compact.UV[i] = (uint32_t) (quantize(uv.x(), m_compact.uvOffset.x(), m_compact.uvScale.x(), 65535.0f) |
+                                                  quantize(uv.y(), m_compact.uvOffset.y(), m_compact.uvScale.y(), 65535.0f) << 16);
+                    result.y() = std::max(result.y(), (getVertexTexCoord(i) - uv).cwiseAbs().maxCoeff());
+                }
+            }
+            return result;
+        },
+        [](const Vector3f &a, const Vector3f &b) -> Vector3f {
+            return a.cwiseMax(b);
+        }
+    );
+
+    if (compactV) {
+        m_V.resize(0, 0);
+        m_bbox.reset();
+        for (n_UINT i = 0; i < count; ++i)
+            m_bbox.expandBy(getVertexPosition(i));
+    }
+    if (compactN)
+        m_N.resize(0, 0);
+    if (compactUV)
+        m_UV.resize(0, 0);
+
+    std::string errors;
+    if (compactN)
+        errors += tfm::format(", normals %.3g deg.", error.x());
+    if (compactUV)
+        errors += tfm::format(", texcoords %.3g", error.y());
+    if (compactV)
+        errors += tfm::format(", positions %.3g", error.z());
+    cout << "done. (took " << timer.elapsedString() << ", " << memString(memoryBefore)
+         << " -> " << memString(memoryUsage());
+    if (!errors.empty())
+        cout << ", max. error" << errors.substr(1);
+    cout << ")" << endl;
+}
+
 /// Return the surface area of the given triangle
 float Mesh::pdf(const Point3f &p) const
 {
@@ -190,12 +478,37 @@ void Mesh::addChild(NoriObject *obj, const std::string& name) {
             }
             break;
 
+        case ETexture:
+            if (name != "alpha")
+                throw NoriException("Mesh::addChild(<%s>,%s) is not supported!",
+                                    classTypeName(obj->getClassType()), name);
+            if (m_alpha)
+                throw NoriException(
+                    "Mesh: tried to register multiple opacity masks!");
+            m_alpha = static_cast<Texture *>(obj);
+            break;
+
         default:
             throw NoriException("Mesh::addChild(<%s>) is not supported!",
                                 classTypeName(obj->getClassType()));
     }
 }
 
+bool Mesh::isOpaque(n_UINT index, float u, float v) const {
+    if (!m_alpha)
+        return true;
+
+    Point2f uv(u, v);
+    if (hasVertexTexCoords()) {
+        MatrixXuView F = getIndices();
+        uv = (1 - u - v) * getVertexTexCoord(F(0, index)) +
+             u * getVertexTexCoord(F(1, index)) +
+             v * getVertexTexCoord(F(2, index));
+    }
+
+    return m_alpha->eval(uv).getLuminance() >= 0.5f;
+}
+
 std::string Mesh::toString() const {
     return tfm::format(
         "Mesh[\n"
@@ -203,13 +516,15 @@ std::string Mesh::toString() const {
         "  vertexCount = %i,\n"
         "  triangleCount = %i,\n"
         "  bsdf = %s,\n"
-        "  emitter = %s\n"
+        "  emitter = %s,\n"
+        "  alpha = %s\n"
         "]",
         m_name,
-        m_V.cols(),
-        m_F.cols(),
+        getVertexCount(),
+        getTriangleCount(),
         m_bsdf ? indent(m_bsdf->toString()) : std::string("null"),
-        m_emitter ? indent(m_emitter->toString()) : std::string("null")
+        m_emitter ? indent(m_emitter->toString()) : std::string("null"),
+        m_alpha ? indent(m_alpha->toString()) : std::string("null")
     );
 }
 
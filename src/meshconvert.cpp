@@ -0,0 +1,53 @@
+/*
+    This file is an extension of Nori, a simple educational ray tracer
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/binarymesh.h>
+#include <nori/timer.h>
+#include <filesystem/resolver.h>
+
+using namespace nori;
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        cerr << "Syntax: " << argv[0] << " <input mesh> <output.nmesh>" << endl
+             << endl
+             << "Converts a mesh into the binary mesh format, which Nori loads" << endl
+             << "without parsing (<mesh type=\"nmesh\">). The type of the input" << endl
+             << "is given by its extension." << endl;
+        return -1;
+    }
+
+    try {
+        filesystem::path path(argv[1]);
+        getFileResolver()->prepend(path.parent_path());
+
+        PropertyList props;
+        props.setString("filename", argv[1]);
+        std::unique_ptr<Mesh> mesh(static_cast<Mesh *>(
+            NoriObjectFactory::createInstance(toLower(path.extension()), props)));
+
+        cout << "Writing \"" << argv[2] << "\" .. ";
+        cout.flush();
+        Timer timer;
+        writeBinaryMesh(mesh.get(), argv[2]);
+        cout << "done. (took " << timer.elapsedString() << ")" << endl;
+    } catch (const std::exception &e) {
+        cerr << "Fatal error: " << e.what() << endl;
+        return -1;
+    }
+
+    return 0;
+}
@@ -17,170 +17,511 @@
 */
 
 #include <nori/mesh.h>
+#include <nori/mmap.h>
 #include <nori/timer.h>
 #include <filesystem/resolver.h>
-#include <unordered_map>
-#include <fstream>
+#include <tbb/tbb.h>
+#include <atomic>
 
 NORI_NAMESPACE_BEGIN
 
 /**
  * \brief Loader for Wavefront OBJ triangle meshes
+ *
+ * The file is memory-mapped and split into chunks of whole lines, which
+ * are parsed in parallel. Face corners referring to the same combination
+ * of position, texture coordinate and normal are merged into one vertex
+ * using a concurrent open-addressing hash table. The vertices are numbered
+ * in the order of their first use, independently of the number of threads.
+ * Polygons with more than three vertices are split into a triangle fan.
+ *
+ * Setting <tt>optimizeLayout</tt> reorders the triangles and vertices for
+ * memory locality (see \ref Mesh::optimizeLayout()). Setting <tt>compact</tt>
+ * stores the normals and texture coordinates in compact form,
+ * <tt>quantizePositions</tt> additionally quantizes the positions (see
+ * \ref Mesh::compactVertexAttributes()).
  */
 class WavefrontOBJ : public Mesh {
 public:
     WavefrontOBJ(const PropertyList &propList) {
-        typedef std::unordered_map<OBJVertex, uint32_t, OBJVertexHash> VertexMap;
-
         filesystem::path filename =
             getFileResolver()->resolve(propList.getString("filename"));
-
-        std::ifstream is(filename.str());
-        if (is.fail())
-            throw NoriException("Unable to open OBJ file \"%s\"!", filename);
         Transform trafo = propList.getTransform("toWorld", Transform());
 
         cout << "Loading \"" << filename << "\" .. ";
         cout.flush();
         Timer timer;
 
-        std::vector<Vector3f>   positions;
-        std::vector<Vector2f>   texcoords;
-        std::vector<Vector3f>   normals;
-        std::vector<uint32_t>   indices;
-        std::vector<OBJVertex>  vertices;
-        VertexMap vertexMap;
-
-        std::string line_str;
-        while (std::getline(is, line_str)) {
-            std::istringstream line(line_str);
-
-            std::string prefix;
-            line >> prefix;
-
-            if (prefix == "v") {
-                Point3f p;
-                line >> p.x() >> p.y() >> p.z();
-                p = trafo * p;
-                m_bbox.expandBy(p);
-                positions.push_back(p);
-            } else if (prefix == "vt") {
-                Point2f tc;
-                line >> tc.x() >> tc.y();
-                texcoords.push_back(tc);
-            } else if (prefix == "vn") {
-                Normal3f n;
-                line >> n.x() >> n.y() >> n.z();
-                normals.push_back((trafo * n).normalized());
-            } else if (prefix == "f") {
-                std::string v1, v2, v3, v4;
-                line >> v1 >> v2 >> v3 >> v4;
-                OBJVertex verts[6];
-                int nVertices = 3;
-
-                verts[0] = OBJVertex(v1);
-                verts[1] = OBJVertex(v2);
-                verts[2] = OBJVertex(v3);
-
-                if (!v4.empty()) {
-                    /* This is a quad, split into two triangles */
-                    verts[3] = OBJVertex(v4);
-                    verts[4] = verts[0];
-                    verts[5] = verts[2];
-                    nVertices = 6;
-                }
-                /* Convert to an indexed vertex list */
-                for (int i=0; i<nVertices; ++i) {
-                    const OBJVertex &v = verts[i];
-                    VertexMap::const_iterator it = vertexMap.find(v);
-                    if (it == vertexMap.end()) {
-                        vertexMap[v] = (uint32_t) vertices.size();
-                        indices.push_back((uint32_t) vertices.size());
-                        vertices.push_back(v);
-                    } else {
-                        indices.push_back(it->second);
-                    }
-                }
-            }
+        MemoryMappedFile file(filename.str());
+        const char *data = (const char *) file.data();
+
+        /* Split the file into chunks ending at a line break */
+        std::vector<const char *> bounds(1, data);
+        for (size_t offset = CHUNK_SIZE; offset < file.size(); offset += CHUNK_SIZE) {
+            const char *end = std::max(bounds.back(), data + offset);
+            end = (const char *) memchr(end, '\n', data + file.size() - end);
+            if (!end)
+                break;
+            bounds.push_back(end + 1);
         }
-        cout << "End reading \"" << filename << "\" .. ";
-
-
-        m_F.resize(3, indices.size()/3);
-        memcpy(m_F.data(), indices.data(), sizeof(uint32_t)*indices.size());
-
-        m_V.resize(3, vertices.size());
-        for (uint32_t i = 0; i < vertices.size(); ++i)
-        {
-          //  cout << "Vertex " << i << " - " << vertices[i].p - 1 << " vs " << positions.size();
-
-            m_V.col(i) = positions.at(vertices[i].p - 1);
+        bounds.push_back(data + file.size());
+
+        std::vector<Chunk> chunks(bounds.size() - 1);
+        tbb::parallel_for(size_t(0), chunks.size(), [&](size_t i) {
+            chunks[i].parse(bounds[i], bounds[i + 1]);
+        });
+
+        /* Offsets of the chunks in the attribute and corner arrays */
+        Counts total;
+        std::vector<Counts> offsets(chunks.size());
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            offsets[i] = total;
+            total.positions += chunks[i].positions;
+            total.texcoords += chunks[i].texcoords;
+            total.normals += chunks[i].normals;
+            total.corners += chunks[i].corners;
         }
 
-        cout << "Passed with vertices \"" << filename << "\" .. ";
+        /* Indices are stored with 31 bits (see RELATIVE) */
+        if (std::max({ total.positions, total.texcoords, total.normals, total.corners }) >= RELATIVE)
+            throw NoriException("OBJ file \"%s\" is too large!", filename);
 
-        if (!normals.empty()) {
-            m_N.resize(3, vertices.size());
-            for (uint32_t i=0; i<vertices.size(); ++i)
-                m_N.col(i) = normals.at(vertices[i].n-1);
-        }
+        MatrixXf positions(3, total.positions), texcoords(2, total.texcoords),
+                 normals(3, total.normals);
+        std::vector<OBJVertex> corners(total.corners);
 
-        cout << "Passed with normals \"" << filename << "\" .. ";
+        /* Gather the attributes and resolve relative and missing indices */
+        tbb::parallel_for(size_t(0), chunks.size(), [&](size_t i) {
+            Chunk &chunk = chunks[i];
+            const Counts &offset = offsets[i];
 
-        if (!texcoords.empty()) {
-            m_UV.resize(2, vertices.size());
-            for (uint32_t i=0; i<vertices.size(); ++i)
-                m_UV.col(i) = texcoords.at(vertices[i].uv-1);
-        }
+            for (size_t j = 0; j < chunk.positions; ++j) {
+                const float *p = &chunk.positionData[3 * j];
+                positions.col(offset.positions + j) = trafo * Point3f(p[0], p[1], p[2]);
+            }
+            for (size_t j = 0; j < chunk.texcoords; ++j) {
+                const float *uv = &chunk.texcoordData[2 * j];
+                texcoords.col(offset.texcoords + j) = Point2f(uv[0], uv[1]);
+            }
+            for (size_t j = 0; j < chunk.normals; ++j) {
+                const float *n = &chunk.normalData[3 * j];
+                normals.col(offset.normals + j) = (trafo * Normal3f(n[0], n[1], n[2])).normalized();
+            }
+
+            for (size_t j = 0; j < chunk.corners; ++j) {
+                OBJVertex v = chunk.cornerData[j];
+                v.p = resolve(v.p, (uint32_t) offset.positions);
+                v.uv = resolve(v.uv, (uint32_t) offset.texcoords);
+                v.n = resolve(v.n, (uint32_t) offset.normals);
+                /* Attributes without data in the file are ignored */
+                if (total.texcoords == 0)
+                    v.uv = INVALID;
+                if (total.normals == 0)
+                    v.n = INVALID;
+                if (v.p >= total.positions || (total.texcoords > 0 && v.uv >= total.texcoords) ||
+                    (total.normals > 0 && v.n >= total.normals))
+                    throw NoriException("Invalid vertex data in OBJ file \"%s\"!", filename);
+                corners[offset.corners + j] = v;
+            }
 
-        cout << "Passed with UVs \"" << filename << "\" .. ";
+            chunk = Chunk();
+        });
+
+        m_bbox = tbb::parallel_reduce(
+            tbb::blocked_range<n_UINT>(0u, (n_UINT) positions.cols(), GRAIN_SIZE),
+            BoundingBox3f(),
+            [&](const tbb::blocked_range<n_UINT> &range, BoundingBox3f result) {
+                for (n_UINT i = range.begin(); i != range.end(); ++i)
+                    result.expandBy(Point3f(positions.col(i)));
+                return result;
+            },
+            [](const BoundingBox3f &a, const BoundingBox3f &b) {
+                return BoundingBox3f::merge(a, b);
+            }
+        );
+
+        /* Convert to an indexed vertex list */
+        std::vector<uint32_t> vertexCorner = mergeVertices(corners);
+
+        m_F.resize(3, corners.size() / 3);
+        m_V.resize(3, vertexCorner.size());
+        if (total.normals > 0)
+            m_N.resize(3, vertexCorner.size());
+        if (total.texcoords > 0)
+            m_UV.resize(2, vertexCorner.size());
+
+        tbb::parallel_for(
+            tbb::blocked_range<size_t>(0, corners.size(), GRAIN_SIZE),
+            [&](const tbb::blocked_range<size_t> &range) {
+                for (size_t i = range.begin(); i != range.end(); ++i)
+                    m_F.data()[i] = corners[i].vertex;
+            }
+        );
+
+        tbb::parallel_for(
+            tbb::blocked_range<size_t>(0, vertexCorner.size(), GRAIN_SIZE),
+            [&](const tbb::blocked_range<size_t> &range) {
+                for (size_t i = range.begin(); i != range.end(); ++i) {
+                    const OBJVertex &v = corners[vertexCorner[i]];
+                    m_V.col(i) = positions.col(v.p);
+                    if (total.normals > 0)
+                        m_N.col(i) = normals.col(v.n);
+                    if (total.texcoords > 0)
+                        m_UV.col(i) = texcoords.col(v.uv);
+                }
+            }
+        );
 
         m_name = filename.str();
+        double seconds = timer.elapsed() * 1e-3;
         cout << "done. (V=" << m_V.cols() << ", F=" << m_F.cols() << ", took "
-             << timer.elapsedString() << " and "
+             << timer.elapsedString() << " at "
+             << memString(seconds > 0 ? (size_t) (file.size() / seconds) : file.size())
+             << "/s and "
              << memString(m_F.size() * sizeof(uint32_t) +
                           sizeof(float) * (m_V.size() + m_N.size() + m_UV.size()))
              << ")" << endl;
+
+        if (propList.getBoolean("optimizeLayout", false))
+            optimizeLayout();
+        if (propList.getBoolean("compact", false))
+            compactVertexAttributes(propList.getBoolean("quantizePositions", false));
     }
 
 protected:
-    /// Vertex indices used by the OBJ format
+    /// Size of the chunks of the file that are parsed in parallel
+    static const size_t CHUNK_SIZE = 4 * 1024 * 1024;
+
+    /// Work items per thread when processing attributes and vertices
+    static const n_UINT GRAIN_SIZE = 16384;
+
+    /// Marks a missing attribute index
+    static const uint32_t INVALID = (uint32_t) -1;
+
+    /**
+     * \brief Marks an index relative to the start of the chunk
+     *
+     * Negative OBJ indices refer to the elements declared before the face,
+     * which the parser only counts within its chunk. The remaining 31 bits
+     * hold the index relative to the first element of the chunk, offset by
+     * \ref RELATIVE_BIAS to be non-negative.
+     */
+    static const uint32_t RELATIVE = 0x80000000u;
+    static const int64_t RELATIVE_BIAS = 0x40000000;
+
+    /// Vertex indices used by the OBJ format (0-based once resolved)
     struct OBJVertex {
-        uint32_t p = (uint32_t) -1;
-        uint32_t n = (uint32_t) -1;
-        uint32_t uv = (uint32_t) -1;
+        uint32_t p = INVALID;
+        uint32_t n = INVALID;
+        uint32_t uv = INVALID;
+        uint32_t vertex = INVALID; ///< Index of the merged vertex
 
-        inline OBJVertex() { }
+        inline bool operator==(const OBJVertex &v) const {
+            return v.p == p && v.n == n && v.uv == uv;
+        }
 
-        inline OBJVertex(const std::string &string) {
-            std::vector<std::string> tokens = tokenize(string, "/", true);
+        inline uint64_t hash() const {
+            uint64_t hash = ((uint64_t) p << 32 | uv) * 0x9E3779B97F4A7C15ull;
+            hash ^= (hash >> 29) ^ ((uint64_t) n * 0xBF58476D1CE4E5B9ull);
+            return hash ^ (hash >> 32);
+        }
+    };
 
-            if (tokens.size() < 1 || tokens.size() > 3)
-                throw NoriException("Invalid vertex data: \"%s\"", string);
+    /// Number of elements of each type
+    struct Counts {
+        uint64_t positions = 0, texcoords = 0, normals = 0, corners = 0;
+    };
 
-            p = toUInt(tokens[0]);
+    /// Contents of a part of the file
+    struct Chunk : Counts {
+        std::vector<float> positionData, texcoordData, normalData;
+        std::vector<OBJVertex> cornerData;
+
+        /// Parse all lines in <tt>[start, end)</tt>
+        void parse(const char *start, const char *end) {
+            std::vector<OBJVertex> polygon;
+
+            for (const char *line = start; line < end; ) {
+                const char *lineEnd = (const char *) memchr(line, '\n', end - line);
+                if (!lineEnd)
+                    lineEnd = end;
+
+                const char *p = skipSpace(line, lineEnd);
+                if (p + 1 < lineEnd && p[0] == 'v' && isSpace(p[1])) {
+                    float values[3];
+                    p = parseFloats(p + 1, lineEnd, values, 3, 3, line);
+                    positionData.insert(positionData.end(), values, values + 3);
+                    positions++;
+                } else if (p + 2 < lineEnd && p[0] == 'v' && p[1] == 't' && isSpace(p[2])) {
+                    float values[2] = { 0.f, 0.f };
+                    p = parseFloats(p + 2, lineEnd, values, 1, 2, line);
+                    texcoordData.insert(texcoordData.end(), values, values + 2);
+                    texcoords++;
+                } else if (p + 2 < lineEnd && p[0] == 'v' && p[1] == 'n' && isSpace(p[2])) {
+                    float values[3];
+                    p = parseFloats(p + 2, lineEnd, values, 3, 3, line);
+                    normalData.insert(normalData.end(), values, values + 3);
+                    normals++;
+                } else if (p + 1 < lineEnd && p[0] == 'f' && isSpace(p[1])) {
+                    polygon.clear();
+                    p = skipSpace(p + 1, lineEnd);
+                    while (p < lineEnd && *p != '#') {
+                        polygon.push_back(parseCorner(p, lineEnd, line));
+                        p = skipSpace(p, lineEnd);
+                    }
+                    if (polygon.size() < 3)
+                        throw NoriException("Invalid vertex data: \"%s\"", std::string(line, lineEnd));
+
+                    /* Split polygons into a triangle fan, quads become
+                       (0, 1, 2) and (3, 0, 2) */
+                    cornerData.insert(cornerData.end(), polygon.begin(), polygon.begin() + 3);
+                    for (size_t i = 3; i < polygon.size(); ++i) {
+                        cornerData.push_back(polygon[i]);
+                        cornerData.push_back(polygon[0]);
+                        cornerData.push_back(polygon[i - 1]);
+                    }
+                }
 
-            if (tokens.size() >= 2 && !tokens[1].empty())
-                uv = toUInt(tokens[1]);
+                line = lineEnd + 1;
+            }
 
-            if (tokens.size() >= 3 && !tokens[2].empty())
-                n = toUInt(tokens[2]);
+            corners = cornerData.size();
         }
 
-        inline bool operator==(const OBJVertex &v) const {
-            return v.p == p && v.n == n && v.uv == uv;
+        /// Parse one <tt>p[/uv[/n]]</tt> face corner (indices relative to the chunk if negative)
+        OBJVertex parseCorner(const char *&p, const char *end, const char *line) const {
+            OBJVertex v;
+            uint32_t *indices[3] = { &v.p, &v.uv, &v.n };
+            uint64_t counts[3] = { positions, texcoords, normals };
+
+            for (int i = 0; i < 3; ++i) {
+                if (i > 0) {
+                    if (p == end || *p != '/')
+                        break;
+                    ++p;
+                    if (i == 1 && p != end && *p == '/')
+                        continue; /* p//n */
+                }
+
+                bool negative = p != end && *p == '-';
+                if (negative)
+                    ++p;
+                uint64_t value = 0;
+                const char *digits = p;
+                while (p != end && *p >= '0' && *p <= '9' && value < RELATIVE)
+                    value = value * 10 + (uint64_t) (*p++ - '0');
+
+                if (p == digits || value == 0 || value > (negative ? (uint64_t) RELATIVE_BIAS : RELATIVE))
+                    throw NoriException("Invalid vertex data: \"%s\"", std::string(line, end));
+
+                *indices[i] = negative ? (RELATIVE | (uint32_t) ((int64_t) (counts[i] - value) + RELATIVE_BIAS))
+                                       : (uint32_t) (value - 1);
+            }
+
+            if (p != end && !isSpace(*p))
+                throw NoriException("Invalid vertex data: \"%s\"", std::string(line, end));
+            return v;
         }
     };
 
-    /// Hash function for OBJVertex
-    struct OBJVertexHash : std::unary_function<OBJVertex, size_t> {
-        std::size_t operator()(const OBJVertex &v) const {
-            size_t hash = std::hash<uint32_t>()(v.p);
-            hash = hash * 37 + std::hash<uint32_t>()(v.uv);
-            hash = hash * 37 + std::hash<uint32_t>()(v.n);
-            return hash;
+    static inline bool isSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\r';
+    }
+
+    static inline const char *skipSpace(const char *p, const char *end) {
+        while (p != end && isSpace(*p))
+            ++p;
+        return p;
+    }
+
+    /**
+     * \brief Parse a floating point number without copying it
+     *
+     * Decimal numbers with up to 19 significant digits and a moderate
+     * exponent are converted exactly to double precision and then rounded.
+     * Everything else (e.g. \c inf or long exponents) falls back to \c strtof().
+     * Returns \c nullptr if the text is not a number.
+     */
+    static const char *parseFloat(const char *p, const char *end, float &value) {
+        static const double powers[] = {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+        };
+
+        const char *start = p;
+        bool negative = false;
+        if (p != end && (*p == '-' || *p == '+'))
+            negative = *p++ == '-';
+
+        uint64_t mantissa = 0;
+        int exponent = 0, digits = 0;
+        bool valid = false, exact = true;
+        for (; p != end && *p >= '0' && *p <= '9'; ++p, valid = true) {
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (uint64_t) (*p - '0');
+                digits += mantissa != 0;
+            } else {
+                exponent++;
+                exact = false;
+            }
+        }
+        if (p != end && *p == '.') {
+            for (++p; p != end && *p >= '0' && *p <= '9'; ++p, valid = true) {
+                if (digits < 19) {
+                    mantissa = mantissa * 10 + (uint64_t) (*p - '0');
+                    digits += mantissa != 0;
+                    exponent--;
+                } else {
+                    exact = false;
+                }
+            }
+        }
+        if (valid && p != end && (*p == 'e' || *p == 'E')) {
+            const char *q = p + 1;
+            bool negativeExp = q != end && *q == '-';
+            if (q != end && (*q == '-' || *q == '+'))
+                ++q;
+            int value = 0;
+            const char *expDigits = q;
+            for (; q != end && *q >= '0' && *q <= '9'; ++q)
+                value = std::min(value * 10 + (*q - '0'), 100000);
+            if (q != expDigits) {
+                exponent += negativeExp ? -value : value;
+                p = q;
+            }
+        }
+
+        if (valid && exact && exponent >= -22 && exponent <= 22 && mantissa < (1ull << 53)) {
+            double result = (double) mantissa;
+            result = exponent < 0 ? result / powers[-exponent] : result * powers[exponent];
+            value = (float) (negative ? -result : result);
+            return p;
         }
-    };
+
+        /* Slow path: copy the token, the mapped file is not null-terminated */
+        const char *tokenEnd = start;
+        while (tokenEnd != end && !isSpace(*tokenEnd))
+            ++tokenEnd;
+        char buffer[64];
+        size_t length = std::min((size_t) (tokenEnd - start), sizeof(buffer) - 1);
+        memcpy(buffer, start, length);
+        buffer[length] = '\0';
+
+        char *parsed = nullptr;
+        value = std::strtof(buffer, &parsed);
+        if (parsed == buffer)
+            return nullptr;
+        return start + (parsed - buffer);
+    }
+
+    /// Parse between \c min and \c max numbers, ignoring any further values
+    static const char *parseFloats(const char *p, const char *end, float *values,
+            int min, int max, const char *line) {
+        for (int i = 0; i < max; ++i) {
+            const char *start = skipSpace(p, end);
+            const char *next = start != end ? parseFloat(start, end, values[i]) : nullptr;
+            if (!next || (next != end && !isSpace(*next))) {
+                if (i >= min && (start == end || *start == '#'))
+                    break;
+                throw NoriException("Invalid vertex data: \"%s\"", std::string(line, end));
+            }
+            p = next;
+        }
+        return p;
+    }
+
+    /// Turn a chunk-relative index into a global one (\c INVALID if out of range)
+    static uint32_t resolve(uint32_t index, uint32_t offset) {
+        if (index == INVALID || !(index & RELATIVE))
+            return index;
+        int64_t relative = (int64_t) (index & ~RELATIVE) - RELATIVE_BIAS;
+        return relative < -(int64_t) offset ? INVALID : (uint32_t) (offset + relative);
+    }
+
+    /**
+     * \brief Merge corners with the same indices and number the vertices
+     *
+     * Every corner is inserted into an open-addressing hash table with
+     * linear probing, whose slots are claimed by compare-and-swap and then
+     * lowered to the first corner with the same indices. These first
+     * corners are numbered by a prefix sum, which yields the same vertex
+     * order as a sequential pass over the file. Sets the \c vertex field
+     * of all corners and returns the first corner of each vertex.
+     */
+    static std::vector<uint32_t> mergeVertices(std::vector<OBJVertex> &corners) {
+        size_t size = corners.size(), tableSize = 16;
+        while (tableSize < size + size / 2)
+            tableSize *= 2;
+
+        std::unique_ptr<std::atomic<uint32_t>[]> table(new std::atomic<uint32_t>[tableSize]);
+        tbb::parallel_for(
+            tbb::blocked_range<size_t>(0, tableSize, GRAIN_SIZE),
+            [&](const tbb::blocked_range<size_t> &range) {
+                for (size_t i = range.begin(); i != range.end(); ++i)
+                    table[i].store(INVALID, std::memory_order_relaxed);
+            }
+        );
+
+        /* Insert the corners, the vertex field temporarily holds the slot */
+        tbb::parallel_for(
+            tbb::blocked_range<size_t>(0, size, GRAIN_SIZE),
+            [&](const tbb::blocked_range<size_t> &range) {
+                for (size_t i = range.begin(); i != range.end(); ++i) {
+                    OBJVertex &v = corners[i];
+                    size_t slot = (size_t) v.hash() & (tableSize - 1);
+                    while (true) {
+                        uint32_t entry = table[slot].load(std::memory_order_relaxed);
+                        if (entry == INVALID &&
+                            table[slot].compare_exchange_strong(entry, (uint32_t) i))
+                            break;
+                        if (entry != INVALID && corners[entry] == v) {
+                            while (entry > i && !table[slot].compare_exchange_weak(entry, (uint32_t) i))
+                                ;
+                            break;
+                        }
+                        slot = (slot + 1) & (tableSize - 1);
+                    }
+                    v.vertex = (uint32_t) slot;
+                }
+            }
+        );
+
+        /* Number the first corners of all vertices in parallel blocks */
+        size_t blockCount = (size + GRAIN_SIZE - 1) / GRAIN_SIZE;
+        std::vector<uint32_t> offsets(blockCount + 1, 0u);
+        tbb::parallel_for(size_t(0), blockCount, [&](size_t block) {
+            uint32_t count = 0;
+            for (size_t i = block * GRAIN_SIZE, end = std::min(size, i + GRAIN_SIZE); i < end; ++i)
+                count += table[corners[i].vertex].load(std::memory_order_relaxed) == i;
+            offsets[block + 1] = count;
+        });
+        for (size_t block = 0; block < blockCount; ++block)
+            offsets[block + 1] += offsets[block];
+
+        std::vector<uint32_t> vertexCorner(offsets[blockCount]);
+        tbb::parallel_for(size_t(0), blockCount, [&](size_t block) {
+            uint32_t vertex = offsets[block];
+            for (size_t i = block * GRAIN_SIZE, end = std::min(size, i + GRAIN_SIZE); i < end; ++i) {
+                std::atomic<uint32_t> &entry = table[corners[i].vertex];
+                if (entry.load(std::memory_order_relaxed) == i) {
+                    vertexCorner[vertex] = (uint32_t) i;
+                    /* Replace the corner with the vertex index (marked, as
+                       corner and vertex indices share the value range) */
+                    entry.store(vertex++ | RELATIVE, std::memory_order_relaxed);
+                }
+            }
+        });
+
+        tbb::parallel_for(
+            tbb::blocked_range<size_t>(0, size, GRAIN_SIZE),
+            [&](const tbb::blocked_range<size_t> &range) {
+                for (size_t i = range.begin(); i != range.end(); ++i)
+                    corners[i].vertex = table[corners[i].vertex].load(std::memory_order_relaxed) & ~RELATIVE;
+            }
+        );
+
+        return vertexCorner;
+    }
 };
 
 NORI_REGISTER_CLASS(WavefrontOBJ, "obj");
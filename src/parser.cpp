@@ -18,21 +18,123 @@
 
 #include <nori/parser.h>
 #include <nori/proplist.h>
+#include <nori/snapshot.h>
 #include <Eigen/Geometry>
 #include <pugixml.hpp>
+#include <tbb/task_group.h>
 #include <fstream>
+#include <sstream>
 #include <set>
 
 NORI_NAMESPACE_BEGIN
 
+/**
+ * \brief Stream buffer that lets individual threads write into a string
+ * instead of the console
+ *
+ * Installed in place of the buffer of a stream for its lifetime. Assets that
+ * are loaded in the background redirect their output, which is printed once
+ * the parser reaches them, so that the logs of concurrent loads appear in
+ * document order instead of being interleaved.
+ */
+class LogCapture : public std::streambuf {
+public:
+    LogCapture(std::ostream &os) : m_os(os), m_target(os.rdbuf()) { os.rdbuf(this); }
+    ~LogCapture() { m_os.rdbuf(m_target); }
+
+    /// Redirect the output of the calling thread into \c log (or back to the stream if null)
+    static std::string *redirect(std::string *log) {
+        std::string *previous = m_log;
+        m_log = log;
+        return previous;
+    }
+
+protected:
+    virtual int overflow(int c) {
+        if (c == traits_type::eof())
+            return traits_type::not_eof(c);
+        if (!m_log)
+            return m_target->sputc((char) c);
+        m_log->push_back((char) c);
+        return c;
+    }
+
+    virtual std::streamsize xsputn(const char *s, std::streamsize n) {
+        if (!m_log)
+            return m_target->sputn(s, n);
+        m_log->append(s, (size_t) n);
+        return n;
+    }
+
+    virtual int sync() { return m_log ? 0 : m_target->pubsync(); }
+
+private:
+    std::ostream &m_os;
+    std::streambuf *m_target;
+    static thread_local std::string *m_log;
+};
+
+thread_local std::string *LogCapture::m_log = nullptr;
+
+/**
+ * \brief Object declared in a scene file
+ *
+ * The parser first collects these records for the whole document and
+ * instantiates the objects afterwards. Objects that load a file are
+ * constructed on a task group in the meantime.
+ */
+struct ObjectRecord {
+    pugi::xml_node node;
+    int tag;
+    std::string type;
+    std::string key;              ///< XML declaration of a mesh (if needed)
+    PropertyList propList;
+    std::vector<ObjectRecord *> children;
+    std::vector<std::string> childrenNames;
+
+    bool async = false;           ///< Constructed on the task group?
+    bool instantiated = false;    ///< Children added and activated?
+    NoriObject *object = nullptr;
+    std::exception_ptr error;     ///< Error raised by the asynchronous construction
+    std::string log;              ///< Output of the asynchronous construction
+
+    void construct() {
+        std::string *previous = LogCapture::redirect(&log);
+        try {
+            /* Meshes stored in a scene snapshot are used from there */
+            SceneSnapshot *snapshot = SceneSnapshot::getActive();
+            if (snapshot && tag == NoriObject::EMesh)
+                object = snapshot->createMesh(key);
+            if (!object)
+                object = NoriObjectFactory::createInstance(type, propList);
+            if (snapshot && tag == NoriObject::EMesh)
+                snapshot->addMesh(key, static_cast<Mesh *>(object));
+        } catch (...) {
+            error = std::current_exception();
+        }
+        LogCapture::redirect(previous);
+    }
+};
+
 NoriObject *loadFromXML(const std::string &filename) {
+    /* When loading a scene snapshot, its copy of the scene description is used */
+    SceneSnapshot *snapshot = SceneSnapshot::getActive();
+    std::string document;
+    if (snapshot && snapshot->isLoading())
+        document = snapshot->getDocument();
+
     /* Load the XML file using 'pugi' (a tiny self-contained XML parser implemented in C++) */
     pugi::xml_document doc;
-    pugi::xml_parse_result result = doc.load_file(filename.c_str());
+    pugi::xml_parse_result result = snapshot && snapshot->isLoading()
+        ? doc.load_buffer(document.data(), document.size())
+        : doc.load_file(filename.c_str());
 
     /* Helper function: map a position offset in bytes to a more readable line/column value */
     auto offset = [&](ptrdiff_t pos) -> std::string {
-        std::fstream is(filename);
+        std::unique_ptr<std::istream> stream(document.empty()
+            ? (std::istream *) new std::ifstream(filename)
+            : (std::istream *) new std::istringstream(document));
+        std::istream &is = *stream;
         char buffer[1024];
         int line = 0, linestart = 0, offset = 0;
         while (is.good()) {
@@ -68,6 +170,7 @@ NoriObject *loadFromXML(const std::string &filename) {
         ESampler              = NoriObject::ESampler,
         ETest                 = NoriObject::ETest,
         EReconstructionFilter = NoriObject::EReconstructionFilter,
+        EInstance             = NoriObject::EInstance,
 
         /* Properties */
         EBoolean = NoriObject::EClassTypeCount,
@@ -83,6 +186,7 @@ NoriObject *loadFromXML(const std::string &filename) {
         ERotate,
         EScale,
         ELookAt,
+        EAccel,
 
         EInvalid
     };
@@ -101,6 +205,7 @@ NoriObject *loadFromXML(const std::string &filename) {
     tags["sampler"]    = ESampler;
     tags["rfilter"]    = EReconstructionFilter;
     tags["test"]       = ETest;
+    tags["instance"]   = EInstance;
     tags["boolean"]    = EBoolean;
     tags["integer"]    = EInteger;
     tags["float"]      = EFloat;
@@ -114,6 +219,7 @@ NoriObject *loadFromXML(const std::string &filename) {
     tags["rotate"]     = ERotate;
     tags["scale"]      = EScale;
     tags["lookat"]     = ELookAt;
+    tags["accel"]      = EAccel;
 
     /* Helper function to check if attributes are fully specified */
     auto check_attributes = [&](const pugi::xml_node &node, std::set<std::string> attrs) {
@@ -133,9 +239,15 @@ NoriObject *loadFromXML(const std::string &filename) {
 
     Eigen::Affine3f transform;
 
+    /* Meshes declared within instances, indexed by their XML description */
+    std::map<std::string, ObjectRecord *> instancedMeshes;
+
+    std::vector<std::unique_ptr<ObjectRecord>> records;
+    tbb::task_group tasks;
+
     /* Helper function to parse a Nori XML node (recursive) */
-    std::function<NoriObject *(pugi::xml_node &, PropertyList &, int)> parseTag = [&](
-        pugi::xml_node &node, PropertyList &list, int parentTag) -> NoriObject * {
+    std::function<ObjectRecord *(pugi::xml_node &, PropertyList &, int)> parseTag = [&](
+        pugi::xml_node &node, PropertyList &list, int parentTag) -> ObjectRecord * {
         /* Skip over comments */
         if (node.type() == pugi::node_comment || node.type() == pugi::node_declaration)
             return nullptr;
@@ -157,6 +269,7 @@ NoriObject *loadFromXML(const std::string &filename) {
         bool parentIsObject       = hasParent && parentTag < NoriObject::EClassTypeCount;
         bool currentIsObject      = tag < NoriObject::EClassTypeCount;
         bool parentIsTransform    = parentTag == ETransform;
+        bool parentIsAccel        = parentTag == EAccel;
         bool currentIsTransformOp = tag == ETranslate || tag == ERotate || tag == EScale || tag == ELookAt || tag == EMatrix;
 
         if (!hasParent && !currentIsObject)
@@ -168,20 +281,41 @@ NoriObject *loadFromXML(const std::string &filename) {
                                 "can only contain transform operations (at %s)",
                                 filename,  offset(node.offset_debug()));
 
-        if (hasParent && !parentIsObject && !(parentIsTransform && currentIsTransformOp))
+        if (hasParent && !parentIsObject && !(parentIsTransform && currentIsTransformOp) &&
+                !(parentIsAccel && !currentIsObject))
             throw NoriException("Error while parsing \"%s\": node \"%s\" requires a Nori object as parent (at %s)",
                                 filename, node.name(), offset(node.offset_debug()));
 
+        if (tag == EAccel && parentTag != EScene)
+            throw NoriException("Error while parsing \"%s\": the acceleration structure "
+                                "can only be configured within a scene (at %s)",
+                                filename, offset(node.offset_debug()));
+
+        /* Identical meshes referenced by several instances are only loaded once.
+           Scene snapshots also identify meshes by their declaration */
+        std::string meshKey;
+        if (tag == EMesh && (parentTag == EInstance || snapshot)) {
+            std::ostringstream oss;
+            node.print(oss, "", pugi::format_raw);
+            meshKey = oss.str();
+            auto it = instancedMeshes.find(meshKey);
+            if (parentTag == EInstance && it != instancedMeshes.end())
+                return it->second;
+        }
+
         if (tag == EScene)
             node.append_attribute("type") = "scene";
+        else if (tag == EInstance)
+            node.append_attribute("type") = "instance";
         else if (tag == ETransform)
             transform.setIdentity();
 
         PropertyList propList;
-        std::vector<NoriObject *> children;
+        std::vector<ObjectRecord *> children;
         std::vector<std::string> children_names;
         for (pugi::xml_node &ch: node.children()) {
-            NoriObject *child = parseTag(ch, propList, tag);
+            /* Properties nested in <accel> are forwarded to the enclosing scene */
+            ObjectRecord *child = parseTag(ch, tag == EAccel ? list : propList, tag);
             if (child)
             {
                 children.push_back(child);
@@ -189,36 +323,36 @@ NoriObject *loadFromXML(const std::string &filename) {
             }
         }
 
-        NoriObject *result = nullptr;
+        ObjectRecord *result = nullptr;
         try {
             if (currentIsObject) {
                 check_attributes(node, { "type" });
 
-                /* This is an object, first instantiate it */
-                result = NoriObjectFactory::createInstance(
-                    node.attribute("type").value(),
-                    propList
-                );
-
-                if (result->getClassType() != (int) tag) {
-                    throw NoriException(
-                        "Unexpectedly constructed an object "
-                        "of type <%s> (expected type <%s>): %s",
-                        NoriObject::classTypeName(result->getClassType()),
-                        NoriObject::classTypeName((NoriObject::EClassType) tag),
-                        result->toString());
+                /* Let the scene know where it was loaded from */
+                if (tag == EScene)
+                    propList.setString("filename", filename);
+
+                /* This is an object, record it for instantiation */
+                records.emplace_back(new ObjectRecord());
+                result = records.back().get();
+                result->node = node;
+                result->tag = tag;
+                result->type = node.attribute("type").value();
+                result->key = meshKey;
+                result->propList = propList;
+                result->children = std::move(children);
+                result->childrenNames = std::move(children_names);
+
+                /* Meshes, textures and emitters that load a file are constructed
+                   in the background while the rest of the document is parsed */
+                if ((tag == EMesh || tag == ETexture || tag == EEmitter) &&
+                        !propList.getString("filename", "").empty()) {
+                    result->async = true;
+                    tasks.run([result] { result->construct(); });
                 }
 
-                /* Add all children */
-                unsigned int i = 0;
-                for (auto ch: children) {
-                    result->addChild(ch, children_names[i]);
-                    ++i;
-                    ch->setParent(result);
-                }
-
-                /* Activate / configure the object */
-                result->activate();
+                if (tag == EMesh && parentTag == EInstance)
+                    instancedMeshes[meshKey] = result;
             } else {
                 /* This is a property */
                 switch (tag) {
@@ -311,6 +445,12 @@ NoriObject *loadFromXML(const std::string &filename) {
                         }
                         break;
 
+                    case EAccel: {
+                            check_attributes(node, { "type" });
+                            list.setString("accel", node.attribute("type").value());
+                        }
+                        break;
+
                     default: throw NoriException("Unhandled element \"%s\"", node.name());
                 };
             }
@@ -322,8 +462,76 @@ NoriObject *loadFromXML(const std::string &filename) {
         return result;
     };
 
-    PropertyList list;
-    return parseTag(*doc.begin(), list, EInvalid);
+    /* Helper function to instantiate a recorded object after its children (recursive) */
+    std::function<NoriObject *(ObjectRecord *)> instantiate = [&](ObjectRecord *record) -> NoriObject * {
+        if (record->instantiated)
+            return record->object;
+
+        for (auto ch: record->children)
+            instantiate(ch);
+
+        NoriObject *result = nullptr;
+        try {
+            if (record->async) {
+                /* Replay the output of the background load in document order */
+                cout << record->log;
+                cout.flush();
+                if (record->error)
+                    std::rethrow_exception(record->error);
+                result = record->object;
+            } else {
+                result = NoriObjectFactory::createInstance(record->type, record->propList);
+            }
+
+            if (result->getClassType() != record->tag) {
+                throw NoriException(
+                    "Unexpectedly constructed an object "
+                    "of type <%s> (expected type <%s>): %s",
+                    NoriObject::classTypeName(result->getClassType()),
+                    NoriObject::classTypeName((NoriObject::EClassType) record->tag),
+                    result->toString());
+            }
+
+            /* Add all children */
+            unsigned int i = 0;
+            for (auto ch: record->children) {
+                result->addChild(ch->object, record->childrenNames[i]);
+                ++i;
+                ch->object->setParent(result);
+            }
+
+            /* Activate / configure the object */
+            result->activate();
+        } catch (const NoriException &e) {
+            throw NoriException("Error while parsing \"%s\": %s (at %s)", filename,
+                                e.what(), offset(record->node.offset_debug()));
+        }
+
+        record->object = result;
+        record->instantiated = true;
+        return result;
+    };
+
+    /* Parse the whole document while the assets are loaded. The loads are joined
+       before anything is instantiated, so errors are reported in document order
+       and the scene is only activated once all of its assets are available */
+    ObjectRecord *root = nullptr;
+    {
+        LogCapture capture(std::cout);
+        try {
+            PropertyList list;
+            root = parseTag(*doc.begin(), list, EInvalid);
+        } catch (...) {
+            tasks.cancel();
+            tasks.wait();
+            for (auto &record : records)
+                delete record->object;
+            throw;
+        }
+        tasks.wait();
+    }
+
+    return root ? instantiate(root) : nullptr;
 }
 
 NORI_NAMESPACE_END
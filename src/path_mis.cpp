@@ -68,10 +68,7 @@ public:
 		shadowRay_ems.maxt = (emitterRecord_ems.p - its.p).norm() - Epsilon;
         shadowRay_ems.mint = Epsilon;
 
-		Intersection its_sh_ems;
-		bool inter_shadow_ems = scene->rayIntersect(shadowRay_ems, its_sh_ems); //Check if the ray intersect with the scene
-
-		if (!inter_shadow_ems) { // No occlusion
+		if (!scene->occluded(shadowRay_ems)) { // No occlusion
 
 			BSDFQueryRecord bsdfRecord_ems(its.toLocal(-ray.d), its.toLocal(emitterRecord_ems.wi), its.uv, ESolidAngle);
             float den_ems = pdflight_ems * emitterRecord_ems.pdf; //We check if he denominator is dif from zero, to avoid extra calculations
@@ -61,12 +61,9 @@ public:
 		Ray3f shadowRay(its.p, wi);
 
 		//shadowRay.maxt is set to the distance between the intersection point its.p and the position of the light source emitterRecord.p, normalized by .norm().
-		shadowRay.maxt = (emitterRecord.p - its.p).norm();
+		shadowRay.maxt = (emitterRecord.p - its.p).norm() - Epsilon;
 
-		Intersection its_sh;
-		bool inter_shadow = scene->rayIntersect(shadowRay, its_sh); //Check if the ray intersect with the scene
-
-		if (!inter_shadow && (its_sh.t < emitterRecord.dist)) { // No occlusion
+		if (!scene->occluded(shadowRay)) { // No occlusion
 
 			BSDFQueryRecord bsdfRecord(its.toLocal(-ray.d), its.toLocal(emitterRecord.wi), its.uv, ESolidAngle);
 
@@ -0,0 +1,513 @@
+/*
+    This file is an extension of Nori, a simple educational ray tracer
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/mesh.h>
+#include <nori/mmap.h>
+#include <nori/timer.h>
+#include <filesystem/resolver.h>
+#include <tbb/tbb.h>
+#include <atomic>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Loader for Stanford PLY triangle meshes
+ *
+ * Supports ASCII as well as binary little- and big-endian files. The
+ * <tt>vertex</tt> element provides the positions (<tt>x</tt>, <tt>y</tt>,
+ * <tt>z</tt>), and optionally normals (<tt>nx</tt>, <tt>ny</tt>, <tt>nz</tt>)
+ * and texture coordinates (<tt>u</tt>/<tt>s</tt>/<tt>texture_u</tt>/<tt>texture_s</tt>
+ * and <tt>v</tt>/<tt>t</tt>/<tt>texture_v</tt>/<tt>texture_t</tt>), all other
+ * properties and elements are skipped. Polygons of the <tt>face</tt> element
+ * (list property <tt>vertex_indices</tt> or <tt>vertex_index</tt>) are split
+ * into triangle fans.
+ *
+ * The elements are split into blocks of records that are decoded in
+ * parallel, directly into the vertex and index matrices. Fixed-size
+ * binary records are located arithmetically, otherwise a sequential pass
+ * over the list lengths finds the start of every block.
+ *
+ * Setting <tt>optimizeLayout</tt> reorders the triangles and vertices for
+ * memory locality (see \ref Mesh::optimizeLayout()). Setting <tt>compact</tt>
+ * stores the normals and texture coordinates in compact form,
+ * <tt>quantizePositions</tt> additionally quantizes the positions (see
+ * \ref Mesh::compactVertexAttributes()).
+ */
+class PLYMesh : public Mesh {
+public:
+    PLYMesh(const PropertyList &propList) {
+        filesystem::path filename =
+            getFileResolver()->resolve(propList.getString("filename"));
+        Transform trafo = propList.getTransform("toWorld", Transform());
+
+        cout << "Loading \"" << filename << "\" .. ";
+        cout.flush();
+        Timer timer;
+
+        MemoryMappedFile file(filename.str());
+        const char *data = (const char *) file.data(), *end = data + file.size();
+
+        std::vector<Element> elements;
+        const char *body = parseHeader(data, end, elements, filename.str());
+
+        /* ASCII data is copied to have a null-terminated string for strtod() */
+        std::string text;
+        if (m_format == EASCII) {
+            text.assign(body, end);
+            body = text.c_str();
+            end = body + text.size();
+        }
+
+        bool hasVertices = false, hasFaces = false;
+        for (const Element &element : elements) {
+            if (element.name == "vertex" && !hasVertices) {
+                body = readVertices(element, body, end, filename.str());
+                hasVertices = true;
+            } else if (element.name == "face" && !hasFaces) {
+                body = readFaces(element, body, end, filename.str());
+                hasFaces = true;
+            } else {
+                std::vector<Block> blocks;
+                body = scan(element, body, end, -1, blocks, filename.str());
+            }
+        }
+
+        if (!hasVertices || !hasFaces)
+            throw NoriException("PLY file \"%s\" has no vertex or face element!", filename);
+
+        n_UINT maxIndex = tbb::parallel_reduce(
+            tbb::blocked_range<size_t>(0, (size_t) m_F.size(), GRAIN_SIZE), 0u,
+            [&](const tbb::blocked_range<size_t> &range, n_UINT result) {
+                for (size_t i = range.begin(); i != range.end(); ++i)
+                    result = std::max(result, (n_UINT) m_F.data()[i]);
+                return result;
+            },
+            [](n_UINT a, n_UINT b) { return std::max(a, b); }
+        );
+        if (m_F.size() > 0 && maxIndex >= (n_UINT) m_V.cols())
+            throw NoriException("PLY file \"%s\" contains invalid vertex indices!", filename);
+
+        /* Apply the transformation and compute the bounding box */
+        m_bbox = tbb::parallel_reduce(
+            tbb::blocked_range<n_UINT>(0u, (n_UINT) m_V.cols(), GRAIN_SIZE),
+            BoundingBox3f(),
+            [&](const tbb::blocked_range<n_UINT> &range, BoundingBox3f result) {
+                for (n_UINT i = range.begin(); i != range.end(); ++i) {
+                    m_V.col(i) = trafo * Point3f(m_V.col(i));
+                    result.expandBy(Point3f(m_V.col(i)));
+                    if (m_N.size() > 0)
+                        m_N.col(i) = (trafo * Normal3f(m_N.col(i))).normalized();
+                }
+                return result;
+            },
+            [](const BoundingBox3f &a, const BoundingBox3f &b) {
+                return BoundingBox3f::merge(a, b);
+            }
+        );
+
+        m_name = filename.str();
+        double seconds = timer.elapsed() * 1e-3;
+        cout << "done. (V=" << m_V.cols() << ", F=" << m_F.cols() << ", took "
+             << timer.elapsedString() << " at "
+             << memString(seconds > 0 ? (size_t) (file.size() / seconds) : file.size())
+             << "/s and "
+             << memString(m_F.size() * sizeof(uint32_t) +
+                          sizeof(float) * (m_V.size() + m_N.size() + m_UV.size()))
+             << ")" << endl;
+
+        if (propList.getBoolean("optimizeLayout", false))
+            optimizeLayout();
+        if (propList.getBoolean("compact", false))
+            compactVertexAttributes(propList.getBoolean("quantizePositions", false));
+    }
+
+protected:
+    enum EFormat {
+        EASCII = 0,
+        EBinaryLittleEndian,
+        EBinaryBigEndian
+    };
+
+    enum EType {
+        EInt8 = 0, EUInt8, EInt16, EUInt16, EInt32, EUInt32, EFloat32, EFloat64, ETypeCount
+    };
+
+    /// Records per block that is decoded in parallel
+    static const size_t BLOCK_SIZE = 16384;
+
+    /// Vertices per task when transforming the positions
+    static const n_UINT GRAIN_SIZE = 16384;
+
+    struct Property {
+        std::string name;
+        EType type;
+        EType countType;   ///< Type of the length of list properties
+        bool list = false;
+    };
+
+    struct Element {
+        std::string name;
+        size_t count = 0;
+        std::vector<Property> properties;
+        size_t stride = 0; ///< Size of binary records (0 if they contain lists)
+    };
+
+    /// Start of a block of records
+    struct Block {
+        const char *start;
+        size_t triangle;   ///< Number of triangles in the previous blocks
+    };
+
+    static size_t typeSize(EType type) {
+        const size_t sizes[] = { 1, 1, 2, 2, 4, 4, 4, 8 };
+        return sizes[type];
+    }
+
+    static EType parseType(const std::string &name, const std::string &filename) {
+        const char *names[][2] = {
+            { "char", "int8" }, { "uchar", "uint8" }, { "short", "int16" },
+            { "ushort", "uint16" }, { "int", "int32" }, { "uint", "uint32" },
+            { "float", "float32" }, { "double", "float64" }
+        };
+        for (int i = 0; i < ETypeCount; ++i) {
+            if (name == names[i][0] || name == names[i][1])
+                return (EType) i;
+        }
+        throw NoriException("PLY file \"%s\": unknown property type \"%s\"!", filename, name);
+    }
+
+    /// Parse the header and return the start of the data
+    const char *parseHeader(const char *data, const char *end, std::vector<Element> &elements,
+                            const std::string &filename) {
+        const char *p = data;
+        bool first = true, format = false;
+
+        while (true) {
+            const char *lineEnd = (const char *) memchr(p, '\n', end - p);
+            if (!lineEnd)
+                throw NoriException("PLY file \"%s\" has an incomplete header!", filename);
+
+            std::istringstream line(std::string(p, lineEnd));
+            p = lineEnd + 1;
+
+            std::string keyword;
+            line >> keyword;
+            if (first) {
+                if (keyword != "ply")
+                    throw NoriException("\"%s\" is not a PLY file!", filename);
+                first = false;
+            } else if (keyword == "format") {
+                std::string name;
+                line >> name;
+                if (name == "ascii")
+                    m_format = EASCII;
+                else if (name == "binary_little_endian")
+                    m_format = EBinaryLittleEndian;
+                else if (name == "binary_big_endian")
+                    m_format = EBinaryBigEndian;
+                else
+                    throw NoriException("PLY file \"%s\": unknown format \"%s\"!", filename, name);
+                format = true;
+            } else if (keyword == "element") {
+                Element element;
+                line >> element.name >> element.count;
+                if (line.fail())
+                    throw NoriException("PLY file \"%s\": invalid element declaration!", filename);
+                elements.push_back(element);
+            } else if (keyword == "property") {
+                if (elements.empty())
+                    throw NoriException("PLY file \"%s\": property without element!", filename);
+                Property property;
+                std::string type;
+                line >> type;
+                if (type == "list") {
+                    std::string countType;
+                    line >> countType >> type;
+                    property.list = true;
+                    property.countType = parseType(countType, filename);
+                }
+                property.type = parseType(type, filename);
+                line >> property.name;
+                elements.back().properties.push_back(property);
+            } else if (keyword == "end_header") {
+                break;
+            }
+            /* Comments and obj_info lines are ignored */
+        }
+
+        if (!format)
+            throw NoriException("PLY file \"%s\" does not specify its format!", filename);
+
+        for (Element &element : elements) {
+            element.stride = 0;
+            for (const Property &property : element.properties) {
+                if (property.list) {
+                    element.stride = 0;
+                    break;
+                }
+                element.stride += typeSize(property.type);
+            }
+        }
+
+        return p;
+    }
+
+    /// Read a scalar of the given type and advance \c p
+    inline double read(const char *&p, EType type) const {
+        if (m_format == EASCII) {
+            char *next;
+            double value = std::strtod(p, &next);
+            if (next == p)
+                throw NoriException("PLY file: invalid or missing ASCII value!");
+            p = next;
+            return value;
+        }
+
+        uint8_t bytes[8];
+        size_t size = typeSize(type);
+        memcpy(bytes, p, size);
+        p += size;
+        if (m_format != NATIVE_FORMAT)
+            std::reverse(bytes, bytes + size);
+
+        switch (type) {
+            case EInt8: return (double) *(const int8_t *) bytes;
+            case EUInt8: return (double) *(const uint8_t *) bytes;
+            case EInt16: { int16_t v; memcpy(&v, bytes, 2); return v; }
+            case EUInt16: { uint16_t v; memcpy(&v, bytes, 2); return v; }
+            case EInt32: { int32_t v; memcpy(&v, bytes, 4); return v; }
+            case EUInt32: { uint32_t v; memcpy(&v, bytes, 4); return v; }
+            case EFloat32: { float v; memcpy(&v, bytes, 4); return v; }
+            default: { double v; memcpy(&v, bytes, 8); return v; }
+        }
+    }
+
+    /// Skip a list of \c count values
+    inline void skip(const char *&p, EType type, size_t count) const {
+        if (m_format == EASCII) {
+            for (size_t i = 0; i < count; ++i)
+                read(p, type);
+        } else {
+            p += count * typeSize(type);
+        }
+    }
+
+    /// Read the length of a list and check it against the end of the data
+    inline size_t readCount(const char *&p, const Property &property, const char *end) const {
+        if (m_format != EASCII && (p > end || typeSize(property.countType) > (size_t) (end - p)))
+            throw NoriException("PLY file: invalid list length!");
+        double count = read(p, property.countType);
+        if (!(count >= 0) || (m_format != EASCII && count * typeSize(property.type) > end - p))
+            throw NoriException("PLY file: invalid list length!");
+        return (size_t) count;
+    }
+
+    /**
+     * \brief Find the start of every block of records of an element
+     *
+     * When \c listIndex refers to a list property, the number of triangles
+     * in the fans of the preceding records is stored along with each block.
+     * Returns the end of the element.
+     */
+    const char *scan(const Element &element, const char *p, const char *end, int listIndex,
+                     std::vector<Block> &blocks, const std::string &filename) const {
+        size_t blockCount = (element.count + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        blocks.resize(blockCount + 1);
+
+        if (m_format != EASCII && element.stride > 0) {
+            if ((uint64_t) element.stride * element.count > (uint64_t) (end - p))
+                throw NoriException("PLY file \"%s\" is truncated!", filename);
+            for (size_t i = 0; i <= blockCount; ++i)
+                blocks[i].start = p + std::min(i * BLOCK_SIZE, element.count) * element.stride;
+            return blocks[blockCount].start;
+        }
+
+        size_t triangles = 0;
+        for (size_t i = 0; i < element.count; ++i) {
+            if (i % BLOCK_SIZE == 0)
+                blocks[i / BLOCK_SIZE] = Block { p, triangles };
+            if (p >= end)
+                throw NoriException("PLY file \"%s\" is truncated!", filename);
+
+            for (size_t j = 0; j < element.properties.size(); ++j) {
+                const Property &property = element.properties[j];
+                if (property.list) {
+                    size_t count = readCount(p, property, end);
+                    if ((int) j == listIndex && count >= 3)
+                        triangles += count - 2;
+                    skip(p, property.type, count);
+                } else {
+                    /* Check every value, so that p never moves past the end */
+                    if (m_format != EASCII && typeSize(property.type) > (size_t) (end - p))
+                        throw NoriException("PLY file \"%s\" is truncated!", filename);
+                    skip(p, property.type, 1);
+                }
+            }
+        }
+
+        if (p > end)
+            throw NoriException("PLY file \"%s\" is truncated!", filename);
+        blocks[blockCount] = Block { p, triangles };
+        return p;
+    }
+
+    /// Decode the vertex element into \c m_V, \c m_N and \c m_UV
+    const char *readVertices(const Element &element, const char *p, const char *end,
+                             const std::string &filename) {
+        /* Destination (matrix and row) of every property */
+        const char *names[][4] = {
+            { "x", nullptr }, { "y", nullptr }, { "z", nullptr },
+            { "nx", nullptr }, { "ny", nullptr }, { "nz", nullptr },
+            { "u", "s", "texture_u", "texture_s" }, { "v", "t", "texture_v", "texture_t" }
+        };
+        std::vector<int> target(element.properties.size(), -1);
+        int found = 0;
+        for (size_t i = 0; i < element.properties.size(); ++i) {
+            const Property &property = element.properties[i];
+            for (int j = 0; j < 8 && !property.list; ++j) {
+                for (int k = 0; k < 4 && names[j][k]; ++k) {
+                    if (property.name == names[j][k] && !(found & (1 << j))) {
+                        target[i] = j;
+                        found |= 1 << j;
+                    }
+                }
+            }
+        }
+
+        if ((found & 7) != 7)
+            throw NoriException("PLY file \"%s\": the vertices have no positions!", filename);
+        if (element.count > (size_t) std::numeric_limits<n_UINT>::max())
+            throw NoriException("PLY file \"%s\" is too large!", filename);
+
+        std::vector<Block> blocks;
+        const char *elementEnd = scan(element, p, end, -1, blocks, filename);
+
+        m_V.resize(3, element.count);
+        if ((found & (7 << 3)) == (7 << 3))
+            m_N.resize(3, element.count);
+        if ((found & (3 << 6)) == (3 << 6))
+            m_UV.resize(2, element.count);
+        float *destinations[] = {
+            m_V.data(), m_V.data() + 1, m_V.data() + 2,
+            m_N.size() ? m_N.data() : nullptr, m_N.size() ? m_N.data() + 1 : nullptr,
+            m_N.size() ? m_N.data() + 2 : nullptr,
+            m_UV.size() ? m_UV.data() : nullptr, m_UV.size() ? m_UV.data() + 1 : nullptr
+        };
+        const size_t strides[] = { 3, 3, 3, 3, 3, 3, 2, 2 };
+
+        tbb::parallel_for(size_t(0), blocks.size() - 1, [&](size_t block) {
+            const char *p = blocks[block].start;
+            for (size_t i = block * BLOCK_SIZE,
+                        end = std::min(element.count, i + BLOCK_SIZE); i < end; ++i) {
+                for (size_t j = 0; j < element.properties.size(); ++j) {
+                    const Property &property = element.properties[j];
+                    if (property.list) {
+                        skip(p, property.type, readCount(p, property, elementEnd));
+                        continue;
+                    }
+                    double value = read(p, property.type);
+                    int k = target[j];
+                    if (k >= 0 && destinations[k])
+                        destinations[k][i * strides[k]] = (float) value;
+                }
+            }
+        });
+
+        return elementEnd;
+    }
+
+    /// Decode the face element into \c m_F
+    const char *readFaces(const Element &element, const char *p, const char *end,
+                          const std::string &filename) {
+        int listIndex = -1;
+        for (size_t i = 0; i < element.properties.size(); ++i) {
+            const Property &property = element.properties[i];
+            if (property.list && (property.name == "vertex_indices" ||
+                                  property.name == "vertex_index"))
+                listIndex = (int) i;
+        }
+        if (listIndex < 0)
+            throw NoriException("PLY file \"%s\": the faces have no vertex indices!", filename);
+
+        std::vector<Block> blocks;
+        const char *elementEnd = scan(element, p, end, listIndex, blocks, filename);
+        size_t triangleCount = blocks.back().triangle;
+        if (triangleCount > (size_t) std::numeric_limits<n_UINT>::max())
+            throw NoriException("PLY file \"%s\" is too large!", filename);
+
+        m_F.resize(3, triangleCount);
+        std::atomic<bool> valid(true);
+
+        tbb::parallel_for(size_t(0), blocks.size() - 1, [&](size_t block) {
+            const char *p = blocks[block].start;
+            uint32_t *f = m_F.data() + 3 * blocks[block].triangle;
+            uint32_t polygon[3];
+
+            for (size_t i = block * BLOCK_SIZE,
+                        end = std::min(element.count, i + BLOCK_SIZE); i < end; ++i) {
+                for (size_t j = 0; j < element.properties.size(); ++j) {
+                    const Property &property = element.properties[j];
+                    if (!property.list) {
+                        skip(p, property.type, 1);
+                        continue;
+                    }
+                    size_t count = readCount(p, property, elementEnd);
+                    if ((int) j != listIndex) {
+                        skip(p, property.type, count);
+                        continue;
+                    }
+
+                    /* Split polygons into a triangle fan, quads become
+                       (0, 1, 2) and (3, 0, 2) */
+                    for (size_t k = 0; k < count; ++k) {
+                        double index = read(p, property.type);
+                        if (!(index >= 0 && index <= (double) std::numeric_limits<uint32_t>::max()))
+                            valid = false;
+                        uint32_t v = (uint32_t) index;
+                        if (count < 3)
+                            continue;
+                        if (k < 3) {
+                            polygon[k] = v;
+                            *f++ = v;
+                        } else {
+                            *f++ = v;
+                            *f++ = polygon[0];
+                            *f++ = polygon[2];
+                            polygon[2] = v;
+                        }
+                    }
+                }
+            }
+        });
+
+        if (!valid)
+            throw NoriException("PLY file \"%s\" contains invalid vertex indices!", filename);
+
+        return elementEnd;
+    }
+
+protected:
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    static const EFormat NATIVE_FORMAT = EBinaryBigEndian;
+#else
+    static const EFormat NATIVE_FORMAT = EBinaryLittleEndian;
+#endif
+
+    EFormat m_format = EASCII;
+};
+
+NORI_REGISTER_CLASS(PLYMesh, "ply");
+NORI_NAMESPACE_END
@@ -0,0 +1,433 @@
+/*
+    This file is an extension of Nori, a simple educational ray tracer
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/accel.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Builder for spatial split BVHs
+ *
+ * In addition to the usual object splits, this builder considers spatial
+ * splits, which partition the space of a node and clip the triangle
+ * references that straddle the split plane. Triangles can hence be
+ * referenced by several leaves, and the children of a node overlap less.
+ *
+ * The used methodology is that described in
+ * "Spatial Splits in Bounding Volume Hierarchies"
+ * by Martin Stich, Heiko Friedrich and Andreas Dietrich (Proc. HPG 2009).
+ * Both kinds of splits are evaluated using binning, and the total number
+ * of references is limited by a duplication budget.
+ *
+ * The tree is built serially and written in the same depth-first layout
+ * as the one produced by \ref BVHBuildTask.
+ */
+class SBVHBuilder {
+public:
+	/// Build-related parameters
+	enum {
+		/// Number of bins used to evaluate object splits
+		OBJECT_BIN_COUNT = 32,
+
+		/// Number of bins used to evaluate spatial splits
+		SPATIAL_BIN_COUNT = 32,
+
+		/// Create a leaf when the tree gets deeper than this (traversal stacks hold 64 entries)
+		MAX_DEPTH = 48,
+
+		/// Heuristic cost value for traversal operations (same as \ref BVHBuildTask)
+		TRAVERSAL_COST = 1,
+
+		/// Heuristic cost value for intersection operations (same as \ref BVHBuildTask)
+		INTERSECTION_COST = 1
+	};
+
+	/**
+	 * Spatial splits are only attempted when the children of the best
+	 * object split overlap by more than this fraction of the root's
+	 * surface area (called alpha in the paper)
+	 */
+	static constexpr float SPATIAL_SPLIT_ALPHA = 1e-5f;
+
+	/// Triangle reference along with its (possibly clipped) bounding box
+	struct Reference {
+		n_UINT prim;
+		BoundingBox3f bbox;
+	};
+
+	SBVHBuilder(Accel &bvh, float duplicationBudget) : bvh(bvh) {
+		n_UINT size = bvh.getTriangleCount();
+		m_maxReferences = (size_t) (size * (1.0 + duplicationBudget));
+		m_referenceCount = size;
+		m_rootArea = bvh.m_bbox.getSurfaceArea();
+	}
+
+	/// Build the tree into the \c m_nodes and \c m_indices arrays of the BVH
+	void build() {
+		n_UINT size = bvh.getTriangleCount();
+
+		std::vector<Reference> refs(size);
+		for (n_UINT i = 0; i < size; ++i) {
+			refs[i].prim = i;
+			refs[i].bbox = bvh.getBoundingBox(i);
+		}
+
+		bvh.m_nodes.clear();
+		bvh.m_indices.clear();
+		bvh.m_nodes.reserve(2 * size);
+		bvh.m_indices.reserve(size);
+
+		buildNode(refs, bvh.m_bbox, 0);
+
+		bvh.m_nodes.shrink_to_fit();
+		bvh.m_indices.shrink_to_fit();
+	}
+
+private:
+	/// Best split found for a node
+	struct Split {
+		float cost = std::numeric_limits<float>::infinity();
+		int axis = -1;
+		/// Bin index of the split plane (the plane lies after this bin)
+		int index = -1;
+		BoundingBox3f bboxLeft, bboxRight;
+	};
+
+	/// Build the subtree over \c refs, returns the index of its root node
+	n_UINT buildNode(std::vector<Reference> &refs, const BoundingBox3f &bbox, int depth) {
+		n_UINT node_idx = (n_UINT) bvh.m_nodes.size();
+		bvh.m_nodes.emplace_back();
+
+		Accel::BVHNode node;
+		memset(&node, 0, sizeof(Accel::BVHNode));
+		node.bbox = bbox;
+
+		n_UINT size = (n_UINT) refs.size();
+		float leafCost = (float) INTERSECTION_COST * size;
+
+		/* Find the best object split */
+		BoundingBox3f centroids;
+		for (const Reference &ref : refs)
+			centroids.expandBy(ref.bbox.getCenter());
+		Split objectSplit = findObjectSplit(refs, bbox, centroids);
+
+		/* Consider a spatial split if the children of the object split overlap */
+		Split spatialSplit;
+		if (objectSplit.axis >= 0 && m_referenceCount < m_maxReferences) {
+			BoundingBox3f overlap = objectSplit.bboxLeft;
+			overlap.clip(objectSplit.bboxRight);
+			if (overlap.isValid() && overlap.getSurfaceArea() > SPATIAL_SPLIT_ALPHA * m_rootArea)
+				spatialSplit = findSpatialSplit(refs, bbox);
+		}
+
+		std::vector<Reference> left, right;
+		BoundingBox3f bboxLeft, bboxRight;
+		bool useSpatial = spatialSplit.cost < objectSplit.cost;
+		float bestCost = std::min(objectSplit.cost, spatialSplit.cost);
+
+		if (bestCost < leafCost && depth < MAX_DEPTH) {
+			if (useSpatial) {
+				performSpatialSplit(refs, spatialSplit, bbox, left, right, bboxLeft, bboxRight);
+
+				/* Unsplitting may have moved all references to one side */
+				if ((left.empty() || right.empty()) && objectSplit.cost < leafCost) {
+					left.clear();
+					right.clear();
+					useSpatial = false;
+				}
+			}
+			if (!useSpatial)
+				performObjectSplit(refs, objectSplit, centroids, left, right, bboxLeft, bboxRight);
+		}
+
+		if (left.empty() || right.empty()) {
+			/* Splitting does not reduce the cost, make a leaf */
+			node.leaf.flag = 1;
+			node.leaf.start = (n_UINT) bvh.m_indices.size();
+			node.leaf.size = size;
+			for (const Reference &ref : refs)
+				bvh.m_indices.push_back(ref.prim);
+			bvh.m_nodes[node_idx] = node;
+			return node_idx;
+		}
+
+		/* Release the parent's references before descending */
+		std::vector<Reference>().swap(refs);
+
+		node.inner.flag = 0;
+		node.inner.axis = useSpatial ? spatialSplit.axis : objectSplit.axis;
+
+		buildNode(left, bboxLeft, depth + 1);
+		node.inner.rightChild = buildNode(right, bboxRight, depth + 1);
+		bvh.m_nodes[node_idx] = node;
+
+		return node_idx;
+	}
+
+	/// Evaluate binned object splits along all three axes
+	Split findObjectSplit(const std::vector<Reference> &refs, const BoundingBox3f &bbox,
+			const BoundingBox3f &centroids) const {
+		Split best;
+		float tri_factor = (float) INTERSECTION_COST / bbox.getSurfaceArea();
+		n_UINT size = (n_UINT) refs.size();
+
+		for (int axis = 0; axis < 3; ++axis) {
+			float min = centroids.min[axis], extent = centroids.max[axis] - min;
+			if (extent <= 0)
+				continue;
+			float inv_bin_size = OBJECT_BIN_COUNT / extent;
+
+			n_UINT counts[OBJECT_BIN_COUNT] = { };
+			BoundingBox3f bins[OBJECT_BIN_COUNT];
+			for (const Reference &ref : refs) {
+				int index = objectBin(ref, axis, min, inv_bin_size);
+				counts[index]++;
+				bins[index].expandBy(ref.bbox);
+			}
+
+			BoundingBox3f bbox_left[OBJECT_BIN_COUNT];
+			bbox_left[0] = bins[0];
+			for (int i = 1; i < OBJECT_BIN_COUNT; ++i) {
+				counts[i] += counts[i - 1];
+				bbox_left[i] = BoundingBox3f::merge(bbox_left[i - 1], bins[i]);
+			}
+
+			BoundingBox3f bbox_right = bins[OBJECT_BIN_COUNT - 1];
+			for (int i = OBJECT_BIN_COUNT - 2; i >= 0; --i) {
+				n_UINT prims_left = counts[i], prims_right = size - counts[i];
+				if (prims_left > 0 && prims_right > 0) {
+					float sah_cost = 2.0f * TRAVERSAL_COST +
+						tri_factor * (prims_left * bbox_left[i].getSurfaceArea() +
+							prims_right * bbox_right.getSurfaceArea());
+					if (sah_cost < best.cost) {
+						best.cost = sah_cost;
+						best.axis = axis;
+						best.index = i;
+						best.bboxLeft = bbox_left[i];
+						best.bboxRight = bbox_right;
+					}
+				}
+				bbox_right = BoundingBox3f::merge(bbox_right, bins[i]);
+			}
+		}
+
+		return best;
+	}
+
+	/// Evaluate binned spatial splits along all three axes
+	Split findSpatialSplit(const std::vector<Reference> &refs, const BoundingBox3f &bbox) const {
+		Split best;
+		float tri_factor = (float) INTERSECTION_COST / bbox.getSurfaceArea();
+		size_t remaining = m_maxReferences - m_referenceCount;
+
+		for (int axis = 0; axis < 3; ++axis) {
+			float min = bbox.min[axis], extent = bbox.max[axis] - min;
+			if (extent <= 0)
+				continue;
+			float bin_size = extent / SPATIAL_BIN_COUNT;
+
+			n_UINT entries[SPATIAL_BIN_COUNT] = { }, exits[SPATIAL_BIN_COUNT] = { };
+			BoundingBox3f bins[SPATIAL_BIN_COUNT];
+
+			/* Chop every reference into the bins that it overlaps */
+			for (const Reference &ref : refs) {
+				int first = spatialBin(ref.bbox.min[axis], min, bin_size);
+				int last = spatialBin(ref.bbox.max[axis], min, bin_size);
+				entries[first]++;
+				exits[last]++;
+
+				Reference current = ref, leftPart, rightPart;
+				for (int i = first; i < last; ++i) {
+					splitReference(current, axis, min + (i + 1) * bin_size, leftPart, rightPart);
+					bins[i].expandBy(leftPart.bbox);
+					current = rightPart;
+				}
+				bins[last].expandBy(current.bbox);
+			}
+
+			BoundingBox3f bbox_left[SPATIAL_BIN_COUNT];
+			bbox_left[0] = bins[0];
+			for (int i = 1; i < SPATIAL_BIN_COUNT; ++i) {
+				entries[i] += entries[i - 1];
+				bbox_left[i] = BoundingBox3f::merge(bbox_left[i - 1], bins[i]);
+			}
+
+			BoundingBox3f bbox_right = bins[SPATIAL_BIN_COUNT - 1];
+			n_UINT prims_right = exits[SPATIAL_BIN_COUNT - 1];
+			for (int i = SPATIAL_BIN_COUNT - 2; i >= 0; --i) {
+				n_UINT prims_left = entries[i];
+				if (prims_left > 0 && prims_right > 0 &&
+						prims_left + prims_right - refs.size() <= remaining) {
+					float sah_cost = 2.0f * TRAVERSAL_COST +
+						tri_factor * (prims_left * bbox_left[i].getSurfaceArea() +
+							prims_right * bbox_right.getSurfaceArea());
+					if (sah_cost < best.cost) {
+						best.cost = sah_cost;
+						best.axis = axis;
+						best.index = i;
+						best.bboxLeft = bbox_left[i];
+						best.bboxRight = bbox_right;
+					}
+				}
+				bbox_right = BoundingBox3f::merge(bbox_right, bins[i]);
+				prims_right += exits[i];
+			}
+		}
+
+		return best;
+	}
+
+	void performObjectSplit(const std::vector<Reference> &refs, const Split &split,
+			const BoundingBox3f &centroids, std::vector<Reference> &left,
+			std::vector<Reference> &right, BoundingBox3f &bboxLeft, BoundingBox3f &bboxRight) const {
+		float min = centroids.min[split.axis],
+			inv_bin_size = OBJECT_BIN_COUNT / (centroids.max[split.axis] - min);
+
+		for (const Reference &ref : refs) {
+			if (objectBin(ref, split.axis, min, inv_bin_size) <= split.index)
+				left.push_back(ref);
+			else
+				right.push_back(ref);
+		}
+		bboxLeft = split.bboxLeft;
+		bboxRight = split.bboxRight;
+	}
+
+	void performSpatialSplit(const std::vector<Reference> &refs, const Split &split,
+			const BoundingBox3f &bbox, std::vector<Reference> &left,
+			std::vector<Reference> &right, BoundingBox3f &bboxLeft, BoundingBox3f &bboxRight) {
+		int axis = split.axis;
+		float pos = bbox.min[axis] + (split.index + 1) *
+			((bbox.max[axis] - bbox.min[axis]) / SPATIAL_BIN_COUNT);
+
+		/* Assign the references that lie entirely on one side */
+		std::vector<const Reference *> straddling;
+		for (const Reference &ref : refs) {
+			if (ref.bbox.max[axis] <= pos) {
+				left.push_back(ref);
+				bboxLeft.expandBy(ref.bbox);
+			} else if (ref.bbox.min[axis] >= pos) {
+				right.push_back(ref);
+				bboxRight.expandBy(ref.bbox);
+			} else {
+				straddling.push_back(&ref);
+			}
+		}
+
+		/* The remaining ones are either split or, when this is cheaper
+		   according to the SAH, moved to one of the sides ("unsplitting") */
+		size_t countLeft = left.size() + straddling.size(),
+		       countRight = right.size() + straddling.size();
+
+		for (const Reference *ref : straddling) {
+			Reference leftPart, rightPart;
+			splitReference(*ref, axis, pos, leftPart, rightPart);
+
+			BoundingBox3f splitLeft = BoundingBox3f::merge(bboxLeft, leftPart.bbox),
+			              splitRight = BoundingBox3f::merge(bboxRight, rightPart.bbox),
+			              unsplitLeft = BoundingBox3f::merge(bboxLeft, ref->bbox),
+			              unsplitRight = BoundingBox3f::merge(bboxRight, ref->bbox);
+
+			float costSplit = splitLeft.getSurfaceArea() * countLeft +
+				splitRight.getSurfaceArea() * countRight;
+			float costLeft = unsplitLeft.getSurfaceArea() * countLeft +
+				bboxRight.getSurfaceArea() * (countRight - 1);
+			float costRight = bboxLeft.getSurfaceArea() * (countLeft - 1) +
+				unsplitRight.getSurfaceArea() * countRight;
+
+			if (costLeft < costSplit && costLeft <= costRight) {
+				left.push_back(*ref);
+				bboxLeft = unsplitLeft;
+				countRight--;
+			} else if (costRight < costSplit) {
+				right.push_back(*ref);
+				bboxRight = unsplitRight;
+				countLeft--;
+			} else {
+				left.push_back(leftPart);
+				right.push_back(rightPart);
+				bboxLeft = splitLeft;
+				bboxRight = splitRight;
+				m_referenceCount++;
+			}
+		}
+	}
+
+	/**
+	 * \brief Split a triangle reference at an axis-aligned plane
+	 *
+	 * The bounding boxes of both parts are computed from the triangle
+	 * clipped against the plane, and they are never larger than the
+	 * bounding box of the input reference.
+	 */
+	void splitReference(const Reference &ref, int axis, float pos,
+			Reference &left, Reference &right) const {
+		n_UINT idx = ref.prim;
+		const Mesh *mesh = bvh.m_meshes[bvh.findMesh(idx)];
+		MatrixXuView F = mesh->getIndices();
+
+		left.prim = right.prim = ref.prim;
+		left.bbox.reset();
+		right.bbox.reset();
+
+		for (int i = 0; i < 3; ++i) {
+			Point3f v0 = mesh->getVertexPosition(F(i, idx)),
+			        v1 = mesh->getVertexPosition(F((i + 1) % 3, idx));
+			float p0 = v0[axis], p1 = v1[axis];
+
+			if (p0 <= pos)
+				left.bbox.expandBy(v0);
+			if (p0 >= pos)
+				right.bbox.expandBy(v0);
+
+			/* The edge crosses the plane */
+			if ((p0 < pos && p1 > pos) || (p0 > pos && p1 < pos)) {
+				float t = std::min(std::max((pos - p0) / (p1 - p0), 0.0f), 1.0f);
+				Point3f p = v0 + (v1 - v0) * t;
+				p[axis] = pos;
+				left.bbox.expandBy(p);
+				right.bbox.expandBy(p);
+			}
+		}
+
+		left.bbox.max[axis] = pos;
+		right.bbox.min[axis] = pos;
+		left.bbox.clip(ref.bbox);
+		right.bbox.clip(ref.bbox);
+	}
+
+	static int objectBin(const Reference &ref, int axis, float min, float inv_bin_size) {
+		return std::min(std::max((int) ((ref.bbox.getCenter()[axis] - min) * inv_bin_size), 0),
+			(int) OBJECT_BIN_COUNT - 1);
+	}
+
+	static int spatialBin(float value, float min, float bin_size) {
+		return std::min(std::max((int) ((value - min) / bin_size), 0),
+			(int) SPATIAL_BIN_COUNT - 1);
+	}
+
+private:
+	Accel &bvh;
+	size_t m_maxReferences;   ///< Total number of references allowed by the budget
+	size_t m_referenceCount;  ///< Current number of references
+	float m_rootArea;         ///< Surface area of the scene bounding box
+};
+
+void Accel::buildSpatialSplits() {
+	SBVHBuilder(*this, m_duplicationBudget).build();
+}
+
+NORI_NAMESPACE_END
@@ -25,11 +25,14 @@
 #include <nori/sampler.h>
 #include <nori/camera.h>
 #include <nori/emitter.h>
+#include <nori/snapshot.h>
 
 NORI_NAMESPACE_BEGIN
 
-Scene::Scene(const PropertyList &) {
-    m_accel = new Accel();
+thread_local Scene::PrimaryHit Scene::m_primaryHit;
+
+Scene::Scene(const PropertyList &props) {
+    m_accel = new Accel(props);
     m_enviromentalEmitter = 0;
 }
 
@@ -38,6 +41,8 @@ Scene::~Scene() {
     delete m_sampler;
     delete m_camera;
     delete m_integrator;
+    for (auto instance : m_instances)
+        delete instance;
 }
 
 void Scene::activate() {
@@ -48,6 +53,11 @@ void Scene::activate() {
         if (m_meshes[i]->isEmitter())
             m_emitters.push_back(m_meshes[i]->getEmitter());
 
+    /* Scene snapshots store the hierarchies, which are then not built */
+    SceneSnapshot *snapshot = SceneSnapshot::getActive();
+    if (snapshot)
+        snapshot->readAccel(m_accel);
+
     m_accel->build();
 
     if (!m_integrator)
@@ -78,6 +88,27 @@ float Scene::pdfEmitter(const Emitter *em) const {
     return 1. / float(m_emitters.size());
 }
 
+void Scene::setPrimaryHit(const Ray3f &ray, const Intersection &its, bool hit) const {
+    m_primaryHit.ray = ray;
+    m_primaryHit.hit = hit;
+    if (hit)
+        m_primaryHit.its = its;
+    m_primaryHit.pending = true;
+}
+
+bool Scene::consumePrimaryHit(const Ray3f &ray, Intersection &its) const {
+    /* The stored hit is used at most once, and only for the very same segment */
+    m_primaryHit.pending = false;
+    const Ray3f &primary = m_primaryHit.ray;
+    if (ray.o != primary.o || ray.d != primary.d || ray.mint != primary.mint ||
+        ray.maxt != primary.maxt)
+        return m_accel->rayIntersect(ray, its, false);
+
+    if (m_primaryHit.hit)
+        its = m_primaryHit.its;
+    return m_primaryHit.hit;
+}
+
 
 void Scene::addChild(NoriObject *obj, const std::string& name) {
     switch (obj->getClassType()) {
@@ -87,6 +118,13 @@ void Scene::addChild(NoriObject *obj, const std::string& name) {
                 m_meshes.push_back(mesh);
             }
             break;
+
+        case EInstance: {
+                Instance *instance = static_cast<Instance *>(obj);
+                m_accel->addInstance(instance->getMesh(), instance->getToWorld());
+                m_instances.push_back(instance);
+            }
+            break;
         
         case EEmitter: {
 				Emitter *emitter = static_cast<Emitter *>(obj);
@@ -160,6 +198,7 @@ std::string Scene::toString() const {
         "  camera = %s,\n"
         "  meshes = {\n"
         "  %s  }\n"
+        "  instances = %i,\n"
 		"  emitters = {\n"
 		"  %s  }\n"
         "]",
@@ -167,6 +206,7 @@ std::string Scene::toString() const {
         indent(m_sampler->toString()),
         indent(m_camera->toString()),
         indent(meshes, 2),
+        m_instances.size(),
 		indent(lights, 2)
     );
 }
@@ -0,0 +1,340 @@
+/*
+    This file is an extension of Nori, a simple educational ray tracer
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/shape.h>
+#include <nori/bsdf.h>
+#include <nori/emitter.h>
+#include <nori/timer.h>
+#include <nori/warp.h>
+#include <filesystem/resolver.h>
+#include <Eigen/Geometry>
+#include <fstream>
+
+NORI_NAMESPACE_BEGIN
+
+void Shape::activate() {
+    m_bbox.reset();
+    for (n_UINT i = 0; i < getPrimitiveCount(); ++i)
+        m_bbox.expandBy(getBoundingBox(i));
+
+    Mesh::activate();
+}
+
+void Shape::samplePosition(const Point2f &sample, Point3f &p, Normal3f &n, Point2f &uv) const {
+    /* Select a primitive proportional to its area, then reuse the sample */
+    Point2f randomSmpl = sample;
+    n_UINT index = (n_UINT) m_pdf.sampleReuse(randomSmpl[0]);
+    samplePrimitive(index, randomSmpl, p, n, uv);
+}
+
+std::string Shape::toString() const {
+    return tfm::format(
+        "Shape[\n"
+        "  name = \"%s\",\n"
+        "  primitiveCount = %i,\n"
+        "  bsdf = %s,\n"
+        "  emitter = %s\n"
+        "]",
+        m_name,
+        getPrimitiveCount(),
+        m_bsdf ? indent(m_bsdf->toString()) : std::string("null"),
+        m_emitter ? indent(m_emitter->toString()) : std::string("null")
+    );
+}
+
+/**
+ * \brief Set of spheres
+ *
+ * A single sphere is specified via the <tt>center</tt> and <tt>radius</tt>
+ * properties. Alternatively, <tt>filename</tt> references a text file with
+ * one sphere per line (<tt>x y z</tt> or <tt>x y z radius</tt>, the radius
+ * defaults to the <tt>radius</tt> property), which is meant for particle
+ * systems with many spheres sharing one material.
+ *
+ * The texture coordinates are the azimuth and polar angle, scaled to [0, 1].
+ */
+class Sphere : public Shape {
+public:
+    Sphere(const PropertyList &propList) {
+        float radius = propList.getFloat("radius", 1.f);
+        std::string filename = propList.getString("filename", "");
+
+        if (filename.empty()) {
+            m_name = "sphere";
+            m_spheres.push_back(Vector4f(0.f, 0.f, 0.f, radius));
+            m_spheres.back().head<3>() = propList.getPoint("center", Point3f(0.f));
+        } else {
+            filesystem::path path = getFileResolver()->resolve(filename);
+            std::ifstream is(path.str());
+            if (is.fail())
+                throw NoriException("Unable to open the sphere file \"%s\"!", path);
+
+            cout << "Loading \"" << path << "\" .. ";
+            cout.flush();
+            Timer timer;
+
+            std::string line_str;
+            while (std::getline(is, line_str)) {
+                std::istringstream line(line_str);
+                Vector4f sphere(0.f, 0.f, 0.f, radius);
+                if (!(line >> sphere[0] >> sphere[1] >> sphere[2]))
+                    continue; /* Empty line or comment */
+                line >> sphere[3];
+                m_spheres.push_back(sphere);
+            }
+
+            m_name = path.str();
+            cout << "done. (" << m_spheres.size() << " spheres, took "
+                 << timer.elapsedString() << ")" << endl;
+        }
+
+        for (const Vector4f &sphere : m_spheres) {
+            if (!(sphere[3] > 0))
+                throw NoriException("Sphere: the radius must be positive!");
+        }
+    }
+
+    n_UINT getPrimitiveCount() const { return (n_UINT) m_spheres.size(); }
+
+    float surfaceArea(n_UINT index) const {
+        float r = m_spheres[index][3];
+        return 4 * M_PI * r * r;
+    }
+
+    BoundingBox3f getBoundingBox(n_UINT index) const {
+        Point3f center = m_spheres[index].head<3>();
+        Vector3f extent = Vector3f::Constant(m_spheres[index][3]);
+        return BoundingBox3f(center - extent, center + extent);
+    }
+
+    bool rayIntersect(n_UINT index, const Ray3f &ray, float &u, float &v, float &t) const {
+        Point3f center = m_spheres[index].head<3>();
+        float r = m_spheres[index][3];
+
+        /* Solve |o + t d - center|^2 = r^2. The discriminant is computed from
+           the distance between the center and the closest point on the ray,
+           which avoids cancellation for distant spheres */
+        Vector3f oc = ray.o - center;
+        float a = ray.d.squaredNorm(), b = oc.dot(ray.d), c = oc.squaredNorm() - r * r;
+        Vector3f closest = oc - (b / a) * ray.d;
+        float discrim = a * (r * r - closest.squaredNorm());
+        if (discrim < 0)
+            return false;
+
+        float q = -b - std::copysign(std::sqrt(discrim), b);
+        float t0 = c / q, t1 = q / a;
+        if (t0 > t1)
+            std::swap(t0, t1);
+
+        if (t0 >= ray.mint && t0 <= ray.maxt)
+            t = t0;
+        else if (t1 >= ray.mint && t1 <= ray.maxt)
+            t = t1;
+        else
+            return false;
+
+        Vector3f n = (ray(t) - center) / r;
+        toSpherical(n, u, v);
+        return true;
+    }
+
+    void computeIntersection(n_UINT index, Intersection &its) const {
+        Vector3f n = fromSpherical(its.uv);
+        its.p = Point3f(m_spheres[index].head<3>()) + m_spheres[index][3] * n;
+        its.geoFrame = its.shFrame = Frame(n);
+    }
+
+    void samplePrimitive(n_UINT index, const Point2f &sample, Point3f &p,
+            Normal3f &n, Point2f &uv) const {
+        n = Warp::squareToUniformSphere(sample);
+        p = Point3f(m_spheres[index].head<3>()) + m_spheres[index][3] * n;
+        toSpherical(n, uv[0], uv[1]);
+    }
+
+protected:
+    static void toSpherical(const Vector3f &n, float &u, float &v) {
+        float phi = std::atan2(n.y(), n.x());
+        if (phi < 0)
+            phi += 2 * M_PI;
+        u = phi * INV_TWOPI;
+        v = std::acos(clamp(n.z(), -1.f, 1.f)) * INV_PI;
+    }
+
+    static Vector3f fromSpherical(const Point2f &uv) {
+        float phi = uv[0] * 2 * M_PI, theta = uv[1] * M_PI;
+        float sinTheta = std::sin(theta);
+        return Vector3f(sinTheta * std::cos(phi), sinTheta * std::sin(phi), std::cos(theta));
+    }
+
+protected:
+    std::vector<Vector4f, Eigen::aligned_allocator<Vector4f>> m_spheres; ///< Center and radius
+};
+
+/**
+ * \brief Disk given by its <tt>center</tt>, <tt>normal</tt> and <tt>radius</tt>
+ *
+ * The disk faces the direction of its normal (which matters for area
+ * emitters). The texture coordinates are the relative radius and the
+ * angle around the normal, scaled to [0, 1].
+ */
+class Disk : public Shape {
+public:
+    Disk(const PropertyList &propList) {
+        m_name = "disk";
+        m_center = propList.getPoint("center", Point3f(0.f));
+        m_frame = Frame(propList.getVector("normal", Vector3f(0.f, 0.f, 1.f)).normalized());
+        m_radius = propList.getFloat("radius", 1.f);
+        if (!(m_radius > 0))
+            throw NoriException("Disk: the radius must be positive!");
+    }
+
+    n_UINT getPrimitiveCount() const { return 1; }
+
+    float surfaceArea(n_UINT) const { return M_PI * m_radius * m_radius; }
+
+    BoundingBox3f getBoundingBox(n_UINT) const {
+        /* Extent of the rim along each axis */
+        const Normal3f &n = m_frame.n;
+        Vector3f extent = m_radius * (Vector3f::Ones() - n.cwiseProduct(n)).cwiseMax(0.f).cwiseSqrt();
+        return BoundingBox3f(m_center - extent, m_center + extent);
+    }
+
+    bool rayIntersect(n_UINT, const Ray3f &ray, float &u, float &v, float &t) const {
+        float denom = ray.d.dot(m_frame.n);
+        if (denom > -1e-8f && denom < 1e-8f)
+            return false;
+
+        t = (m_center - ray.o).dot(m_frame.n) / denom;
+        if (t < ray.mint || t > ray.maxt)
+            return false;
+
+        Vector3f local = m_frame.toLocal(ray(t) - m_center);
+        float r2 = local.x() * local.x() + local.y() * local.y();
+        if (r2 > m_radius * m_radius)
+            return false;
+
+        float phi = std::atan2(local.y(), local.x());
+        if (phi < 0)
+            phi += 2 * M_PI;
+        u = std::sqrt(r2) / m_radius;
+        v = phi * INV_TWOPI;
+        return true;
+    }
+
+    void computeIntersection(n_UINT, Intersection &its) const {
+        float r = its.uv[0] * m_radius, phi = its.uv[1] * 2 * M_PI;
+        its.p = m_center + m_frame.toWorld(Vector3f(r * std::cos(phi), r * std::sin(phi), 0.f));
+        its.geoFrame = its.shFrame = m_frame;
+    }
+
+    void samplePrimitive(n_UINT, const Point2f &sample, Point3f &p,
+            Normal3f &n, Point2f &uv) const {
+        Point2f d = Warp::squareToUniformDisk(sample);
+        p = m_center + m_radius * m_frame.toWorld(Vector3f(d.x(), d.y(), 0.f));
+        n = m_frame.n;
+
+        float phi = std::atan2(d.y(), d.x());
+        if (phi < 0)
+            phi += 2 * M_PI;
+        uv = Point2f(d.norm(), phi * INV_TWOPI);
+    }
+
+protected:
+    Point3f m_center;
+    Frame m_frame;
+    float m_radius;
+};
+
+/**
+ * \brief Parallelogram spanned by <tt>edge1</tt> and <tt>edge2</tt> at the corner <tt>origin</tt>
+ *
+ * Rectangular light panels are the main use case. The quad faces the
+ * direction of <tt>edge1 x edge2</tt>, and the texture coordinates are
+ * the relative positions along both edges.
+ */
+class Quad : public Shape {
+public:
+    Quad(const PropertyList &propList) {
+        m_name = "quad";
+        m_origin = propList.getPoint("origin", Point3f(-1.f, -1.f, 0.f));
+        m_edge1 = propList.getVector("edge1", Vector3f(2.f, 0.f, 0.f));
+        m_edge2 = propList.getVector("edge2", Vector3f(0.f, 2.f, 0.f));
+
+        Vector3f n = m_edge1.cross(m_edge2);
+        m_area = n.norm();
+        if (!(m_area > 0))
+            throw NoriException("Quad: the edges must not be parallel!");
+        m_normal = n / m_area;
+    }
+
+    n_UINT getPrimitiveCount() const { return 1; }
+
+    float surfaceArea(n_UINT) const { return m_area; }
+
+    BoundingBox3f getBoundingBox(n_UINT) const {
+        BoundingBox3f result(m_origin);
+        result.expandBy(m_origin + m_edge1);
+        result.expandBy(m_origin + m_edge2);
+        result.expandBy(m_origin + m_edge1 + m_edge2);
+        return result;
+    }
+
+    bool rayIntersect(n_UINT, const Ray3f &ray, float &u, float &v, float &t) const {
+        /* Same as the Moeller-Trumbore triangle test in Mesh::rayIntersect(),
+           but both edge coordinates may range over [0, 1] */
+        Vector3f pvec = ray.d.cross(m_edge2);
+        float det = m_edge1.dot(pvec);
+        if (det > -1e-8f && det < 1e-8f)
+            return false;
+        float inv_det = 1.0f / det;
+
+        Vector3f tvec = ray.o - m_origin;
+        u = tvec.dot(pvec) * inv_det;
+        if (u < 0.0 || u > 1.0)
+            return false;
+
+        Vector3f qvec = tvec.cross(m_edge1);
+        v = ray.d.dot(qvec) * inv_det;
+        if (v < 0.0 || v > 1.0)
+            return false;
+
+        t = m_edge2.dot(qvec) * inv_det;
+        return t >= ray.mint && t <= ray.maxt;
+    }
+
+    void computeIntersection(n_UINT, Intersection &its) const {
+        its.p = m_origin + its.uv[0] * m_edge1 + its.uv[1] * m_edge2;
+        its.geoFrame = its.shFrame = Frame(m_normal);
+    }
+
+    void samplePrimitive(n_UINT, const Point2f &sample, Point3f &p,
+            Normal3f &n, Point2f &uv) const {
+        p = m_origin + sample.x() * m_edge1 + sample.y() * m_edge2;
+        n = m_normal;
+        uv = sample;
+    }
+
+protected:
+    Point3f m_origin;
+    Vector3f m_edge1, m_edge2;
+    Normal3f m_normal;
+    float m_area;
+};
+
+NORI_REGISTER_CLASS(Sphere, "sphere");
+NORI_REGISTER_CLASS(Disk, "disk");
+NORI_REGISTER_CLASS(Quad, "quad");
+NORI_NAMESPACE_END
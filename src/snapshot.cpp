@@ -0,0 +1,288 @@
+/*
+    This file is an extension of Nori, a simple educational ray tracer
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/snapshot.h>
+#include <nori/binarymesh.h>
+#include <nori/bitmap.h>
+#include <nori/scene.h>
+#include <nori/accel.h>
+#include <nori/timer.h>
+#include <filesystem/path.h>
+#include <fstream>
+#include <sstream>
+
+NORI_NAMESPACE_BEGIN
+
+SceneSnapshot *SceneSnapshot::m_active = nullptr;
+
+/// Pad a stream to the next multiple of \ref NORI_SNAPSHOT_ALIGNMENT bytes and return the position
+static uint64_t align(std::ostream &os) {
+    char padding[NORI_SNAPSHOT_ALIGNMENT] = { 0 };
+    uint64_t pos = (uint64_t) os.tellp(),
+             aligned = (pos + NORI_SNAPSHOT_ALIGNMENT - 1) / NORI_SNAPSHOT_ALIGNMENT * NORI_SNAPSHOT_ALIGNMENT;
+    os.write(padding, (std::streamsize) (aligned - pos));
+    return aligned;
+}
+
+SceneSnapshot::SceneSnapshot(const std::string &filename, EMode mode)
+    : m_filename(filename), m_directory(filesystem::path(filename).parent_path().str()) {
+    if (mode == ELoad) {
+        cout << "Mapping the scene snapshot \"" << filename << "\" .. ";
+        cout.flush();
+        Timer timer;
+
+        m_file.reset(new MemoryMappedFile(filename));
+        const uint8_t *data = m_file->data();
+        uint64_t size = m_file->size();
+
+        if (size < sizeof(SnapshotHeader))
+            throw NoriException("\"%s\" is not a scene snapshot!", filename);
+        memcpy(&m_header, data, sizeof(SnapshotHeader));
+        if (m_header.magic != NORI_SNAPSHOT_MAGIC)
+            throw NoriException("\"%s\" is not a scene snapshot (or was written on a "
+                                "machine with a different byte order)!", filename);
+        if (m_header.version != NORI_SNAPSHOT_VERSION)
+            throw NoriException("\"%s\" has version %i of the snapshot format, expected %i!",
+                                filename, m_header.version, NORI_SNAPSHOT_VERSION);
+
+        auto checkRange = [&](uint64_t offset, uint64_t length) {
+            if (offset > size || length > size - offset)
+                throw NoriException("\"%s\" is truncated or corrupt!", filename);
+        };
+
+        auto readTable = [&](uint64_t offset, uint64_t count, bool images,
+                             std::map<std::string, const SnapshotEntry *> &entries) {
+            if (offset % NORI_SNAPSHOT_ALIGNMENT != 0 || count > size / sizeof(SnapshotEntry))
+                throw NoriException("\"%s\" is truncated or corrupt!", filename);
+            checkRange(offset, count * sizeof(SnapshotEntry));
+
+            const SnapshotEntry *table = (const SnapshotEntry *) (data + offset);
+            for (uint64_t i = 0; i < count; ++i) {
+                const SnapshotEntry &entry = table[i];
+                checkRange(entry.key, entry.keySize);
+                checkRange(entry.name, entry.nameSize);
+                if (images)
+                    checkRange(entry.data, (uint64_t) entry.rows * entry.cols * entry.pixelSize);
+                entries[std::string((const char *) data + entry.key, entry.keySize)] = &entry;
+            }
+        };
+
+        checkRange(m_header.document, m_header.documentSize);
+        checkRange(m_header.accel, m_header.accelSize);
+        readTable(m_header.meshes, m_header.meshCount, false, m_meshEntries);
+        readTable(m_header.images, m_header.imageCount, true, m_imageEntries);
+
+        cout << "done (took " << timer.elapsedString() << ", " << m_meshEntries.size()
+             << (m_meshEntries.size() == 1 ? " mesh, " : " meshes, ") << m_imageEntries.size()
+             << (m_imageEntries.size() == 1 ? " image, " : " images, ") << memString(size)
+             << ")." << endl;
+    }
+
+    m_previous = m_active;
+    m_active = this;
+}
+
+SceneSnapshot::~SceneSnapshot() {
+    m_active = m_previous;
+}
+
+std::string SceneSnapshot::getDocument() const {
+    if (!isLoading())
+        return std::string();
+    return std::string((const char *) m_file->data() + m_header.document, m_header.documentSize);
+}
+
+void SceneSnapshot::addMesh(const std::string &key, const Mesh *mesh) {
+    /* Analytic shapes have no vertex data to store */
+    if (isLoading() || mesh->isAnalytic())
+        return;
+
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_meshes[key] = mesh;
+}
+
+Mesh *SceneSnapshot::createMesh(const std::string &key) const {
+    if (!isLoading())
+        return nullptr;
+
+    auto it = m_meshEntries.find(key);
+    if (it == m_meshEntries.end())
+        return nullptr;
+
+    const SnapshotEntry &entry = *it->second;
+    return createBinaryMesh(m_file, entry.data, std::string(
+        (const char *) m_file->data() + entry.name, entry.nameSize));
+}
+
+std::string SceneSnapshot::imageKey(const std::string &filename) const {
+    /* Resolved filenames start with the scene directory if the file exists */
+    if (!m_directory.empty() && filename.size() > m_directory.size() &&
+        filename.compare(0, m_directory.size(), m_directory) == 0 &&
+        (filename[m_directory.size()] == '/' || filename[m_directory.size()] == '\\'))
+        return filename.substr(m_directory.size() + 1);
+    return filename;
+}
+
+void SceneSnapshot::addImage(const std::string &filename, const Bitmap &bitmap) {
+    addImage(filename, (uint32_t) bitmap.rows(), (uint32_t) bitmap.cols(),
+             (uint32_t) sizeof(Bitmap::Scalar), bitmap.data());
+}
+
+void SceneSnapshot::addImage(const std::string &filename, const LDRBitmap &bitmap) {
+    addImage(filename, (uint32_t) bitmap.rows(), (uint32_t) bitmap.cols(),
+             (uint32_t) sizeof(LDRBitmap::Scalar), bitmap.data());
+}
+
+void SceneSnapshot::addImage(const std::string &filename, uint32_t rows, uint32_t cols,
+                             uint32_t pixelSize, const void *pixels) {
+    if (isLoading())
+        return;
+
+    Image image;
+    image.rows = rows;
+    image.cols = cols;
+    image.pixelSize = pixelSize;
+    image.pixels.assign((const uint8_t *) pixels,
+                        (const uint8_t *) pixels + (size_t) rows * cols * pixelSize);
+
+    std::lock_guard<std::mutex> guard(m_mutex);
+    m_images[imageKey(filename)] = std::move(image);
+}
+
+bool SceneSnapshot::hasImage(const std::string &filename) const {
+    return isLoading() && m_imageEntries.find(imageKey(filename)) != m_imageEntries.end();
+}
+
+const uint8_t *SceneSnapshot::findImage(const std::string &filename, uint32_t pixelSize,
+                                        uint32_t &rows, uint32_t &cols) const {
+    if (!isLoading())
+        return nullptr;
+
+    auto it = m_imageEntries.find(imageKey(filename));
+    if (it == m_imageEntries.end() || it->second->pixelSize != pixelSize)
+        return nullptr;
+
+    rows = it->second->rows;
+    cols = it->second->cols;
+    return m_file->data() + it->second->data;
+}
+
+bool SceneSnapshot::readImage(const std::string &filename, Bitmap &bitmap) const {
+    uint32_t rows, cols;
+    const uint8_t *pixels = findImage(filename, (uint32_t) sizeof(Bitmap::Scalar), rows, cols);
+    if (!pixels)
+        return false;
+
+    bitmap.resize(rows, cols);
+    memcpy((void *) bitmap.data(), pixels, (size_t) rows * cols * sizeof(Bitmap::Scalar));
+    return true;
+}
+
+bool SceneSnapshot::readImage(const std::string &filename, LDRBitmap &bitmap) const {
+    uint32_t rows, cols;
+    const uint8_t *pixels = findImage(filename, (uint32_t) sizeof(LDRBitmap::Scalar), rows, cols);
+    if (!pixels)
+        return false;
+
+    bitmap.resize(rows, cols);
+    memcpy((void *) bitmap.data(), pixels, (size_t) rows * cols * sizeof(LDRBitmap::Scalar));
+    return true;
+}
+
+bool SceneSnapshot::readAccel(Accel *accel) const {
+    if (!isLoading() || m_header.accelSize == 0)
+        return false;
+
+    cout << "Loading the BVH from the scene snapshot .. ";
+    cout.flush();
+    return accel->readCache(m_file->data() + m_header.accel, m_header.accelSize, false);
+}
+
+void SceneSnapshot::write(const std::string &filename, const Scene *scene) const {
+    std::ifstream is(m_filename, std::ios::binary);
+    std::ostringstream document;
+    document << is.rdbuf();
+    if (is.fail())
+        throw NoriException("Unable to read \"%s\"!", m_filename);
+
+    cout << "Writing the scene snapshot \"" << filename << "\" .. ";
+    cout.flush();
+    Timer timer;
+
+    std::ofstream os(filename, std::ios::binary | std::ios::trunc);
+    if (os.fail())
+        throw NoriException("Unable to open \"%s\" for writing!", filename);
+
+    auto writeString = [&](const std::string &str, uint64_t &offset, uint64_t &size) {
+        offset = (uint64_t) os.tellp();
+        size = str.size();
+        os.write(str.data(), (std::streamsize) size);
+    };
+
+    SnapshotHeader header;
+    os.write((const char *) &header, sizeof(SnapshotHeader));
+
+    header.document = align(os);
+    header.documentSize = document.str().size();
+    os.write(document.str().data(), (std::streamsize) header.documentSize);
+
+    std::vector<SnapshotEntry> meshes, images;
+    for (const auto &mesh : m_meshes) {
+        SnapshotEntry entry;
+        writeString(mesh.first, entry.key, entry.keySize);
+        writeString(mesh.second->getName(), entry.name, entry.nameSize);
+        entry.data = align(os);
+        writeBinaryMesh(mesh.second, os);
+        meshes.push_back(entry);
+    }
+
+    for (const auto &image : m_images) {
+        SnapshotEntry entry;
+        writeString(image.first, entry.key, entry.keySize);
+        entry.rows = image.second.rows;
+        entry.cols = image.second.cols;
+        entry.pixelSize = image.second.pixelSize;
+        entry.data = align(os);
+        os.write((const char *) image.second.pixels.data(), (std::streamsize) image.second.pixels.size());
+        images.push_back(entry);
+    }
+
+    header.meshes = align(os);
+    header.meshCount = meshes.size();
+    os.write((const char *) meshes.data(), (std::streamsize) (sizeof(SnapshotEntry) * meshes.size()));
+
+    header.images = align(os);
+    header.imageCount = images.size();
+    os.write((const char *) images.data(), (std::streamsize) (sizeof(SnapshotEntry) * images.size()));
+
+    header.accel = align(os);
+    scene->getAccel()->writeCache(os);
+    header.accelSize = (uint64_t) os.tellp() - header.accel;
+    uint64_t size = (uint64_t) os.tellp();
+
+    os.seekp(0);
+    os.write((const char *) &header, sizeof(SnapshotHeader));
+
+    if (os.fail())
+        throw NoriException("Error while writing \"%s\"!", filename);
+
+    cout << "done (took " << timer.elapsedString() << ", " << meshes.size()
+         << (meshes.size() == 1 ? " mesh, " : " meshes, ") << images.size()
+         << (images.size() == 1 ? " image, " : " images, ") << memString(size)
+         << ")." << endl;
+}
+
+NORI_NAMESPACE_END
@@ -17,6 +17,7 @@
 
 #include <nori/texture.h>
 #include <nori/bitmap.h>
+#include <nori/snapshot.h>
 
 #include <filesystem/resolver.h>
 #include <fstream>
@@ -32,8 +33,10 @@ public:
 		filesystem::path filename =
 			getFileResolver()->resolve(m_bitmap_name);
 
+		/* Scene snapshots store the decoded image, the file may not exist */
+		SceneSnapshot *snapshot = SceneSnapshot::getActive();
 		std::ifstream is(filename.str());
-		if (!is.fail())
+		if (!is.fail() || (snapshot && snapshot->hasImage(filename.str())))
 		{
 			cout << "Loading Texture Map: " << filename.str() << endl;
 